@@ -0,0 +1,351 @@
+/* Arena allocator with memory accounting.
+ *
+ * Before #including,
+ *      #define ARENA_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Allocations are bumped out of blocks owned by the arena and released all
+ * at once by arena_reset. Freeing single allocation only gives memory back
+ * when it's the last one in its block or big enough to have its own block,
+ * which covers the grow-and-free pattern of decoders.
+ *
+ * Blocks of ARENA_HUGE_SIZE and more are mapped on their own and backed
+ * by huge pages where the system has them, so walking through big pixel
+ * buffers doesn't miss the TLB every 4 KB.
+ *
+ * Arenas can be used from several threads at once, every call takes a
+ * single lock. */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef ARENA_EXTERN
+#define ARENA_EXTERN extern
+#endif
+
+#ifndef ARENA_STATIC
+#define ARENA_STATIC static
+#endif
+
+/* Size of shared blocks, bigger allocations get a block of their own */
+#define ARENA_BLOCK_SIZE ( (size_t) 1 << 20 )
+#define ARENA_ALIGN 16
+
+/* Blocks this big get huge pages, zero turns them off */
+#ifndef ARENA_HUGE_SIZE
+#define ARENA_HUGE_SIZE ( 8 << 20 )
+#endif
+
+struct arena_block;
+
+typedef struct arena {
+        const char *name;
+        struct arena_block *blocks;
+
+        /* Bytes taken from the system right now and at most */
+        size_t used;
+        size_t peak;
+} arena;
+
+ARENA_EXTERN void *arena_alloc ( arena *a, size_t size );
+ARENA_EXTERN void *arena_calloc ( arena *a, size_t count, size_t size );
+
+/* Reallocation and freeing find the owning arena on their own,
+ * arena passed to realloc is only used when ptr is NULL */
+ARENA_EXTERN void *arena_realloc ( arena *a, void *ptr, size_t size );
+ARENA_EXTERN void arena_free ( void *ptr );
+
+/* Release all allocations of arena at once */
+ARENA_EXTERN void arena_reset ( arena *a );
+
+/* Bytes held by all arenas right now and at most */
+ARENA_EXTERN size_t arena_total_used ( void );
+ARENA_EXTERN size_t arena_total_peak ( void );
+
+#endif /* _ARENA_H */
+
+/* Implementation */
+#ifdef ARENA_IMPL
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined( __linux__ ) && ARENA_HUGE_SIZE > 0
+#include <sys/mman.h>
+#define ARENA_MMAP
+#endif
+
+typedef struct arena_block {
+        struct arena_block *next;
+        size_t size;
+        size_t used;
+        size_t live; /* Allocations not freed yet */
+        size_t mapped; /* Length of mapping, zero when malloc'd */
+} arena_block;
+
+/* Sits right in front of every allocation */
+typedef struct arena_header {
+        arena *owner;
+        arena_block *block;
+        size_t size;
+        size_t padding;
+} arena_header;
+
+#define ARENA_BLOCK_HEADER ( ( sizeof( arena_block ) + ARENA_ALIGN - 1 ) & ~(size_t) ( ARENA_ALIGN - 1 ) )
+#define ARENA_ROUND( size ) ( ( ( size ) + ARENA_ALIGN - 1 ) & ~(size_t) ( ARENA_ALIGN - 1 ) )
+
+static size_t _arena_total_used = 0;
+static size_t _arena_total_peak = 0;
+
+static pthread_mutex_t _arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+ARENA_STATIC void _arena_account ( arena *a, size_t bytes, bool add ) {
+        if ( add ) {
+                a->used += bytes;
+                _arena_total_used += bytes;
+        } else {
+                a->used -= bytes;
+                _arena_total_used -= bytes;
+        }
+
+        if ( a->used > a->peak ) {
+                a->peak = a->used;
+        }
+        if ( _arena_total_used > _arena_total_peak ) {
+                _arena_total_peak = _arena_total_used;
+        }
+}
+
+ARENA_STATIC unsigned char *_arena_block_data ( arena_block *block ) {
+        return (unsigned char *) block + ARENA_BLOCK_HEADER;
+}
+
+ARENA_STATIC size_t _arena_block_bytes ( const arena_block *block ) {
+        return block->mapped != 0 ? block->mapped : ARENA_BLOCK_HEADER + block->size;
+}
+
+#ifdef ARENA_MMAP
+
+#define ARENA_HUGE_PAGE ( (size_t) 2 << 20 )
+
+/* Cleared once reserved huge pages run out, so we stop asking for them */
+static bool _arena_hugetlb = true;
+
+/* Map length bytes aligned to huge page. Reserved huge pages are tried
+ * first, then transparent ones on a mapping trimmed to alignment. */
+ARENA_STATIC void *_arena_map_huge ( size_t length ) {
+#ifdef MAP_HUGETLB
+        if ( _arena_hugetlb ) {
+                void *ptr = mmap( NULL, length, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+                if ( ptr != MAP_FAILED ) {
+                        return ptr;
+                }
+                _arena_hugetlb = false;
+        }
+#endif
+
+        unsigned char *raw = (unsigned char *) mmap( NULL, length + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( raw == (unsigned char *) MAP_FAILED ) {
+                return NULL;
+        }
+
+        unsigned char *aligned =
+            (unsigned char *) ( ( (uintptr_t) raw + ARENA_HUGE_PAGE - 1 ) & ~(uintptr_t) ( ARENA_HUGE_PAGE - 1 ) );
+        if ( aligned > raw ) {
+                munmap( raw, aligned - raw );
+        }
+        munmap( aligned + length, raw + ARENA_HUGE_PAGE - aligned );
+
+#ifdef MADV_HUGEPAGE
+        madvise( aligned, length, MADV_HUGEPAGE );
+#endif
+
+        return aligned;
+}
+
+#endif
+
+/* Shared blocks go first, that's where small allocations are bumped from */
+ARENA_STATIC arena_block *_arena_new_block ( arena *a, size_t size, bool shared ) {
+        arena_block *block = NULL;
+        size_t mapped = 0;
+
+#ifdef ARENA_MMAP
+        if ( size >= ARENA_HUGE_SIZE ) {
+                mapped = ( ARENA_BLOCK_HEADER + size + ARENA_HUGE_PAGE - 1 ) & ~( ARENA_HUGE_PAGE - 1 );
+                block = (arena_block *) _arena_map_huge( mapped );
+        }
+#endif
+
+        if ( block == NULL ) {
+                mapped = 0;
+                block = (arena_block *) malloc( ARENA_BLOCK_HEADER + size );
+        }
+        if ( block == NULL ) {
+                return NULL;
+        }
+
+        arena_block **link = shared || a->blocks == NULL ? &a->blocks : &a->blocks->next;
+        *block = (arena_block) { .next = *link, .size = size, .mapped = mapped };
+        *link = block;
+
+        _arena_account( a, _arena_block_bytes( block ), true );
+
+        return block;
+}
+
+ARENA_STATIC void _arena_drop_block ( arena *a, arena_block *block ) {
+        arena_block **link = &a->blocks;
+        while ( *link != block ) {
+                link = &( *link )->next;
+        }
+        *link = block->next;
+
+        _arena_account( a, _arena_block_bytes( block ), false );
+
+#ifdef ARENA_MMAP
+        if ( block->mapped != 0 ) {
+                munmap( block, block->mapped );
+                return;
+        }
+#endif
+
+        free( block );
+}
+
+ARENA_STATIC void *_arena_alloc ( arena *a, size_t size ) {
+        size_t needed = sizeof( arena_header ) + ARENA_ROUND( size );
+        if ( needed < size ) {
+                return NULL;
+        }
+
+        arena_block *block = a->blocks;
+
+        /* Big allocations get their own block so freeing them is real */
+        if ( needed > ARENA_BLOCK_SIZE / 4 ) {
+                block = _arena_new_block( a, needed, false );
+        } else if ( block == NULL || block->size - block->used < needed ) {
+                block = _arena_new_block( a, ARENA_BLOCK_SIZE, true );
+        }
+
+        if ( block == NULL ) {
+                return NULL;
+        }
+
+        arena_header *header = (arena_header *) ( _arena_block_data( block ) + block->used );
+        *header = (arena_header) { .owner = a, .block = block, .size = size };
+
+        block->used += needed;
+        block->live += 1;
+
+        return header + 1;
+}
+
+ARENA_EXTERN void *arena_alloc ( arena *a, size_t size ) {
+        pthread_mutex_lock( &_arena_lock );
+        void *ptr = _arena_alloc( a, size );
+        pthread_mutex_unlock( &_arena_lock );
+
+        return ptr;
+}
+
+ARENA_EXTERN void *arena_calloc ( arena *a, size_t count, size_t size ) {
+        if ( size != 0 && count > SIZE_MAX / size ) {
+                return NULL;
+        }
+
+        void *ptr = arena_alloc( a, count * size );
+        if ( ptr != NULL ) {
+                memset( ptr, 0, count * size );
+        }
+
+        return ptr;
+}
+
+ARENA_STATIC void _arena_free ( void *ptr ) {
+        arena_header *header = (arena_header *) ptr - 1;
+        arena_block *block = header->block;
+        arena *a = header->owner;
+
+        block->live -= 1;
+
+        if ( block->live == 0 && ( block->size != ARENA_BLOCK_SIZE || block != a->blocks ) ) {
+                /* Nothing left in it, own blocks and full shared ones go back */
+                _arena_drop_block( a, block );
+        } else if ( block->live == 0 ) {
+                block->used = 0;
+        } else if ( (unsigned char *) ptr + ARENA_ROUND( header->size ) ==
+                    _arena_block_data( block ) + block->used ) {
+                /* Last allocation of the block, just step back */
+                block->used -= sizeof( arena_header ) + ARENA_ROUND( header->size );
+        }
+}
+
+ARENA_EXTERN void arena_free ( void *ptr ) {
+        if ( ptr == NULL ) {
+                return;
+        }
+
+        pthread_mutex_lock( &_arena_lock );
+        _arena_free( ptr );
+        pthread_mutex_unlock( &_arena_lock );
+}
+
+ARENA_EXTERN void *arena_realloc ( arena *a, void *ptr, size_t size ) {
+        if ( ptr == NULL ) {
+                return arena_alloc( a, size );
+        }
+
+        arena_header *header = (arena_header *) ptr - 1;
+        arena_block *block = header->block;
+
+        pthread_mutex_lock( &_arena_lock );
+
+        /* Grow in place when it's the last allocation and there's room */
+        if ( (unsigned char *) ptr + ARENA_ROUND( header->size ) == _arena_block_data( block ) + block->used &&
+             ARENA_ROUND( size ) - ARENA_ROUND( header->size ) <= block->size - block->used ) {
+                block->used += ARENA_ROUND( size ) - ARENA_ROUND( header->size );
+                header->size = size;
+                pthread_mutex_unlock( &_arena_lock );
+                return ptr;
+        }
+
+        void *moved = ptr;
+        if ( size > header->size ) {
+                moved = _arena_alloc( header->owner, size );
+                if ( moved != NULL ) {
+                        memcpy( moved, ptr, header->size );
+                        _arena_free( ptr );
+                }
+        }
+
+        pthread_mutex_unlock( &_arena_lock );
+
+        return moved;
+}
+
+ARENA_EXTERN void arena_reset ( arena *a ) {
+        pthread_mutex_lock( &_arena_lock );
+        while ( a->blocks != NULL ) {
+                _arena_drop_block( a, a->blocks );
+        }
+        pthread_mutex_unlock( &_arena_lock );
+}
+
+ARENA_EXTERN size_t arena_total_used ( void ) {
+        return _arena_total_used;
+}
+
+ARENA_EXTERN size_t arena_total_peak ( void ) {
+        return _arena_total_peak;
+}
+
+#endif
@@ -0,0 +1,2219 @@
+/* Block compressed pixels, BC1, BC3, BC4, BC5 and BC7 for desktop GPUs,
+ * ETC2 RGBA and ASTC from 4x4 to 8x8 for mobile ones.
+ *
+ * Before #including,
+ *      #define BC_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Encodes blocks of RGBA pixels one at a time. Endpoints start at the
+ * ends of the principal axis of the block's colours and are refined by
+ * least squares on the indices picked for them. BC1 switches to three
+ * colours and transparent black when a pixel has alpha under half, the
+ * colour half of BC3 always takes four colours. BC4 keeps red, BC5 red and
+ * green. BC7 tries single subset modes 6 and 5 and two subset modes 1, 3
+ * and 7 on the partitions whose subsets sit closest to a line each, three
+ * subset modes and mode 4 are left out. Quality picks how many modes,
+ * partitions and refinement rounds are tried.
+ *
+ * ETC2 colour goes in individual, differential or planar blocks, T and H
+ * blocks are left out. Alpha takes an EAC block searched around the
+ * multiplier spanning its range. ASTC blocks have a single partition and
+ * plane of weights, RGB or RGBA endpoints depending on alpha, and flat
+ * blocks become void extent. Every block ranks the weight grids and
+ * ranges of its footprint by how much the grid blurs its ideal weights
+ * and how coarse weights and endpoints get, quality picks how many of the
+ * best are fit.
+ *
+ * Rows of blocks don't depend on each other, given a runner every one of
+ * them is a job of its own. */
+
+#ifndef _BC_H
+#define _BC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef BC_EXTERN
+#define BC_EXTERN extern
+#endif
+
+#ifndef BC_STATIC
+#define BC_STATIC static
+#endif
+
+/* Widest and tallest blocks get in pixels */
+#define BC_MAX_BLOCK_SIDE 8
+
+typedef enum bc_format {
+        BC_FORMAT_BC1,
+        BC_FORMAT_BC3,
+        BC_FORMAT_BC4,
+        BC_FORMAT_BC5,
+        BC_FORMAT_BC7,
+        BC_FORMAT_ETC2,
+        BC_FORMAT_ASTC_4X4,
+        BC_FORMAT_ASTC_5X4,
+        BC_FORMAT_ASTC_5X5,
+        BC_FORMAT_ASTC_6X5,
+        BC_FORMAT_ASTC_6X6,
+        BC_FORMAT_ASTC_8X5,
+        BC_FORMAT_ASTC_8X6,
+        BC_FORMAT_ASTC_8X8,
+        BC_FORMAT_NUM,
+} bc_format;
+
+typedef enum bc_quality {
+        BC_QUALITY_FAST,
+        BC_QUALITY_NORMAL,
+        BC_QUALITY_SLOW,
+} bc_quality;
+
+typedef void ( *bc_job_fn )( void *arg, int index );
+typedef void ( *bc_run_fn )( void *ctx, bc_job_fn fn, void *arg, int count );
+
+BC_EXTERN const char *bc_name ( bc_format f );
+BC_EXTERN bool bc_parse ( const char *name, bc_format *f );
+
+/* Bytes every block takes, 8 or 16 */
+BC_EXTERN int bc_block_bytes ( bc_format f );
+
+/* Pixels every block covers across and down */
+BC_EXTERN int bc_block_width ( bc_format f );
+BC_EXTERN int bc_block_height ( bc_format f );
+
+/* Encode a block of RGBA pixels, rows of block width from the top */
+BC_EXTERN void bc_encode_block ( bc_format f, bc_quality quality, const unsigned char *rgba, unsigned char *out );
+
+/* Encode RGBA rows, width and rows multiples of the block's, into rows of
+ * blocks following each other. Without run everything is done on the caller. */
+BC_EXTERN void bc_encode_rows ( bc_format f, bc_quality quality, const unsigned char *rgba, size_t stride,
+                                size_t width, size_t rows, unsigned char *out, bc_run_fn run, void *ctx );
+
+#endif /* _BC_H */
+
+/* Implementation */
+#ifdef BC_IMPL
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *_bc_names[BC_FORMAT_NUM] = {
+    [BC_FORMAT_BC1] = "bc1",
+    [BC_FORMAT_BC3] = "bc3",
+    [BC_FORMAT_BC4] = "bc4",
+    [BC_FORMAT_BC5] = "bc5",
+    [BC_FORMAT_BC7] = "bc7",
+    [BC_FORMAT_ETC2] = "etc2",
+    [BC_FORMAT_ASTC_4X4] = "astc4x4",
+    [BC_FORMAT_ASTC_5X4] = "astc5x4",
+    [BC_FORMAT_ASTC_5X5] = "astc5x5",
+    [BC_FORMAT_ASTC_6X5] = "astc6x5",
+    [BC_FORMAT_ASTC_6X6] = "astc6x6",
+    [BC_FORMAT_ASTC_8X5] = "astc8x5",
+    [BC_FORMAT_ASTC_8X6] = "astc8x6",
+    [BC_FORMAT_ASTC_8X8] = "astc8x8",
+};
+
+/* Least squares rounds after the first fit and partitions tried by two
+ * subset BC7 modes, for every quality */
+static const int _bc_refine[3] = { 0, 1, 2 };
+static const int _bc_partitions[3] = { 0, 4, 16 };
+
+/* Squared error of a whole BC7 block low enough to stop trying modes */
+static const int _bc7_enough[3] = { INT_MAX, 48, 0 };
+
+/* Pixels in the second subset of each BC7 partition, bit per pixel */
+static const unsigned short _bc7_partitions[64] = {
+    0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80, 0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8,
+    0xff00, 0xfff0, 0xf000, 0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce, 0x088c, 0x3110,
+    0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c, 0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696,
+    0xa55a, 0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660, 0x0272, 0x04e4, 0x4e40, 0x2720,
+    0xc936, 0x936c, 0x39c6, 0x639c, 0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22,
+};
+
+/* Pixel of the second subset whose index leaves out its top bit */
+static const unsigned char _bc7_anchors[64] = {
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 2,  8, 2,  2,  8,
+    8,  15, 2,  8,  2,  2,  8,  8,  2,  2,  15, 15, 6,  8,  2,  8,  15, 15, 2, 8,  2,  2,
+    2,  15, 15, 6,  6,  2,  6,  8,  15, 15, 2,  2,  15, 15, 15, 15, 15, 2,  2, 15,
+};
+
+/* Weight of the second endpoint in 64ths for indices of 2, 3 and 4 bits */
+static const int _bc7_weights[5][16] = {
+    [2] = { 0, 21, 43, 64 },
+    [3] = { 0, 9, 18, 27, 37, 46, 55, 64 },
+    [4] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 },
+};
+
+/* Weight of the second endpoint for BC1 indices in four and three colour
+ * blocks and for BC4 indices in eight value blocks */
+static const float _bc1_weights[2][4] = { { 0, 1, 1 / 3.0f, 2 / 3.0f }, { 0, 1, 0.5f, 0 } };
+static const float _bc4_weights[8] = { 0, 1, 1 / 7.0f, 2 / 7.0f, 3 / 7.0f, 4 / 7.0f, 5 / 7.0f, 6 / 7.0f };
+
+typedef struct _bc7_mode {
+        int subsets;
+        int partition_bits;
+        int rotation_bits;
+        int colour_bits;
+        int alpha_bits; /* Zero for opaque modes */
+        int pbits;      /* Zero for none, one shared by both ends of a subset, two for every end */
+        int index_bits;
+        int alpha_index_bits; /* Alpha has indices of its own when not zero */
+} _bc7_mode;
+
+static const _bc7_mode _bc7_modes[8] = {
+    [1] = { 2, 6, 0, 6, 0, 1, 3, 0 },
+    [3] = { 2, 6, 0, 7, 0, 2, 2, 0 },
+    [5] = { 1, 0, 2, 7, 8, 0, 2, 2 },
+    [6] = { 1, 0, 0, 7, 7, 2, 4, 0 },
+    [7] = { 2, 6, 0, 5, 5, 2, 2, 0 },
+};
+
+/* Endpoint picking weighs alpha up, so opaque and fully transparent pixels
+ * get p-bits that keep them exact */
+#define _BC7_ALPHA_WEIGHT 8
+
+typedef struct _bc7_block {
+        int mode;
+        int partition;
+        int rotation;
+        int error;
+
+        /* Ends of every subset without p-bits */
+        unsigned char endpoint[2][2][4];
+        unsigned char pbit[2][2];
+        unsigned char index[16];
+        unsigned char alpha_index[16];
+} _bc7_block;
+
+/* ETC1 modifiers, each half of an ETC2 block picks a row and every pixel
+ * one of the row */
+static const int _etc_modifiers[8][4] = {
+    { 2, 8, -2, -8 },     { 5, 17, -5, -17 },   { 9, 29, -9, -29 },     { 13, 42, -13, -42 },
+    { 18, 60, -18, -60 }, { 24, 80, -24, -80 }, { 33, 106, -33, -106 }, { 47, 183, -47, -183 },
+};
+
+/* EAC alpha modifiers, scaled by the multiplier of the block */
+static const int _eac_modifiers[16][8] = {
+    { -3, -6, -9, -15, 2, 5, 8, 14 }, { -3, -7, -10, -13, 2, 6, 9, 12 }, { -2, -5, -8, -13, 1, 4, 7, 12 },
+    { -2, -4, -6, -13, 1, 3, 5, 12 }, { -3, -6, -8, -12, 2, 5, 7, 11 },  { -3, -7, -9, -11, 2, 6, 8, 10 },
+    { -4, -7, -8, -11, 3, 6, 7, 10 }, { -3, -5, -8, -11, 2, 4, 7, 10 },  { -2, -6, -8, -10, 1, 5, 7, 9 },
+    { -2, -5, -8, -10, 1, 4, 7, 9 },  { -2, -4, -8, -10, 1, 3, 7, 9 },   { -2, -5, -7, -10, 1, 4, 6, 9 },
+    { -3, -4, -7, -10, 2, 3, 6, 9 },  { -1, -2, -3, -10, 0, 1, 2, 9 },   { -4, -6, -8, -9, 3, 5, 7, 8 },
+    { -3, -5, -7, -9, 2, 4, 6, 8 },
+};
+
+/* Table and index of the zero EAC modifier, constant alpha sits on it */
+#define _EAC_FLAT_TABLE 13
+#define _EAC_FLAT_INDEX 4
+
+/* Pixels in either half of ETC blocks, side by side or flipped on top of
+ * each other */
+static const int _etc_halves[2][2] = { { 0x3333, 0xcccc }, { 0x00ff, 0xff00 } };
+
+/* Bits of planar origin, horizontal and vertical colours by channel */
+static const int _etc_plane_bits[3] = { 6, 7, 6 };
+
+enum {
+        _ETC_INDIVIDUAL,
+        _ETC_DIFFERENTIAL,
+        _ETC_PLANAR,
+};
+
+typedef struct _etc_block {
+        int mode;
+        int flip;
+        int error;
+
+        /* Base colours of the halves, or planar origin, horizontal and
+         * vertical colours, quantised */
+        int colour[3][3];
+        int table[2];
+        unsigned char index[16];
+} _etc_block;
+
+/* Integer sequence ranges by number of levels, trits, quints and bits of
+ * every value. Weights take the first 12. */
+#define _ASTC_RANGES 21
+#define _ASTC_WEIGHT_RANGES 12
+
+static const unsigned char _astc_ranges[_ASTC_RANGES][3] = {
+    { 0, 0, 1 }, { 1, 0, 0 }, { 0, 0, 2 }, { 0, 1, 0 }, { 1, 0, 1 }, { 0, 0, 3 }, { 0, 1, 1 },
+    { 1, 0, 2 }, { 0, 0, 4 }, { 0, 1, 2 }, { 1, 0, 3 }, { 0, 0, 5 }, { 0, 1, 3 }, { 1, 0, 4 },
+    { 0, 0, 6 }, { 0, 1, 4 }, { 1, 0, 5 }, { 0, 0, 7 }, { 0, 1, 5 }, { 1, 0, 6 }, { 0, 0, 8 },
+};
+
+/* Endpoints need at least six levels */
+#define _ASTC_MIN_COLOUR_RANGE 4
+
+/* Eight bits packing five trits and seven packing three quints, the first
+ * of them lowest in the index */
+static const unsigned char _astc_trits[243] = {
+    0, 1, 2, 4, 5, 6, 8, 9, 10, 16, 17, 18, 20, 21, 22, 24, 25, 26, 3, 7,
+    11, 19, 23, 27, 12, 13, 14, 32, 33, 34, 36, 37, 38, 40, 41, 42, 48, 49, 50, 52,
+    53, 54, 56, 57, 58, 35, 39, 43, 51, 55, 59, 44, 45, 46, 64, 65, 66, 68, 69, 70,
+    72, 73, 74, 80, 81, 82, 84, 85, 86, 88, 89, 90, 67, 71, 75, 83, 87, 91, 76, 77,
+    78, 128, 129, 130, 132, 133, 134, 136, 137, 138, 144, 145, 146, 148, 149, 150, 152, 153, 154, 131,
+    135, 139, 147, 151, 155, 140, 141, 142, 160, 161, 162, 164, 165, 166, 168, 169, 170, 176, 177, 178,
+    180, 181, 182, 184, 185, 186, 163, 167, 171, 179, 183, 187, 172, 173, 174, 192, 193, 194, 196, 197,
+    198, 200, 201, 202, 208, 209, 210, 212, 213, 214, 216, 217, 218, 195, 199, 203, 211, 215, 219, 204,
+    205, 206, 96, 97, 98, 100, 101, 102, 104, 105, 106, 112, 113, 114, 116, 117, 118, 120, 121, 122,
+    99, 103, 107, 115, 119, 123, 108, 109, 110, 224, 225, 226, 228, 229, 230, 232, 233, 234, 240, 241,
+    242, 244, 245, 246, 248, 249, 250, 227, 231, 235, 243, 247, 251, 236, 237, 238, 28, 29, 30, 60,
+    61, 62, 92, 93, 94, 156, 157, 158, 188, 189, 190, 220, 221, 222, 31, 63, 95, 159, 191, 223,
+    124, 125, 126,
+};
+
+static const unsigned char _astc_quints[125] = {
+    0, 1, 2, 3, 4, 8, 9, 10, 11, 12, 16, 17, 18, 19, 20, 24, 25, 26, 27, 28,
+    5, 13, 21, 29, 6, 32, 33, 34, 35, 36, 40, 41, 42, 43, 44, 48, 49, 50, 51, 52,
+    56, 57, 58, 59, 60, 37, 45, 53, 61, 14, 64, 65, 66, 67, 68, 72, 73, 74, 75, 76,
+    80, 81, 82, 83, 84, 88, 89, 90, 91, 92, 69, 77, 85, 93, 22, 96, 97, 98, 99, 100,
+    104, 105, 106, 107, 108, 112, 113, 114, 115, 116, 120, 121, 122, 123, 124, 101, 109, 117, 125, 30,
+    102, 103, 70, 71, 38, 110, 111, 78, 79, 46, 118, 119, 86, 87, 54, 126, 127, 94, 95, 62,
+    39, 47, 55, 63, 7,
+};
+
+/* Trit or quint bits following the low bits of every value in a group */
+static const int _astc_trit_split[5] = { 2, 2, 1, 2, 1 };
+static const int _astc_quint_split[3] = { 3, 2, 2 };
+
+/* Footprints of ASTC formats in order */
+#define _ASTC_FOOTPRINTS 8
+
+static const int _astc_footprints[_ASTC_FOOTPRINTS][2] = {
+    { 4, 4 }, { 5, 4 }, { 5, 5 }, { 6, 5 }, { 6, 6 }, { 8, 5 }, { 8, 6 }, { 8, 8 },
+};
+
+/* Endpoint modes of direct RGB and RGBA, six and eight values */
+#define _ASTC_CEM_RGB 8
+#define _ASTC_CEM_RGBA 12
+
+/* Bits of block mode, partition count and endpoint mode before endpoints */
+#define _ASTC_HEADER_BITS 17
+
+/* Weights decoders take at most and bits they may fill */
+#define _ASTC_MAX_WEIGHTS 64
+#define _ASTC_MIN_WEIGHT_BITS 24
+#define _ASTC_MAX_WEIGHT_BITS 96
+
+typedef struct _astc_config {
+        unsigned short mode; /* Zero ends the list, it's reserved */
+        unsigned char grid[2];
+        unsigned char weights;
+        unsigned char colours;
+} _astc_config;
+
+/* Configurations a footprint may take, those of one grid next to each
+ * other, and how many of those a block expects to lose least with are
+ * fit for every quality */
+#define _ASTC_MAX_CONFIGS 340
+#define _ASTC_MAX_TRIES 6
+
+static const int _astc_tries[3] = { 1, 2, _ASTC_MAX_TRIES };
+
+typedef struct _astc_block {
+        const _astc_config *config;
+        int error;
+        unsigned char colour[8];
+        unsigned char weight[_ASTC_MAX_WEIGHTS];
+} _astc_block;
+
+/* Value of every code and code closest to every value, endpoints over
+ * 0..255 and weights over 0..64, and configurations of every footprint
+ * with RGB and RGBA endpoints. Filled once by _astc_init. */
+static unsigned char _astc_colour_values[_ASTC_RANGES][256];
+static unsigned char _astc_colour_codes[_ASTC_RANGES][256];
+static unsigned char _astc_weight_values[_ASTC_WEIGHT_RANGES][32];
+static unsigned char _astc_weight_codes[_ASTC_WEIGHT_RANGES][65];
+static _astc_config _astc_configs[_ASTC_FOOTPRINTS][2][_ASTC_MAX_CONFIGS + 1];
+static bool _astc_ready = false;
+
+#ifndef NDEBUG
+/* Weight values of every range as the specification lists them, what
+ * _astc_weight_value has to agree with */
+static const unsigned char _astc_spec_weights[_ASTC_WEIGHT_RANGES][32] = {
+    { 0, 64 },
+    { 0, 32, 64 },
+    { 0, 21, 43, 64 },
+    { 0, 16, 32, 48, 64 },
+    { 0, 64, 12, 52, 25, 39 },
+    { 0, 9, 18, 27, 37, 46, 55, 64 },
+    { 0, 64, 7, 57, 14, 50, 21, 43, 28, 36 },
+    { 0, 64, 17, 47, 5, 59, 23, 41, 11, 53, 28, 36 },
+    { 0, 4, 8, 12, 17, 21, 25, 29, 35, 39, 43, 47, 52, 56, 60, 64 },
+    { 0, 64, 16, 48, 3, 61, 19, 45, 6, 58, 23, 41, 9, 55, 26, 38, 13, 51, 29, 35 },
+    { 0, 64, 8, 56, 16, 48, 24, 40, 2, 62, 11, 53, 19, 45, 27, 37, 5, 59, 13, 51, 22, 42, 30, 34 },
+    { 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30,
+      34, 36, 38, 40, 42, 44, 46, 48, 50, 52, 54, 56, 58, 60, 62, 64 },
+};
+#endif
+
+typedef struct _bc_bits {
+        unsigned char *out;
+        int pos;
+} _bc_bits;
+
+typedef struct _bc_rows {
+        bc_format format;
+        bc_quality quality;
+        const unsigned char *rgba;
+        size_t stride;
+        size_t width;
+        unsigned char *out;
+} _bc_rows;
+
+BC_STATIC int _bc_clamp ( int v, int lo, int hi ) {
+        return v < lo ? lo : v > hi ? hi : v;
+}
+
+BC_STATIC float _bc_clampf ( float v ) {
+        return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Bits go in from the lowest of the first byte */
+BC_STATIC void _bc_put ( _bc_bits *b, unsigned value, int bits ) {
+        for ( int i = 0; i < bits; ++i, ++b->pos ) {
+                b->out[b->pos >> 3] |= ( ( value >> i ) & 1 ) << ( b->pos & 7 );
+        }
+}
+
+/* Principal axis of symmetric covariance over channels [first, last) by
+ * power iteration from the column of the channel spreading most. Returns
+ * spread along it, the axis is zero when there's none. */
+BC_STATIC float _bc_principal ( const float cov[4][4], int first, int last, float axis[4] ) {
+        int top = first;
+        for ( int c = 0; c < 4; ++c ) {
+                axis[c] = 0;
+        }
+        for ( int c = first; c < last; ++c ) {
+                if ( cov[c][c] > cov[top][top] ) {
+                        top = c;
+                }
+        }
+        for ( int c = first; c < last; ++c ) {
+                axis[c] = cov[c][top];
+        }
+
+        for ( int iter = 0; iter < 4; ++iter ) {
+                float next[4] = { 0 };
+                float largest = 0;
+
+                for ( int a = first; a < last; ++a ) {
+                        for ( int b = first; b < last; ++b ) {
+                                next[a] += cov[a][b] * axis[b];
+                        }
+                        largest = fmaxf( largest, fabsf( next[a] ) );
+                }
+                if ( largest == 0 ) {
+                        return 0;
+                }
+
+                for ( int c = first; c < last; ++c ) {
+                        axis[c] = next[c] / largest;
+                }
+        }
+
+        float len = 0;
+        for ( int c = first; c < last; ++c ) {
+                len += axis[c] * axis[c];
+        }
+        for ( int c = first; c < last; ++c ) {
+                axis[c] /= sqrtf( len );
+        }
+
+        float spread = 0;
+        for ( int a = first; a < last; ++a ) {
+                for ( int b = first; b < last; ++b ) {
+                        spread += axis[a] * cov[a][b] * axis[b];
+                }
+        }
+
+        return spread;
+}
+
+/* Mean and principal axis of channels [first, last) of pixels in mask */
+BC_STATIC void _bc_axis ( const unsigned char px[16][4], int mask, int first, int last, float mean[4], float axis[4] ) {
+        float cov[4][4] = { { 0 } };
+        int n = 0;
+
+        for ( int c = 0; c < 4; ++c ) {
+                mean[c] = 0;
+                axis[c] = 0;
+        }
+
+        for ( int i = 0; i < 16; ++i ) {
+                if ( ( mask >> i ) & 1 ) {
+                        n += 1;
+                        for ( int c = first; c < last; ++c ) {
+                                mean[c] += px[i][c];
+                        }
+                }
+        }
+        if ( n == 0 ) {
+                return;
+        }
+
+        for ( int c = first; c < last; ++c ) {
+                mean[c] /= n;
+        }
+
+        for ( int i = 0; i < 16; ++i ) {
+                if ( ( mask >> i ) & 1 ) {
+                        for ( int a = first; a < last; ++a ) {
+                                for ( int b = a; b < last; ++b ) {
+                                        cov[a][b] += ( px[i][a] - mean[a] ) * ( px[i][b] - mean[b] );
+                                }
+                        }
+                }
+        }
+        for ( int a = first; a < last; ++a ) {
+                for ( int b = first; b < a; ++b ) {
+                        cov[a][b] = cov[b][a];
+                }
+        }
+
+        _bc_principal( cov, first, last, axis );
+}
+
+/* Ends of the axis through mean where pixels in mask project the furthest */
+BC_STATIC void _bc_ends ( const unsigned char px[16][4], int mask, int first, int last, const float mean[4],
+                          const float axis[4], float ends[2][4] ) {
+        float lo = 0;
+        float hi = 0;
+
+        for ( int i = 0; i < 16; ++i ) {
+                if ( ( mask >> i ) & 1 ) {
+                        float t = 0;
+                        for ( int c = first; c < last; ++c ) {
+                                t += ( px[i][c] - mean[c] ) * axis[c];
+                        }
+                        lo = fminf( lo, t );
+                        hi = fmaxf( hi, t );
+                }
+        }
+
+        for ( int c = first; c < last; ++c ) {
+                ends[0][c] = _bc_clampf( mean[c] + axis[c] * lo );
+                ends[1][c] = _bc_clampf( mean[c] + axis[c] * hi );
+        }
+}
+
+/* Ends best fitting pixels in mask given weight of the second end for every
+ * pixel, false when all of them lean the same way */
+BC_STATIC bool _bc_least_squares ( const unsigned char px[16][4], int mask, int first, int last,
+                                   const float weight[16], float ends[2][4] ) {
+        float aa = 0, ab = 0, bb = 0;
+        float ax[4] = { 0 }, bx[4] = { 0 };
+
+        for ( int i = 0; i < 16; ++i ) {
+                if ( ( mask >> i ) & 1 ) {
+                        float b = weight[i];
+                        float a = 1 - b;
+                        aa += a * a;
+                        ab += a * b;
+                        bb += b * b;
+                        for ( int c = first; c < last; ++c ) {
+                                ax[c] += a * px[i][c];
+                                bx[c] += b * px[i][c];
+                        }
+                }
+        }
+
+        float det = aa * bb - ab * ab;
+        if ( det < 1e-4f ) {
+                return false;
+        }
+
+        for ( int c = first; c < last; ++c ) {
+                ends[0][c] = _bc_clampf( ( bb * ax[c] - ab * bx[c] ) / det );
+                ends[1][c] = _bc_clampf( ( aa * bx[c] - ab * ax[c] ) / det );
+        }
+
+        return true;
+}
+
+/* Spread of n pixels off their principal axis, from sums of their
+ * channels and of products of channel pairs */
+BC_STATIC float _bc_residual ( const float sum[4], const float prod[4][4], int n, int channels ) {
+        if ( n == 0 ) {
+                return 0;
+        }
+
+        float cov[4][4];
+        float trace = 0;
+        for ( int a = 0; a < channels; ++a ) {
+                for ( int b = 0; b < channels; ++b ) {
+                        cov[a][b] = prod[a][b] - sum[a] * sum[b] / n;
+                }
+                trace += cov[a][a];
+        }
+
+        float axis[4];
+        return trace - _bc_principal( cov, 0, channels, axis );
+}
+
+BC_STATIC unsigned _bc_565 ( const float c[4] ) {
+        int r = _bc_clamp( (int) ( c[0] * 31 / 255 + 0.5f ), 0, 31 );
+        int g = _bc_clamp( (int) ( c[1] * 63 / 255 + 0.5f ), 0, 63 );
+        int b = _bc_clamp( (int) ( c[2] * 31 / 255 + 0.5f ), 0, 31 );
+        return (unsigned) ( r << 11 | g << 5 | b );
+}
+
+BC_STATIC void _bc_unpack_565 ( unsigned v, int c[3] ) {
+        int r = ( v >> 11 ) & 31;
+        int g = ( v >> 5 ) & 63;
+        int b = v & 31;
+        c[0] = r << 3 | r >> 2;
+        c[1] = g << 2 | g >> 4;
+        c[2] = b << 3 | b >> 2;
+}
+
+/* Indices of colour block with ends a and b, pixels outside mask go
+ * transparent in three colour blocks. Returns error. */
+BC_STATIC int _bc1_indices ( const unsigned char px[16][4], int mask, unsigned a, unsigned b, bool three,
+                             unsigned char index[16] ) {
+        int pal[4][3];
+        _bc_unpack_565( a, pal[0] );
+        _bc_unpack_565( b, pal[1] );
+
+        for ( int c = 0; c < 3; ++c ) {
+                if ( three ) {
+                        pal[2][c] = ( pal[0][c] + pal[1][c] + 1 ) / 2;
+                } else {
+                        pal[2][c] = ( 2 * pal[0][c] + pal[1][c] + 1 ) / 3;
+                        pal[3][c] = ( pal[0][c] + 2 * pal[1][c] + 1 ) / 3;
+                }
+        }
+
+        int colours = three ? 3 : 4;
+        int error = 0;
+
+        for ( int i = 0; i < 16; ++i ) {
+                if ( !( ( mask >> i ) & 1 ) ) {
+                        index[i] = 3;
+                        continue;
+                }
+
+                int best = INT_MAX;
+                for ( int k = 0; k < colours; ++k ) {
+                        int d = 0;
+                        for ( int c = 0; c < 3; ++c ) {
+                                d += ( px[i][c] - pal[k][c] ) * ( px[i][c] - pal[k][c] );
+                        }
+                        if ( d < best ) {
+                                best = d;
+                                index[i] = (unsigned char) k;
+                        }
+                }
+                error += best;
+        }
+
+        return error;
+}
+
+/* Colour block of BC1, or of BC3 when alpha is kept elsewhere */
+BC_STATIC void _bc1_encode ( const unsigned char px[16][4], bool punch_through, int refine, unsigned char *out ) {
+        int mask = 0xffff;
+        for ( int i = 0; i < 16 && punch_through; ++i ) {
+                if ( px[i][3] < 128 ) {
+                        mask &= ~( 1 << i );
+                }
+        }
+
+        bool three = mask != 0xffff;
+        unsigned a = 0, b = 0;
+        unsigned char index[16];
+        memset( index, 3, sizeof( index ) );
+
+        if ( mask != 0 ) {
+                float mean[4], axis[4], ends[2][4];
+                _bc_axis( px, mask, 0, 3, mean, axis );
+                _bc_ends( px, mask, 0, 3, mean, axis, ends );
+
+                int best = INT_MAX;
+                for ( int r = 0;; ++r ) {
+                        unsigned ra = _bc_565( ends[0] );
+                        unsigned rb = _bc_565( ends[1] );
+                        unsigned char tried[16];
+
+                        int error = _bc1_indices( px, mask, ra, rb, three, tried );
+                        if ( error < best ) {
+                                best = error;
+                                a = ra;
+                                b = rb;
+                                memcpy( index, tried, sizeof( index ) );
+                        }
+                        if ( r == refine || error == 0 ) {
+                                break;
+                        }
+
+                        float weight[16];
+                        for ( int i = 0; i < 16; ++i ) {
+                                weight[i] = _bc1_weights[three][tried[i]];
+                        }
+                        if ( !_bc_least_squares( px, mask, 0, 3, weight, ends ) ) {
+                                break;
+                        }
+                }
+        }
+
+        /* Order of ends tells the blocks apart, swapping them flips indices.
+         * Four colours can't have equal ends, those blocks are a single colour. */
+        static const unsigned char flip[2][4] = { { 1, 0, 3, 2 }, { 1, 0, 2, 3 } };
+        if ( ( three && a > b ) || ( !three && a < b ) ) {
+                unsigned swap = a;
+                a = b;
+                b = swap;
+                for ( int i = 0; i < 16; ++i ) {
+                        index[i] = flip[three][index[i]];
+                }
+        } else if ( !three && a == b ) {
+                memset( index, 0, sizeof( index ) );
+        }
+
+        uint32_t bits = 0;
+        for ( int i = 0; i < 16; ++i ) {
+                bits |= (uint32_t) index[i] << ( i * 2 );
+        }
+
+        out[0] = a & 0xff;
+        out[1] = a >> 8;
+        out[2] = b & 0xff;
+        out[3] = b >> 8;
+        for ( int i = 0; i < 4; ++i ) {
+                out[4 + i] = ( bits >> ( i * 8 ) ) & 0xff;
+        }
+}
+
+/* Indices of single channel block with ends a and b, returns error */
+BC_STATIC int _bc4_indices ( const unsigned char px[16][4], int channel, int a, int b, unsigned char index[16] ) {
+        int pal[8] = { a, b };
+        if ( a > b ) {
+                for ( int k = 2; k < 8; ++k ) {
+                        pal[k] = ( ( 8 - k ) * a + ( k - 1 ) * b + 3 ) / 7;
+                }
+        } else {
+                for ( int k = 2; k < 6; ++k ) {
+                        pal[k] = ( ( 6 - k ) * a + ( k - 1 ) * b + 2 ) / 5;
+                }
+                pal[6] = 0;
+                pal[7] = 255;
+        }
+
+        int error = 0;
+        for ( int i = 0; i < 16; ++i ) {
+                int best = INT_MAX;
+                for ( int k = 0; k < 8; ++k ) {
+                        int d = ( px[i][channel] - pal[k] ) * ( px[i][channel] - pal[k] );
+                        if ( d < best ) {
+                                best = d;
+                                index[i] = (unsigned char) k;
+                        }
+                }
+                error += best;
+        }
+
+        return error;
+}
+
+/* Single channel block of BC4 and BC5, and alpha of BC3. Eight values
+ * between the extremes, or six with 0 and 255 coming free. */
+BC_STATIC void _bc4_encode ( const unsigned char px[16][4], int channel, int refine, bool six, unsigned char *out ) {
+        int lo = 255, hi = 0;
+        int inner_lo = 255, inner_hi = 0;
+        for ( int i = 0; i < 16; ++i ) {
+                int v = px[i][channel];
+                lo = v < lo ? v : lo;
+                hi = v > hi ? v : hi;
+                if ( v > 0 && v < 255 ) {
+                        inner_lo = v < inner_lo ? v : inner_lo;
+                        inner_hi = v > inner_hi ? v : inner_hi;
+                }
+        }
+
+        int a = hi, b = lo;
+        unsigned char index[16];
+        int best = _bc4_indices( px, channel, a, b, index );
+
+        float ends[2][4] = { { 0 } };
+        for ( int r = 0; r < refine && best > 0 && a > b; ++r ) {
+                float weight[16];
+                for ( int i = 0; i < 16; ++i ) {
+                        weight[i] = _bc4_weights[index[i]];
+                }
+                if ( !_bc_least_squares( px, 0xffff, channel, channel + 1, weight, ends ) ) {
+                        break;
+                }
+
+                int ra = (int) ( fmaxf( ends[0][channel], ends[1][channel] ) + 0.5f );
+                int rb = (int) ( fminf( ends[0][channel], ends[1][channel] ) + 0.5f );
+                if ( ra <= rb ) {
+                        break;
+                }
+
+                unsigned char tried[16];
+                int error = _bc4_indices( px, channel, ra, rb, tried );
+                if ( error >= best ) {
+                        break;
+                }
+                best = error;
+                a = ra;
+                b = rb;
+                memcpy( index, tried, sizeof( index ) );
+        }
+
+        if ( six && ( lo == 0 || hi == 255 ) && inner_lo <= inner_hi && best > 0 ) {
+                unsigned char tried[16];
+                int error = _bc4_indices( px, channel, inner_lo, inner_hi, tried );
+                if ( error < best ) {
+                        a = inner_lo;
+                        b = inner_hi;
+                        memcpy( index, tried, sizeof( index ) );
+                }
+        }
+
+        uint64_t bits = 0;
+        for ( int i = 0; i < 16; ++i ) {
+                bits |= (uint64_t) index[i] << ( i * 3 );
+        }
+
+        out[0] = (unsigned char) a;
+        out[1] = (unsigned char) b;
+        for ( int i = 0; i < 6; ++i ) {
+                out[2 + i] = ( bits >> ( i * 8 ) ) & 0xff;
+        }
+}
+
+/* End channel quantised to bits, with p-bit below them unless negative */
+BC_STATIC int _bc7_quantise ( float v, int bits, int p ) {
+        int top = ( 1 << bits ) - 1;
+        if ( p < 0 ) {
+                return _bc_clamp( (int) ( v * top / 255 + 0.5f ), 0, top );
+        }
+
+        float s = v * ( ( 2 << bits ) - 1 ) / 255;
+        return _bc_clamp( (int) floorf( ( s - p ) / 2 + 0.5f ), 0, top );
+}
+
+BC_STATIC int _bc7_unquantise ( int q, int bits, int p ) {
+        if ( p >= 0 ) {
+                q = q << 1 | p;
+                bits += 1;
+        }
+
+        q <<= 8 - bits;
+        return q | q >> bits;
+}
+
+/* Quantise both ends over channels [first, last) with p-bits losing the
+ * least, q gets them without p-bits and d back in 8 bits */
+BC_STATIC void _bc7_quantise_ends ( const _bc7_mode *m, const float ends[2][4], int first, int last,
+                                    unsigned char q[2][4], unsigned char p[2], int d[2][4] ) {
+        float error[2][2] = { { 0 } };
+
+        for ( int pb = 0; pb < ( m->pbits > 0 ? 2 : 1 ); ++pb ) {
+                for ( int e = 0; e < 2; ++e ) {
+                        for ( int c = first; c < last; ++c ) {
+                                int bits = c == 3 ? m->alpha_bits : m->colour_bits;
+                                int pv = m->pbits > 0 ? pb : -1;
+                                float diff = _bc7_unquantise( _bc7_quantise( ends[e][c], bits, pv ), bits, pv ) -
+                                             ends[e][c];
+                                error[pb][e] += diff * diff * ( c == 3 ? _BC7_ALPHA_WEIGHT : 1 );
+                        }
+                }
+        }
+
+        for ( int e = 0; e < 2; ++e ) {
+                if ( m->pbits == 2 ) {
+                        p[e] = error[1][e] < error[0][e];
+                } else if ( m->pbits == 1 ) {
+                        p[e] = error[1][0] + error[1][1] < error[0][0] + error[0][1];
+                } else {
+                        p[e] = 0;
+                }
+
+                int pv = m->pbits > 0 ? p[e] : -1;
+                for ( int c = first; c < last; ++c ) {
+                        int bits = c == 3 ? m->alpha_bits : m->colour_bits;
+                        q[e][c] = (unsigned char) _bc7_quantise( ends[e][c], bits, pv );
+                        d[e][c] = _bc7_unquantise( q[e][c], bits, pv );
+                }
+        }
+}
+
+/* Fit ends of subset of pixels in mask over channels [first, last) for
+ * indices of index_bits, those of the subset's pixels go into index.
+ * Returns error. */
+BC_STATIC int _bc7_fit ( const _bc7_mode *m, const unsigned char px[16][4], int mask, int first, int last,
+                         int index_bits, int refine, unsigned char q[2][4], unsigned char p[2],
+                         unsigned char index[16] ) {
+        float mean[4], axis[4], ends[2][4];
+        _bc_axis( px, mask, first, last, mean, axis );
+        _bc_ends( px, mask, first, last, mean, axis, ends );
+
+        const int *weights = _bc7_weights[index_bits];
+        int count = 1 << index_bits;
+        int best = INT_MAX;
+
+        for ( int r = 0;; ++r ) {
+                unsigned char tq[2][4], tp[2], tried[16];
+                int d[2][4];
+                _bc7_quantise_ends( m, ends, first, last, tq, tp, d );
+
+                int pal[16][4];
+                for ( int k = 0; k < count; ++k ) {
+                        for ( int c = first; c < last; ++c ) {
+                                pal[k][c] = ( ( 64 - weights[k] ) * d[0][c] + weights[k] * d[1][c] + 32 ) >> 6;
+                        }
+                }
+
+                int error = 0;
+                for ( int i = 0; i < 16; ++i ) {
+                        if ( !( ( mask >> i ) & 1 ) ) {
+                                continue;
+                        }
+
+                        int nearest = INT_MAX;
+                        for ( int k = 0; k < count; ++k ) {
+                                int dist = 0;
+                                for ( int c = first; c < last; ++c ) {
+                                        dist += ( px[i][c] - pal[k][c] ) * ( px[i][c] - pal[k][c] );
+                                }
+                                if ( dist < nearest ) {
+                                        nearest = dist;
+                                        tried[i] = (unsigned char) k;
+                                }
+                        }
+                        error += nearest;
+                }
+
+                if ( error < best ) {
+                        best = error;
+                        for ( int e = 0; e < 2; ++e ) {
+                                p[e] = tp[e];
+                                for ( int c = first; c < last; ++c ) {
+                                        q[e][c] = tq[e][c];
+                                }
+                        }
+                        for ( int i = 0; i < 16; ++i ) {
+                                if ( ( mask >> i ) & 1 ) {
+                                        index[i] = tried[i];
+                                }
+                        }
+                }
+                if ( r == refine || error == 0 ) {
+                        break;
+                }
+
+                float weight[16];
+                for ( int i = 0; i < 16; ++i ) {
+                        weight[i] = ( ( mask >> i ) & 1 ) ? weights[tried[i]] / 64.0f : 0;
+                }
+                if ( !_bc_least_squares( px, mask, first, last, weight, ends ) ) {
+                        break;
+                }
+        }
+
+        return best;
+}
+
+/* Single subset with all four channels sharing indices */
+BC_STATIC void _bc7_mode6 ( const unsigned char px[16][4], int refine, _bc7_block *b ) {
+        *b = (_bc7_block) { .mode = 6 };
+        b->error = _bc7_fit( &_bc7_modes[6], px, 0xffff, 0, 4, 4, refine, b->endpoint[0], b->pbit[0], b->index );
+}
+
+/* Single subset with alpha fitted apart from colour, rotation swaps alpha
+ * with one of the colour channels first */
+BC_STATIC void _bc7_mode5 ( const unsigned char px[16][4], int rotation, int refine, _bc7_block *b ) {
+        const _bc7_mode *m = &_bc7_modes[5];
+        unsigned char rotated[16][4];
+        memcpy( rotated, px, sizeof( rotated ) );
+        for ( int i = 0; i < 16 && rotation > 0; ++i ) {
+                rotated[i][3] = px[i][rotation - 1];
+                rotated[i][rotation - 1] = px[i][3];
+        }
+
+        *b = (_bc7_block) { .mode = 5, .rotation = rotation };
+        b->error = _bc7_fit( m, rotated, 0xffff, 0, 3, m->index_bits, refine, b->endpoint[0], b->pbit[0], b->index ) +
+                   _bc7_fit( m, rotated, 0xffff, 3, 4, m->alpha_index_bits, refine, b->endpoint[0], b->pbit[0],
+                             b->alpha_index );
+}
+
+/* Two subsets split by partition, opaque modes leave alpha at 255 */
+BC_STATIC void _bc7_two ( const unsigned char px[16][4], int mode, int partition, int refine, _bc7_block *b ) {
+        const _bc7_mode *m = &_bc7_modes[mode];
+        int channels = m->alpha_bits > 0 ? 4 : 3;
+        int second = _bc7_partitions[partition];
+
+        *b = (_bc7_block) { .mode = mode, .partition = partition };
+        b->error = _bc7_fit( m, px, ~second & 0xffff, 0, channels, m->index_bits, refine, b->endpoint[0],
+                             b->pbit[0], b->index ) +
+                   _bc7_fit( m, px, second, 0, channels, m->index_bits, refine, b->endpoint[1], b->pbit[1],
+                             b->index );
+}
+
+/* Count of partitions whose subsets sit closest to a line each. Sums for
+ * the first subset are what's left of the block after the second. */
+BC_STATIC void _bc7_rank ( const unsigned char px[16][4], int channels, int count, int best[] ) {
+        float total[4] = { 0 }, total_prod[4][4] = { { 0 } };
+        for ( int i = 0; i < 16; ++i ) {
+                for ( int a = 0; a < channels; ++a ) {
+                        total[a] += px[i][a];
+                        for ( int b = 0; b < channels; ++b ) {
+                                total_prod[a][b] += px[i][a] * px[i][b];
+                        }
+                }
+        }
+
+        float score[64];
+        for ( int p = 0; p < 64; ++p ) {
+                int second = _bc7_partitions[p];
+                float sum[2][4] = { { 0 } }, prod[2][4][4] = { { { 0 } } };
+                int n = 0;
+
+                for ( int i = 0; i < 16; ++i ) {
+                        if ( ( second >> i ) & 1 ) {
+                                n += 1;
+                                for ( int a = 0; a < channels; ++a ) {
+                                        sum[1][a] += px[i][a];
+                                        for ( int b = 0; b < channels; ++b ) {
+                                                prod[1][a][b] += px[i][a] * px[i][b];
+                                        }
+                                }
+                        }
+                }
+                for ( int a = 0; a < channels; ++a ) {
+                        sum[0][a] = total[a] - sum[1][a];
+                        for ( int b = 0; b < channels; ++b ) {
+                                prod[0][a][b] = total_prod[a][b] - prod[1][a][b];
+                        }
+                }
+
+                score[p] = _bc_residual( sum[0], prod[0], 16 - n, channels ) +
+                           _bc_residual( sum[1], prod[1], n, channels );
+        }
+
+        for ( int k = 0; k < count; ++k ) {
+                int pick = 0;
+                for ( int p = 1; p < 64; ++p ) {
+                        if ( score[p] < score[pick] ) {
+                                pick = p;
+                        }
+                }
+                best[k] = pick;
+                score[pick] = INFINITY;
+        }
+}
+
+/* Index of every anchor pixel leaves out its top bit, subsets where it's set
+ * get their ends swapped and indices flipped */
+BC_STATIC void _bc7_fix_anchors ( _bc7_block *b ) {
+        const _bc7_mode *m = &_bc7_modes[b->mode];
+        int last = m->alpha_index_bits > 0 ? 3 : 4;
+
+        for ( int s = 0; s < m->subsets; ++s ) {
+                int second = m->subsets > 1 ? _bc7_partitions[b->partition] : 0;
+                int mask = s == 0 ? ~second & 0xffff : second;
+                int anchor = s == 0 ? 0 : _bc7_anchors[b->partition];
+                int top = ( 1 << m->index_bits ) - 1;
+
+                if ( !( b->index[anchor] >> ( m->index_bits - 1 ) ) ) {
+                        continue;
+                }
+
+                for ( int c = 0; c < last; ++c ) {
+                        unsigned char swap = b->endpoint[s][0][c];
+                        b->endpoint[s][0][c] = b->endpoint[s][1][c];
+                        b->endpoint[s][1][c] = swap;
+                }
+                unsigned char swap = b->pbit[s][0];
+                b->pbit[s][0] = b->pbit[s][1];
+                b->pbit[s][1] = swap;
+
+                for ( int i = 0; i < 16; ++i ) {
+                        if ( ( mask >> i ) & 1 ) {
+                                b->index[i] = (unsigned char) ( top - b->index[i] );
+                        }
+                }
+        }
+
+        if ( m->alpha_index_bits > 0 && b->alpha_index[0] >> ( m->alpha_index_bits - 1 ) ) {
+                unsigned char swap = b->endpoint[0][0][3];
+                b->endpoint[0][0][3] = b->endpoint[0][1][3];
+                b->endpoint[0][1][3] = swap;
+
+                for ( int i = 0; i < 16; ++i ) {
+                        b->alpha_index[i] = (unsigned char) ( ( 1 << m->alpha_index_bits ) - 1 - b->alpha_index[i] );
+                }
+        }
+}
+
+BC_STATIC void _bc7_emit ( const _bc7_block *b, unsigned char *out ) {
+        const _bc7_mode *m = &_bc7_modes[b->mode];
+        _bc_bits bits = { out, 0 };
+        memset( out, 0, 16 );
+
+        _bc_put( &bits, 1u << b->mode, b->mode + 1 );
+        _bc_put( &bits, b->partition, m->partition_bits );
+        _bc_put( &bits, b->rotation, m->rotation_bits );
+
+        for ( int c = 0; c < ( m->alpha_bits > 0 ? 4 : 3 ); ++c ) {
+                for ( int s = 0; s < m->subsets; ++s ) {
+                        for ( int e = 0; e < 2; ++e ) {
+                                _bc_put( &bits, b->endpoint[s][e][c], c == 3 ? m->alpha_bits : m->colour_bits );
+                        }
+                }
+        }
+
+        for ( int s = 0; s < m->subsets; ++s ) {
+                for ( int e = 0; e < m->pbits; ++e ) {
+                        _bc_put( &bits, b->pbit[s][e], 1 );
+                }
+        }
+
+        for ( int i = 0; i < 16; ++i ) {
+                bool anchor = i == 0 || ( m->subsets > 1 && i == _bc7_anchors[b->partition] );
+                _bc_put( &bits, b->index[i], m->index_bits - anchor );
+        }
+        for ( int i = 0; i < 16 && m->alpha_index_bits > 0; ++i ) {
+                _bc_put( &bits, b->alpha_index[i], m->alpha_index_bits - ( i == 0 ) );
+        }
+}
+
+BC_STATIC void _bc7_encode ( const unsigned char px[16][4], bc_quality quality, unsigned char *out ) {
+        int refine = _bc_refine[quality];
+        bool opaque = true;
+        for ( int i = 0; i < 16; ++i ) {
+                opaque &= px[i][3] == 255;
+        }
+
+        _bc7_block best, tried;
+        _bc7_mode6( px, refine, &best );
+
+        int enough = _bc7_enough[quality];
+
+        if ( best.error > enough ) {
+                int rotations = quality == BC_QUALITY_SLOW ? 4 : opaque ? 0 : 1;
+                for ( int r = 0; r < rotations && best.error > enough; ++r ) {
+                        _bc7_mode5( px, r, refine, &tried );
+                        if ( tried.error < best.error ) {
+                                best = tried;
+                        }
+                }
+
+                /* Translucent blocks only split in slow mode, mode 7 has little
+                 * precision to spare */
+                static const int modes[2][2] = { { 1, 3 }, { 7, 7 } };
+                int count = opaque || quality == BC_QUALITY_SLOW ? _bc_partitions[quality] : 0;
+                int ranked[16];
+                if ( count > 0 && best.error > enough ) {
+                        _bc7_rank( px, opaque ? 3 : 4, count, ranked );
+                }
+
+                for ( int k = 0; k < ( opaque ? 2 : 1 ); ++k ) {
+                        for ( int i = 0; i < count && best.error > enough; ++i ) {
+                                _bc7_two( px, modes[!opaque][k], ranked[i], refine, &tried );
+                                if ( tried.error < best.error ) {
+                                        best = tried;
+                                }
+                        }
+                }
+        }
+
+        _bc7_fix_anchors( &best );
+        _bc7_emit( &best, out );
+}
+
+/* Bits of a colour repeated up to 8 */
+BC_STATIC int _etc_expand ( int q, int bits ) {
+        return q << ( 8 - bits ) | q >> ( 2 * bits - 8 );
+}
+
+/* Quantised value of bits whose expansion to 8 bits lands closest to v */
+BC_STATIC int _etc_quantise ( float v, int bits ) {
+        int top = ( 1 << bits ) - 1;
+        int q = _bc_clamp( (int) ( v * top / 255 + 0.5f ), 0, top );
+        int best = q;
+
+        /* Expansion repeats the top bits, a neighbour may land closer */
+        for ( int n = q - 1; n <= q + 1; n += 2 ) {
+                if ( n >= 0 && n <= top &&
+                     fabsf( _etc_expand( n, bits ) - v ) < fabsf( _etc_expand( best, bits ) - v ) ) {
+                        best = n;
+                }
+        }
+
+        return best;
+}
+
+/* Error of pixels in mask around base colour with modifiers of table, every
+ * pixel picking the closest */
+BC_STATIC int _etc_half_error ( const unsigned char px[16][4], int mask, const int base[3], int table,
+                                unsigned char index[16] ) {
+        int error = 0;
+
+        for ( int i = 0; i < 16; ++i ) {
+                if ( ( ( mask >> i ) & 1 ) == 0 ) {
+                        continue;
+                }
+
+                int best = INT_MAX;
+                for ( int k = 0; k < 4; ++k ) {
+                        int e = 0;
+                        for ( int c = 0; c < 3; ++c ) {
+                                int d = _bc_clamp( base[c] + _etc_modifiers[table][k], 0, 255 ) - px[i][c];
+                                e += d * d;
+                        }
+                        if ( e < best ) {
+                                best = e;
+                                index[i] = (unsigned char) k;
+                        }
+                }
+                error += best;
+        }
+
+        return error;
+}
+
+/* Table fitting pixels in mask best around quantised base colour */
+BC_STATIC int _etc_half_table ( const unsigned char px[16][4], int mask, const int q[3], int bits, int *table,
+                                unsigned char index[16] ) {
+        int base[3];
+        for ( int c = 0; c < 3; ++c ) {
+                base[c] = _etc_expand( q[c], bits );
+        }
+
+        int best = INT_MAX;
+        for ( int t = 0; t < 8 && best > 0; ++t ) {
+                unsigned char tried[16];
+                int error = _etc_half_error( px, mask, base, t, tried );
+                if ( error < best ) {
+                        best = error;
+                        *table = t;
+                        for ( int i = 0; i < 16; ++i ) {
+                                if ( ( mask >> i ) & 1 ) {
+                                        index[i] = tried[i];
+                                }
+                        }
+                }
+        }
+
+        return best;
+}
+
+/* Base colour of bits per channel within [lo, hi] for the half in mask,
+ * starting from the mean of its pixels. Refinement moves it to the mean of
+ * pixels minus their modifiers, search tries every neighbour once. Returns
+ * squared error. */
+BC_STATIC int _etc_fit_half ( const unsigned char px[16][4], int mask, int bits, const int lo[3], const int hi[3],
+                              int refine, bool search, int q[3], int *table, unsigned char index[16] ) {
+        float mean[3] = { 0 };
+        for ( int i = 0; i < 16; ++i ) {
+                if ( ( mask >> i ) & 1 ) {
+                        for ( int c = 0; c < 3; ++c ) {
+                                mean[c] += px[i][c] / 8.0f;
+                        }
+                }
+        }
+        for ( int c = 0; c < 3; ++c ) {
+                q[c] = _bc_clamp( _etc_quantise( mean[c], bits ), lo[c], hi[c] );
+        }
+
+        int error = _etc_half_table( px, mask, q, bits, table, index );
+
+        for ( int r = 0; r < refine && error > 0; ++r ) {
+                float target[3] = { 0 };
+                for ( int i = 0; i < 16; ++i ) {
+                        if ( ( mask >> i ) & 1 ) {
+                                for ( int c = 0; c < 3; ++c ) {
+                                        target[c] += ( px[i][c] - _etc_modifiers[*table][index[i]] ) / 8.0f;
+                                }
+                        }
+                }
+
+                int next[3];
+                for ( int c = 0; c < 3; ++c ) {
+                        next[c] = _bc_clamp( _etc_quantise( target[c], bits ), lo[c], hi[c] );
+                }
+                if ( memcmp( next, q, sizeof( next ) ) == 0 ) {
+                        break;
+                }
+
+                int tried_table;
+                unsigned char tried[16];
+                int tried_error = _etc_half_table( px, mask, next, bits, &tried_table, tried );
+                if ( tried_error >= error ) {
+                        break;
+                }
+
+                error = tried_error;
+                *table = tried_table;
+                memcpy( q, next, sizeof( next ) );
+                for ( int i = 0; i < 16; ++i ) {
+                        if ( ( mask >> i ) & 1 ) {
+                                index[i] = tried[i];
+                        }
+                }
+        }
+
+        if ( !search || error == 0 ) {
+                return error;
+        }
+
+        int centre[3] = { q[0], q[1], q[2] };
+        for ( int n = 0; n < 27; ++n ) {
+                int next[3] = { centre[0] + n % 3 - 1, centre[1] + n / 3 % 3 - 1, centre[2] + n / 9 - 1 };
+                if ( n == 13 || next[0] < lo[0] || next[0] > hi[0] || next[1] < lo[1] || next[1] > hi[1] ||
+                     next[2] < lo[2] || next[2] > hi[2] ) {
+                        continue;
+                }
+
+                int tried_table;
+                unsigned char tried[16];
+                int tried_error = _etc_half_table( px, mask, next, bits, &tried_table, tried );
+                if ( tried_error < error ) {
+                        error = tried_error;
+                        *table = tried_table;
+                        memcpy( q, next, sizeof( next ) );
+                        for ( int i = 0; i < 16; ++i ) {
+                                if ( ( mask >> i ) & 1 ) {
+                                        index[i] = tried[i];
+                                }
+                        }
+                }
+        }
+
+        return error;
+}
+
+/* Halves with 4 bit colours of their own, or a 5 bit colour and the second
+ * one 3 bits off it */
+BC_STATIC void _etc_halves_fit ( const unsigned char px[16][4], int flip, bool differential, int refine, bool search,
+                                 _etc_block *b ) {
+        int bits = differential ? 5 : 4;
+        int lo[3] = { 0, 0, 0 };
+        int hi[3];
+        for ( int c = 0; c < 3; ++c ) {
+                hi[c] = ( 1 << bits ) - 1;
+        }
+
+        b->mode = differential ? _ETC_DIFFERENTIAL : _ETC_INDIVIDUAL;
+        b->flip = flip;
+        b->error = _etc_fit_half( px, _etc_halves[flip][0], bits, lo, hi, refine, search, b->colour[0],
+                                  &b->table[0], b->index );
+
+        if ( differential ) {
+                for ( int c = 0; c < 3; ++c ) {
+                        lo[c] = _bc_clamp( b->colour[0][c] - 4, 0, 31 );
+                        hi[c] = _bc_clamp( b->colour[0][c] + 3, 0, 31 );
+                }
+        }
+        b->error += _etc_fit_half( px, _etc_halves[flip][1], bits, lo, hi, refine, search, b->colour[1],
+                                   &b->table[1], b->index );
+}
+
+/* Colour at x, y of plane through origin o, h four pixels right and v four
+ * pixels down */
+BC_STATIC int _etc_plane ( int o, int h, int v, int x, int y ) {
+        return _bc_clamp( ( x * ( h - o ) + y * ( v - o ) + 4 * o + 2 ) >> 2, 0, 255 );
+}
+
+BC_STATIC int _etc_planar_error ( const unsigned char px[16][4], const int q[3][3] ) {
+        int error = 0;
+
+        for ( int c = 0; c < 3; ++c ) {
+                int bits = _etc_plane_bits[c];
+                int o = _etc_expand( q[0][c], bits );
+                int h = _etc_expand( q[1][c], bits );
+                int v = _etc_expand( q[2][c], bits );
+
+                for ( int i = 0; i < 16; ++i ) {
+                        int d = _etc_plane( o, h, v, i & 3, i >> 2 ) - px[i][c];
+                        error += d * d;
+                }
+        }
+
+        return error;
+}
+
+/* Plane fitting pixels by least squares, search nudges every value once */
+BC_STATIC void _etc_planar ( const unsigned char px[16][4], bool search, _etc_block *b ) {
+        b->mode = _ETC_PLANAR;
+
+        for ( int c = 0; c < 3; ++c ) {
+                /* Slopes across and down around the middle of the block */
+                float sum = 0, across = 0, down = 0;
+                for ( int i = 0; i < 16; ++i ) {
+                        sum += px[i][c];
+                        across += ( ( i & 3 ) - 1.5f ) * px[i][c];
+                        down += ( ( i >> 2 ) - 1.5f ) * px[i][c];
+                }
+                across /= 20;
+                down /= 20;
+
+                float o = sum / 16 - 1.5f * ( across + down );
+                int bits = _etc_plane_bits[c];
+                b->colour[0][c] = _etc_quantise( o, bits );
+                b->colour[1][c] = _etc_quantise( o + 4 * across, bits );
+                b->colour[2][c] = _etc_quantise( o + 4 * down, bits );
+        }
+
+        b->error = _etc_planar_error( px, b->colour );
+
+        for ( int n = 0; search && n < 9 && b->error > 0; ++n ) {
+                int c = n / 3;
+                int *value = &b->colour[n % 3][c];
+                int top = ( 1 << _etc_plane_bits[c] ) - 1;
+
+                for ( int d = -1; d <= 1; d += 2 ) {
+                        int kept = *value;
+                        *value = _bc_clamp( kept + d, 0, top );
+
+                        int error = _etc_planar_error( px, b->colour );
+                        if ( error < b->error ) {
+                                b->error = error;
+                                break;
+                        }
+                        *value = kept;
+                }
+        }
+}
+
+/* Bits are numbered from the lowest of the last byte, 64 bits at a time */
+BC_STATIC void _etc_put64 ( unsigned char *out, uint64_t v ) {
+        for ( int i = 0; i < 8; ++i ) {
+                out[i] = (unsigned char) ( v >> ( 56 - 8 * i ) );
+        }
+}
+
+BC_STATIC void _etc_emit ( const _etc_block *b, unsigned char *out ) {
+        uint64_t v = 0;
+
+        if ( b->mode == _ETC_PLANAR ) {
+                uint64_t o[3], h[3], w[3];
+                for ( int c = 0; c < 3; ++c ) {
+                        o[c] = (uint64_t) b->colour[0][c];
+                        h[c] = (uint64_t) b->colour[1][c];
+                        w[c] = (uint64_t) b->colour[2][c];
+                }
+
+                v = o[0] << 57 | ( o[1] >> 6 ) << 56 | ( o[1] & 63 ) << 49 | ( o[2] >> 5 ) << 48 |
+                    ( ( o[2] >> 3 ) & 3 ) << 43 | ( o[2] & 7 ) << 39 | ( h[0] >> 1 ) << 34 | (uint64_t) 1 << 33 |
+                    ( h[0] & 1 ) << 32 | h[1] << 25 | h[2] << 19 | w[0] << 13 | w[1] << 6 | w[2];
+
+                /* Planar blocks are told apart by red and green of the
+                 * differential layout staying in range while blue overflows,
+                 * free bits steer them */
+                int red = (int) ( o[0] >> 2 ) & 15;
+                int red_diff = (int) ( ( ( o[0] & 3 ) << 1 ) | o[1] >> 6 );
+                if ( red + ( red_diff ^ 4 ) - 4 < 0 ) {
+                        v |= (uint64_t) 1 << 63;
+                }
+
+                int green = (int) ( o[1] >> 2 ) & 15;
+                int green_diff = (int) ( ( ( o[1] & 3 ) << 1 ) | o[2] >> 5 );
+                if ( green + ( green_diff ^ 4 ) - 4 < 0 ) {
+                        v |= (uint64_t) 1 << 55;
+                }
+
+                if ( ( ( o[2] >> 3 ) & 3 ) + ( ( o[2] >> 1 ) & 3 ) >= 4 ) {
+                        v |= (uint64_t) 7 << 45;
+                } else {
+                        v |= (uint64_t) 1 << 42;
+                }
+
+                _etc_put64( out, v );
+                return;
+        }
+
+        for ( int c = 0; c < 3; ++c ) {
+                uint64_t first = (uint64_t) b->colour[0][c];
+                uint64_t second = (uint64_t) b->colour[1][c];
+
+                if ( b->mode == _ETC_DIFFERENTIAL ) {
+                        v |= first << ( 59 - 8 * c ) | ( ( second - first ) & 7 ) << ( 56 - 8 * c );
+                } else {
+                        v |= first << ( 60 - 8 * c ) | second << ( 56 - 8 * c );
+                }
+        }
+        v |= (uint64_t) b->table[0] << 37 | (uint64_t) b->table[1] << 34;
+        v |= (uint64_t) ( b->mode == _ETC_DIFFERENTIAL ) << 33 | (uint64_t) b->flip << 32;
+
+        /* Pixels go down columns, top index bits in the upper half */
+        for ( int i = 0; i < 16; ++i ) {
+                int p = ( i & 3 ) * 4 + ( i >> 2 );
+                v |= (uint64_t) ( b->index[i] >> 1 ) << ( 16 + p ) | (uint64_t) ( b->index[i] & 1 ) << p;
+        }
+
+        _etc_put64( out, v );
+}
+
+/* Error of alpha around base with table scaled by mult, stops once over limit */
+BC_STATIC int _eac_error ( const unsigned char px[16][4], int base, int mult, int table, unsigned char index[16],
+                           int limit ) {
+        int error = 0;
+
+        for ( int i = 0; i < 16 && error < limit; ++i ) {
+                int best = INT_MAX;
+                for ( int k = 0; k < 8; ++k ) {
+                        int d = _bc_clamp( base + _eac_modifiers[table][k] * mult, 0, 255 ) - px[i][3];
+                        if ( d * d < best ) {
+                                best = d * d;
+                                index[i] = (unsigned char) k;
+                        }
+                }
+                error += best;
+        }
+
+        return error;
+}
+
+/* Every table with multipliers around the one spanning the alpha range and
+ * bases around the one centring it, more of them for higher quality */
+BC_STATIC void _eac_encode ( const unsigned char px[16][4], bc_quality quality, unsigned char *out ) {
+        int lo = 255, hi = 0;
+        for ( int i = 0; i < 16; ++i ) {
+                lo = px[i][3] < lo ? px[i][3] : lo;
+                hi = px[i][3] > hi ? px[i][3] : hi;
+        }
+
+        int best = lo == hi ? 0 : INT_MAX;
+        int base = lo, mult = 1, table = _EAC_FLAT_TABLE;
+        unsigned char index[16];
+        memset( index, _EAC_FLAT_INDEX, sizeof( index ) );
+
+        int reach = (int) quality;
+        for ( int t = 0; t < 16 && best > 0; ++t ) {
+                const int *m = _eac_modifiers[t];
+                int spanning = _bc_clamp( (int) ( ( hi - lo ) / (float) ( m[7] - m[3] ) + 0.5f ), 1, 15 );
+
+                for ( int mu = spanning - reach; mu <= spanning + reach; ++mu ) {
+                        if ( mu < 1 || mu > 15 ) {
+                                continue;
+                        }
+
+                        int centre = (int) lroundf( ( lo + hi ) / 2.0f - mu * ( m[3] + m[7] ) / 2.0f );
+
+                        int last = _bc_clamp( centre + reach, 0, 255 );
+                        for ( int b = _bc_clamp( centre - reach, 0, 255 ); b <= last; ++b ) {
+                                unsigned char tried[16];
+                                int error = _eac_error( px, b, mu, t, tried, best );
+                                if ( error < best ) {
+                                        best = error;
+                                        base = b;
+                                        mult = mu;
+                                        table = t;
+                                        memcpy( index, tried, sizeof( index ) );
+                                }
+                        }
+                }
+        }
+
+        uint64_t v = (uint64_t) base << 56 | (uint64_t) mult << 52 | (uint64_t) table << 48;
+        for ( int i = 0; i < 16; ++i ) {
+                int p = ( i & 3 ) * 4 + ( i >> 2 );
+                v |= (uint64_t) index[i] << ( 45 - 3 * p );
+        }
+
+        _etc_put64( out, v );
+}
+
+/* ETC2 RGBA, EAC alpha first. Both flips in individual and differential
+ * layouts, planar from normal quality on. */
+BC_STATIC void _etc_encode ( const unsigned char px[16][4], bc_quality quality, unsigned char *out ) {
+        int refine = _bc_refine[quality];
+        bool search = quality == BC_QUALITY_SLOW;
+
+        _eac_encode( px, quality, out );
+
+        _etc_block best = { .error = INT_MAX };
+        _etc_block tried;
+        for ( int n = 0; n < 4 && best.error > 0; ++n ) {
+                _etc_halves_fit( px, n & 1, n >> 1, refine, search, &tried );
+                if ( tried.error < best.error ) {
+                        best = tried;
+                }
+        }
+
+        if ( quality > BC_QUALITY_FAST && best.error > 0 ) {
+                _etc_planar( px, search, &tried );
+                if ( tried.error < best.error ) {
+                        best = tried;
+                }
+        }
+
+        _etc_emit( &best, out + 8 );
+}
+
+BC_STATIC int _astc_levels ( int range ) {
+        const unsigned char *r = _astc_ranges[range];
+        return ( r[0] ? 3 : r[1] ? 5 : 1 ) << r[2];
+}
+
+/* Bits count values take in range, trits packed five to 8 bits and quints
+ * three to 7 */
+BC_STATIC int _astc_ise_bits ( int range, int count ) {
+        const unsigned char *r = _astc_ranges[range];
+        return count * r[2] + ( r[0] ? ( 8 * count + 4 ) / 5 : r[1] ? ( 7 * count + 2 ) / 3 : 0 );
+}
+
+/* Endpoint value of code, bits replicated or trit or quint scaled and
+ * mirrored by the lowest bit */
+BC_STATIC int _astc_colour_value ( int range, int code ) {
+        const unsigned char *r = _astc_ranges[range];
+        int n = r[2];
+        if ( r[0] == 0 && r[1] == 0 ) {
+                int v = code << ( 8 - n );
+                for ( int shift = n; shift < 8; shift += n ) {
+                        v |= code << ( 8 - n ) >> shift;
+                }
+                return v;
+        }
+
+        int d = code >> n;
+        int b = ( code & ( ( 1 << n ) - 1 ) ) >> 1;
+        int a = ( code & 1 ) ? 0x1ff : 0;
+        int scale, bits;
+
+        if ( r[0] ) {
+                static const int scales[7] = { 0, 204, 93, 44, 22, 11, 5 };
+                scale = scales[n];
+                bits = n == 1 ? 0 : n == 2 ? b << 8 | b << 4 | b << 2 | b << 1
+                                   : n == 3 ? b << 7 | b << 2 | b
+                                   : n == 4 ? b << 6 | b
+                                   : n == 5 ? b << 5 | b >> 2
+                                            : b << 4 | b >> 4;
+        } else {
+                static const int scales[6] = { 0, 113, 54, 26, 13, 6 };
+                scale = scales[n];
+                bits = n == 1 ? 0 : n == 2 ? b << 8 | b << 3 | b << 2
+                                   : n == 3 ? b << 7 | b << 1 | b >> 1
+                                   : n == 4 ? b << 6 | b >> 1
+                                            : b << 5 | b >> 3;
+        }
+
+        int t = ( d * scale + bits ) ^ a;
+        return ( a & 0x80 ) | t >> 2;
+}
+
+/* Weight value of code over 0..64 */
+BC_STATIC int _astc_weight_value ( int range, int code ) {
+        const unsigned char *r = _astc_ranges[range];
+        int n = r[2];
+        int v;
+
+        if ( r[0] == 0 && r[1] == 0 ) {
+                v = code << ( 6 - n );
+                for ( int shift = n; shift < 6; shift += n ) {
+                        v |= code << ( 6 - n ) >> shift;
+                }
+        } else if ( n == 0 ) {
+                static const int trits[3] = { 0, 32, 63 };
+                static const int quints[5] = { 0, 16, 32, 47, 63 };
+                v = r[0] ? trits[code] : quints[code];
+        } else {
+                int d = code >> n;
+                int b = ( code & ( ( 1 << n ) - 1 ) ) >> 1;
+                int a = ( code & 1 ) ? 0x7f : 0;
+                int scale, bits;
+
+                if ( r[0] ) {
+                        scale = n == 1 ? 50 : n == 2 ? 23 : 11;
+                        bits = n == 1 ? 0 : n == 2 ? b << 6 | b << 2 | b : b << 5 | b;
+                } else {
+                        scale = n == 1 ? 28 : 13;
+                        bits = n == 1 ? 0 : b << 6 | b << 1;
+                }
+
+                v = ( a & 0x20 ) | ( ( d * scale + bits ) ^ a ) >> 2;
+        }
+
+        return v > 32 ? v + 1 : v;
+}
+
+/* Block mode of a single plane weight grid of width by height in range, -1
+ * when no layout holds it */
+BC_STATIC int _astc_block_mode ( int width, int height, int range ) {
+        int high = range >= 6;
+        int r = range % 6 + 2;
+        int low = r >> 1 | ( r & 1 ) << 4 | high << 9;
+
+        if ( height >= 2 && height <= 5 ) {
+                int a = ( height - 2 ) << 5;
+                if ( width >= 4 && width <= 7 ) {
+                        return low | a | ( width - 4 ) << 7;
+                }
+                if ( width == 8 ) {
+                        return low | 1 << 2 | a;
+                }
+                if ( width <= 3 ) {
+                        return low | 3 << 2 | a | ( width - 2 ) << 7 | 1 << 8;
+                }
+        }
+        if ( width <= 5 && ( height == 6 || height == 7 ) ) {
+                return low | 3 << 2 | ( width - 2 ) << 5 | ( height - 6 ) << 7;
+        }
+        if ( width <= 5 && height == 8 ) {
+                return low | 2 << 2 | ( width - 2 ) << 5;
+        }
+
+        /* Layout for 6 to 9 on both sides has no room for the high bit */
+        if ( width >= 6 && height >= 6 && !high ) {
+                return ( r >> 1 ) << 2 | ( r & 1 ) << 4 | ( width - 6 ) << 5 | 2 << 7 | ( height - 6 ) << 9;
+        }
+
+        return -1;
+}
+
+/* Tables of values and codes, then every grid and weight range of every
+ * footprint that leaves endpoints enough bits */
+BC_STATIC void _astc_init ( void ) {
+        if ( _astc_ready ) {
+                return;
+        }
+
+        for ( int r = 0; r < _ASTC_RANGES; ++r ) {
+                int levels = _astc_levels( r );
+                for ( int code = 0; code < levels; ++code ) {
+                        _astc_colour_values[r][code] = (unsigned char) _astc_colour_value( r, code );
+                }
+                for ( int v = 0; v < 256; ++v ) {
+                        int best = 0;
+                        for ( int code = 1; code < levels; ++code ) {
+                                const unsigned char *values = _astc_colour_values[r];
+                                if ( abs( values[code] - v ) < abs( values[best] - v ) ) {
+                                        best = code;
+                                }
+                        }
+                        _astc_colour_codes[r][v] = (unsigned char) best;
+                }
+        }
+
+        for ( int r = 0; r < _ASTC_WEIGHT_RANGES; ++r ) {
+                int levels = _astc_levels( r );
+                for ( int code = 0; code < levels; ++code ) {
+                        _astc_weight_values[r][code] = (unsigned char) _astc_weight_value( r, code );
+#ifndef NDEBUG
+                        assert( _astc_weight_values[r][code] == _astc_spec_weights[r][code] );
+#endif
+                }
+                for ( int v = 0; v <= 64; ++v ) {
+                        int best = 0;
+                        for ( int code = 1; code < levels; ++code ) {
+                                const unsigned char *values = _astc_weight_values[r];
+                                if ( abs( values[code] - v ) < abs( values[best] - v ) ) {
+                                        best = code;
+                                }
+                        }
+                        _astc_weight_codes[r][v] = (unsigned char) best;
+                }
+        }
+
+        for ( int f = 0; f < _ASTC_FOOTPRINTS; ++f ) {
+                for ( int alpha = 0; alpha < 2; ++alpha ) {
+                        _astc_config *list = _astc_configs[f][alpha];
+                        int count = 0;
+
+                        for ( int n = 0; n < 7 * 7 * _ASTC_WEIGHT_RANGES && count < _ASTC_MAX_CONFIGS; ++n ) {
+                                int grid = n / _ASTC_WEIGHT_RANGES;
+                                _astc_config c = {
+                                    .grid = { (unsigned char) ( grid % 7 + 2 ), (unsigned char) ( grid / 7 + 2 ) },
+                                    .weights = (unsigned char) ( n % _ASTC_WEIGHT_RANGES ),
+                                };
+                                int weights = c.grid[0] * c.grid[1];
+                                int weight_bits = _astc_ise_bits( c.weights, weights );
+                                int mode = _astc_block_mode( c.grid[0], c.grid[1], c.weights );
+
+                                if ( c.grid[0] > _astc_footprints[f][0] || c.grid[1] > _astc_footprints[f][1] ||
+                                     mode < 0 || weights > _ASTC_MAX_WEIGHTS || weight_bits < _ASTC_MIN_WEIGHT_BITS ||
+                                     weight_bits > _ASTC_MAX_WEIGHT_BITS ) {
+                                        continue;
+                                }
+
+                                /* Decoders give endpoints the largest range fitting what's left */
+                                int left = 128 - _ASTC_HEADER_BITS - weight_bits;
+                                int colours = _ASTC_RANGES - 1;
+                                while ( colours >= 0 && _astc_ise_bits( colours, alpha ? 8 : 6 ) > left ) {
+                                        --colours;
+                                }
+                                if ( colours < _ASTC_MIN_COLOUR_RANGE ) {
+                                        continue;
+                                }
+                                c.mode = (unsigned short) mode;
+                                c.colours = (unsigned char) colours;
+                                list[count++] = c;
+                        }
+                }
+        }
+
+        _astc_ready = true;
+}
+
+/* Put bits of value at pos, leaving out any past end */
+BC_STATIC void _astc_put ( unsigned char *out, int *pos, int end, unsigned value, int bits ) {
+        for ( int i = 0; i < bits && *pos < end; ++i, ++*pos ) {
+                out[*pos >> 3] |= ( ( value >> i ) & 1 ) << ( *pos & 7 );
+        }
+}
+
+/* Integer sequence of codes in range from pos on. Every group of values
+ * interleaves their low bits with bits of their packed trits or quints,
+ * a group cut short by the end of codes is cut short in bits too. */
+BC_STATIC void _astc_ise ( unsigned char *out, int pos, int range, const unsigned char *codes, int count ) {
+        const unsigned char *r = _astc_ranges[range];
+        int end = pos + _astc_ise_bits( range, count );
+        int group = r[0] ? 5 : r[1] ? 3 : 1;
+
+        for ( int i = 0; i < count; i += group ) {
+                int low[5] = { 0 }, high[5] = { 0 };
+                for ( int k = 0; k < group && i + k < count; ++k ) {
+                        low[k] = codes[i + k] & ( ( 1 << r[2] ) - 1 );
+                        high[k] = codes[i + k] >> r[2];
+                }
+
+                unsigned packed = 0;
+                const int *split = NULL;
+                if ( r[0] ) {
+                        packed = _astc_trits[high[0] + 3 * high[1] + 9 * high[2] + 27 * high[3] + 81 * high[4]];
+                        split = _astc_trit_split;
+                } else if ( r[1] ) {
+                        packed = _astc_quints[high[0] + 5 * high[1] + 25 * high[2]];
+                        split = _astc_quint_split;
+                }
+
+                for ( int k = 0; k < group; ++k ) {
+                        _astc_put( out, &pos, end, (unsigned) low[k], r[2] );
+                        if ( split != NULL ) {
+                                _astc_put( out, &pos, end, packed, split[k] );
+                                packed >>= split[k];
+                        }
+                }
+        }
+}
+
+/* Grid weights every texel blends and their shares in 16ths, as decoders
+ * infill them */
+BC_STATIC void _astc_infill ( int width, int height, const unsigned char grid[2], unsigned char tap[][4],
+                              unsigned char share[][4] ) {
+        int ds = ( 1024 + width / 2 ) / ( width - 1 );
+        int dt = ( 1024 + height / 2 ) / ( height - 1 );
+
+        for ( int t = 0; t < height; ++t ) {
+                for ( int s = 0; s < width; ++s ) {
+                        int gs = ( ds * s * ( grid[0] - 1 ) + 32 ) >> 6;
+                        int gt = ( dt * t * ( grid[1] - 1 ) + 32 ) >> 6;
+                        int fs = gs & 15;
+                        int ft = gt & 15;
+                        int v = ( gs >> 4 ) + ( gt >> 4 ) * grid[0];
+                        int i = t * width + s;
+
+                        share[i][3] = (unsigned char) ( ( fs * ft + 8 ) >> 4 );
+                        share[i][2] = (unsigned char) ( ft - share[i][3] );
+                        share[i][1] = (unsigned char) ( fs - share[i][3] );
+                        share[i][0] = (unsigned char) ( 16 - fs - ft + share[i][3] );
+
+                        /* Taps past the last row or column come with no share */
+                        tap[i][0] = (unsigned char) v;
+                        tap[i][1] = (unsigned char) ( fs ? v + 1 : v );
+                        tap[i][2] = (unsigned char) ( ft ? v + grid[0] : v );
+                        tap[i][3] = (unsigned char) ( fs && ft ? v + grid[0] + 1 : v );
+                }
+        }
+}
+
+/* Grid weights averaging the ideal weights of the texels they reach */
+BC_STATIC void _astc_decimate ( const float ideal[], int n, int weights, unsigned char tap[][4],
+                                unsigned char share[][4], float grid[] ) {
+        float sum[_ASTC_MAX_WEIGHTS] = { 0 }, total[_ASTC_MAX_WEIGHTS] = { 0 };
+        for ( int i = 0; i < n; ++i ) {
+                for ( int k = 0; k < 4; ++k ) {
+                        sum[tap[i][k]] += share[i][k] * ideal[i];
+                        total[tap[i][k]] += share[i][k];
+                }
+        }
+        for ( int j = 0; j < weights; ++j ) {
+                grid[j] = total[j] > 0 ? sum[j] / total[j] : 0;
+        }
+}
+
+/* Squared distance of ideal weights from what a grid of them infills */
+BC_STATIC float _astc_blur ( const float ideal[], int width, int height, const unsigned char grid[2] ) {
+        int n = width * height;
+        unsigned char tap[BC_MAX_BLOCK_SIDE * BC_MAX_BLOCK_SIDE][4];
+        unsigned char share[BC_MAX_BLOCK_SIDE * BC_MAX_BLOCK_SIDE][4];
+        float weight[_ASTC_MAX_WEIGHTS];
+        _astc_infill( width, height, grid, tap, share );
+        _astc_decimate( ideal, n, grid[0] * grid[1], tap, share, weight );
+
+        float blur = 0;
+        for ( int i = 0; i < n; ++i ) {
+                float w = 0;
+                for ( int k = 0; k < 4; ++k ) {
+                        w += weight[tap[i][k]] * share[i][k] / 16.0f;
+                }
+                blur += ( w - ideal[i] ) * ( w - ideal[i] );
+        }
+
+        return blur;
+}
+
+/* Fit config to texels from ends, refining ends by least squares on the
+ * weights texels end up with. Keeps the lowest error in b. */
+BC_STATIC void _astc_fit ( const unsigned char px[][4], int width, int height, int channels, const _astc_config *config,
+                           float ends[2][4], int refine, _astc_block *b ) {
+        int n = width * height;
+        int weights = config->grid[0] * config->grid[1];
+        unsigned char tap[BC_MAX_BLOCK_SIDE * BC_MAX_BLOCK_SIDE][4];
+        unsigned char share[BC_MAX_BLOCK_SIDE * BC_MAX_BLOCK_SIDE][4];
+        _astc_infill( width, height, config->grid, tap, share );
+
+        b->error = INT_MAX;
+
+        for ( int r = 0; r <= refine; ++r ) {
+                _astc_block tried = { .config = config };
+                int value[2][4] = { { 0, 0, 0, 255 }, { 0, 0, 0, 255 } };
+                for ( int c = 0; c < channels; ++c ) {
+                        for ( int e = 0; e < 2; ++e ) {
+                                int code = _astc_colour_codes[config->colours][(int) ( ends[e][c] + 0.5f )];
+                                tried.colour[2 * c + e] = (unsigned char) code;
+                                value[e][c] = _astc_colour_values[config->colours][code];
+                        }
+                }
+
+                /* Second end summing lower would read as blue contraction */
+                if ( value[1][0] + value[1][1] + value[1][2] < value[0][0] + value[0][1] + value[0][2] ) {
+                        for ( int c = 0; c < channels; ++c ) {
+                                unsigned char code = tried.colour[2 * c];
+                                tried.colour[2 * c] = tried.colour[2 * c + 1];
+                                tried.colour[2 * c + 1] = code;
+
+                                int v = value[0][c];
+                                value[0][c] = value[1][c];
+                                value[1][c] = v;
+                        }
+                }
+
+                /* Ideal weight of every texel along the quantised ends */
+                float dir[4], len = 0;
+                for ( int c = 0; c < 4; ++c ) {
+                        dir[c] = (float) ( value[1][c] - value[0][c] );
+                        len += dir[c] * dir[c];
+                }
+
+                float ideal[BC_MAX_BLOCK_SIDE * BC_MAX_BLOCK_SIDE];
+                for ( int i = 0; i < n; ++i ) {
+                        float t = 0;
+                        for ( int c = 0; c < 4 && len > 0; ++c ) {
+                                t += ( px[i][c] - value[0][c] ) * dir[c] / len;
+                        }
+                        ideal[i] = t < 0 ? 0 : t > 1 ? 1 : t;
+                }
+
+                float grid[_ASTC_MAX_WEIGHTS];
+                int weight[_ASTC_MAX_WEIGHTS];
+                _astc_decimate( ideal, n, weights, tap, share, grid );
+                for ( int j = 0; j < weights; ++j ) {
+                        int code = _astc_weight_codes[config->weights][(int) ( grid[j] * 64 + 0.5f )];
+                        tried.weight[j] = (unsigned char) code;
+                        weight[j] = _astc_weight_values[config->weights][code];
+                }
+
+                float texel[BC_MAX_BLOCK_SIDE * BC_MAX_BLOCK_SIDE];
+                tried.error = 0;
+                for ( int i = 0; i < n; ++i ) {
+                        int w = ( weight[tap[i][0]] * share[i][0] + weight[tap[i][1]] * share[i][1] +
+                                  weight[tap[i][2]] * share[i][2] + weight[tap[i][3]] * share[i][3] + 8 ) >>
+                                4;
+                        texel[i] = w / 64.0f;
+
+                        for ( int c = 0; c < 4; ++c ) {
+                                int v = ( ( value[0][c] * 257 * ( 64 - w ) + value[1][c] * 257 * w + 32 ) >> 6 ) >> 8;
+                                tried.error += ( v - px[i][c] ) * ( v - px[i][c] );
+                        }
+                }
+
+                if ( tried.error < b->error ) {
+                        *b = tried;
+                }
+                if ( r == refine || tried.error == 0 ) {
+                        break;
+                }
+
+                /* Refit ends to the weights texels got */
+                float aa = 0, ab = 0, bb = 0;
+                float ax[4] = { 0 }, bx[4] = { 0 };
+                for ( int i = 0; i < n; ++i ) {
+                        float t = texel[i];
+                        aa += ( 1 - t ) * ( 1 - t );
+                        ab += ( 1 - t ) * t;
+                        bb += t * t;
+                        for ( int c = 0; c < channels; ++c ) {
+                                ax[c] += ( 1 - t ) * px[i][c];
+                                bx[c] += t * px[i][c];
+                        }
+                }
+
+                float det = aa * bb - ab * ab;
+                if ( det < 1e-4f ) {
+                        break;
+                }
+                for ( int c = 0; c < channels; ++c ) {
+                        ends[0][c] = _bc_clampf( ( bb * ax[c] - ab * bx[c] ) / det );
+                        ends[1][c] = _bc_clampf( ( aa * bx[c] - ab * ax[c] ) / det );
+                }
+        }
+}
+
+BC_STATIC void _astc_emit ( const _astc_block *b, int channels, unsigned char *out ) {
+        const _astc_config *config = b->config;
+        _bc_bits bits = { out, 0 };
+
+        memset( out, 0, 16 );
+        _bc_put( &bits, config->mode, 11 );
+        _bc_put( &bits, 0, 2 ); /* Single partition */
+        _bc_put( &bits, channels == 4 ? _ASTC_CEM_RGBA : _ASTC_CEM_RGB, 4 );
+        _astc_ise( out, _ASTC_HEADER_BITS, config->colours, b->colour, 2 * channels );
+
+        /* Weights go in from the top of the block down */
+        unsigned char weights[16] = { 0 };
+        int count = config->grid[0] * config->grid[1];
+        _astc_ise( weights, 0, config->weights, b->weight, count );
+
+        int len = _astc_ise_bits( config->weights, count );
+        for ( int i = 0; i < len; ++i ) {
+                if ( ( weights[i >> 3] >> ( i & 7 ) ) & 1 ) {
+                        out[( 127 - i ) >> 3] |= (unsigned char) ( 1 << ( ( 127 - i ) & 7 ) );
+                }
+        }
+}
+
+/* ASTC block of footprint, void extent when flat */
+BC_STATIC void _astc_encode ( const unsigned char *rgba, int footprint, bc_quality quality, unsigned char *out ) {
+        const unsigned char( *px )[4] = (const unsigned char( * )[4]) rgba;
+        int width = _astc_footprints[footprint][0];
+        int height = _astc_footprints[footprint][1];
+        int n = width * height;
+
+        bool flat = true, opaque = true;
+        for ( int i = 0; i < n; ++i ) {
+                flat = flat && memcmp( px[i], px[0], 4 ) == 0;
+                opaque = opaque && px[i][3] == 255;
+        }
+
+        if ( flat ) {
+                /* LDR void extent with all extent coordinates set, none given */
+                static const unsigned char header[8] = { 0xfc, 0xfd, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+                memcpy( out, header, sizeof( header ) );
+                for ( int c = 0; c < 4; ++c ) {
+                        out[8 + 2 * c] = px[0][c];
+                        out[9 + 2 * c] = px[0][c];
+                }
+                return;
+        }
+
+        int channels = opaque ? 3 : 4;
+        float mean[4] = { 0 }, cov[4][4] = { { 0 } }, axis[4];
+        for ( int i = 0; i < n; ++i ) {
+                for ( int c = 0; c < channels; ++c ) {
+                        mean[c] += px[i][c] / (float) n;
+                }
+        }
+        for ( int i = 0; i < n; ++i ) {
+                for ( int a = 0; a < channels; ++a ) {
+                        for ( int b = 0; b < channels; ++b ) {
+                                cov[a][b] += ( px[i][a] - mean[a] ) * ( px[i][b] - mean[b] );
+                        }
+                }
+        }
+        _bc_principal( cov, 0, channels, axis );
+
+        float lo = 0, hi = 0;
+        for ( int i = 0; i < n; ++i ) {
+                float t = 0;
+                for ( int c = 0; c < channels; ++c ) {
+                        t += ( px[i][c] - mean[c] ) * axis[c];
+                }
+                lo = fminf( lo, t );
+                hi = fmaxf( hi, t );
+        }
+
+        /* Every configuration loses what its grid blurs of the ideal weights
+         * and what rounding weights and ends to their ranges adds, spread
+         * evenly over the steps between levels */
+        float ideal[BC_MAX_BLOCK_SIDE * BC_MAX_BLOCK_SIDE];
+        for ( int i = 0; i < n; ++i ) {
+                float t = 0;
+                for ( int c = 0; c < channels; ++c ) {
+                        t += ( px[i][c] - mean[c] ) * axis[c];
+                }
+                ideal[i] = hi > lo ? ( t - lo ) / ( hi - lo ) : 0;
+        }
+
+        const _astc_config *configs = _astc_configs[footprint][!opaque];
+        float spread = ( hi - lo ) * ( hi - lo );
+        float loss[_ASTC_MAX_CONFIGS], blur = 0;
+        int ranked[_ASTC_MAX_TRIES], tries = 0;
+
+        for ( int k = 0; configs[k].mode != 0; ++k ) {
+                if ( k == 0 || memcmp( configs[k].grid, configs[k - 1].grid, 2 ) != 0 ) {
+                        blur = _astc_blur( ideal, width, height, configs[k].grid );
+                }
+
+                float weight_step = 1.0f / ( _astc_levels( configs[k].weights ) - 1 );
+                float colour_step = 255.0f / ( _astc_levels( configs[k].colours ) - 1 );
+                loss[k] = spread * ( blur + n * weight_step * weight_step / 12 ) +
+                          n * channels * colour_step * colour_step / 18;
+
+                int at = tries < _astc_tries[quality] ? tries++ : tries;
+                while ( at > 0 && loss[ranked[at - 1]] > loss[k] ) {
+                        if ( at < tries ) {
+                                ranked[at] = ranked[at - 1];
+                        }
+                        --at;
+                }
+                if ( at < tries ) {
+                        ranked[at] = k;
+                }
+        }
+
+        _astc_block best = { .error = INT_MAX };
+        _astc_block tried;
+
+        for ( int k = 0; k < tries && best.error > 0; ++k ) {
+                float ends[2][4];
+                for ( int c = 0; c < channels; ++c ) {
+                        ends[0][c] = _bc_clampf( mean[c] + axis[c] * lo );
+                        ends[1][c] = _bc_clampf( mean[c] + axis[c] * hi );
+                }
+
+                _astc_fit( px, width, height, channels, &configs[ranked[k]], ends, _bc_refine[quality] + 1, &tried );
+                if ( tried.error < best.error ) {
+                        best = tried;
+                }
+        }
+
+        _astc_emit( &best, channels, out );
+}
+
+BC_STATIC void _bc_rows_job ( void *arg, int index ) {
+        const _bc_rows *job = (const _bc_rows *) arg;
+        int bytes = bc_block_bytes( job->format );
+        int width = bc_block_width( job->format );
+        int height = bc_block_height( job->format );
+        size_t blocks = job->width / width;
+
+        const unsigned char *row = job->rgba + (size_t) index * height * job->stride;
+        unsigned char *out = job->out + (size_t) index * blocks * bytes;
+        unsigned char block[BC_MAX_BLOCK_SIDE * BC_MAX_BLOCK_SIDE * 4];
+
+        for ( size_t x = 0; x < blocks; ++x ) {
+                for ( int y = 0; y < height; ++y ) {
+                        memcpy( block + y * width * 4, row + y * job->stride + x * width * 4, width * 4 );
+                }
+
+                bc_encode_block( job->format, job->quality, block, out + x * bytes );
+        }
+}
+
+BC_EXTERN const char *bc_name ( bc_format f ) {
+        return _bc_names[f];
+}
+
+BC_EXTERN bool bc_parse ( const char *name, bc_format *f ) {
+        for ( int i = 0; name != NULL && i < BC_FORMAT_NUM; ++i ) {
+                if ( strcmp( name, _bc_names[i] ) == 0 ) {
+                        *f = (bc_format) i;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+BC_EXTERN int bc_block_bytes ( bc_format f ) {
+        return f == BC_FORMAT_BC1 || f == BC_FORMAT_BC4 ? 8 : 16;
+}
+
+BC_EXTERN int bc_block_width ( bc_format f ) {
+        return f >= BC_FORMAT_ASTC_4X4 ? _astc_footprints[f - BC_FORMAT_ASTC_4X4][0] : 4;
+}
+
+BC_EXTERN int bc_block_height ( bc_format f ) {
+        return f >= BC_FORMAT_ASTC_4X4 ? _astc_footprints[f - BC_FORMAT_ASTC_4X4][1] : 4;
+}
+
+BC_EXTERN void bc_encode_block ( bc_format f, bc_quality quality, const unsigned char *rgba, unsigned char *out ) {
+        const unsigned char( *px )[4] = (const unsigned char( * )[4]) rgba;
+        int refine = _bc_refine[quality];
+        bool six = quality > BC_QUALITY_FAST;
+
+        switch ( f ) {
+        case BC_FORMAT_BC1:
+                _bc1_encode( px, true, refine, out );
+                break;
+        case BC_FORMAT_BC3:
+                _bc4_encode( px, 3, refine, six, out );
+                _bc1_encode( px, false, refine, out + 8 );
+                break;
+        case BC_FORMAT_BC4:
+                _bc4_encode( px, 0, refine, six, out );
+                break;
+        case BC_FORMAT_BC5:
+                _bc4_encode( px, 0, refine, six, out );
+                _bc4_encode( px, 1, refine, six, out + 8 );
+                break;
+        case BC_FORMAT_BC7:
+                _bc7_encode( px, quality, out );
+                break;
+        case BC_FORMAT_ETC2:
+                _etc_encode( px, quality, out );
+                break;
+        case BC_FORMAT_ASTC_4X4:
+        case BC_FORMAT_ASTC_5X4:
+        case BC_FORMAT_ASTC_5X5:
+        case BC_FORMAT_ASTC_6X5:
+        case BC_FORMAT_ASTC_6X6:
+        case BC_FORMAT_ASTC_8X5:
+        case BC_FORMAT_ASTC_8X6:
+        case BC_FORMAT_ASTC_8X8:
+                _astc_init();
+                _astc_encode( rgba, f - BC_FORMAT_ASTC_4X4, quality, out );
+                break;
+        case BC_FORMAT_NUM:
+                break;
+        }
+}
+
+BC_EXTERN void bc_encode_rows ( bc_format f, bc_quality quality, const unsigned char *rgba, size_t stride,
+                                size_t width, size_t rows, unsigned char *out, bc_run_fn run, void *ctx ) {
+        _bc_rows job = {
+            .format = f,
+            .quality = quality,
+            .rgba = rgba,
+            .stride = stride,
+            .width = width,
+            .out = out,
+        };
+
+        /* Tables are filled before any job may read them */
+        _astc_init();
+
+        int count = (int) ( rows / bc_block_height( f ) );
+        if ( run != NULL ) {
+                run( ctx, _bc_rows_job, &job, count );
+                return;
+        }
+
+        for ( int i = 0; i < count; ++i ) {
+                _bc_rows_job( &job, i );
+        }
+}
+
+#endif
@@ -0,0 +1,815 @@
+/* Row blitting between channel layouts.
+ *
+ * Before #including,
+ *      #define BLIT_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Rows are converted from source to destination channel count (1 gray,
+ * 2 gray+alpha, 3 RGB, 4 RGBA) by kernels specialised for each pair.
+ * Kernels are picked by blit_init based on what the CPU supports, falling
+ * back to scalar code. Dropping channels assumes they are redundant, that
+ * is opaque alpha or gray colour.
+ *
+ * Rows with alpha can be premultiplied in place after blitting, either
+ * straight on the stored values or in linear light for sRGB colour, or
+ * have the colour of their fully transparent pixels cleaned up. Images
+ * halve into the next level of their mip chain row by row. */
+
+#ifndef _BLIT_H
+#define _BLIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef BLIT_EXTERN
+#define BLIT_EXTERN extern
+#endif
+
+#ifndef BLIT_STATIC
+#define BLIT_STATIC static
+#endif
+
+typedef void ( *blit_row_fn )( const unsigned char *src, unsigned char *dst, size_t pixels );
+
+/* Pick kernels for this CPU, call once before blitting */
+BLIT_EXTERN void blit_init ( void );
+
+/* Name of the best instruction set in use */
+BLIT_EXTERN const char *blit_isa ( void );
+
+BLIT_EXTERN blit_row_fn blit_kernel ( int src_channels, int dst_channels );
+
+/* Convert rectangle of width x rows pixels */
+BLIT_EXTERN void blit_rows ( const unsigned char *src, size_t src_stride, int src_channels,
+                             unsigned char *dst, size_t dst_stride, int dst_channels,
+                             size_t width, size_t rows );
+
+/* Multiply colour by alpha in place, rounded to nearest. With srgb colour is
+ * taken to linear light and back around the multiply. Layouts without alpha
+ * are left alone. */
+BLIT_EXTERN void blit_premultiply ( unsigned char *row, size_t pixels, int channels, bool srgb );
+
+/* Zero colour of fully transparent pixels, leftover colour only gets in
+ * the way of compression */
+BLIT_EXTERN void blit_clear_transparent ( unsigned char *row, size_t pixels, int channels );
+
+/* Give fully transparent pixels of row y of src the average colour of their
+ * visible neighbours, zero when there are none. dst is that row already
+ * blitted, filtering across sprite edges then doesn't pull in black. */
+BLIT_EXTERN void blit_dilate ( const unsigned char *src, size_t src_stride, int src_channels,
+                               size_t width, size_t height, size_t y,
+                               unsigned char *dst, int dst_channels );
+
+/* Repeat first and last pixel of row border times to the left and right of
+ * it, the row must have room for them */
+BLIT_EXTERN void blit_extrude ( unsigned char *row, size_t width, int channels, size_t border );
+
+/* Row y of src of width by height halved into dst, every pixel the average
+ * of the 2x2 under it. Odd last row and column go to the pixels next to
+ * them, a side of one stays one. Colour is weighted by alpha unless it's
+ * premultiplied and averaged in linear light with srgb. */
+BLIT_EXTERN void blit_halve ( const unsigned char *src, size_t src_stride, size_t width, size_t height, size_t y,
+                              unsigned char *dst, int channels, bool srgb, bool premultiplied );
+
+/* Whether count tightly packed pixels are all the same */
+BLIT_EXTERN bool blit_uniform ( const unsigned char *pixels, size_t count, int channels );
+
+#endif /* _BLIT_H */
+
+/* Implementation */
+#ifdef BLIT_IMPL
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define BLIT_X86
+#include <immintrin.h>
+#endif
+
+static blit_row_fn _blit_kernels[5][5];
+static const char *_blit_isa = "scalar";
+
+typedef void ( *blit_premultiply_fn )( unsigned char *row, size_t pixels );
+static blit_premultiply_fn _blit_premultiply_kernels[5];
+static blit_premultiply_fn _blit_clear_kernels[5];
+
+typedef void ( *blit_fill_fn )( unsigned char *dst, const unsigned char *pixel, int channels, size_t count );
+static blit_fill_fn _blit_fill;
+
+/* Pixels are compared against the first one repeated over this many bytes,
+ * whole pixels of any layout and whole registers fit in it */
+#define BLIT_UNIFORM_SPAN 96
+
+typedef bool ( *blit_uniform_fn )( const unsigned char *bytes, size_t len, const unsigned char *pattern );
+static blit_uniform_fn _blit_uniform;
+
+/* sRGB to 16 bit linear and back, encoding rounds in sRGB space */
+static uint16_t _blit_srgb_to_linear[256];
+static unsigned char _blit_linear_to_srgb[65536];
+
+/* Generic scalar path, any layout to any layout */
+BLIT_STATIC void _blit_pixel ( const unsigned char *src, int src_n, unsigned char *dst, int dst_n ) {
+        unsigned char r = src[0];
+        unsigned char g = src_n >= 3 ? src[1] : r;
+        unsigned char b = src_n >= 3 ? src[2] : r;
+        unsigned char a = src_n == 2 || src_n == 4 ? src[src_n - 1] : 255;
+
+        switch ( dst_n ) {
+        case 1:
+                dst[0] = r;
+                break;
+        case 2:
+                dst[0] = r;
+                dst[1] = a;
+                break;
+        case 3:
+                dst[0] = r;
+                dst[1] = g;
+                dst[2] = b;
+                break;
+        case 4:
+                dst[0] = r;
+                dst[1] = g;
+                dst[2] = b;
+                dst[3] = a;
+                break;
+        }
+}
+
+#define BLIT_SCALAR( src_n, dst_n )                                                                \
+        BLIT_STATIC void _blit_##src_n##_##dst_n ( const unsigned char *src, unsigned char *dst,    \
+                                                   size_t pixels ) {                               \
+                for ( size_t i = 0; i < pixels; ++i ) {                                             \
+                        _blit_pixel( src + i * ( src_n ), src_n, dst + i * ( dst_n ), dst_n );      \
+                }                                                                                   \
+        }
+
+BLIT_SCALAR( 1, 2 )
+BLIT_SCALAR( 1, 3 )
+BLIT_SCALAR( 1, 4 )
+BLIT_SCALAR( 2, 1 )
+BLIT_SCALAR( 2, 3 )
+BLIT_SCALAR( 2, 4 )
+BLIT_SCALAR( 3, 1 )
+BLIT_SCALAR( 3, 2 )
+BLIT_SCALAR( 3, 4 )
+BLIT_SCALAR( 4, 1 )
+BLIT_SCALAR( 4, 2 )
+BLIT_SCALAR( 4, 3 )
+
+#define BLIT_COPY( n )                                                                           \
+        BLIT_STATIC void _blit_copy_##n ( const unsigned char *src, unsigned char *dst,           \
+                                          size_t pixels ) {                                       \
+                memcpy( dst, src, pixels * ( n ) );                                               \
+        }
+
+BLIT_COPY( 1 )
+BLIT_COPY( 2 )
+BLIT_COPY( 3 )
+BLIT_COPY( 4 )
+
+/* Exact round( c * a / 255 ) */
+BLIT_STATIC unsigned char _blit_mul ( unsigned c, unsigned a ) {
+        unsigned t = c * a + 128;
+        return ( t + ( t >> 8 ) ) >> 8;
+}
+
+BLIT_STATIC void _blit_premultiply_2 ( unsigned char *row, size_t pixels ) {
+        for ( size_t i = 0; i < pixels; ++i ) {
+                row[i * 2] = _blit_mul( row[i * 2], row[i * 2 + 1] );
+        }
+}
+
+BLIT_STATIC void _blit_premultiply_4 ( unsigned char *row, size_t pixels ) {
+        for ( size_t i = 0; i < pixels; ++i ) {
+                unsigned char *p = row + i * 4;
+                p[0] = _blit_mul( p[0], p[3] );
+                p[1] = _blit_mul( p[1], p[3] );
+                p[2] = _blit_mul( p[2], p[3] );
+        }
+}
+
+BLIT_STATIC void _blit_premultiply_srgb ( unsigned char *row, size_t pixels, int channels ) {
+        int colours = channels - 1;
+
+        for ( size_t i = 0; i < pixels; ++i ) {
+                unsigned char *p = row + i * channels;
+                unsigned a = p[colours];
+
+                for ( int c = 0; c < colours; ++c ) {
+                        uint32_t linear = ( (uint32_t) _blit_srgb_to_linear[p[c]] * a + 127 ) / 255;
+                        p[c] = _blit_linear_to_srgb[linear];
+                }
+        }
+}
+
+BLIT_STATIC void _blit_clear_2 ( unsigned char *row, size_t pixels ) {
+        for ( size_t i = 0; i < pixels; ++i ) {
+                if ( row[i * 2 + 1] == 0 ) {
+                        row[i * 2] = 0;
+                }
+        }
+}
+
+BLIT_STATIC void _blit_clear_4 ( unsigned char *row, size_t pixels ) {
+        for ( size_t i = 0; i < pixels; ++i ) {
+                if ( row[i * 4 + 3] == 0 ) {
+                        memset( row + i * 4, 0, 3 );
+                }
+        }
+}
+
+/* Copy pixel once, then keep doubling what's already there */
+BLIT_STATIC void _blit_fill_scalar ( unsigned char *dst, const unsigned char *pixel, int channels, size_t count ) {
+        size_t total = count * channels;
+        if ( total == 0 ) {
+                return;
+        }
+
+        memcpy( dst, pixel, channels );
+        for ( size_t done = channels; done < total; done *= 2 ) {
+                memcpy( dst + done, dst, done < total - done ? done : total - done );
+        }
+}
+
+BLIT_STATIC bool _blit_uniform_scalar ( const unsigned char *bytes, size_t len, const unsigned char *pattern ) {
+        for ( size_t i = 0; i < len; i += BLIT_UNIFORM_SPAN ) {
+                size_t span = len - i < BLIT_UNIFORM_SPAN ? len - i : BLIT_UNIFORM_SPAN;
+                if ( memcmp( bytes + i, pattern, span ) != 0 ) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+BLIT_STATIC float _blit_srgb_decode ( float c ) {
+        return c <= 0.04045f ? c / 12.92f : powf( ( c + 0.055f ) / 1.055f, 2.4f );
+}
+
+BLIT_STATIC void _blit_srgb_init ( void ) {
+        float mid[256];
+
+        for ( int i = 0; i < 256; ++i ) {
+                _blit_srgb_to_linear[i] = (uint16_t) lrintf( _blit_srgb_decode( i / 255.0f ) * 65535.0f );
+                mid[i] = _blit_srgb_decode( ( i + 0.5f ) / 255.0f ) * 65535.0f;
+        }
+
+        /* Every linear value up to the midpoint between two codes maps to the lower one */
+        int code = 0;
+        for ( int v = 0; v < 65536; ++v ) {
+                while ( code < 255 && v > mid[code] ) {
+                        code += 1;
+                }
+                _blit_linear_to_srgb[v] = (unsigned char) code;
+        }
+}
+
+#ifdef BLIT_X86
+
+/* Gray to RGBA, 16 pixels at a time */
+__attribute__( ( target( "sse2" ) ) )
+BLIT_STATIC void _blit_1_4_sse2 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m128i alpha = _mm_set1_epi8( (char) 0xff );
+        size_t i = 0;
+
+        for ( ; i + 16 <= pixels; i += 16 ) {
+                __m128i g = _mm_loadu_si128( (const __m128i *) ( src + i ) );
+                __m128i gg_lo = _mm_unpacklo_epi8( g, g );
+                __m128i gg_hi = _mm_unpackhi_epi8( g, g );
+                __m128i ga_lo = _mm_unpacklo_epi8( g, alpha );
+                __m128i ga_hi = _mm_unpackhi_epi8( g, alpha );
+
+                __m128i *out = (__m128i *) ( dst + i * 4 );
+                _mm_storeu_si128( out, _mm_unpacklo_epi16( gg_lo, ga_lo ) );
+                _mm_storeu_si128( out + 1, _mm_unpackhi_epi16( gg_lo, ga_lo ) );
+                _mm_storeu_si128( out + 2, _mm_unpacklo_epi16( gg_hi, ga_hi ) );
+                _mm_storeu_si128( out + 3, _mm_unpackhi_epi16( gg_hi, ga_hi ) );
+        }
+
+        _blit_1_4( src + i, dst + i * 4, pixels - i );
+}
+
+/* RGBA to gray, keeps red, 16 pixels at a time */
+__attribute__( ( target( "sse2" ) ) )
+BLIT_STATIC void _blit_4_1_sse2 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m128i mask = _mm_set1_epi32( 0xff );
+        size_t i = 0;
+
+        for ( ; i + 16 <= pixels; i += 16 ) {
+                const __m128i *in = (const __m128i *) ( src + i * 4 );
+                __m128i a = _mm_and_si128( _mm_loadu_si128( in ), mask );
+                __m128i b = _mm_and_si128( _mm_loadu_si128( in + 1 ), mask );
+                __m128i c = _mm_and_si128( _mm_loadu_si128( in + 2 ), mask );
+                __m128i d = _mm_and_si128( _mm_loadu_si128( in + 3 ), mask );
+
+                __m128i ab = _mm_packs_epi32( a, b );
+                __m128i cd = _mm_packs_epi32( c, d );
+                _mm_storeu_si128( (__m128i *) ( dst + i ), _mm_packus_epi16( ab, cd ) );
+        }
+
+        _blit_4_1( src + i * 4, dst + i, pixels - i );
+}
+
+/* RGB to RGBA. 16 byte loads read past the 4 pixels used, so the loop
+ * stops early enough to stay inside the row */
+__attribute__( ( target( "ssse3" ) ) )
+BLIT_STATIC void _blit_3_4_ssse3 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m128i shuffle = _mm_setr_epi8( 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1 );
+        const __m128i alpha = _mm_set1_epi32( (int) 0xff000000 );
+        size_t i = 0;
+
+        for ( ; i + 6 <= pixels; i += 4 ) {
+                __m128i rgb = _mm_loadu_si128( (const __m128i *) ( src + i * 3 ) );
+                __m128i rgba = _mm_or_si128( _mm_shuffle_epi8( rgb, shuffle ), alpha );
+                _mm_storeu_si128( (__m128i *) ( dst + i * 4 ), rgba );
+        }
+
+        _blit_3_4( src + i * 3, dst + i * 4, pixels - i );
+}
+
+/* RGBA to RGB. 16 byte stores spill past the 4 pixels written, the loop
+ * stops early enough to not touch anything past the row */
+__attribute__( ( target( "ssse3" ) ) )
+BLIT_STATIC void _blit_4_3_ssse3 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m128i shuffle = _mm_setr_epi8( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 );
+        size_t i = 0;
+
+        for ( ; i + 6 <= pixels; i += 4 ) {
+                __m128i rgba = _mm_loadu_si128( (const __m128i *) ( src + i * 4 ) );
+                _mm_storeu_si128( (__m128i *) ( dst + i * 3 ), _mm_shuffle_epi8( rgba, shuffle ) );
+        }
+
+        _blit_4_3( src + i * 4, dst + i * 3, pixels - i );
+}
+
+/* Gray to RGB, 16 pixels at a time */
+__attribute__( ( target( "ssse3" ) ) )
+BLIT_STATIC void _blit_1_3_ssse3 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m128i m0 = _mm_setr_epi8( 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 );
+        const __m128i m1 = _mm_setr_epi8( 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 );
+        const __m128i m2 = _mm_setr_epi8( 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 );
+        size_t i = 0;
+
+        for ( ; i + 16 <= pixels; i += 16 ) {
+                __m128i g = _mm_loadu_si128( (const __m128i *) ( src + i ) );
+                __m128i *out = (__m128i *) ( dst + i * 3 );
+                _mm_storeu_si128( out, _mm_shuffle_epi8( g, m0 ) );
+                _mm_storeu_si128( out + 1, _mm_shuffle_epi8( g, m1 ) );
+                _mm_storeu_si128( out + 2, _mm_shuffle_epi8( g, m2 ) );
+        }
+
+        _blit_1_3( src + i, dst + i * 3, pixels - i );
+}
+
+/* RGB to gray, keeps red, 16 pixels at a time */
+__attribute__( ( target( "ssse3" ) ) )
+BLIT_STATIC void _blit_3_1_ssse3 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m128i m0 = _mm_setr_epi8( 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+        const __m128i m1 = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 );
+        const __m128i m2 = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 );
+        size_t i = 0;
+
+        for ( ; i + 16 <= pixels; i += 16 ) {
+                const __m128i *in = (const __m128i *) ( src + i * 3 );
+                __m128i a = _mm_shuffle_epi8( _mm_loadu_si128( in ), m0 );
+                __m128i b = _mm_shuffle_epi8( _mm_loadu_si128( in + 1 ), m1 );
+                __m128i c = _mm_shuffle_epi8( _mm_loadu_si128( in + 2 ), m2 );
+                _mm_storeu_si128( (__m128i *) ( dst + i ), _mm_or_si128( a, _mm_or_si128( b, c ) ) );
+        }
+
+        _blit_3_1( src + i * 3, dst + i, pixels - i );
+}
+
+/* Gray to RGBA, widen to 32 bits and spread, 8 pixels at a time */
+__attribute__( ( target( "avx2" ) ) )
+BLIT_STATIC void _blit_1_4_avx2 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m256i spread = _mm256_set1_epi32( 0x010101 );
+        const __m256i alpha = _mm256_set1_epi32( (int) 0xff000000 );
+        size_t i = 0;
+
+        for ( ; i + 8 <= pixels; i += 8 ) {
+                __m256i g = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *) ( src + i ) ) );
+                __m256i rgba = _mm256_or_si256( _mm256_mullo_epi32( g, spread ), alpha );
+                _mm256_storeu_si256( (__m256i *) ( dst + i * 4 ), rgba );
+        }
+
+        _blit_1_4( src + i, dst + i * 4, pixels - i );
+}
+
+/* RGB to RGBA, each 128 bit lane takes 4 pixels */
+__attribute__( ( target( "avx2" ) ) )
+BLIT_STATIC void _blit_3_4_avx2 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m256i shuffle = _mm256_setr_epi8( 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                  0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1 );
+        const __m256i alpha = _mm256_set1_epi32( (int) 0xff000000 );
+        size_t i = 0;
+
+        for ( ; i + 10 <= pixels; i += 8 ) {
+                __m128i lo = _mm_loadu_si128( (const __m128i *) ( src + i * 3 ) );
+                __m128i hi = _mm_loadu_si128( (const __m128i *) ( src + i * 3 + 12 ) );
+                __m256i rgb = _mm256_inserti128_si256( _mm256_castsi128_si256( lo ), hi, 1 );
+                __m256i rgba = _mm256_or_si256( _mm256_shuffle_epi8( rgb, shuffle ), alpha );
+                _mm256_storeu_si256( (__m256i *) ( dst + i * 4 ), rgba );
+        }
+
+        _blit_3_4_ssse3( src + i * 3, dst + i * 4, pixels - i );
+}
+
+/* RGBA to RGB, each 128 bit lane gives 12 bytes, stored separately */
+__attribute__( ( target( "avx2" ) ) )
+BLIT_STATIC void _blit_4_3_avx2 ( const unsigned char *src, unsigned char *dst, size_t pixels ) {
+        const __m256i shuffle = _mm256_setr_epi8( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                                  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 );
+        const __m256i pack = _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 3, 7 );
+        size_t i = 0;
+
+        for ( ; i + 11 <= pixels; i += 8 ) {
+                __m256i rgba = _mm256_loadu_si256( (const __m256i *) ( src + i * 4 ) );
+                __m256i rgb = _mm256_permutevar8x32_epi32( _mm256_shuffle_epi8( rgba, shuffle ), pack );
+                _mm256_storeu_si256( (__m256i *) ( dst + i * 3 ), rgb );
+        }
+
+        _blit_4_3_ssse3( src + i * 4, dst + i * 3, pixels - i );
+}
+
+/* Multiply 16 bit colour lanes by 16 bit alpha lanes, rounded like _blit_mul */
+__attribute__( ( target( "sse2" ) ) )
+BLIT_STATIC __m128i _blit_mul_sse2 ( __m128i c, __m128i a ) {
+        __m128i t = _mm_add_epi16( _mm_mullo_epi16( c, a ), _mm_set1_epi16( 128 ) );
+        return _mm_srli_epi16( _mm_add_epi16( t, _mm_srli_epi16( t, 8 ) ), 8 );
+}
+
+/* Alpha is spread over the lanes of its pixel, its own lane gets 255 so it
+ * stays as it is */
+#define BLIT_PREMULTIPLY_SSE2( n, spread, keep )                                                       \
+        __attribute__( ( target( "sse2" ) ) )                                                          \
+        BLIT_STATIC void _blit_premultiply_##n##_sse2 ( unsigned char *row, size_t pixels ) {           \
+                const __m128i zero = _mm_setzero_si128();                                              \
+                const __m128i opaque = keep;                                                           \
+                size_t i = 0;                                                                          \
+                                                                                                       \
+                for ( ; i + 16 / ( n ) <= pixels; i += 16 / ( n ) ) {                                  \
+                        __m128i p = _mm_loadu_si128( (const __m128i *) ( row + i * ( n ) ) );          \
+                        __m128i lo = _mm_unpacklo_epi8( p, zero );                                     \
+                        __m128i hi = _mm_unpackhi_epi8( p, zero );                                     \
+                        __m128i alpha_lo = _mm_shufflehi_epi16( _mm_shufflelo_epi16( lo, spread ), spread ); \
+                        __m128i alpha_hi = _mm_shufflehi_epi16( _mm_shufflelo_epi16( hi, spread ), spread ); \
+                        lo = _blit_mul_sse2( lo, _mm_or_si128( alpha_lo, opaque ) );                   \
+                        hi = _blit_mul_sse2( hi, _mm_or_si128( alpha_hi, opaque ) );                   \
+                        _mm_storeu_si128( (__m128i *) ( row + i * ( n ) ), _mm_packus_epi16( lo, hi ) ); \
+                }                                                                                      \
+                                                                                                       \
+                _blit_premultiply_##n( row + i * ( n ), pixels - i );                                  \
+        }
+
+BLIT_PREMULTIPLY_SSE2( 2, _MM_SHUFFLE( 3, 3, 1, 1 ), _mm_setr_epi16( 0, 255, 0, 255, 0, 255, 0, 255 ) )
+BLIT_PREMULTIPLY_SSE2( 4, _MM_SHUFFLE( 3, 3, 3, 3 ), _mm_setr_epi16( 0, 0, 0, 255, 0, 0, 0, 255 ) )
+
+/* Pixels whose alpha bits are all zero become zero entirely */
+__attribute__( ( target( "sse2" ) ) )
+BLIT_STATIC void _blit_clear_2_sse2 ( unsigned char *row, size_t pixels ) {
+        const __m128i alpha = _mm_set1_epi16( (short) 0xff00 );
+        size_t i = 0;
+
+        for ( ; i + 8 <= pixels; i += 8 ) {
+                __m128i *p = (__m128i *) ( row + i * 2 );
+                __m128i v = _mm_loadu_si128( p );
+                __m128i clear = _mm_cmpeq_epi16( _mm_and_si128( v, alpha ), _mm_setzero_si128() );
+                _mm_storeu_si128( p, _mm_andnot_si128( clear, v ) );
+        }
+
+        _blit_clear_2( row + i * 2, pixels - i );
+}
+
+__attribute__( ( target( "sse2" ) ) )
+BLIT_STATIC void _blit_clear_4_sse2 ( unsigned char *row, size_t pixels ) {
+        const __m128i alpha = _mm_set1_epi32( (int) 0xff000000 );
+        size_t i = 0;
+
+        for ( ; i + 4 <= pixels; i += 4 ) {
+                __m128i *p = (__m128i *) ( row + i * 4 );
+                __m128i v = _mm_loadu_si128( p );
+                __m128i clear = _mm_cmpeq_epi32( _mm_and_si128( v, alpha ), _mm_setzero_si128() );
+                _mm_storeu_si128( p, _mm_andnot_si128( clear, v ) );
+        }
+
+        _blit_clear_4( row + i * 4, pixels - i );
+}
+
+/* Four channel pixels splat into whole registers */
+__attribute__( ( target( "sse2" ) ) )
+BLIT_STATIC void _blit_fill_sse2 ( unsigned char *dst, const unsigned char *pixel, int channels, size_t count ) {
+        if ( channels != 4 ) {
+                _blit_fill_scalar( dst, pixel, channels, count );
+                return;
+        }
+
+        int value;
+        memcpy( &value, pixel, 4 );
+        const __m128i v = _mm_set1_epi32( value );
+        size_t i = 0;
+
+        for ( ; i + 4 <= count; i += 4 ) {
+                _mm_storeu_si128( (__m128i *) ( dst + i * 4 ), v );
+        }
+        for ( ; i < count; ++i ) {
+                memcpy( dst + i * 4, &value, 4 );
+        }
+}
+
+__attribute__( ( target( "sse2" ) ) )
+BLIT_STATIC bool _blit_uniform_sse2 ( const unsigned char *bytes, size_t len, const unsigned char *pattern ) {
+        __m128i p[6];
+        for ( int k = 0; k < 6; ++k ) {
+                p[k] = _mm_loadu_si128( (const __m128i *) ( pattern + k * 16 ) );
+        }
+
+        size_t i = 0;
+        for ( ; i + BLIT_UNIFORM_SPAN <= len; i += BLIT_UNIFORM_SPAN ) {
+                __m128i diff = _mm_setzero_si128();
+                for ( int k = 0; k < 6; ++k ) {
+                        __m128i v = _mm_loadu_si128( (const __m128i *) ( bytes + i + k * 16 ) );
+                        diff = _mm_or_si128( diff, _mm_xor_si128( v, p[k] ) );
+                }
+
+                if ( _mm_movemask_epi8( _mm_cmpeq_epi8( diff, _mm_setzero_si128() ) ) != 0xffff ) {
+                        return false;
+                }
+        }
+
+        return _blit_uniform_scalar( bytes + i, len - i, pattern );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+BLIT_STATIC bool _blit_uniform_avx2 ( const unsigned char *bytes, size_t len, const unsigned char *pattern ) {
+        __m256i p[3];
+        for ( int k = 0; k < 3; ++k ) {
+                p[k] = _mm256_loadu_si256( (const __m256i *) ( pattern + k * 32 ) );
+        }
+
+        size_t i = 0;
+        for ( ; i + BLIT_UNIFORM_SPAN <= len; i += BLIT_UNIFORM_SPAN ) {
+                __m256i diff = _mm256_setzero_si256();
+                for ( int k = 0; k < 3; ++k ) {
+                        __m256i v = _mm256_loadu_si256( (const __m256i *) ( bytes + i + k * 32 ) );
+                        diff = _mm256_or_si256( diff, _mm256_xor_si256( v, p[k] ) );
+                }
+
+                if ( !_mm256_testz_si256( diff, diff ) ) {
+                        return false;
+                }
+        }
+
+        return _blit_uniform_scalar( bytes + i, len - i, pattern );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+BLIT_STATIC void _blit_clear_4_avx2 ( unsigned char *row, size_t pixels ) {
+        const __m256i alpha = _mm256_set1_epi32( (int) 0xff000000 );
+        size_t i = 0;
+
+        for ( ; i + 8 <= pixels; i += 8 ) {
+                __m256i *p = (__m256i *) ( row + i * 4 );
+                __m256i v = _mm256_loadu_si256( p );
+                __m256i clear = _mm256_cmpeq_epi32( _mm256_and_si256( v, alpha ), _mm256_setzero_si256() );
+                _mm256_storeu_si256( p, _mm256_andnot_si256( clear, v ) );
+        }
+
+        _blit_clear_4_sse2( row + i * 4, pixels - i );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+BLIT_STATIC void _blit_premultiply_4_avx2 ( unsigned char *row, size_t pixels ) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i opaque = _mm256_set1_epi64x( (long long) 0x00ff000000000000 );
+        const __m256i bias = _mm256_set1_epi16( 128 );
+        size_t i = 0;
+
+        for ( ; i + 8 <= pixels; i += 8 ) {
+                __m256i p = _mm256_loadu_si256( (const __m256i *) ( row + i * 4 ) );
+                __m256i c[2] = { _mm256_unpacklo_epi8( p, zero ), _mm256_unpackhi_epi8( p, zero ) };
+
+                for ( int k = 0; k < 2; ++k ) {
+                        __m256i alpha = _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( c[k], 0xff ), 0xff );
+                        __m256i t = _mm256_mullo_epi16( c[k], _mm256_or_si256( alpha, opaque ) );
+                        t = _mm256_add_epi16( t, bias );
+                        c[k] = _mm256_srli_epi16( _mm256_add_epi16( t, _mm256_srli_epi16( t, 8 ) ), 8 );
+                }
+
+                _mm256_storeu_si256( (__m256i *) ( row + i * 4 ), _mm256_packus_epi16( c[0], c[1] ) );
+        }
+
+        _blit_premultiply_4_sse2( row + i * 4, pixels - i );
+}
+
+#endif /* BLIT_X86 */
+
+BLIT_EXTERN void blit_init ( void ) {
+        blit_row_fn scalar[5][5] = {
+            [1] = { NULL, _blit_copy_1, _blit_1_2, _blit_1_3, _blit_1_4 },
+            [2] = { NULL, _blit_2_1, _blit_copy_2, _blit_2_3, _blit_2_4 },
+            [3] = { NULL, _blit_3_1, _blit_3_2, _blit_copy_3, _blit_3_4 },
+            [4] = { NULL, _blit_4_1, _blit_4_2, _blit_4_3, _blit_copy_4 },
+        };
+        memcpy( _blit_kernels, scalar, sizeof( scalar ) );
+        _blit_isa = "scalar";
+
+        _blit_premultiply_kernels[2] = _blit_premultiply_2;
+        _blit_premultiply_kernels[4] = _blit_premultiply_4;
+        _blit_clear_kernels[2] = _blit_clear_2;
+        _blit_clear_kernels[4] = _blit_clear_4;
+        _blit_fill = _blit_fill_scalar;
+        _blit_uniform = _blit_uniform_scalar;
+        _blit_srgb_init();
+
+#ifdef BLIT_X86
+        __builtin_cpu_init();
+
+        if ( __builtin_cpu_supports( "sse2" ) ) {
+                _blit_kernels[1][4] = _blit_1_4_sse2;
+                _blit_kernels[4][1] = _blit_4_1_sse2;
+                _blit_premultiply_kernels[2] = _blit_premultiply_2_sse2;
+                _blit_premultiply_kernels[4] = _blit_premultiply_4_sse2;
+                _blit_clear_kernels[2] = _blit_clear_2_sse2;
+                _blit_clear_kernels[4] = _blit_clear_4_sse2;
+                _blit_fill = _blit_fill_sse2;
+                _blit_uniform = _blit_uniform_sse2;
+                _blit_isa = "sse2";
+        }
+
+        if ( __builtin_cpu_supports( "ssse3" ) ) {
+                _blit_kernels[1][3] = _blit_1_3_ssse3;
+                _blit_kernels[3][1] = _blit_3_1_ssse3;
+                _blit_kernels[3][4] = _blit_3_4_ssse3;
+                _blit_kernels[4][3] = _blit_4_3_ssse3;
+                _blit_isa = "ssse3";
+        }
+
+        if ( __builtin_cpu_supports( "avx2" ) ) {
+                _blit_kernels[1][4] = _blit_1_4_avx2;
+                _blit_kernels[3][4] = _blit_3_4_avx2;
+                _blit_kernels[4][3] = _blit_4_3_avx2;
+                _blit_premultiply_kernels[4] = _blit_premultiply_4_avx2;
+                _blit_clear_kernels[4] = _blit_clear_4_avx2;
+                _blit_uniform = _blit_uniform_avx2;
+                _blit_isa = "avx2";
+        }
+#endif
+}
+
+BLIT_EXTERN const char *blit_isa ( void ) {
+        return _blit_isa;
+}
+
+BLIT_EXTERN blit_row_fn blit_kernel ( int src_channels, int dst_channels ) {
+        return _blit_kernels[src_channels][dst_channels];
+}
+
+BLIT_EXTERN void blit_rows ( const unsigned char *src, size_t src_stride, int src_channels,
+                             unsigned char *dst, size_t dst_stride, int dst_channels,
+                             size_t width, size_t rows ) {
+        blit_row_fn kernel = blit_kernel( src_channels, dst_channels );
+
+        for ( size_t y = 0; y < rows; ++y ) {
+                kernel( src + y * src_stride, dst + y * dst_stride, width );
+        }
+}
+
+BLIT_EXTERN void blit_premultiply ( unsigned char *row, size_t pixels, int channels, bool srgb ) {
+        if ( channels != 2 && channels != 4 ) {
+                return;
+        }
+
+        if ( srgb ) {
+                _blit_premultiply_srgb( row, pixels, channels );
+        } else {
+                _blit_premultiply_kernels[channels]( row, pixels );
+        }
+}
+
+BLIT_EXTERN void blit_clear_transparent ( unsigned char *row, size_t pixels, int channels ) {
+        if ( channels == 2 || channels == 4 ) {
+                _blit_clear_kernels[channels]( row, pixels );
+        }
+}
+
+BLIT_EXTERN void blit_dilate ( const unsigned char *src, size_t src_stride, int src_channels,
+                               size_t width, size_t height, size_t y,
+                               unsigned char *dst, int dst_channels ) {
+        if ( ( src_channels != 2 && src_channels != 4 ) || ( dst_channels != 2 && dst_channels != 4 ) ) {
+                return;
+        }
+
+        const unsigned char *row = src + y * src_stride;
+        size_t top = y > 0 ? y - 1 : 0;
+        size_t bottom = y + 1 < height ? y + 1 : y;
+
+        for ( size_t x = 0; x < width; ++x ) {
+                if ( row[x * src_channels + src_channels - 1] != 0 ) {
+                        continue;
+                }
+
+                unsigned sum[3] = { 0 };
+                unsigned count = 0;
+                size_t left = x > 0 ? x - 1 : 0;
+                size_t right = x + 1 < width ? x + 1 : x;
+
+                for ( size_t ny = top; ny <= bottom; ++ny ) {
+                        for ( size_t nx = left; nx <= right; ++nx ) {
+                                const unsigned char *p = src + ny * src_stride + nx * src_channels;
+                                if ( p[src_channels - 1] == 0 ) {
+                                        continue;
+                                }
+
+                                unsigned char rgba[4];
+                                _blit_pixel( p, src_channels, rgba, 4 );
+                                sum[0] += rgba[0];
+                                sum[1] += rgba[1];
+                                sum[2] += rgba[2];
+                                count += 1;
+                        }
+                }
+
+                unsigned char colour[4] = { 0 };
+                for ( int c = 0; count > 0 && c < 3; ++c ) {
+                        colour[c] = (unsigned char) ( ( sum[c] + count / 2 ) / count );
+                }
+
+                _blit_pixel( colour, 4, dst + x * dst_channels, dst_channels );
+        }
+}
+
+BLIT_EXTERN void blit_extrude ( unsigned char *row, size_t width, int channels, size_t border ) {
+        if ( width == 0 || border == 0 ) {
+                return;
+        }
+
+        _blit_fill( row - border * channels, row, channels, border );
+        _blit_fill( row + width * channels, row + ( width - 1 ) * channels, channels, border );
+}
+
+BLIT_EXTERN void blit_halve ( const unsigned char *src, size_t src_stride, size_t width, size_t height, size_t y,
+                              unsigned char *dst, int channels, bool srgb, bool premultiplied ) {
+        size_t half_width = width > 1 ? width / 2 : 1;
+        size_t half_height = height > 1 ? height / 2 : 1;
+        bool has_alpha = channels == 2 || channels == 4;
+        int colours = has_alpha ? channels - 1 : channels;
+
+        size_t top = 2 * y;
+        size_t bottom = y + 1 == half_height ? height : top + 2;
+
+        for ( size_t x = 0; x < half_width; ++x ) {
+                size_t left = 2 * x;
+                size_t right = x + 1 == half_width ? width : left + 2;
+
+                /* Colour in 16 bits, transparent pixels add nothing to it
+                 * unless every one of them is */
+                uint32_t sum[3] = { 0 }, plain[3] = { 0 };
+                uint32_t alpha = 0, weight = 0, count = 0;
+
+                for ( size_t ny = top; ny < bottom; ++ny ) {
+                        for ( size_t nx = left; nx < right; ++nx ) {
+                                const unsigned char *p = src + ny * src_stride + nx * channels;
+                                uint32_t a = has_alpha ? p[colours] : 255;
+                                uint32_t w = has_alpha && !premultiplied ? a : 1;
+
+                                for ( int c = 0; c < colours; ++c ) {
+                                        uint32_t v = srgb ? _blit_srgb_to_linear[p[c]] : p[c] * 257u;
+                                        sum[c] += v * w;
+                                        plain[c] += v;
+                                }
+                                alpha += a;
+                                weight += w;
+                                count += 1;
+                        }
+                }
+
+                unsigned char *out = dst + x * channels;
+                for ( int c = 0; c < colours; ++c ) {
+                        uint32_t v = weight > 0 ? ( sum[c] + weight / 2 ) / weight : ( plain[c] + count / 2 ) / count;
+                        out[c] = srgb ? _blit_linear_to_srgb[v] : (unsigned char) ( ( v + 128 ) / 257 );
+                }
+                if ( has_alpha ) {
+                        out[colours] = (unsigned char) ( ( alpha + count / 2 ) / count );
+                }
+        }
+}
+
+BLIT_EXTERN bool blit_uniform ( const unsigned char *pixels, size_t count, int channels ) {
+        if ( count == 0 ) {
+                return true;
+        }
+
+        unsigned char pattern[BLIT_UNIFORM_SPAN];
+        for ( int i = 0; i < BLIT_UNIFORM_SPAN; ++i ) {
+                pattern[i] = pixels[i % channels];
+        }
+
+        return _blit_uniform( pixels, count * channels, pattern );
+}
+
+#endif
@@ -0,0 +1,327 @@
+/* Persistent content addressed cache of decoded images.
+ *
+ * Before #including,
+ *      #define CACHE_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Entries are keyed by a hash of the source file bytes (see cache_hash) and
+ * hold the decoded pixels behind a small fixed size header, so a hit is just
+ * an mmap of the entry file. Stale entries are never invalidated, a changed
+ * source simply hashes to a different key. */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CACHE_EXTERN
+#define CACHE_EXTERN extern
+#endif
+
+#ifndef CACHE_STATIC
+#define CACHE_STATIC static
+#endif
+
+/* Bump when the decoded representation changes, old entries then miss */
+#define CACHE_VERSION 3
+
+#define CACHE_MAGIC "PACKCCH"
+
+/* Per entry flags, results of analysing the pixels at decode time */
+#define CACHE_FLAG_ALPHA ( 1 << 0 )  /* Has a texel with alpha below 255 */
+#define CACHE_FLAG_COLOUR ( 1 << 1 ) /* Has a texel that isn't gray */
+#define CACHE_FLAG_SOLID ( 1 << 2 )  /* Every texel is the same */
+
+/* On disk layout, pixels follow the header directly. Header is padded to
+ * 64 bytes so the pixels of a mapped entry stay cache line aligned. */
+typedef struct cache_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t flags;
+
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;
+        uint32_t reserved;
+
+        uint64_t key;
+        uint64_t pixel_len;
+
+        uint8_t padding[16];
+} cache_header;
+
+typedef struct cache_entry {
+        int width;
+        int height;
+        int channels;
+        unsigned int flags;
+
+        const unsigned char *pixels;
+
+        /* Backing mapping, NULL when pixels are not owned by the cache */
+        void *map;
+        size_t map_len;
+} cache_entry;
+
+/* Hash arbitrary bytes (XXH64) */
+CACHE_EXTERN uint64_t cache_hash ( const void *data, size_t len, uint64_t seed );
+
+/* Map a whole file read only. Returns NULL on failure */
+CACHE_EXTERN const unsigned char *cache_map_file ( const char *path, size_t *len );
+CACHE_EXTERN void cache_unmap_file ( const unsigned char *data, size_t len );
+
+/* Look the key up in cache directory, on hit entry points into the mapping */
+CACHE_EXTERN bool cache_lookup ( const char *dir, uint64_t key, cache_entry *entry );
+
+/* Store decoded entry under the key. Entry is written atomically */
+CACHE_EXTERN bool cache_store ( const char *dir, uint64_t key, const cache_entry *entry );
+
+/* Unmap entry returned by cache_lookup */
+CACHE_EXTERN void cache_release ( cache_entry *entry );
+
+#endif /* _CACHE_H */
+
+/* Implementation */
+#ifdef CACHE_IMPL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_PRIME1 0x9E3779B185EBCA87ULL
+#define CACHE_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define CACHE_PRIME3 0x165667B19E3779F9ULL
+#define CACHE_PRIME4 0x85EBCA77C2B2AE63ULL
+#define CACHE_PRIME5 0x27D4EB2F165667C5ULL
+
+#define CACHE_MAX_PATH 4096
+
+CACHE_STATIC uint64_t _cache_rotl ( uint64_t x, int r ) {
+        return ( x << r ) | ( x >> ( 64 - r ) );
+}
+
+CACHE_STATIC uint64_t _cache_read64 ( const unsigned char *p ) {
+        uint64_t v;
+        memcpy( &v, p, sizeof( v ) );
+        return v;
+}
+
+CACHE_STATIC uint32_t _cache_read32 ( const unsigned char *p ) {
+        uint32_t v;
+        memcpy( &v, p, sizeof( v ) );
+        return v;
+}
+
+CACHE_STATIC uint64_t _cache_round ( uint64_t acc, uint64_t input ) {
+        acc += input * CACHE_PRIME2;
+        acc = _cache_rotl( acc, 31 );
+        return acc * CACHE_PRIME1;
+}
+
+CACHE_STATIC uint64_t _cache_merge ( uint64_t acc, uint64_t val ) {
+        acc ^= _cache_round( 0, val );
+        return acc * CACHE_PRIME1 + CACHE_PRIME4;
+}
+
+CACHE_EXTERN uint64_t cache_hash ( const void *data, size_t len, uint64_t seed ) {
+        const unsigned char *p = (const unsigned char *) data;
+        const unsigned char *end = p + len;
+        uint64_t h;
+
+        if ( len >= 32 ) {
+                uint64_t v1 = seed + CACHE_PRIME1 + CACHE_PRIME2;
+                uint64_t v2 = seed + CACHE_PRIME2;
+                uint64_t v3 = seed;
+                uint64_t v4 = seed - CACHE_PRIME1;
+
+                do {
+                        v1 = _cache_round( v1, _cache_read64( p ) );
+                        v2 = _cache_round( v2, _cache_read64( p + 8 ) );
+                        v3 = _cache_round( v3, _cache_read64( p + 16 ) );
+                        v4 = _cache_round( v4, _cache_read64( p + 24 ) );
+                        p += 32;
+                } while ( p + 32 <= end );
+
+                h = _cache_rotl( v1, 1 ) + _cache_rotl( v2, 7 ) + _cache_rotl( v3, 12 ) + _cache_rotl( v4, 18 );
+                h = _cache_merge( h, v1 );
+                h = _cache_merge( h, v2 );
+                h = _cache_merge( h, v3 );
+                h = _cache_merge( h, v4 );
+        } else {
+                h = seed + CACHE_PRIME5;
+        }
+
+        h += (uint64_t) len;
+
+        while ( p + 8 <= end ) {
+                h ^= _cache_round( 0, _cache_read64( p ) );
+                h = _cache_rotl( h, 27 ) * CACHE_PRIME1 + CACHE_PRIME4;
+                p += 8;
+        }
+
+        if ( p + 4 <= end ) {
+                h ^= (uint64_t) _cache_read32( p ) * CACHE_PRIME1;
+                h = _cache_rotl( h, 23 ) * CACHE_PRIME2 + CACHE_PRIME3;
+                p += 4;
+        }
+
+        while ( p < end ) {
+                h ^= ( *p++ ) * CACHE_PRIME5;
+                h = _cache_rotl( h, 11 ) * CACHE_PRIME1;
+        }
+
+        h ^= h >> 33;
+        h *= CACHE_PRIME2;
+        h ^= h >> 29;
+        h *= CACHE_PRIME3;
+        h ^= h >> 32;
+
+        return h;
+}
+
+CACHE_EXTERN const unsigned char *cache_map_file ( const char *path, size_t *len ) {
+        int fd = open( path, O_RDONLY );
+        if ( fd < 0 ) {
+                return NULL;
+        }
+
+        struct stat st;
+        if ( fstat( fd, &st ) != 0 || st.st_size == 0 ) {
+                close( fd );
+                return NULL;
+        }
+
+        void *data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        close( fd );
+
+        if ( data == MAP_FAILED ) {
+                return NULL;
+        }
+
+        *len = st.st_size;
+        return (const unsigned char *) data;
+}
+
+CACHE_EXTERN void cache_unmap_file ( const unsigned char *data, size_t len ) {
+        if ( data != NULL ) {
+                munmap( (void *) data, len );
+        }
+}
+
+CACHE_STATIC void _cache_entry_path ( const char *dir, uint64_t key, char *dest, size_t dest_len ) {
+        snprintf( dest, dest_len, "%s/%016llx.pxc", dir, (unsigned long long) key );
+}
+
+CACHE_EXTERN bool cache_lookup ( const char *dir, uint64_t key, cache_entry *entry ) {
+        char path[CACHE_MAX_PATH];
+        _cache_entry_path( dir, key, path, sizeof( path ) );
+
+        size_t len;
+        const unsigned char *data = cache_map_file( path, &len );
+        if ( data == NULL ) {
+                return false;
+        }
+
+        const cache_header *header = (const cache_header *) data;
+
+        /* Anything that doesn't look exactly right is a miss, it gets rewritten */
+        if ( len < sizeof( cache_header ) ||
+             memcmp( header->magic, CACHE_MAGIC, sizeof( CACHE_MAGIC ) ) != 0 ||
+             header->version != CACHE_VERSION ||
+             header->key != key ||
+             header->pixel_len != (uint64_t) header->width * header->height * header->channels ||
+             len - sizeof( cache_header ) < header->pixel_len ) {
+                cache_unmap_file( data, len );
+                return false;
+        }
+
+        *entry = (cache_entry) {
+            .width = header->width,
+            .height = header->height,
+            .channels = header->channels,
+            .flags = header->flags,
+            .pixels = data + sizeof( cache_header ),
+            .map = (void *) data,
+            .map_len = len,
+        };
+
+        return true;
+}
+
+CACHE_STATIC bool _cache_write_all ( int fd, const void *data, size_t len ) {
+        const char *p = (const char *) data;
+
+        while ( len > 0 ) {
+                ssize_t written = write( fd, p, len );
+                if ( written < 0 ) {
+                        if ( errno == EINTR ) {
+                                continue;
+                        }
+                        return false;
+                }
+                p += written;
+                len -= written;
+        }
+
+        return true;
+}
+
+CACHE_EXTERN bool cache_store ( const char *dir, uint64_t key, const cache_entry *entry ) {
+        char path[CACHE_MAX_PATH];
+        char tmp_path[CACHE_MAX_PATH + 32];
+
+        /* Directory most likely exists already */
+        if ( mkdir( dir, 0755 ) != 0 && errno != EEXIST ) {
+                return false;
+        }
+
+        _cache_entry_path( dir, key, path, sizeof( path ) );
+        snprintf( tmp_path, sizeof( tmp_path ), "%s.%ld.tmp", path, (long) getpid() );
+
+        cache_header header = {
+            .version = CACHE_VERSION,
+            .flags = entry->flags,
+            .width = entry->width,
+            .height = entry->height,
+            .channels = entry->channels,
+            .key = key,
+            .pixel_len = (uint64_t) entry->width * entry->height * entry->channels,
+        };
+        memcpy( header.magic, CACHE_MAGIC, sizeof( CACHE_MAGIC ) );
+
+        int fd = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if ( fd < 0 ) {
+                return false;
+        }
+
+        bool ok = _cache_write_all( fd, &header, sizeof( header ) ) &&
+                  _cache_write_all( fd, entry->pixels, header.pixel_len );
+
+        ok = close( fd ) == 0 && ok;
+
+        /* Readers only ever see complete entries */
+        if ( !ok || rename( tmp_path, path ) != 0 ) {
+                unlink( tmp_path );
+                return false;
+        }
+
+        return true;
+}
+
+CACHE_EXTERN void cache_release ( cache_entry *entry ) {
+        if ( entry->map != NULL ) {
+                munmap( entry->map, entry->map_len );
+        }
+
+        entry->map = NULL;
+        entry->pixels = NULL;
+}
+
+#endif
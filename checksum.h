@@ -0,0 +1,368 @@
+/* CRC-32 and Adler-32 checksums.
+ *
+ * Before #including,
+ *      #define CHECKSUM_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * CRC-32 is the one of PNG chunks and gzip, Adler-32 the one of zlib
+ * streams. Kernels are picked by checksum_init based on what the CPU
+ * supports. CRC-32 folds 64 bytes at a time with carry-less multiplies
+ * (PCLMULQDQ) and does the rest eight bytes per step with slice-by-8
+ * tables. Adler-32 sums 32 bytes per step with SSSE3 or AVX2 and falls
+ * back to an unrolled scalar loop. */
+
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CHECKSUM_EXTERN
+#define CHECKSUM_EXTERN extern
+#endif
+
+#ifndef CHECKSUM_STATIC
+#define CHECKSUM_STATIC static
+#endif
+
+#define CHECKSUM_CRC32_INIT 0u
+#define CHECKSUM_ADLER32_INIT 1u
+
+/* Build tables and pick kernels for this CPU, call once before the rest */
+CHECKSUM_EXTERN void checksum_init ( void );
+
+/* Name of the best instruction set in use */
+CHECKSUM_EXTERN const char *checksum_isa ( void );
+
+/* Running CRC-32, start with CHECKSUM_CRC32_INIT */
+CHECKSUM_EXTERN uint32_t checksum_crc32 ( uint32_t crc, const unsigned char *data, size_t len );
+
+/* Running Adler-32, start with CHECKSUM_ADLER32_INIT */
+CHECKSUM_EXTERN uint32_t checksum_adler32 ( uint32_t adler, const unsigned char *data, size_t len );
+
+/* Adler-32 of two pieces back to back from the checksums of each, second
+ * one started from CHECKSUM_ADLER32_INIT and len2 bytes long */
+CHECKSUM_EXTERN uint32_t checksum_adler32_combine ( uint32_t adler1, uint32_t adler2, size_t len2 );
+
+#endif /* _CHECKSUM_H */
+
+/* Implementation */
+#ifdef CHECKSUM_IMPL
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+#define CHECKSUM_CRC32_POLY 0xedb88320u
+#define CHECKSUM_ADLER32_BASE 65521u
+
+/* Most bytes summed before s2 can overflow 32 bits */
+#define CHECKSUM_ADLER32_NMAX 5552
+
+/* Both work on the inverted CRC */
+typedef uint32_t ( *_checksum_fn )( uint32_t crc, const unsigned char *data, size_t len );
+
+static uint32_t _checksum_crc_table[8][256];
+static _checksum_fn _checksum_crc32;
+static _checksum_fn _checksum_adler32;
+static const char *_checksum_isa = "scalar";
+
+static inline uint32_t _checksum_le32 ( const unsigned char *p ) {
+        return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t) p[3] << 24 );
+}
+
+CHECKSUM_STATIC uint32_t _checksum_crc32_slice8 ( uint32_t crc, const unsigned char *data, size_t len ) {
+        uint32_t( *t )[256] = _checksum_crc_table;
+
+        for ( ; len >= 8; len -= 8, data += 8 ) {
+                uint32_t a = _checksum_le32( data ) ^ crc;
+                uint32_t b = _checksum_le32( data + 4 );
+                crc = t[7][a & 0xff] ^ t[6][( a >> 8 ) & 0xff] ^ t[5][( a >> 16 ) & 0xff] ^ t[4][a >> 24] ^
+                      t[3][b & 0xff] ^ t[2][( b >> 8 ) & 0xff] ^ t[1][( b >> 16 ) & 0xff] ^ t[0][b >> 24];
+        }
+
+        while ( len-- ) {
+                crc = ( crc >> 8 ) ^ t[0][( crc ^ *data++ ) & 0xff];
+        }
+
+        return crc;
+}
+
+CHECKSUM_STATIC uint32_t _checksum_adler32_scalar ( uint32_t adler, const unsigned char *data, size_t len ) {
+        uint32_t s1 = adler & 0xffff;
+        uint32_t s2 = adler >> 16;
+
+        while ( len > 0 ) {
+                size_t block = len < CHECKSUM_ADLER32_NMAX ? len : CHECKSUM_ADLER32_NMAX;
+                len -= block;
+
+                for ( ; block >= 8; block -= 8, data += 8 ) {
+                        s1 += data[0];
+                        s2 += s1;
+                        s1 += data[1];
+                        s2 += s1;
+                        s1 += data[2];
+                        s2 += s1;
+                        s1 += data[3];
+                        s2 += s1;
+                        s1 += data[4];
+                        s2 += s1;
+                        s1 += data[5];
+                        s2 += s1;
+                        s1 += data[6];
+                        s2 += s1;
+                        s1 += data[7];
+                        s2 += s1;
+                }
+
+                while ( block-- ) {
+                        s1 += *data++;
+                        s2 += s1;
+                }
+
+                s1 %= CHECKSUM_ADLER32_BASE;
+                s2 %= CHECKSUM_ADLER32_BASE;
+        }
+
+        return ( s2 << 16 ) | s1;
+}
+
+#ifdef CHECKSUM_X86
+
+/* Fold four 128 bit lanes over every 64 bytes, then into one lane and
+ * Barrett reduce it, as in Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ". Constants are for the bit reflected
+ * polynomial. Tail below 16 bytes goes to the tables. */
+__attribute__( ( target( "pclmul,sse4.1" ) ) )
+CHECKSUM_STATIC uint32_t _checksum_crc32_pclmul ( uint32_t crc, const unsigned char *data, size_t len ) {
+        if ( len < 64 ) {
+                return _checksum_crc32_slice8( crc, data, len );
+        }
+
+        const __m128i k1k2 = _mm_set_epi64x( 0x01c6e41596, 0x0154442bd4 );
+        const __m128i k3k4 = _mm_set_epi64x( 0x00ccaa009e, 0x01751997d0 );
+        const __m128i k5 = _mm_set_epi64x( 0, 0x0163cd6124 );
+        const __m128i poly = _mm_set_epi64x( 0x01f7011641, 0x01db710641 );
+        const __m128i low32 = _mm_setr_epi32( ~0, 0, ~0, 0 );
+
+        __m128i x1 = _mm_loadu_si128( (const __m128i *) data );
+        __m128i x2 = _mm_loadu_si128( (const __m128i *) ( data + 16 ) );
+        __m128i x3 = _mm_loadu_si128( (const __m128i *) ( data + 32 ) );
+        __m128i x4 = _mm_loadu_si128( (const __m128i *) ( data + 48 ) );
+        x1 = _mm_xor_si128( x1, _mm_cvtsi32_si128( (int) crc ) );
+        data += 64;
+        len -= 64;
+
+        for ( ; len >= 64; len -= 64, data += 64 ) {
+                __m128i y1 = _mm_clmulepi64_si128( x1, k1k2, 0x00 );
+                __m128i y2 = _mm_clmulepi64_si128( x2, k1k2, 0x00 );
+                __m128i y3 = _mm_clmulepi64_si128( x3, k1k2, 0x00 );
+                __m128i y4 = _mm_clmulepi64_si128( x4, k1k2, 0x00 );
+                x1 = _mm_clmulepi64_si128( x1, k1k2, 0x11 );
+                x2 = _mm_clmulepi64_si128( x2, k1k2, 0x11 );
+                x3 = _mm_clmulepi64_si128( x3, k1k2, 0x11 );
+                x4 = _mm_clmulepi64_si128( x4, k1k2, 0x11 );
+                x1 = _mm_xor_si128( _mm_xor_si128( x1, y1 ), _mm_loadu_si128( (const __m128i *) data ) );
+                x2 = _mm_xor_si128( _mm_xor_si128( x2, y2 ), _mm_loadu_si128( (const __m128i *) ( data + 16 ) ) );
+                x3 = _mm_xor_si128( _mm_xor_si128( x3, y3 ), _mm_loadu_si128( (const __m128i *) ( data + 32 ) ) );
+                x4 = _mm_xor_si128( _mm_xor_si128( x4, y4 ), _mm_loadu_si128( (const __m128i *) ( data + 48 ) ) );
+        }
+
+        /* Four lanes into one, then whatever whole 16 bytes are left */
+        __m128i lanes[3] = { x2, x3, x4 };
+        for ( int i = 0; i < 3; ++i ) {
+                __m128i y = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+                x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+                x1 = _mm_xor_si128( _mm_xor_si128( x1, lanes[i] ), y );
+        }
+
+        for ( ; len >= 16; len -= 16, data += 16 ) {
+                __m128i y = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+                x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+                x1 = _mm_xor_si128( _mm_xor_si128( x1, _mm_loadu_si128( (const __m128i *) data ) ), y );
+        }
+
+        /* 128 bits to 64 */
+        __m128i y = _mm_clmulepi64_si128( x1, k3k4, 0x10 );
+        x1 = _mm_xor_si128( _mm_srli_si128( x1, 8 ), y );
+
+        y = _mm_srli_si128( x1, 4 );
+        x1 = _mm_clmulepi64_si128( _mm_and_si128( x1, low32 ), k5, 0x00 );
+        x1 = _mm_xor_si128( x1, y );
+
+        /* Barrett reduction to 32 */
+        y = _mm_clmulepi64_si128( _mm_and_si128( x1, low32 ), poly, 0x10 );
+        y = _mm_clmulepi64_si128( _mm_and_si128( y, low32 ), poly, 0x00 );
+        x1 = _mm_xor_si128( x1, y );
+
+        crc = (uint32_t) _mm_extract_epi32( x1, 1 );
+        return _checksum_crc32_slice8( crc, data, len );
+}
+
+/* 32 bytes per step. Sum of bytes goes to s1 lanes, bytes weighted by
+ * distance from the end of the step to s2 lanes. Every step adds the s1
+ * before it 32 times to s2, gathered in ps and added at the end. */
+__attribute__( ( target( "ssse3" ) ) )
+CHECKSUM_STATIC uint32_t _checksum_adler32_ssse3 ( uint32_t adler, const unsigned char *data, size_t len ) {
+        uint32_t s1 = adler & 0xffff;
+        uint32_t s2 = adler >> 16;
+
+        const __m128i tap1 = _mm_setr_epi8( 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17 );
+        const __m128i tap2 = _mm_setr_epi8( 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 );
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16( 1 );
+
+        size_t steps = len / 32;
+        len -= steps * 32;
+
+        while ( steps > 0 ) {
+                size_t n = steps < CHECKSUM_ADLER32_NMAX / 32 ? steps : CHECKSUM_ADLER32_NMAX / 32;
+                steps -= n;
+
+                __m128i ps = _mm_cvtsi32_si128( (int) ( s1 * n ) );
+                __m128i v2 = _mm_cvtsi32_si128( (int) s2 );
+                __m128i v1 = zero;
+
+                for ( size_t i = 0; i < n; ++i, data += 32 ) {
+                        __m128i a = _mm_loadu_si128( (const __m128i *) data );
+                        __m128i b = _mm_loadu_si128( (const __m128i *) ( data + 16 ) );
+
+                        ps = _mm_add_epi32( ps, v1 );
+                        v1 = _mm_add_epi32( v1, _mm_add_epi32( _mm_sad_epu8( a, zero ), _mm_sad_epu8( b, zero ) ) );
+                        v2 = _mm_add_epi32( v2, _mm_madd_epi16( _mm_maddubs_epi16( a, tap1 ), ones ) );
+                        v2 = _mm_add_epi32( v2, _mm_madd_epi16( _mm_maddubs_epi16( b, tap2 ), ones ) );
+                }
+
+                v2 = _mm_add_epi32( v2, _mm_slli_epi32( ps, 5 ) );
+
+                v1 = _mm_add_epi32( v1, _mm_shuffle_epi32( v1, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+                v1 = _mm_add_epi32( v1, _mm_shuffle_epi32( v1, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+                v2 = _mm_add_epi32( v2, _mm_shuffle_epi32( v2, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+                v2 = _mm_add_epi32( v2, _mm_shuffle_epi32( v2, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+
+                s1 = ( s1 + (uint32_t) _mm_cvtsi128_si32( v1 ) ) % CHECKSUM_ADLER32_BASE;
+                s2 = (uint32_t) _mm_cvtsi128_si32( v2 ) % CHECKSUM_ADLER32_BASE;
+        }
+
+        return _checksum_adler32_scalar( ( s2 << 16 ) | s1, data, len );
+}
+
+/* Same with all 32 bytes of a step in one register */
+__attribute__( ( target( "avx2" ) ) )
+CHECKSUM_STATIC uint32_t _checksum_adler32_avx2 ( uint32_t adler, const unsigned char *data, size_t len ) {
+        uint32_t s1 = adler & 0xffff;
+        uint32_t s2 = adler >> 16;
+
+        const __m256i tap = _mm256_setr_epi8( 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,
+                                              14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 );
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi16( 1 );
+
+        size_t steps = len / 32;
+        len -= steps * 32;
+
+        while ( steps > 0 ) {
+                size_t n = steps < CHECKSUM_ADLER32_NMAX / 32 ? steps : CHECKSUM_ADLER32_NMAX / 32;
+                steps -= n;
+
+                __m256i ps = _mm256_setr_epi32( (int) ( s1 * n ), 0, 0, 0, 0, 0, 0, 0 );
+                __m256i v2 = _mm256_setr_epi32( (int) s2, 0, 0, 0, 0, 0, 0, 0 );
+                __m256i v1 = zero;
+
+                for ( size_t i = 0; i < n; ++i, data += 32 ) {
+                        __m256i a = _mm256_loadu_si256( (const __m256i *) data );
+
+                        ps = _mm256_add_epi32( ps, v1 );
+                        v1 = _mm256_add_epi32( v1, _mm256_sad_epu8( a, zero ) );
+                        v2 = _mm256_add_epi32( v2, _mm256_madd_epi16( _mm256_maddubs_epi16( a, tap ), ones ) );
+                }
+
+                v2 = _mm256_add_epi32( v2, _mm256_slli_epi32( ps, 5 ) );
+
+                __m128i h1 = _mm_add_epi32( _mm256_castsi256_si128( v1 ), _mm256_extracti128_si256( v1, 1 ) );
+                __m128i h2 = _mm_add_epi32( _mm256_castsi256_si128( v2 ), _mm256_extracti128_si256( v2, 1 ) );
+                h1 = _mm_add_epi32( h1, _mm_shuffle_epi32( h1, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+                h1 = _mm_add_epi32( h1, _mm_shuffle_epi32( h1, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+                h2 = _mm_add_epi32( h2, _mm_shuffle_epi32( h2, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+                h2 = _mm_add_epi32( h2, _mm_shuffle_epi32( h2, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+
+                s1 = ( s1 + (uint32_t) _mm_cvtsi128_si32( h1 ) ) % CHECKSUM_ADLER32_BASE;
+                s2 = (uint32_t) _mm_cvtsi128_si32( h2 ) % CHECKSUM_ADLER32_BASE;
+        }
+
+        return _checksum_adler32_scalar( ( s2 << 16 ) | s1, data, len );
+}
+
+#endif /* CHECKSUM_X86 */
+
+CHECKSUM_EXTERN void checksum_init ( void ) {
+        for ( uint32_t i = 0; i < 256; ++i ) {
+                uint32_t c = i;
+                for ( int k = 0; k < 8; ++k ) {
+                        c = c & 1 ? CHECKSUM_CRC32_POLY ^ ( c >> 1 ) : c >> 1;
+                }
+                _checksum_crc_table[0][i] = c;
+        }
+
+        /* Table k advances a byte followed by k zero bytes */
+        for ( int k = 1; k < 8; ++k ) {
+                for ( int i = 0; i < 256; ++i ) {
+                        uint32_t c = _checksum_crc_table[k - 1][i];
+                        _checksum_crc_table[k][i] = ( c >> 8 ) ^ _checksum_crc_table[0][c & 0xff];
+                }
+        }
+
+        _checksum_crc32 = _checksum_crc32_slice8;
+        _checksum_adler32 = _checksum_adler32_scalar;
+        _checksum_isa = "scalar";
+
+#ifdef CHECKSUM_X86
+        __builtin_cpu_init();
+
+        if ( __builtin_cpu_supports( "ssse3" ) ) {
+                _checksum_adler32 = _checksum_adler32_ssse3;
+                _checksum_isa = "ssse3";
+        }
+
+        if ( __builtin_cpu_supports( "pclmul" ) && __builtin_cpu_supports( "sse4.1" ) ) {
+                _checksum_crc32 = _checksum_crc32_pclmul;
+                _checksum_isa = "pclmul";
+        }
+
+        if ( __builtin_cpu_supports( "avx2" ) ) {
+                _checksum_adler32 = _checksum_adler32_avx2;
+                _checksum_isa = _checksum_crc32 == _checksum_crc32_pclmul ? "pclmul+avx2" : "avx2";
+        }
+#endif
+}
+
+CHECKSUM_EXTERN const char *checksum_isa ( void ) {
+        return _checksum_isa;
+}
+
+CHECKSUM_EXTERN uint32_t checksum_crc32 ( uint32_t crc, const unsigned char *data, size_t len ) {
+        return ~_checksum_crc32( ~crc, data, len );
+}
+
+CHECKSUM_EXTERN uint32_t checksum_adler32 ( uint32_t adler, const unsigned char *data, size_t len ) {
+        return _checksum_adler32( adler, data, len );
+}
+
+CHECKSUM_EXTERN uint32_t checksum_adler32_combine ( uint32_t adler1, uint32_t adler2, size_t len2 ) {
+        const uint32_t base = CHECKSUM_ADLER32_BASE;
+        uint32_t rem = (uint32_t) ( len2 % base );
+
+        /* Every byte of the second piece adds s1 of the first to s2 once more */
+        uint32_t s1 = ( adler1 & 0xffff ) + ( adler2 & 0xffff ) + base - 1;
+        uint32_t s2 = (uint32_t) ( ( (uint64_t) rem * ( adler1 & 0xffff ) ) % base );
+        s2 += ( adler1 >> 16 ) + ( adler2 >> 16 ) + base - rem;
+
+        s1 %= base;
+        s2 %= base;
+
+        return ( s2 << 16 ) | s1;
+}
+
+#endif
@@ -0,0 +1,182 @@
+/* DDS container headers.
+ *
+ * Before #including,
+ *      #define DDS_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Writes the 128 byte header of a single 2D texture without mips, pixel
+ * rows or rows of blocks follow it tightly packed. Uncompressed formats are
+ * described with bit masks, block compressed ones with a FourCC code or the
+ * DX10 extension that names their DXGI format. Premultiplied alpha can only
+ * be told in the DX10 extension, so it's always used then.
+ *
+ * Pitch and linear size are 32 bit, levels too big for them aren't written
+ * at all. */
+
+#ifndef _DDS_H
+#define _DDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef DDS_EXTERN
+#define DDS_EXTERN extern
+#endif
+
+#ifndef DDS_STATIC
+#define DDS_STATIC static
+#endif
+
+#define DDS_HEADER_SIZE 128
+#define DDS_DX10_SIZE 20
+
+/* DXGI formats of packed pixels, with masks of the same layout */
+#define DDS_DXGI_R8G8B8A8_UNORM 28
+#define DDS_DXGI_R8G8B8A8_UNORM_SRGB 29
+#define DDS_DXGI_B5G6R5_UNORM 85
+#define DDS_DXGI_B5G5R5A1_UNORM 86
+#define DDS_DXGI_B4G4R4A4_UNORM 115
+
+/* DXGI formats of block compressed pixels */
+#define DDS_DXGI_BC1_UNORM 71
+#define DDS_DXGI_BC1_UNORM_SRGB 72
+#define DDS_DXGI_BC3_UNORM 77
+#define DDS_DXGI_BC3_UNORM_SRGB 78
+#define DDS_DXGI_BC4_UNORM 80
+#define DDS_DXGI_BC5_UNORM 83
+#define DDS_DXGI_BC7_UNORM 98
+#define DDS_DXGI_BC7_UNORM_SRGB 99
+
+/* Header for pixels of bits each with red, green, blue and alpha masks,
+ * zero alpha mask means no alpha. Premultiplied pixels are named by their
+ * DXGI format instead, which has to match the masks. */
+DDS_EXTERN bool dds_write_header ( FILE *file, uint32_t width, uint32_t height, uint32_t bits,
+                                   const uint32_t masks[4], uint32_t dxgi_format, bool premultiplied );
+
+/* Header for 4x4 blocks of block_bytes each in DXGI format. Linear BC1 and
+ * BC3 get the DXT1 and DXT5 codes every reader knows unless premultiplied,
+ * anything else the DX10 extension. */
+DDS_EXTERN bool dds_write_block_header ( FILE *file, uint32_t width, uint32_t height, uint32_t dxgi_format,
+                                         uint32_t block_bytes, bool premultiplied );
+
+#endif /* _DDS_H */
+
+/* Implementation */
+#ifdef DDS_IMPL
+
+#include <string.h>
+
+#define DDS_MAGIC 0x20534444 /* "DDS " */
+
+#define DDSD_CAPS 0x1
+#define DDSD_HEIGHT 0x2
+#define DDSD_WIDTH 0x4
+#define DDSD_PITCH 0x8
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_LINEARSIZE 0x80000
+
+#define DDPF_ALPHAPIXELS 0x1
+#define DDPF_FOURCC 0x4
+#define DDPF_RGB 0x40
+
+#define DDSCAPS_TEXTURE 0x1000
+
+#define DDS_FOURCC_DXT1 0x31545844 /* "DXT1" */
+#define DDS_FOURCC_DXT5 0x35545844 /* "DXT5" */
+#define DDS_FOURCC_DX10 0x30315844 /* "DX10" */
+
+#define DDS_DIMENSION_TEXTURE2D 3
+#define DDS_ALPHA_MODE_PREMULTIPLIED 2
+
+DDS_STATIC void _dds_put32 ( unsigned char *dst, uint32_t value ) {
+        dst[0] = value & 0xff;
+        dst[1] = ( value >> 8 ) & 0xff;
+        dst[2] = ( value >> 16 ) & 0xff;
+        dst[3] = value >> 24;
+}
+
+/* DX10 extension naming dxgi_format, with alpha mode when premultiplied */
+DDS_STATIC void _dds_dx10 ( unsigned char *header, uint32_t dxgi_format, bool premultiplied ) {
+        unsigned char *dx10 = header + DDS_HEADER_SIZE;
+        memset( dx10, 0, DDS_DX10_SIZE );
+
+        _dds_put32( header + 80, DDPF_FOURCC );
+        _dds_put32( header + 84, DDS_FOURCC_DX10 );
+        _dds_put32( dx10, dxgi_format );
+        _dds_put32( dx10 + 4, DDS_DIMENSION_TEXTURE2D );
+        _dds_put32( dx10 + 12, 1 ); /* Array size */
+        _dds_put32( dx10 + 16, premultiplied ? DDS_ALPHA_MODE_PREMULTIPLIED : 0 );
+}
+
+/* Fields every header shares, flags and pitch are left to the caller */
+DDS_STATIC void _dds_header ( unsigned char *header, uint32_t width, uint32_t height ) {
+        memset( header, 0, DDS_HEADER_SIZE );
+
+        _dds_put32( header, DDS_MAGIC );
+        _dds_put32( header + 4, 124 );
+        _dds_put32( header + 12, height );
+        _dds_put32( header + 16, width );
+        _dds_put32( header + 76, 32 );
+        _dds_put32( header + 108, DDSCAPS_TEXTURE );
+}
+
+DDS_EXTERN bool dds_write_header ( FILE *file, uint32_t width, uint32_t height, uint32_t bits,
+                                   const uint32_t masks[4], uint32_t dxgi_format, bool premultiplied ) {
+        uint64_t pitch = ( (uint64_t) width * bits + 7 ) / 8;
+        if ( pitch > UINT32_MAX ) {
+                return false;
+        }
+
+        unsigned char header[DDS_HEADER_SIZE + DDS_DX10_SIZE];
+        _dds_header( header, width, height );
+
+        _dds_put32( header + 8, DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PITCH | DDSD_PIXELFORMAT );
+        _dds_put32( header + 20, (uint32_t) pitch );
+
+        if ( premultiplied ) {
+                _dds_dx10( header, dxgi_format, true );
+                return fwrite( header, sizeof( header ), 1, file ) == 1;
+        }
+
+        /* Pixel format */
+        unsigned char *pf = header + 76;
+        _dds_put32( pf + 4, DDPF_RGB | ( masks[3] != 0 ? DDPF_ALPHAPIXELS : 0 ) );
+        _dds_put32( pf + 12, bits );
+        for ( int i = 0; i < 4; ++i ) {
+                _dds_put32( pf + 16 + i * 4, masks[i] );
+        }
+
+        return fwrite( header, DDS_HEADER_SIZE, 1, file ) == 1;
+}
+
+DDS_EXTERN bool dds_write_block_header ( FILE *file, uint32_t width, uint32_t height, uint32_t dxgi_format,
+                                         uint32_t block_bytes, bool premultiplied ) {
+        /* Linear size is the whole level, blocks cover the edges */
+        uint64_t size = (uint64_t) ( ( width + 3 ) / 4 ) * ( ( height + 3 ) / 4 ) * block_bytes;
+        if ( size > UINT32_MAX ) {
+                return false;
+        }
+
+        unsigned char header[DDS_HEADER_SIZE + DDS_DX10_SIZE];
+        _dds_header( header, width, height );
+
+        _dds_put32( header + 8, DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_LINEARSIZE | DDSD_PIXELFORMAT );
+        _dds_put32( header + 20, (uint32_t) size );
+
+        uint32_t fourcc = premultiplied                       ? DDS_FOURCC_DX10
+                          : dxgi_format == DDS_DXGI_BC1_UNORM ? DDS_FOURCC_DXT1
+                          : dxgi_format == DDS_DXGI_BC3_UNORM ? DDS_FOURCC_DXT5
+                                                              : DDS_FOURCC_DX10;
+        if ( fourcc != DDS_FOURCC_DX10 ) {
+                _dds_put32( header + 80, DDPF_FOURCC );
+                _dds_put32( header + 84, fourcc );
+                return fwrite( header, DDS_HEADER_SIZE, 1, file ) == 1;
+        }
+
+        _dds_dx10( header, dxgi_format, premultiplied );
+        return fwrite( header, sizeof( header ), 1, file ) == 1;
+}
+
+#endif
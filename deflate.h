@@ -0,0 +1,1267 @@
+/* Chunked DEFLATE (RFC 1951) compressor.
+ *
+ * Before #including,
+ *      #define DEFLATE_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Input is compressed in chunks. A chunk may reference the bytes directly
+ * preceding it (the dictionary) and every non final chunk ends on a byte
+ * boundary with an empty stored block, same as zlib's Z_SYNC_FLUSH. Output
+ * of consecutive chunks can therefore be concatenated into a single stream. */
+
+#ifndef _DEFLATE_H
+#define _DEFLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef DEFLATE_EXTERN
+#define DEFLATE_EXTERN extern
+#endif
+
+#ifndef DEFLATE_STATIC
+#define DEFLATE_STATIC static
+#endif
+
+#define DEFLATE_WINDOW ( 32768 )
+
+/* Largest chunk deflate_compress accepts, dictionary included */
+#define DEFLATE_MAX_CHUNK ( (size_t) 1 << 30 )
+
+#define DEFLATE_MIN_LEVEL ( -1 ) /* Runs of a repeated byte only, zlib's Z_RLE */
+#define DEFLATE_STORED_LEVEL 0   /* Stored blocks only */
+#define DEFLATE_MAX_LEVEL 10 /* Zopfli style, optimal parse iterated */
+
+/* Compress len bytes starting at data + dict_len. Matches may reach back up
+ * to DEFLATE_WINDOW bytes into the dict_len bytes in front of them.
+ * Returns buffer allocated with DEFLATE_MALLOC or NULL on failure. */
+DEFLATE_EXTERN unsigned char *deflate_compress ( const unsigned char *data, size_t dict_len, size_t len,
+                                                 int level, bool final, size_t *out_len );
+
+/* Two byte zlib (RFC 1950) stream header matching the level */
+DEFLATE_EXTERN void deflate_zlib_header ( int level, unsigned char header[2] );
+
+#endif /* _DEFLATE_H */
+
+/* Implementation */
+#ifdef DEFLATE_IMPL
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Allow for opting out malloc */
+#ifndef DEFLATE_MALLOC
+#define DEFLATE_MALLOC( size ) malloc( size )
+#endif
+#ifndef DEFLATE_FREE
+#define DEFLATE_FREE( ptr ) free( ptr )
+#endif
+
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE ( 1 << DEFLATE_HASH_BITS )
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MAX_STORED 65535
+
+/* Three byte matches further than this cost more than the literals */
+#define DEFLATE_TOO_FAR 4096
+
+/* Fixed code has 288 literal/length codes, last two are never used */
+#define DEFLATE_LITLEN_CODES 288
+#define DEFLATE_LITLEN_USED 286
+#define DEFLATE_DIST_CODES 30
+#define DEFLATE_CODELEN_CODES 19
+#define DEFLATE_MAX_BITS 15
+#define DEFLATE_MAX_CODELEN_BITS 7
+
+/* Symbols gathered before a block is written out, more means fewer
+ * headers but codes adapt slower */
+#define DEFLATE_BLOCK_SYMBOLS 16384
+
+/* Bytes parsed optimally at once, each of them is a block, and matches
+ * remembered per byte for the parse */
+#define DEFLATE_OPT_BLOCK 65536
+#define DEFLATE_OPT_MATCHES 8
+
+/* Optimal parse blocks split this many times over, halves tried at as
+ * many points and no part shorter than this many symbols */
+#define DEFLATE_SPLIT_DEPTH 4
+#define DEFLATE_SPLIT_TRIES 16
+#define DEFLATE_SPLIT_MIN 1024
+
+/* Optimal parse prices are in 1/16 bits */
+#define DEFLATE_PRICE_SHIFT 4
+
+typedef enum _deflate_parse {
+        _DEFLATE_GREEDY,  /* Longest match right away */
+        _DEFLATE_LAZY,    /* Longest match unless the next byte has a longer one */
+        _DEFLATE_OPTIMAL, /* Cheapest path through all matches of a block */
+        _DEFLATE_RLE,     /* Runs of the byte before, no hashing at all */
+} _deflate_parse;
+
+/* Same knobs as zlib. Greedy parse uses lazy as longest match whose bytes
+ * still go into the hash. Optimal parse runs passes times over a block,
+ * later ones priced by the symbols of the one before, and keeps the
+ * smallest. */
+typedef struct _deflate_params {
+        int good;  /* Search less once a match this long is in hand */
+        int lazy;  /* Don't look further ahead than this */
+        int nice;  /* Stop searching at this length */
+        int chain; /* Hash chain links followed */
+        _deflate_parse parse;
+        int passes;
+        bool split; /* Optimal parse blocks may be split in smaller ones */
+} _deflate_params;
+
+static const _deflate_params _deflate_levels[DEFLATE_MAX_LEVEL + 1] = {
+    { 0, 0, 0, 0, _DEFLATE_GREEDY, 0, false },
+    { 4, 4, 8, 4, _DEFLATE_GREEDY, 0, false },
+    { 4, 5, 16, 8, _DEFLATE_GREEDY, 0, false },
+    { 4, 6, 32, 32, _DEFLATE_GREEDY, 0, false },
+    { 4, 4, 16, 16, _DEFLATE_LAZY, 0, false },
+    { 8, 16, 32, 32, _DEFLATE_LAZY, 0, false },
+    { 8, 16, 128, 128, _DEFLATE_LAZY, 0, false },
+    { 8, 32, 128, 256, _DEFLATE_LAZY, 0, false },
+    { 0, 0, 64, 32, _DEFLATE_OPTIMAL, 1, false },
+    { 0, 0, 258, 128, _DEFLATE_OPTIMAL, 2, false },
+    { 0, 0, 258, 256, _DEFLATE_OPTIMAL, 15, true },
+};
+
+static const _deflate_params _deflate_rle_level = { 0, 0, 0, 0, _DEFLATE_RLE, 0, false };
+
+static const unsigned char _deflate_codelen_order[DEFLATE_CODELEN_CODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+typedef struct _deflate_writer {
+        unsigned char *out;
+        size_t len;
+
+        uint64_t bits;
+        int count;
+} _deflate_writer;
+
+/* Literal or match, literals have zero distance */
+typedef struct _deflate_symbol {
+        uint16_t length;
+        uint16_t dist;
+} _deflate_symbol;
+
+/* Huffman code, already bit reversed */
+typedef struct _deflate_code {
+        uint16_t lit_code[DEFLATE_LITLEN_CODES];
+        uint8_t lit_bits[DEFLATE_LITLEN_CODES];
+        uint16_t dist_code[DEFLATE_DIST_CODES];
+        uint8_t dist_bits[DEFLATE_DIST_CODES];
+} _deflate_code;
+
+typedef struct _deflate_state {
+        _deflate_writer w;
+        const _deflate_params *params;
+
+        const unsigned char *data;
+        size_t end;
+
+        /* Hash chains, positions are stored off by one so 0 means empty.
+         * Every position below inserted is in them. Optimal parse keeps
+         * binary trees instead, two children per position. */
+        uint32_t *head;
+        uint32_t *prev;
+        uint32_t *child;
+        size_t inserted;
+
+        /* Symbols of the block being gathered, it starts at block_start */
+        _deflate_symbol *symbols;
+        size_t symbol_count;
+        size_t block_start;
+        uint32_t lit_freq[DEFLATE_LITLEN_CODES];
+        uint32_t dist_freq[DEFLATE_DIST_CODES];
+
+        uint16_t len_symbol[DEFLATE_MAX_MATCH + 1];
+        uint8_t len_extra[DEFLATE_MAX_MATCH + 1];
+
+        /* Optimal parse: cheapest cost in bits to reach every byte of the
+         * block, last step getting there and matches found at each byte */
+        uint32_t *cost;
+        _deflate_symbol *step;
+        _deflate_symbol *matches;
+        uint8_t *match_count;
+
+        /* Smallest parse of the block so far when running several passes */
+        _deflate_symbol *best;
+        size_t best_count;
+        uint32_t best_lit_freq[DEFLATE_LITLEN_CODES];
+        uint32_t best_dist_freq[DEFLATE_DIST_CODES];
+
+        /* Prices of symbols for the optimal parse */
+        uint16_t price_lit[DEFLATE_LITLEN_CODES];
+        uint16_t price_dist[DEFLATE_DIST_CODES];
+} _deflate_state;
+
+DEFLATE_STATIC void _deflate_bits ( _deflate_writer *w, uint32_t value, int count ) {
+        w->bits |= (uint64_t) value << w->count;
+        w->count += count;
+
+        while ( w->count >= 8 ) {
+                w->out[w->len++] = (unsigned char) w->bits;
+                w->bits >>= 8;
+                w->count -= 8;
+        }
+}
+
+/* Pad to byte boundary */
+DEFLATE_STATIC void _deflate_align ( _deflate_writer *w ) {
+        if ( w->count > 0 ) {
+                _deflate_bits( w, 0, 8 - w->count );
+        }
+}
+
+DEFLATE_STATIC uint32_t _deflate_reverse ( uint32_t code, int count ) {
+        uint32_t res = 0;
+        while ( count-- ) {
+                res = ( res << 1 ) | ( code & 1 );
+                code >>= 1;
+        }
+        return res;
+}
+
+DEFLATE_STATIC int _deflate_log2 ( uint32_t v ) {
+        return 31 - __builtin_clz( v );
+}
+
+/* Length symbol, 257..285, and its extra bits */
+DEFLATE_STATIC int _deflate_length_symbol ( int length, int *extra_bits ) {
+        int l = length - DEFLATE_MIN_MATCH;
+        if ( l < 8 || l == 255 ) {
+                *extra_bits = 0;
+                return l < 8 ? 257 + l : 285;
+        }
+
+        int bits = _deflate_log2( l );
+        *extra_bits = bits - 2;
+        return 257 + 4 * ( bits - 1 ) + ( ( l >> ( bits - 2 ) ) & 3 );
+}
+
+/* Distance symbol, 0..29, and its extra bits */
+static inline int _deflate_dist_symbol ( int distance, int *extra_bits ) {
+        int d = distance - 1;
+        if ( d < 4 ) {
+                *extra_bits = 0;
+                return d;
+        }
+
+        int bits = _deflate_log2( d );
+        *extra_bits = bits - 1;
+        return 2 * bits + ( ( d >> ( bits - 1 ) ) & 1 );
+}
+
+/* Length limited Huffman code lengths, unused symbols get zero. There are
+ * always at least two codes so every decoder takes the result. */
+DEFLATE_STATIC void _deflate_huffman ( const uint32_t *freq, int n, int max_bits, uint8_t *bits ) {
+        uint16_t order[DEFLATE_LITLEN_CODES];
+        uint32_t weight[2 * DEFLATE_LITLEN_CODES];
+        uint16_t parent[2 * DEFLATE_LITLEN_CODES];
+        int count[DEFLATE_MAX_BITS + 1] = { 0 };
+        int used = 0;
+
+        memset( bits, 0, n );
+
+        /* Used symbols by ascending frequency, ties by symbol */
+        for ( int i = 0; i < n; ++i ) {
+                if ( freq[i] == 0 ) {
+                        continue;
+                }
+
+                int j = used++;
+                while ( j > 0 && freq[order[j - 1]] > freq[i] ) {
+                        order[j] = order[j - 1];
+                        --j;
+                }
+                order[j] = (uint16_t) i;
+        }
+
+        if ( used < 2 ) {
+                int only = used == 1 ? order[0] : 0;
+                bits[only] = 1;
+                bits[only == 0 ? 1 : 0] = 1;
+                return;
+        }
+
+        /* Two queues, leaves come sorted and new nodes never get lighter */
+        int leaf = 0;
+        int node = used;
+        int next = used;
+        for ( int i = 0; i < used; ++i ) {
+                weight[i] = freq[order[i]];
+        }
+
+        while ( next < 2 * used - 1 ) {
+                int pick[2];
+                for ( int k = 0; k < 2; ++k ) {
+                        if ( leaf < used && ( node == next || weight[leaf] <= weight[node] ) ) {
+                                pick[k] = leaf++;
+                        } else {
+                                pick[k] = node++;
+                        }
+                }
+
+                weight[next] = weight[pick[0]] + weight[pick[1]];
+                parent[pick[0]] = parent[pick[1]] = (uint16_t) next;
+                ++next;
+        }
+
+        /* Depths reuse weights, root is last and parents come after children */
+        weight[next - 1] = 0;
+        for ( int i = next - 2; i >= 0; --i ) {
+                weight[i] = weight[parent[i]] + 1;
+                if ( i < used ) {
+                        count[weight[i] < (uint32_t) max_bits ? weight[i] : (uint32_t) max_bits] += 1;
+                }
+        }
+
+        /* Clamping overfills the code, move leaves down until it fits */
+        uint32_t total = 0;
+        for ( int b = 1; b <= max_bits; ++b ) {
+                total += (uint32_t) count[b] << ( max_bits - b );
+        }
+
+        while ( total > 1u << max_bits ) {
+                count[max_bits] -= 1;
+                for ( int b = max_bits - 1; b > 0; --b ) {
+                        if ( count[b] > 0 ) {
+                                count[b] -= 1;
+                                count[b + 1] += 2;
+                                break;
+                        }
+                }
+                total -= 1;
+        }
+
+        /* Rarest symbols get the longest codes */
+        int i = 0;
+        for ( int b = max_bits; b > 0; --b ) {
+                for ( int k = 0; k < count[b]; ++k ) {
+                        bits[order[i++]] = (uint8_t) b;
+                }
+        }
+}
+
+/* Canonical codes for code lengths */
+DEFLATE_STATIC void _deflate_canonical ( const uint8_t *bits, int n, uint16_t *code ) {
+        int count[DEFLATE_MAX_BITS + 1] = { 0 };
+        uint32_t next[DEFLATE_MAX_BITS + 1];
+
+        for ( int i = 0; i < n; ++i ) {
+                count[bits[i]] += 1;
+        }
+        count[0] = 0;
+
+        uint32_t c = 0;
+        for ( int b = 1; b <= DEFLATE_MAX_BITS; ++b ) {
+                c = ( c + count[b - 1] ) << 1;
+                next[b] = c;
+        }
+
+        for ( int i = 0; i < n; ++i ) {
+                code[i] = bits[i] ? (uint16_t) _deflate_reverse( next[bits[i]]++, bits[i] ) : 0;
+        }
+}
+
+DEFLATE_STATIC void _deflate_fixed_bits ( uint8_t *lit_bits, uint8_t *dist_bits ) {
+        for ( int i = 0; i < DEFLATE_LITLEN_CODES; ++i ) {
+                lit_bits[i] = i <= 143 ? 8 : i <= 255 ? 9 : i <= 279 ? 7 : 8;
+        }
+        memset( dist_bits, 5, DEFLATE_DIST_CODES );
+}
+
+/* Bits taken by symbols of given frequencies with given code lengths */
+DEFLATE_STATIC uint64_t _deflate_data_bits ( const uint32_t *lit_freq, const uint32_t *dist_freq,
+                                             const uint8_t *lit_bits, const uint8_t *dist_bits ) {
+        uint64_t total = 0;
+
+        for ( int i = 0; i < DEFLATE_LITLEN_CODES; ++i ) {
+                int extra = i >= 265 && i < 285 ? ( i - 261 ) / 4 : 0;
+                total += (uint64_t) lit_freq[i] * ( lit_bits[i] + extra );
+        }
+        for ( int i = 0; i < DEFLATE_DIST_CODES; ++i ) {
+                int extra = i >= 4 ? i / 2 - 1 : 0;
+                total += (uint64_t) dist_freq[i] * ( dist_bits[i] + extra );
+        }
+
+        return total;
+}
+
+/* Stored blocks of up to 64 KB, each starts on a byte boundary */
+DEFLATE_STATIC void _deflate_stored ( _deflate_writer *w, const unsigned char *data, size_t len, bool final ) {
+        do {
+                size_t block = len > DEFLATE_MAX_STORED ? DEFLATE_MAX_STORED : len;
+                bool last = block == len;
+
+                _deflate_bits( w, final && last, 1 ); /* BFINAL */
+                _deflate_bits( w, 0, 2 );             /* BTYPE = 0 -- stored */
+                _deflate_align( w );
+                _deflate_bits( w, (uint32_t) block, 16 );
+                _deflate_bits( w, (uint32_t) ~block & 0xffff, 16 );
+
+                memcpy( w->out + w->len, data, block );
+                w->len += block;
+                data += block;
+                len -= block;
+        } while ( len > 0 );
+}
+
+/* Bits _deflate_stored would take from the current bit position */
+DEFLATE_STATIC uint64_t _deflate_stored_bits ( const _deflate_writer *w, size_t len ) {
+        size_t blocks = len / DEFLATE_MAX_STORED + ( len % DEFLATE_MAX_STORED != 0 || len == 0 );
+        uint64_t first = 3 + ( 8 - ( w->count + 3 ) % 8 ) % 8;
+        return first + ( blocks - 1 ) * 8 + blocks * 32 + (uint64_t) len * 8;
+}
+
+DEFLATE_STATIC void _deflate_write_symbols ( _deflate_state *s, const _deflate_code *code ) {
+        _deflate_writer *w = &s->w;
+
+        for ( size_t i = 0; i < s->symbol_count; ++i ) {
+                _deflate_symbol sym = s->symbols[i];
+                if ( sym.dist == 0 ) {
+                        _deflate_bits( w, code->lit_code[sym.length], code->lit_bits[sym.length] );
+                        continue;
+                }
+
+                int ls = s->len_symbol[sym.length];
+                int le = s->len_extra[sym.length];
+                _deflate_bits( w, code->lit_code[ls], code->lit_bits[ls] );
+                _deflate_bits( w, ( sym.length - DEFLATE_MIN_MATCH ) & ( ( 1 << le ) - 1 ), le );
+
+                int de;
+                int ds = _deflate_dist_symbol( sym.dist, &de );
+                _deflate_bits( w, code->dist_code[ds], code->dist_bits[ds] );
+                _deflate_bits( w, ( sym.dist - 1 ) & ( ( 1 << de ) - 1 ), de );
+        }
+
+        _deflate_bits( w, code->lit_code[256], code->lit_bits[256] ); /* End of block */
+}
+
+/* Header of a dynamic block, both sets of code lengths run length coded
+ * as one sequence and the code lengths of that */
+typedef struct _deflate_header {
+        int hlit;
+        int hdist;
+        int hclen;
+        _deflate_symbol rle[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+        int rle_count;
+        uint8_t cl_bits[DEFLATE_CODELEN_CODES];
+        uint16_t cl_code[DEFLATE_CODELEN_CODES];
+} _deflate_header;
+
+static const uint8_t _deflate_cl_extra[DEFLATE_CODELEN_CODES] = { [16] = 2, [17] = 3, [18] = 7 };
+
+/* Header for the code, returns its size in bits with the block type */
+DEFLATE_STATIC uint64_t _deflate_header_build ( _deflate_header *h, const _deflate_code *code ) {
+        h->hlit = DEFLATE_LITLEN_CODES;
+        while ( code->lit_bits[h->hlit - 1] == 0 ) {
+                --h->hlit;
+        }
+        h->hdist = DEFLATE_DIST_CODES;
+        while ( code->dist_bits[h->hdist - 1] == 0 ) {
+                --h->hdist;
+        }
+
+        uint8_t lengths[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+        memcpy( lengths, code->lit_bits, h->hlit );
+        memcpy( lengths + h->hlit, code->dist_bits, h->hdist );
+
+        _deflate_symbol *rle = h->rle;
+        uint32_t cl_freq[DEFLATE_CODELEN_CODES] = { 0 };
+        int rle_count = 0;
+        int total = h->hlit + h->hdist;
+
+        for ( int i = 0; i < total; ) {
+                int l = lengths[i];
+                int run = 1;
+                while ( i + run < total && lengths[i + run] == l ) {
+                        ++run;
+                }
+                i += run;
+
+                if ( l != 0 ) {
+                        rle[rle_count++] = (_deflate_symbol) { (uint16_t) l, 0 };
+                        run -= 1;
+                        for ( ; run >= 3; run -= run < 6 ? run : 6 ) {
+                                rle[rle_count++] = (_deflate_symbol) { 16, (uint16_t) ( ( run < 6 ? run : 6 ) - 3 ) };
+                        }
+                } else {
+                        for ( ; run >= 11; run -= run < 138 ? run : 138 ) {
+                                rle[rle_count++] = (_deflate_symbol) { 18, (uint16_t) ( ( run < 138 ? run : 138 ) - 11 ) };
+                        }
+                        if ( run >= 3 ) {
+                                rle[rle_count++] = (_deflate_symbol) { 17, (uint16_t) ( run - 3 ) };
+                                run = 0;
+                        }
+                }
+
+                while ( run-- > 0 ) {
+                        rle[rle_count++] = (_deflate_symbol) { (uint16_t) l, 0 };
+                }
+        }
+        h->rle_count = rle_count;
+
+        for ( int i = 0; i < rle_count; ++i ) {
+                cl_freq[rle[i].length] += 1;
+        }
+
+        _deflate_huffman( cl_freq, DEFLATE_CODELEN_CODES, DEFLATE_MAX_CODELEN_BITS, h->cl_bits );
+        _deflate_canonical( h->cl_bits, DEFLATE_CODELEN_CODES, h->cl_code );
+
+        h->hclen = DEFLATE_CODELEN_CODES;
+        while ( h->hclen > 4 && h->cl_bits[_deflate_codelen_order[h->hclen - 1]] == 0 ) {
+                --h->hclen;
+        }
+
+        uint64_t bits = 3 + 5 + 5 + 4 + 3 * h->hclen;
+        for ( int i = 0; i < rle_count; ++i ) {
+                bits += h->cl_bits[rle[i].length] + _deflate_cl_extra[rle[i].length];
+        }
+
+        return bits;
+}
+
+/* Write gathered symbols covering bytes up to block_end as whichever of
+ * dynamic, fixed or stored block comes out smallest */
+DEFLATE_STATIC void _deflate_flush_block ( _deflate_state *s, size_t block_end, bool final ) {
+        _deflate_writer *w = &s->w;
+        _deflate_code dynamic;
+        _deflate_code fixed;
+        _deflate_header header;
+
+        s->lit_freq[256] += 1;
+
+        _deflate_huffman( s->lit_freq, DEFLATE_LITLEN_CODES, DEFLATE_MAX_BITS, dynamic.lit_bits );
+        _deflate_huffman( s->dist_freq, DEFLATE_DIST_CODES, DEFLATE_MAX_BITS, dynamic.dist_bits );
+
+        uint64_t dynamic_bits = _deflate_header_build( &header, &dynamic );
+        dynamic_bits += _deflate_data_bits( s->lit_freq, s->dist_freq, dynamic.lit_bits, dynamic.dist_bits );
+
+        _deflate_fixed_bits( fixed.lit_bits, fixed.dist_bits );
+        uint64_t fixed_bits = 3 + _deflate_data_bits( s->lit_freq, s->dist_freq, fixed.lit_bits, fixed.dist_bits );
+
+        uint64_t stored_bits = _deflate_stored_bits( w, block_end - s->block_start );
+
+        if ( stored_bits <= dynamic_bits && stored_bits <= fixed_bits ) {
+                _deflate_stored( w, s->data + s->block_start, block_end - s->block_start, final );
+        } else if ( fixed_bits <= dynamic_bits ) {
+                _deflate_bits( w, final, 1 ); /* BFINAL */
+                _deflate_bits( w, 1, 2 );     /* BTYPE = 1 -- fixed huffman */
+                _deflate_canonical( fixed.lit_bits, DEFLATE_LITLEN_CODES, fixed.lit_code );
+                _deflate_canonical( fixed.dist_bits, DEFLATE_DIST_CODES, fixed.dist_code );
+                _deflate_write_symbols( s, &fixed );
+        } else {
+                _deflate_bits( w, final, 1 ); /* BFINAL */
+                _deflate_bits( w, 2, 2 );     /* BTYPE = 2 -- dynamic huffman */
+                _deflate_bits( w, header.hlit - 257, 5 );
+                _deflate_bits( w, header.hdist - 1, 5 );
+                _deflate_bits( w, header.hclen - 4, 4 );
+                for ( int i = 0; i < header.hclen; ++i ) {
+                        _deflate_bits( w, header.cl_bits[_deflate_codelen_order[i]], 3 );
+                }
+                for ( int i = 0; i < header.rle_count; ++i ) {
+                        const _deflate_symbol *r = header.rle + i;
+                        _deflate_bits( w, header.cl_code[r->length], header.cl_bits[r->length] );
+                        _deflate_bits( w, r->dist, _deflate_cl_extra[r->length] );
+                }
+
+                _deflate_canonical( dynamic.lit_bits, DEFLATE_LITLEN_CODES, dynamic.lit_code );
+                _deflate_canonical( dynamic.dist_bits, DEFLATE_DIST_CODES, dynamic.dist_code );
+                _deflate_write_symbols( s, &dynamic );
+        }
+
+        s->symbol_count = 0;
+        s->block_start = block_end;
+        memset( s->lit_freq, 0, sizeof( s->lit_freq ) );
+        memset( s->dist_freq, 0, sizeof( s->dist_freq ) );
+}
+
+static inline void _deflate_literal ( _deflate_state *s, int byte ) {
+        s->symbols[s->symbol_count++] = (_deflate_symbol) { (uint16_t) byte, 0 };
+        s->lit_freq[byte] += 1;
+}
+
+static inline void _deflate_match ( _deflate_state *s, int length, int distance ) {
+        int extra;
+        s->symbols[s->symbol_count++] = (_deflate_symbol) { (uint16_t) length, (uint16_t) distance };
+        s->lit_freq[s->len_symbol[length]] += 1;
+        s->dist_freq[_deflate_dist_symbol( distance, &extra )] += 1;
+}
+
+static inline uint32_t _deflate_hash ( const unsigned char *p ) {
+        uint32_t v = p[0] | ( p[1] << 8 ) | ( p[2] << 16 );
+        return ( v * 2654435761u ) >> ( 32 - DEFLATE_HASH_BITS );
+}
+
+/* Put every position below pos into the hash chains */
+static inline void _deflate_insert ( _deflate_state *s, size_t pos ) {
+        size_t last = s->end >= DEFLATE_MIN_MATCH ? s->end - DEFLATE_MIN_MATCH + 1 : 0;
+        if ( pos > last ) {
+                pos = last;
+        }
+
+        for ( ; s->inserted < pos; ++s->inserted ) {
+                uint32_t h = _deflate_hash( s->data + s->inserted );
+                s->prev[s->inserted & ( DEFLATE_WINDOW - 1 )] = s->head[h];
+                s->head[h] = (uint32_t) s->inserted + 1;
+        }
+}
+
+/* Length of common prefix, at most limit */
+static inline int _deflate_match_len ( const unsigned char *a, const unsigned char *b, int limit ) {
+        int i = 0;
+
+        while ( i + 8 <= limit ) {
+                uint64_t x, y;
+                memcpy( &x, a + i, 8 );
+                memcpy( &y, b + i, 8 );
+                if ( x != y ) {
+                        return i + ( __builtin_ctzll( x ^ y ) >> 3 );
+                }
+                i += 8;
+        }
+
+        while ( i < limit && a[i] == b[i] ) {
+                ++i;
+        }
+
+        return i;
+}
+
+/* Longest match at pos beating best_len, zero when there's none. Matches
+ * found along the way go to found when given, shortest first. pos is in
+ * the hash chains afterwards. */
+DEFLATE_STATIC int _deflate_search ( _deflate_state *s, size_t pos, int best_len, int chain, int limit,
+                                     size_t *best_dist, _deflate_symbol *found, int *found_count ) {
+        _deflate_insert( s, pos );
+        if ( pos + DEFLATE_MIN_MATCH > s->end || best_len >= limit ) {
+                _deflate_insert( s, pos + 1 );
+                return 0;
+        }
+
+        const unsigned char *data = s->data;
+        int nice = s->params->nice < limit ? s->params->nice : limit;
+        uint32_t candidate = s->head[_deflate_hash( data + pos )];
+        int result = 0;
+
+        while ( candidate != 0 && chain-- > 0 ) {
+                size_t cand = candidate - 1;
+                size_t dist = pos - cand;
+                if ( dist >= DEFLATE_WINDOW ) {
+                        break;
+                }
+
+                if ( data[cand + best_len] == data[pos + best_len] ) {
+                        int match = _deflate_match_len( data + cand, data + pos, limit );
+                        if ( match > best_len ) {
+                                best_len = match;
+                                *best_dist = dist;
+                                result = match;
+                                if ( found != NULL && match >= DEFLATE_MIN_MATCH ) {
+                                        found[( *found_count )++] = (_deflate_symbol) { (uint16_t) match, (uint16_t) dist };
+                                }
+                                if ( match >= nice ) {
+                                        break;
+                                }
+                        }
+                }
+
+                candidate = s->prev[cand & ( DEFLATE_WINDOW - 1 )];
+        }
+
+        _deflate_insert( s, pos + 1 );
+
+        if ( result == DEFLATE_MIN_MATCH && *best_dist > DEFLATE_TOO_FAR ) {
+                return 0;
+        }
+
+        return result;
+}
+
+static inline int _deflate_limit ( const _deflate_state *s, size_t pos ) {
+        return s->end - pos > DEFLATE_MAX_MATCH ? DEFLATE_MAX_MATCH : (int) ( s->end - pos );
+}
+
+/* Binary trees of earlier positions ordered by the bytes following them,
+ * one per hash bucket, as in LZMA. Walking down from the root meets ever
+ * longer matches, pos becomes the new root and the walk splits the rest
+ * to either side of it. Matches go to found when given, shortest first. */
+DEFLATE_STATIC int _deflate_tree ( _deflate_state *s, size_t pos, _deflate_symbol *found ) {
+        const unsigned char *in = s->data + pos;
+        int limit = _deflate_limit( s, pos );
+        if ( limit < DEFLATE_MIN_MATCH ) {
+                return 0;
+        }
+
+        uint32_t h = _deflate_hash( in );
+        uint32_t cur = s->head[h];
+        s->head[h] = (uint32_t) pos + 1;
+
+        uint32_t *lt = s->child + 2 * ( pos & ( DEFLATE_WINDOW - 1 ) );
+        uint32_t *gt = lt + 1;
+        int nice = s->params->nice < limit ? s->params->nice : limit;
+        int depth = s->params->chain;
+        int lt_len = 0;
+        int gt_len = 0;
+        int len = 0;
+        int best = 0;
+        int count = 0;
+
+        while ( cur != 0 && pos - ( cur - 1 ) < DEFLATE_WINDOW && depth-- > 0 ) {
+                size_t cand = cur - 1;
+                const unsigned char *match = s->data + cand;
+                uint32_t *node = s->child + 2 * ( cand & ( DEFLATE_WINDOW - 1 ) );
+
+                /* Both neighbours share len bytes with pos, so does this one */
+                if ( match[len] == in[len] ) {
+                        len += _deflate_match_len( match + len, in + len, limit - len );
+                        if ( len > best ) {
+                                best = len;
+                                if ( found != NULL && len >= DEFLATE_MIN_MATCH ) {
+                                        found[count++] = (_deflate_symbol) { (uint16_t) len, (uint16_t) ( pos - cand ) };
+                                }
+                                if ( len >= nice ) {
+                                        /* Taken as equal, pos replaces it */
+                                        *lt = node[0];
+                                        *gt = node[1];
+                                        return count;
+                                }
+                        }
+                }
+
+                if ( match[len] < in[len] ) {
+                        *lt = cur;
+                        lt = node + 1;
+                        cur = *lt;
+                        lt_len = len;
+                } else {
+                        *gt = cur;
+                        gt = node;
+                        cur = *gt;
+                        gt_len = len;
+                }
+                len = lt_len < gt_len ? lt_len : gt_len;
+        }
+
+        *lt = 0;
+        *gt = 0;
+        return count;
+}
+
+DEFLATE_STATIC void _deflate_greedy ( _deflate_state *s, size_t pos, bool final ) {
+        const _deflate_params *p = s->params;
+
+        while ( pos < s->end ) {
+                size_t dist = 0;
+                int len = _deflate_search( s, pos, 0, p->chain, _deflate_limit( s, pos ), &dist, NULL, NULL );
+
+                if ( len >= DEFLATE_MIN_MATCH ) {
+                        _deflate_match( s, len, (int) dist );
+                        /* Bytes of long matches are left out of the hash */
+                        if ( len > p->lazy ) {
+                                s->inserted = pos + len;
+                        }
+                        pos += len;
+                } else {
+                        _deflate_literal( s, s->data[pos] );
+                        pos += 1;
+                }
+
+                if ( s->symbol_count >= DEFLATE_BLOCK_SYMBOLS ) {
+                        _deflate_flush_block( s, pos, final && pos == s->end );
+                }
+        }
+}
+
+DEFLATE_STATIC void _deflate_rle ( _deflate_state *s, size_t pos, bool final ) {
+        while ( pos < s->end ) {
+                const unsigned char *in = s->data + pos;
+                int len = 0;
+                if ( pos > 0 && in[0] == in[-1] ) {
+                        len = _deflate_match_len( in - 1, in, _deflate_limit( s, pos ) );
+                }
+
+                if ( len >= DEFLATE_MIN_MATCH ) {
+                        _deflate_match( s, len, 1 );
+                        pos += len;
+                } else {
+                        _deflate_literal( s, in[0] );
+                        pos += 1;
+                }
+
+                if ( s->symbol_count >= DEFLATE_BLOCK_SYMBOLS ) {
+                        _deflate_flush_block( s, pos, final && pos == s->end );
+                }
+        }
+}
+
+DEFLATE_STATIC void _deflate_lazy ( _deflate_state *s, size_t pos, bool final ) {
+        const _deflate_params *p = s->params;
+        int len = -1;
+        size_t dist = 0;
+
+        while ( pos < s->end ) {
+                if ( len < 0 ) {
+                        len = _deflate_search( s, pos, 0, p->chain, _deflate_limit( s, pos ), &dist, NULL, NULL );
+                }
+
+                if ( len < DEFLATE_MIN_MATCH ) {
+                        _deflate_literal( s, s->data[pos] );
+                        pos += 1;
+                        len = -1;
+                } else {
+                        /* Next byte may start a longer match, then this one becomes a literal */
+                        if ( len < p->lazy && pos + 1 < s->end ) {
+                                size_t next_dist = 0;
+                                int chain = len >= p->good ? p->chain >> 2 : p->chain;
+                                int next = _deflate_search( s, pos + 1, len, chain, _deflate_limit( s, pos + 1 ),
+                                                            &next_dist, NULL, NULL );
+                                if ( next > len ) {
+                                        _deflate_literal( s, s->data[pos] );
+                                        pos += 1;
+                                        len = next;
+                                        dist = next_dist;
+                                        continue;
+                                }
+                        }
+
+                        _deflate_match( s, len, (int) dist );
+                        pos += len;
+                        len = -1;
+                }
+
+                if ( s->symbol_count >= DEFLATE_BLOCK_SYMBOLS && len < 0 ) {
+                        _deflate_flush_block( s, pos, final && pos == s->end );
+                }
+        }
+}
+
+/* Entropy of every symbol in 1/16 bits, as Zopfli prices them */
+DEFLATE_STATIC void _deflate_entropy ( const uint32_t *freq, int n, uint16_t *price ) {
+        /* Unseen symbols get a price too, just a high one */
+        double total = 0;
+        for ( int i = 0; i < n; ++i ) {
+                total += freq[i] * 2 + 1;
+        }
+
+        for ( int i = 0; i < n; ++i ) {
+                price[i] = (uint16_t) ( log2( total / ( freq[i] * 2 + 1 ) ) * ( 1 << DEFLATE_PRICE_SHIFT ) + 0.5 );
+        }
+}
+
+/* Prices of every length and literal from fixed code lengths or frequencies */
+DEFLATE_STATIC void _deflate_prices ( _deflate_state *s, const uint32_t *lit_freq, const uint32_t *dist_freq ) {
+        if ( lit_freq == NULL ) {
+                uint8_t lit_bits[DEFLATE_LITLEN_CODES];
+                uint8_t dist_bits[DEFLATE_DIST_CODES];
+                _deflate_fixed_bits( lit_bits, dist_bits );
+                for ( int i = 0; i < DEFLATE_LITLEN_CODES; ++i ) {
+                        s->price_lit[i] = (uint16_t) ( lit_bits[i] << DEFLATE_PRICE_SHIFT );
+                }
+                for ( int i = 0; i < DEFLATE_DIST_CODES; ++i ) {
+                        s->price_dist[i] = (uint16_t) ( dist_bits[i] << DEFLATE_PRICE_SHIFT );
+                }
+                return;
+        }
+
+        _deflate_entropy( lit_freq, DEFLATE_LITLEN_USED, s->price_lit );
+        _deflate_entropy( dist_freq, DEFLATE_DIST_CODES, s->price_dist );
+}
+
+/* Cheapest parse of the block of n bytes with current prices, as symbols */
+DEFLATE_STATIC void _deflate_optimal_pass ( _deflate_state *s, size_t n ) {
+        const unsigned char *data = s->data + s->block_start;
+        uint32_t *cost = s->cost;
+        _deflate_symbol *step = s->step;
+        int nice = s->params->nice;
+
+        uint32_t len_price[DEFLATE_MAX_MATCH + 1];
+        for ( int l = DEFLATE_MIN_MATCH; l <= DEFLATE_MAX_MATCH; ++l ) {
+                len_price[l] = s->price_lit[s->len_symbol[l]] + ( s->len_extra[l] << DEFLATE_PRICE_SHIFT );
+        }
+
+        cost[0] = 0;
+        for ( size_t i = 1; i <= n; ++i ) {
+                cost[i] = UINT32_MAX;
+        }
+
+        for ( size_t i = 0; i < n; ++i ) {
+                uint32_t here = cost[i];
+
+                uint32_t lit = here + s->price_lit[data[i]];
+                if ( lit < cost[i + 1] ) {
+                        cost[i + 1] = lit;
+                        step[i + 1] = (_deflate_symbol) { 1, 0 };
+                }
+
+                const _deflate_symbol *m = s->matches + i * DEFLATE_OPT_MATCHES;
+                int shortest = DEFLATE_MIN_MATCH;
+                for ( int k = 0; k < s->match_count[i]; ++k ) {
+                        int extra;
+                        int ds = _deflate_dist_symbol( m[k].dist, &extra );
+                        uint32_t base = here + s->price_dist[ds] + ( extra << DEFLATE_PRICE_SHIFT );
+
+                        /* Long matches are taken whole, shorter ones at any length */
+                        int from = m[k].length >= nice ? m[k].length : shortest;
+                        for ( int l = from; l <= m[k].length; ++l ) {
+                                uint32_t c = base + len_price[l];
+                                if ( c < cost[i + l] ) {
+                                        cost[i + l] = c;
+                                        step[i + l] = (_deflate_symbol) { (uint16_t) l, m[k].dist };
+                                }
+                        }
+                        shortest = m[k].length + 1;
+                }
+        }
+
+        /* Walk back from the end, steps land reversed at the tail of symbols */
+        size_t count = 0;
+        for ( size_t i = n; i > 0; i -= step[i].length ) {
+                s->symbols[n - 1 - count++] = step[i];
+        }
+
+        s->symbol_count = 0;
+        memset( s->lit_freq, 0, sizeof( s->lit_freq ) );
+        memset( s->dist_freq, 0, sizeof( s->dist_freq ) );
+
+        size_t pos = 0;
+        for ( size_t k = n - count; k < n; ++k ) {
+                _deflate_symbol sym = s->symbols[k];
+                if ( sym.dist == 0 ) {
+                        _deflate_literal( s, data[pos] );
+                } else {
+                        _deflate_match( s, sym.length, sym.dist );
+                }
+                pos += sym.length;
+        }
+}
+
+/* Frequencies of symbols from up to to, end of block included */
+DEFLATE_STATIC void _deflate_count ( const _deflate_state *s, size_t from, size_t to, uint32_t *lit_freq,
+                                     uint32_t *dist_freq ) {
+        memset( lit_freq, 0, sizeof( uint32_t ) * DEFLATE_LITLEN_CODES );
+        memset( dist_freq, 0, sizeof( uint32_t ) * DEFLATE_DIST_CODES );
+        lit_freq[256] = 1;
+
+        for ( size_t i = from; i < to; ++i ) {
+                _deflate_symbol sym = s->symbols[i];
+                if ( sym.dist == 0 ) {
+                        lit_freq[sym.length] += 1;
+                } else {
+                        int extra;
+                        lit_freq[s->len_symbol[sym.length]] += 1;
+                        dist_freq[_deflate_dist_symbol( sym.dist, &extra )] += 1;
+                }
+        }
+}
+
+/* Size of symbols from up to to as a dynamic block of their own */
+DEFLATE_STATIC uint64_t _deflate_block_bits ( const _deflate_state *s, size_t from, size_t to ) {
+        uint32_t lit_freq[DEFLATE_LITLEN_CODES];
+        uint32_t dist_freq[DEFLATE_DIST_CODES];
+        _deflate_code code;
+        _deflate_header header;
+
+        _deflate_count( s, from, to, lit_freq, dist_freq );
+        _deflate_huffman( lit_freq, DEFLATE_LITLEN_CODES, DEFLATE_MAX_BITS, code.lit_bits );
+        _deflate_huffman( dist_freq, DEFLATE_DIST_CODES, DEFLATE_MAX_BITS, code.dist_bits );
+
+        return _deflate_header_build( &header, &code ) +
+               _deflate_data_bits( lit_freq, dist_freq, code.lit_bits, code.dist_bits );
+}
+
+/* Split points of symbols from up to to where two blocks come out smaller
+ * than one, tried at evenly spaced symbols and again inside both halves */
+DEFLATE_STATIC void _deflate_split ( const _deflate_state *s, size_t from, size_t to, uint64_t bits, int depth,
+                                     size_t *splits, int *count ) {
+        if ( depth == 0 || to - from < 2 * DEFLATE_SPLIT_MIN ) {
+                return;
+        }
+
+        size_t at = 0;
+        uint64_t left = 0;
+        uint64_t right = 0;
+        for ( int k = 1; k < DEFLATE_SPLIT_TRIES; ++k ) {
+                size_t mid = from + ( to - from ) * k / DEFLATE_SPLIT_TRIES;
+                uint64_t a = _deflate_block_bits( s, from, mid );
+                uint64_t b = _deflate_block_bits( s, mid, to );
+                if ( a + b < bits ) {
+                        bits = a + b;
+                        at = mid;
+                        left = a;
+                        right = b;
+                }
+        }
+
+        if ( at == 0 ) {
+                return;
+        }
+
+        _deflate_split( s, from, at, left, depth - 1, splits, count );
+        splits[( *count )++] = at;
+        _deflate_split( s, at, to, right, depth - 1, splits, count );
+}
+
+DEFLATE_STATIC void _deflate_keep_best ( _deflate_state *s, bool restore ) {
+        if ( restore ) {
+                memcpy( s->symbols, s->best, s->best_count * sizeof( _deflate_symbol ) );
+                memcpy( s->lit_freq, s->best_lit_freq, sizeof( s->lit_freq ) );
+                memcpy( s->dist_freq, s->best_dist_freq, sizeof( s->dist_freq ) );
+                s->symbol_count = s->best_count;
+        } else {
+                memcpy( s->best, s->symbols, s->symbol_count * sizeof( _deflate_symbol ) );
+                memcpy( s->best_lit_freq, s->lit_freq, sizeof( s->lit_freq ) );
+                memcpy( s->best_dist_freq, s->dist_freq, sizeof( s->dist_freq ) );
+                s->best_count = s->symbol_count;
+        }
+}
+
+DEFLATE_STATIC void _deflate_optimal ( _deflate_state *s, size_t pos, bool final ) {
+        const _deflate_params *p = s->params;
+        bool priced = false;
+
+        while ( pos < s->end ) {
+                size_t n = s->end - pos < DEFLATE_OPT_BLOCK ? s->end - pos : DEFLATE_OPT_BLOCK;
+
+                /* Matches of every byte, bytes inside long ones only go in the trees */
+                size_t skip_to = pos;
+                for ( size_t i = 0; i < n; ++i ) {
+                        _deflate_symbol found[DEFLATE_MAX_MATCH];
+                        s->match_count[i] = 0;
+
+                        if ( pos + i < skip_to ) {
+                                _deflate_tree( s, pos + i, NULL );
+                                continue;
+                        }
+
+                        int count = _deflate_tree( s, pos + i, found );
+                        if ( count == 0 ) {
+                                continue;
+                        }
+                        if ( found[count - 1].length >= p->nice ) {
+                                skip_to = pos + i + found[count - 1].length;
+                        }
+
+                        /* Keep the longest ones, shorter lengths reuse their distances.
+                         * Nothing reaches past the block. */
+                        int keep = count < DEFLATE_OPT_MATCHES ? count : DEFLATE_OPT_MATCHES;
+                        _deflate_symbol *m = s->matches + i * DEFLATE_OPT_MATCHES;
+                        for ( int k = 0; k < keep; ++k ) {
+                                m[k] = found[count - keep + k];
+                                if ( m[k].length > n - i ) {
+                                        m[k].length = (uint16_t) ( n - i );
+                                }
+                        }
+                        s->match_count[i] = (uint8_t) keep;
+                }
+
+                /* First block is priced by fixed codes, later ones by the block before */
+                if ( !priced ) {
+                        _deflate_prices( s, NULL, NULL );
+                        priced = true;
+                }
+
+                uint64_t best_bits = UINT64_MAX;
+                for ( int pass = 0; pass < p->passes; ++pass ) {
+                        if ( pass > 0 ) {
+                                _deflate_prices( s, s->lit_freq, s->dist_freq );
+                        }
+                        _deflate_optimal_pass( s, n );
+
+                        if ( p->passes > 1 ) {
+                                uint64_t bits = _deflate_block_bits( s, 0, s->symbol_count );
+                                if ( bits < best_bits ) {
+                                        best_bits = bits;
+                                        _deflate_keep_best( s, false );
+                                }
+                        }
+                }
+
+                if ( p->passes > 1 ) {
+                        _deflate_keep_best( s, true );
+                }
+
+                _deflate_prices( s, s->lit_freq, s->dist_freq );
+
+                size_t splits[( 1 << DEFLATE_SPLIT_DEPTH ) - 1];
+                int split_count = 0;
+                if ( p->split ) {
+                        uint64_t bits = _deflate_block_bits( s, 0, s->symbol_count );
+                        _deflate_split( s, 0, s->symbol_count, bits, DEFLATE_SPLIT_DEPTH, splits, &split_count );
+                }
+
+                /* Every part goes out as a block of its own */
+                _deflate_symbol *symbols = s->symbols;
+                size_t count = s->symbol_count;
+                size_t from = 0;
+                for ( int k = 0; k <= split_count; ++k ) {
+                        size_t to = k < split_count ? splits[k] : count;
+                        size_t block_end = s->block_start;
+                        for ( size_t i = from; i < to; ++i ) {
+                                block_end += symbols[i].dist == 0 ? 1 : symbols[i].length;
+                        }
+
+                        if ( split_count > 0 ) {
+                                s->symbols = symbols + from;
+                                s->symbol_count = to - from;
+                                _deflate_count( s, 0, to - from, s->lit_freq, s->dist_freq );
+                                s->lit_freq[256] = 0;
+                        }
+
+                        _deflate_flush_block( s, block_end, final && block_end == s->end );
+                        from = to;
+                }
+                s->symbols = symbols;
+
+                pos += n;
+        }
+}
+
+DEFLATE_EXTERN unsigned char *deflate_compress ( const unsigned char *data, size_t dict_len, size_t len,
+                                                 int level, bool final, size_t *out_len ) {
+        if ( dict_len + len > DEFLATE_MAX_CHUNK ) {
+                return NULL;
+        }
+
+        if ( level < DEFLATE_MIN_LEVEL ) {
+                level = DEFLATE_MIN_LEVEL;
+        }
+        if ( level > DEFLATE_MAX_LEVEL ) {
+                level = DEFLATE_MAX_LEVEL;
+        }
+
+        /* Stored data is the worst case. Every block is no bigger than
+         * storing it, which costs a few header bytes per block more. */
+        size_t stored_len = len + 5 * ( len / DEFLATE_MAX_STORED + 1 );
+        size_t cap = stored_len + 6 * ( len / DEFLATE_BLOCK_SYMBOLS + 1 ) + 64;
+
+        _deflate_state *s = (_deflate_state *) DEFLATE_MALLOC( sizeof( _deflate_state ) );
+        unsigned char *out = (unsigned char *) DEFLATE_MALLOC( cap );
+        if ( s == NULL || out == NULL ) {
+                DEFLATE_FREE( s );
+                DEFLATE_FREE( out );
+                return NULL;
+        }
+
+        memset( s, 0, sizeof( *s ) );
+        s->w.out = out;
+
+        bool compressed = false;
+
+        if ( level != DEFLATE_STORED_LEVEL && len > 0 ) {
+                const _deflate_params *p = level == DEFLATE_MIN_LEVEL ? &_deflate_rle_level : &_deflate_levels[level];
+                bool optimal = p->parse == _DEFLATE_OPTIMAL;
+                size_t symbols = optimal ? DEFLATE_OPT_BLOCK : DEFLATE_BLOCK_SYMBOLS;
+                size_t opt = optimal ? DEFLATE_OPT_BLOCK : 0;
+
+                size_t bytes = sizeof( uint32_t ) * ( DEFLATE_HASH_SIZE + 2 * DEFLATE_WINDOW ) +
+                               sizeof( _deflate_symbol ) * symbols +
+                               ( sizeof( uint32_t ) + 2 * sizeof( _deflate_symbol ) ) * ( opt + 1 ) +
+                               ( sizeof( _deflate_symbol ) * DEFLATE_OPT_MATCHES + 1 ) * opt;
+                unsigned char *scratch = (unsigned char *) DEFLATE_MALLOC( bytes );
+                if ( scratch == NULL ) {
+                        DEFLATE_FREE( s );
+                        DEFLATE_FREE( out );
+                        return NULL;
+                }
+
+                s->params = p;
+                s->data = data;
+                s->end = dict_len + len;
+                s->head = (uint32_t *) scratch;
+                s->prev = s->head + DEFLATE_HASH_SIZE;
+                s->child = s->prev;
+                s->symbols = (_deflate_symbol *) ( s->child + 2 * DEFLATE_WINDOW );
+                s->cost = (uint32_t *) ( s->symbols + symbols );
+                s->step = (_deflate_symbol *) ( s->cost + opt + 1 );
+                s->matches = s->step + opt + 1;
+                s->best = s->matches + opt * DEFLATE_OPT_MATCHES;
+                s->match_count = (uint8_t *) ( s->best + opt + 1 );
+                s->block_start = dict_len;
+
+                for ( int l = DEFLATE_MIN_MATCH; l <= DEFLATE_MAX_MATCH; ++l ) {
+                        int extra;
+                        s->len_symbol[l] = (uint16_t) _deflate_length_symbol( l, &extra );
+                        s->len_extra[l] = (uint8_t) extra;
+                }
+
+                /* Dictionary goes into the hash, matches may reach back into it */
+                s->inserted = dict_len > DEFLATE_WINDOW ? dict_len - DEFLATE_WINDOW : 0;
+                if ( p->parse == _DEFLATE_RLE ) {
+                        s->inserted = dict_len;
+                } else if ( optimal ) {
+                        memset( s->head, 0, sizeof( uint32_t ) * DEFLATE_HASH_SIZE );
+                        for ( ; s->inserted < dict_len; ++s->inserted ) {
+                                _deflate_tree( s, s->inserted, NULL );
+                        }
+                } else {
+                        memset( s->head, 0, sizeof( uint32_t ) * DEFLATE_HASH_SIZE );
+                        _deflate_insert( s, dict_len );
+                }
+
+                switch ( p->parse ) {
+                case _DEFLATE_GREEDY:
+                        _deflate_greedy( s, dict_len, final );
+                        break;
+                case _DEFLATE_LAZY:
+                        _deflate_lazy( s, dict_len, final );
+                        break;
+                case _DEFLATE_OPTIMAL:
+                        _deflate_optimal( s, dict_len, final );
+                        break;
+                case _DEFLATE_RLE:
+                        _deflate_rle( s, dict_len, final );
+                        break;
+                }
+
+                if ( s->symbol_count > 0 || s->block_start < s->end ) {
+                        _deflate_flush_block( s, s->end, final );
+                }
+
+                DEFLATE_FREE( scratch );
+                compressed = true;
+
+                if ( final ) {
+                        _deflate_align( &s->w );
+                } else {
+                        /* Empty stored block gets us back to byte boundary */
+                        _deflate_bits( &s->w, 0, 3 );
+                        _deflate_align( &s->w );
+                        _deflate_bits( &s->w, 0x0000, 16 );
+                        _deflate_bits( &s->w, 0xffff, 16 );
+                }
+        }
+
+        /* Compression didn't pay off, store instead */
+        if ( !compressed || s->w.len > stored_len ) {
+                s->w.len = 0;
+                s->w.bits = 0;
+                s->w.count = 0;
+                _deflate_stored( &s->w, data + dict_len, len, final );
+        }
+
+        *out_len = s->w.len;
+        DEFLATE_FREE( s );
+        return out;
+}
+
+DEFLATE_EXTERN void deflate_zlib_header ( int level, unsigned char header[2] ) {
+        /* CM = 8, CINFO = 7 (32K window), FLEVEL by level, FCHECK makes it divisible by 31 */
+        int flevel = level <= 1 ? 0 : level <= 5 ? 1 : level <= 6 ? 2 : 3;
+        int cmf = 0x78;
+        int flg = flevel << 6;
+
+        flg += ( 31 - ( ( cmf << 8 ) + flg ) % 31 ) % 31;
+
+        header[0] = (unsigned char) cmf;
+        header[1] = (unsigned char) flg;
+}
+
+#endif
@@ -0,0 +1,369 @@
+/* Packed 16 bit pixel formats.
+ *
+ * Before #including,
+ *      #define FORMAT_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Converts RGBA rows to 16 bit pixels stored little endian, with channels
+ * laid out like Direct3D B5G6R5, B4G4R4A4 and B5G5R5A1, red in the high
+ * bits and blue in the low ones, alpha above red. Rows go through a
+ * converter one at a time from the top, which keeps state for dithering.
+ * Plain and ordered dithering are vectorised, error diffusion
+ * (Floyd-Steinberg) carries error from row to row and stays scalar. */
+
+#ifndef _FORMAT_H
+#define _FORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FORMAT_EXTERN
+#define FORMAT_EXTERN extern
+#endif
+
+#ifndef FORMAT_STATIC
+#define FORMAT_STATIC static
+#endif
+
+#ifndef FORMAT_MALLOC
+#define FORMAT_MALLOC( size ) malloc( size )
+#endif
+
+#ifndef FORMAT_FREE
+#define FORMAT_FREE( ptr ) free( ptr )
+#endif
+
+typedef enum format {
+        FORMAT_RGBA8, /* 8 bits per channel, not packed */
+        FORMAT_RGB565,
+        FORMAT_RGBA4444,
+        FORMAT_RGBA5551,
+        FORMAT_NUM,
+} format;
+
+typedef enum format_dither {
+        FORMAT_DITHER_NONE,
+        FORMAT_DITHER_ORDERED,
+        FORMAT_DITHER_DIFFUSION,
+} format_dither;
+
+typedef struct format_desc {
+        const char *name;
+        int bytes; /* Per pixel */
+
+        /* Bits and lowest bit of red, green, blue and alpha */
+        int bits[4];
+        int shift[4];
+} format_desc;
+
+typedef struct format_converter {
+        const format_desc *desc;
+        format_dither dither;
+        size_t width;
+        size_t y;
+
+        /* Diffused error in 16ths for this row and next, padded by a pixel
+         * on both sides */
+        int *error;
+        int *error_next;
+} format_converter;
+
+/* Pick kernels for this CPU, call once before converting */
+FORMAT_EXTERN void format_init ( void );
+
+FORMAT_EXTERN const format_desc *format_describe ( format f );
+FORMAT_EXTERN bool format_parse ( const char *name, format *f );
+
+/* Mask of bits channel takes in a packed pixel */
+FORMAT_EXTERN uint32_t format_mask ( const format_desc *desc, int channel );
+
+FORMAT_EXTERN bool format_begin ( format_converter *c, format f, format_dither dither, size_t width );
+FORMAT_EXTERN void format_end ( format_converter *c );
+
+/* Convert next row of RGBA pixels, out takes width * bytes of the format */
+FORMAT_EXTERN void format_convert_row ( format_converter *c, const unsigned char *rgba, unsigned char *out );
+
+#endif /* _FORMAT_H */
+
+/* Implementation */
+#ifdef FORMAT_IMPL
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define FORMAT_X86
+#include <immintrin.h>
+#endif
+
+static const format_desc _format_descs[FORMAT_NUM] = {
+    [FORMAT_RGBA8] = { "rgba8", 4, { 8, 8, 8, 8 }, { 0, 8, 16, 24 } },
+    [FORMAT_RGB565] = { "rgb565", 2, { 5, 6, 5, 0 }, { 11, 5, 0, 0 } },
+    [FORMAT_RGBA4444] = { "rgba4444", 2, { 4, 4, 4, 4 }, { 8, 4, 0, 12 } },
+    [FORMAT_RGBA5551] = { "rgba5551", 2, { 5, 5, 5, 1 }, { 10, 5, 0, 15 } },
+};
+
+/* 4x4 Bayer matrix */
+static const int _format_bayer[4][4] = {
+    { 0, 8, 2, 10 },
+    { 12, 4, 14, 6 },
+    { 3, 11, 1, 9 },
+    { 15, 7, 13, 5 },
+};
+
+typedef void ( *format_row_fn )( const format_desc *desc, const unsigned char *rgba, unsigned char *out,
+                                 size_t x, size_t width, size_t y, bool ordered );
+static format_row_fn _format_row;
+
+/* Added before dividing by 255, 127 rounds to nearest */
+FORMAT_STATIC int _format_threshold ( size_t x, size_t y, bool ordered ) {
+        return ordered ? _format_bayer[y & 3][x & 3] * 16 + 8 : 127;
+}
+
+FORMAT_STATIC void _format_store ( unsigned char *out, unsigned pixel ) {
+        out[0] = pixel & 0xff;
+        out[1] = pixel >> 8;
+}
+
+/* Pixels [x, width) of row without error diffusion */
+FORMAT_STATIC void _format_row_scalar ( const format_desc *desc, const unsigned char *rgba, unsigned char *out,
+                                        size_t x, size_t width, size_t y, bool ordered ) {
+        for ( ; x < width; ++x ) {
+                int t = _format_threshold( x, y, ordered );
+                unsigned pixel = 0;
+
+                for ( int c = 0; c < 4; ++c ) {
+                        unsigned max = ( 1u << desc->bits[c] ) - 1;
+                        pixel |= ( ( rgba[x * 4 + c] * max + t ) / 255 ) << desc->shift[c];
+                }
+
+                _format_store( out + x * 2, pixel );
+        }
+}
+
+FORMAT_STATIC void _format_row_diffusion ( format_converter *c, const unsigned char *rgba, unsigned char *out ) {
+        const format_desc *desc = c->desc;
+        int *error = c->error + 4;
+        int *next = c->error_next + 4;
+
+        memset( c->error_next, 0, sizeof( int ) * ( c->width + 2 ) * 4 );
+
+        for ( size_t x = 0; x < c->width; ++x ) {
+                unsigned pixel = 0;
+
+                for ( int ch = 0; ch < 4; ++ch ) {
+                        int max = ( 1 << desc->bits[ch] ) - 1;
+                        if ( max == 0 ) {
+                                continue;
+                        }
+
+                        int v = rgba[x * 4 + ch] + error[x * 4 + ch] / 16;
+                        v = v < 0 ? 0 : v > 255 ? 255 : v;
+
+                        int q = ( v * max + 127 ) / 255;
+                        int e = v - ( q * 255 + max / 2 ) / max;
+
+                        error[( x + 1 ) * 4 + ch] += e * 7;
+                        next[( (ptrdiff_t) x - 1 ) * 4 + ch] += e * 3;
+                        next[x * 4 + ch] += e * 5;
+                        next[( x + 1 ) * 4 + ch] += e;
+
+                        pixel |= (unsigned) q << desc->shift[ch];
+                }
+
+                _format_store( out + x * 2, pixel );
+        }
+
+        int *swap = c->error;
+        c->error = c->error_next;
+        c->error_next = swap;
+}
+
+#ifdef FORMAT_X86
+
+/* Lanes of scale, placement and thresholds for pixels at x % 4 of 0 to 3 */
+FORMAT_STATIC void _format_lanes ( const format_desc *desc, size_t y, bool ordered,
+                                   short scale[4], short place[4], short t[4] ) {
+        for ( int c = 0; c < 4; ++c ) {
+                scale[c] = (short) ( ( 1 << desc->bits[c] ) - 1 );
+                place[c] = (short) ( desc->bits[c] > 0 ? 1 << desc->shift[c] : 0 );
+        }
+        for ( int x = 0; x < 4; ++x ) {
+                t[x] = (short) _format_threshold( x, y, ordered );
+        }
+}
+
+/* Quantise channels of two pixels held in 16 bit lanes, with floor( x / 255 )
+ * done exactly as ( x + 1 + ( x >> 8 ) ) >> 8. Channels are moved into place
+ * and ORed together into the low lane of each pixel. */
+__attribute__( ( target( "sse4.1" ) ) )
+FORMAT_STATIC __m128i _format_pack2_sse41 ( __m128i v, __m128i t, __m128i scale, __m128i place ) {
+        __m128i x = _mm_add_epi16( _mm_mullo_epi16( v, scale ), t );
+        __m128i q = _mm_srli_epi16( _mm_add_epi16( _mm_add_epi16( x, _mm_set1_epi16( 1 ) ), _mm_srli_epi16( x, 8 ) ), 8 );
+        __m128i s = _mm_mullo_epi16( q, place );
+        s = _mm_or_si128( s, _mm_srli_epi64( s, 32 ) );
+        s = _mm_or_si128( s, _mm_srli_epi64( s, 16 ) );
+        return _mm_and_si128( s, _mm_set1_epi64x( 0xffff ) );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+FORMAT_STATIC __m256i _format_pack2_avx2 ( __m256i v, __m256i t, __m256i scale, __m256i place ) {
+        __m256i x = _mm256_add_epi16( _mm256_mullo_epi16( v, scale ), t );
+        __m256i q = _mm256_srli_epi16( _mm256_add_epi16( _mm256_add_epi16( x, _mm256_set1_epi16( 1 ) ),
+                                                         _mm256_srli_epi16( x, 8 ) ), 8 );
+        __m256i s = _mm256_mullo_epi16( q, place );
+        s = _mm256_or_si256( s, _mm256_srli_epi64( s, 32 ) );
+        s = _mm256_or_si256( s, _mm256_srli_epi64( s, 16 ) );
+        return _mm256_and_si256( s, _mm256_set1_epi64x( 0xffff ) );
+}
+
+__attribute__( ( target( "sse4.1" ) ) )
+FORMAT_STATIC void _format_row_sse41 ( const format_desc *desc, const unsigned char *rgba, unsigned char *out,
+                                       size_t x, size_t width, size_t y, bool ordered ) {
+        short scale_[4], place_[4], t_[4];
+        _format_lanes( desc, y, ordered, scale_, place_, t_ );
+
+        const __m128i scale = _mm_setr_epi16( scale_[0], scale_[1], scale_[2], scale_[3],
+                                              scale_[0], scale_[1], scale_[2], scale_[3] );
+        const __m128i place = _mm_setr_epi16( place_[0], place_[1], place_[2], place_[3],
+                                              place_[0], place_[1], place_[2], place_[3] );
+        const __m128i t01 = _mm_setr_epi16( t_[0], t_[0], t_[0], t_[0], t_[1], t_[1], t_[1], t_[1] );
+        const __m128i t23 = _mm_setr_epi16( t_[2], t_[2], t_[2], t_[2], t_[3], t_[3], t_[3], t_[3] );
+        const __m128i zero = _mm_setzero_si128();
+
+        for ( ; x + 8 <= width; x += 8 ) {
+                __m128i p0 = _mm_loadu_si128( (const __m128i *) ( rgba + x * 4 ) );
+                __m128i p1 = _mm_loadu_si128( (const __m128i *) ( rgba + x * 4 + 16 ) );
+
+                __m128i a = _format_pack2_sse41( _mm_unpacklo_epi8( p0, zero ), t01, scale, place );
+                __m128i b = _format_pack2_sse41( _mm_unpackhi_epi8( p0, zero ), t23, scale, place );
+                __m128i c = _format_pack2_sse41( _mm_unpacklo_epi8( p1, zero ), t01, scale, place );
+                __m128i d = _format_pack2_sse41( _mm_unpackhi_epi8( p1, zero ), t23, scale, place );
+
+                __m128i packed = _mm_packus_epi32( _mm_packus_epi32( a, b ), _mm_packus_epi32( c, d ) );
+                _mm_storeu_si128( (__m128i *) ( out + x * 2 ), packed );
+        }
+
+        _format_row_scalar( desc, rgba, out, x, width, y, ordered );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+FORMAT_STATIC void _format_row_avx2 ( const format_desc *desc, const unsigned char *rgba, unsigned char *out,
+                                      size_t x, size_t width, size_t y, bool ordered ) {
+        short scale_[4], place_[4], t_[4];
+        _format_lanes( desc, y, ordered, scale_, place_, t_ );
+
+        const __m256i scale = _mm256_setr_epi16( scale_[0], scale_[1], scale_[2], scale_[3],
+                                                 scale_[0], scale_[1], scale_[2], scale_[3],
+                                                 scale_[0], scale_[1], scale_[2], scale_[3],
+                                                 scale_[0], scale_[1], scale_[2], scale_[3] );
+        const __m256i place = _mm256_setr_epi16( place_[0], place_[1], place_[2], place_[3],
+                                                 place_[0], place_[1], place_[2], place_[3],
+                                                 place_[0], place_[1], place_[2], place_[3],
+                                                 place_[0], place_[1], place_[2], place_[3] );
+        const __m256i t01 = _mm256_setr_epi16( t_[0], t_[0], t_[0], t_[0], t_[1], t_[1], t_[1], t_[1],
+                                               t_[0], t_[0], t_[0], t_[0], t_[1], t_[1], t_[1], t_[1] );
+        const __m256i t23 = _mm256_setr_epi16( t_[2], t_[2], t_[2], t_[2], t_[3], t_[3], t_[3], t_[3],
+                                               t_[2], t_[2], t_[2], t_[2], t_[3], t_[3], t_[3], t_[3] );
+        const __m256i zero = _mm256_setzero_si256();
+
+        /* Lanes hold pixels 0-3 and 4-7 of each load, packing keeps them
+         * apart until the final permute */
+        for ( ; x + 16 <= width; x += 16 ) {
+                __m256i p0 = _mm256_loadu_si256( (const __m256i *) ( rgba + x * 4 ) );
+                __m256i p1 = _mm256_loadu_si256( (const __m256i *) ( rgba + x * 4 + 32 ) );
+
+                __m256i a = _format_pack2_avx2( _mm256_unpacklo_epi8( p0, zero ), t01, scale, place );
+                __m256i b = _format_pack2_avx2( _mm256_unpackhi_epi8( p0, zero ), t23, scale, place );
+                __m256i c = _format_pack2_avx2( _mm256_unpacklo_epi8( p1, zero ), t01, scale, place );
+                __m256i d = _format_pack2_avx2( _mm256_unpackhi_epi8( p1, zero ), t23, scale, place );
+
+                __m256i packed = _mm256_packus_epi32( _mm256_packus_epi32( a, b ), _mm256_packus_epi32( c, d ) );
+                packed = _mm256_permute4x64_epi64( packed, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+                _mm256_storeu_si256( (__m256i *) ( out + x * 2 ), packed );
+        }
+
+        _format_row_sse41( desc, rgba, out, x, width, y, ordered );
+}
+
+#endif /* FORMAT_X86 */
+
+FORMAT_EXTERN void format_init ( void ) {
+        _format_row = _format_row_scalar;
+
+#ifdef FORMAT_X86
+        __builtin_cpu_init();
+
+        if ( __builtin_cpu_supports( "sse4.1" ) ) {
+                _format_row = _format_row_sse41;
+        }
+        if ( __builtin_cpu_supports( "avx2" ) ) {
+                _format_row = _format_row_avx2;
+        }
+#endif
+}
+
+FORMAT_EXTERN const format_desc *format_describe ( format f ) {
+        return &_format_descs[f];
+}
+
+FORMAT_EXTERN bool format_parse ( const char *name, format *f ) {
+        for ( int i = 0; name != NULL && i < FORMAT_NUM; ++i ) {
+                if ( strcmp( name, _format_descs[i].name ) == 0 ) {
+                        *f = (format) i;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+FORMAT_EXTERN uint32_t format_mask ( const format_desc *desc, int channel ) {
+        return ( ( 1u << desc->bits[channel] ) - 1 ) << desc->shift[channel];
+}
+
+FORMAT_EXTERN bool format_begin ( format_converter *c, format f, format_dither dither, size_t width ) {
+        *c = (format_converter) { .desc = &_format_descs[f], .dither = dither, .width = width };
+
+        if ( dither == FORMAT_DITHER_DIFFUSION ) {
+                size_t len = sizeof( int ) * ( width + 2 ) * 4;
+                c->error = (int *) FORMAT_MALLOC( len );
+                c->error_next = (int *) FORMAT_MALLOC( len );
+                if ( c->error == NULL || c->error_next == NULL ) {
+                        format_end( c );
+                        return false;
+                }
+
+                memset( c->error, 0, len );
+        }
+
+        return true;
+}
+
+FORMAT_EXTERN void format_end ( format_converter *c ) {
+        if ( c->error != NULL ) {
+                FORMAT_FREE( c->error );
+        }
+        if ( c->error_next != NULL ) {
+                FORMAT_FREE( c->error_next );
+        }
+
+        c->error = NULL;
+        c->error_next = NULL;
+}
+
+FORMAT_EXTERN void format_convert_row ( format_converter *c, const unsigned char *rgba, unsigned char *out ) {
+        if ( c->desc->bytes == 4 ) {
+                memcpy( out, rgba, c->width * 4 );
+        } else if ( c->dither == FORMAT_DITHER_DIFFUSION ) {
+                _format_row_diffusion( c, rgba, out );
+        } else {
+                _format_row( c->desc, rgba, out, 0, c->width, c->y, c->dither == FORMAT_DITHER_ORDERED );
+        }
+
+        c->y += 1;
+}
+
+#endif
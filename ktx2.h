@@ -0,0 +1,328 @@
+/* KTX2 container headers.
+ *
+ * Before #including,
+ *      #define KTX2_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Writes 2D textures: header, level index, data format descriptor and the
+ * writer's name as the only key, then the levels. A texture of one level
+ * without supercompression can have everything up to its data written
+ * first and the data streamed after. Otherwise every level is in hand and
+ * the index is worked out from their lengths, levels go smallest first as
+ * the format asks, each padded to the alignment of its format unless they
+ * are supercompressed. Descriptors are made for the Vulkan formats listed
+ * here, RGBA8 and the block compressed BC, ETC2 and ASTC with the footprint
+ * of their blocks. */
+
+#ifndef _KTX2_H
+#define _KTX2_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef KTX2_EXTERN
+#define KTX2_EXTERN extern
+#endif
+
+#ifndef KTX2_STATIC
+#define KTX2_STATIC static
+#endif
+
+#define KTX2_VK_FORMAT_R8G8B8A8_UNORM 37
+#define KTX2_VK_FORMAT_R8G8B8A8_SRGB 43
+#define KTX2_VK_FORMAT_BC1_RGB_UNORM_BLOCK 131
+#define KTX2_VK_FORMAT_BC1_RGB_SRGB_BLOCK 132
+#define KTX2_VK_FORMAT_BC1_RGBA_UNORM_BLOCK 133
+#define KTX2_VK_FORMAT_BC1_RGBA_SRGB_BLOCK 134
+#define KTX2_VK_FORMAT_BC3_UNORM_BLOCK 137
+#define KTX2_VK_FORMAT_BC3_SRGB_BLOCK 138
+#define KTX2_VK_FORMAT_BC4_UNORM_BLOCK 139
+#define KTX2_VK_FORMAT_BC5_UNORM_BLOCK 141
+#define KTX2_VK_FORMAT_BC7_UNORM_BLOCK 145
+#define KTX2_VK_FORMAT_BC7_SRGB_BLOCK 146
+#define KTX2_VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK 151
+#define KTX2_VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK 152
+#define KTX2_VK_FORMAT_ASTC_4x4_UNORM_BLOCK 157
+#define KTX2_VK_FORMAT_ASTC_4x4_SRGB_BLOCK 158
+#define KTX2_VK_FORMAT_ASTC_5x4_UNORM_BLOCK 159
+#define KTX2_VK_FORMAT_ASTC_5x4_SRGB_BLOCK 160
+#define KTX2_VK_FORMAT_ASTC_5x5_UNORM_BLOCK 161
+#define KTX2_VK_FORMAT_ASTC_5x5_SRGB_BLOCK 162
+#define KTX2_VK_FORMAT_ASTC_6x5_UNORM_BLOCK 163
+#define KTX2_VK_FORMAT_ASTC_6x5_SRGB_BLOCK 164
+#define KTX2_VK_FORMAT_ASTC_6x6_UNORM_BLOCK 165
+#define KTX2_VK_FORMAT_ASTC_6x6_SRGB_BLOCK 166
+#define KTX2_VK_FORMAT_ASTC_8x5_UNORM_BLOCK 167
+#define KTX2_VK_FORMAT_ASTC_8x5_SRGB_BLOCK 168
+#define KTX2_VK_FORMAT_ASTC_8x6_UNORM_BLOCK 169
+#define KTX2_VK_FORMAT_ASTC_8x6_SRGB_BLOCK 170
+#define KTX2_VK_FORMAT_ASTC_8x8_UNORM_BLOCK 171
+#define KTX2_VK_FORMAT_ASTC_8x8_SRGB_BLOCK 172
+
+#define KTX2_SUPERCOMPRESSION_NONE 0
+#define KTX2_SUPERCOMPRESSION_ZLIB 3
+
+/* Levels of a 32 bit wide texture at most */
+#define KTX2_MAX_LEVELS 32
+
+/* Level data as stored and its length before supercompression, same as len
+ * without it */
+typedef struct ktx2_level {
+        const void *data;
+        uint64_t len;
+        uint64_t uncompressed_len;
+} ktx2_level;
+
+/* Header for level of len bytes of width by height pixels in vk_format,
+ * premultiplied marks colour as multiplied by alpha. False for formats
+ * not listed above too. */
+KTX2_EXTERN bool ktx2_write_header ( FILE *file, uint32_t vk_format, uint32_t width, uint32_t height,
+                                     bool premultiplied, uint64_t len );
+
+/* Whole texture of count levels, largest first, each supercompressed the
+ * way supercompression says. False for formats not listed above too. */
+KTX2_EXTERN bool ktx2_write ( FILE *file, uint32_t vk_format, uint32_t width, uint32_t height, bool premultiplied,
+                              uint32_t supercompression, const ktx2_level *levels, uint32_t count );
+
+#endif /* _KTX2_H */
+
+/* Implementation */
+#ifdef KTX2_IMPL
+
+#include <string.h>
+
+#define KTX2_HEADER_SIZE 80
+#define KTX2_LEVEL_SIZE 24
+
+/* Header and index of every level, then descriptor of four samples, key and
+ * padding up to the first level */
+#define KTX2_MAX_HEADER ( KTX2_HEADER_SIZE + KTX2_LEVEL_SIZE * KTX2_MAX_LEVELS + 256 )
+
+/* Khronos data format descriptor values */
+#define KTX2_DF_VERSION 2
+#define KTX2_DF_MODEL_RGBSDA 1
+#define KTX2_DF_MODEL_BC1A 128
+#define KTX2_DF_MODEL_BC3 130
+#define KTX2_DF_MODEL_BC4 131
+#define KTX2_DF_MODEL_BC5 132
+#define KTX2_DF_MODEL_BC7 134
+#define KTX2_DF_MODEL_ETC2 161
+#define KTX2_DF_MODEL_ASTC 162
+#define KTX2_DF_PRIMARIES_BT709 1
+#define KTX2_DF_TRANSFER_LINEAR 1
+#define KTX2_DF_TRANSFER_SRGB 2
+#define KTX2_DF_FLAG_PREMULTIPLIED 1
+#define KTX2_DF_SAMPLE_LINEAR 0x10
+
+/* Alpha samples, same in every model */
+#define KTX2_DF_CHANNEL_ALPHA 15
+
+#define KTX2_WRITER "pack"
+
+/* Pixels and bytes of every block, channel of every sample in it, up to four
+ * of them splitting its bits */
+typedef struct _ktx2_format {
+        uint32_t vk_format;
+        int model;
+        bool srgb;
+        int block[2];
+        int block_bytes;
+        int samples;
+        int channel[4];
+} _ktx2_format;
+
+static const _ktx2_format _ktx2_formats[] = {
+    { KTX2_VK_FORMAT_R8G8B8A8_UNORM, KTX2_DF_MODEL_RGBSDA, false, { 1, 1 }, 4, 4, { 0, 1, 2, KTX2_DF_CHANNEL_ALPHA } },
+    { KTX2_VK_FORMAT_R8G8B8A8_SRGB, KTX2_DF_MODEL_RGBSDA, true, { 1, 1 }, 4, 4, { 0, 1, 2, KTX2_DF_CHANNEL_ALPHA } },
+    { KTX2_VK_FORMAT_BC1_RGB_UNORM_BLOCK, KTX2_DF_MODEL_BC1A, false, { 4, 4 }, 8, 1, { 0 } },
+    { KTX2_VK_FORMAT_BC1_RGB_SRGB_BLOCK, KTX2_DF_MODEL_BC1A, true, { 4, 4 }, 8, 1, { 0 } },
+    { KTX2_VK_FORMAT_BC1_RGBA_UNORM_BLOCK, KTX2_DF_MODEL_BC1A, false, { 4, 4 }, 8, 1, { 1 } },
+    { KTX2_VK_FORMAT_BC1_RGBA_SRGB_BLOCK, KTX2_DF_MODEL_BC1A, true, { 4, 4 }, 8, 1, { 1 } },
+    { KTX2_VK_FORMAT_BC3_UNORM_BLOCK, KTX2_DF_MODEL_BC3, false, { 4, 4 }, 16, 2, { KTX2_DF_CHANNEL_ALPHA, 0 } },
+    { KTX2_VK_FORMAT_BC3_SRGB_BLOCK, KTX2_DF_MODEL_BC3, true, { 4, 4 }, 16, 2, { KTX2_DF_CHANNEL_ALPHA, 0 } },
+    { KTX2_VK_FORMAT_BC4_UNORM_BLOCK, KTX2_DF_MODEL_BC4, false, { 4, 4 }, 8, 1, { 0 } },
+    { KTX2_VK_FORMAT_BC5_UNORM_BLOCK, KTX2_DF_MODEL_BC5, false, { 4, 4 }, 16, 2, { 0, 1 } },
+    { KTX2_VK_FORMAT_BC7_UNORM_BLOCK, KTX2_DF_MODEL_BC7, false, { 4, 4 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_BC7_SRGB_BLOCK, KTX2_DF_MODEL_BC7, true, { 4, 4 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK, KTX2_DF_MODEL_ETC2, false, { 4, 4 }, 16, 2, { KTX2_DF_CHANNEL_ALPHA, 2 } },
+    { KTX2_VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK, KTX2_DF_MODEL_ETC2, true, { 4, 4 }, 16, 2, { KTX2_DF_CHANNEL_ALPHA, 2 } },
+    { KTX2_VK_FORMAT_ASTC_4x4_UNORM_BLOCK, KTX2_DF_MODEL_ASTC, false, { 4, 4 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_4x4_SRGB_BLOCK, KTX2_DF_MODEL_ASTC, true, { 4, 4 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_5x4_UNORM_BLOCK, KTX2_DF_MODEL_ASTC, false, { 5, 4 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_5x4_SRGB_BLOCK, KTX2_DF_MODEL_ASTC, true, { 5, 4 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_5x5_UNORM_BLOCK, KTX2_DF_MODEL_ASTC, false, { 5, 5 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_5x5_SRGB_BLOCK, KTX2_DF_MODEL_ASTC, true, { 5, 5 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_6x5_UNORM_BLOCK, KTX2_DF_MODEL_ASTC, false, { 6, 5 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_6x5_SRGB_BLOCK, KTX2_DF_MODEL_ASTC, true, { 6, 5 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_6x6_UNORM_BLOCK, KTX2_DF_MODEL_ASTC, false, { 6, 6 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_6x6_SRGB_BLOCK, KTX2_DF_MODEL_ASTC, true, { 6, 6 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_8x5_UNORM_BLOCK, KTX2_DF_MODEL_ASTC, false, { 8, 5 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_8x5_SRGB_BLOCK, KTX2_DF_MODEL_ASTC, true, { 8, 5 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_8x6_UNORM_BLOCK, KTX2_DF_MODEL_ASTC, false, { 8, 6 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_8x6_SRGB_BLOCK, KTX2_DF_MODEL_ASTC, true, { 8, 6 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_8x8_UNORM_BLOCK, KTX2_DF_MODEL_ASTC, false, { 8, 8 }, 16, 1, { 0 } },
+    { KTX2_VK_FORMAT_ASTC_8x8_SRGB_BLOCK, KTX2_DF_MODEL_ASTC, true, { 8, 8 }, 16, 1, { 0 } },
+};
+
+static const unsigned char _ktx2_identifier[12] = { 0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n' };
+
+KTX2_STATIC void _ktx2_put32 ( unsigned char *dst, uint32_t value ) {
+        dst[0] = value & 0xff;
+        dst[1] = ( value >> 8 ) & 0xff;
+        dst[2] = ( value >> 16 ) & 0xff;
+        dst[3] = value >> 24;
+}
+
+KTX2_STATIC void _ktx2_put64 ( unsigned char *dst, uint64_t value ) {
+        _ktx2_put32( dst, value & 0xffffffff );
+        _ktx2_put32( dst + 4, value >> 32 );
+}
+
+KTX2_STATIC const _ktx2_format *_ktx2_find ( uint32_t vk_format ) {
+        for ( size_t i = 0; i < sizeof( _ktx2_formats ) / sizeof( _ktx2_formats[0] ); ++i ) {
+                if ( _ktx2_formats[i].vk_format == vk_format ) {
+                        return &_ktx2_formats[i];
+                }
+        }
+
+        return NULL;
+}
+
+/* Basic descriptor block of format, returns its length */
+KTX2_STATIC size_t _ktx2_dfd ( unsigned char *dst, const _ktx2_format *f, bool premultiplied,
+                               uint32_t supercompression ) {
+        size_t len = 24 + 16 * f->samples;
+        memset( dst, 0, len );
+
+        /* Vendor and descriptor type are both zero for Khronos basic blocks */
+        _ktx2_put32( dst + 4, KTX2_DF_VERSION | (uint32_t) len << 16 );
+        dst[8] = (unsigned char) f->model;
+        dst[9] = KTX2_DF_PRIMARIES_BT709;
+        dst[10] = f->srgb ? KTX2_DF_TRANSFER_SRGB : KTX2_DF_TRANSFER_LINEAR;
+        dst[11] = premultiplied ? KTX2_DF_FLAG_PREMULTIPLIED : 0;
+
+        /* Block dimensions minus one, then bytes of the only plane. Those
+         * are unknown once levels are supercompressed and left zero. */
+        dst[12] = (unsigned char) ( f->block[0] - 1 );
+        dst[13] = (unsigned char) ( f->block[1] - 1 );
+        dst[16] = supercompression == KTX2_SUPERCOMPRESSION_NONE ? (unsigned char) f->block_bytes : 0;
+
+        /* Samples split the block evenly, alpha stays linear in sRGB formats.
+         * Block compressed samples take their whole range, plain ones that of
+         * their bits. */
+        int bits = f->block_bytes * 8 / f->samples;
+        uint32_t upper = f->block[0] * f->block[1] > 1 ? 0xffffffff : (uint32_t) ( ( 1ull << bits ) - 1 );
+        for ( int i = 0; i < f->samples; ++i ) {
+                unsigned char *s = dst + 24 + 16 * i;
+                bool alpha = f->channel[i] == KTX2_DF_CHANNEL_ALPHA;
+
+                _ktx2_put32( s, (uint32_t) ( i * bits ) | (uint32_t) ( bits - 1 ) << 16 |
+                                    (uint32_t) ( f->channel[i] | ( alpha && f->srgb ? KTX2_DF_SAMPLE_LINEAR : 0 ) )
+                                        << 24 );
+                _ktx2_put32( s + 12, upper );
+        }
+
+        return len;
+}
+
+/* Everything up to the data of the smallest level into header, offset of
+ * every level into offsets. Returns how far the data of the smallest level
+ * starts, which is how much of header to write. */
+KTX2_STATIC size_t _ktx2_header ( unsigned char *header, const _ktx2_format *f, uint32_t width, uint32_t height,
+                                  bool premultiplied, uint32_t supercompression, const ktx2_level *levels,
+                                  uint32_t count, uint64_t *offsets ) {
+        size_t dfd_offset = KTX2_HEADER_SIZE + KTX2_LEVEL_SIZE * count;
+        size_t dfd_len = 4 + _ktx2_dfd( header + dfd_offset + 4, f, premultiplied, supercompression );
+        _ktx2_put32( header + dfd_offset, (uint32_t) dfd_len );
+
+        size_t kvd_offset = dfd_offset + dfd_len;
+        size_t key_len = sizeof( "KTXwriter" ) + sizeof( KTX2_WRITER );
+        _ktx2_put32( header + kvd_offset, (uint32_t) key_len );
+        memcpy( header + kvd_offset + 4, "KTXwriter", sizeof( "KTXwriter" ) );
+        memcpy( header + kvd_offset + 4 + sizeof( "KTXwriter" ), KTX2_WRITER, sizeof( KTX2_WRITER ) );
+        size_t kvd_len = ( 4 + key_len + 3 ) & ~(size_t) 3;
+
+        /* Levels start on a whole block, which is a multiple of 4 already.
+         * Supercompressed ones need no alignment at all. */
+        uint64_t align = supercompression == KTX2_SUPERCOMPRESSION_NONE ? (uint64_t) f->block_bytes : 1;
+        uint64_t end = kvd_offset + kvd_len;
+        for ( uint32_t i = count; i-- > 0; ) {
+                offsets[i] = ( end + align - 1 ) / align * align;
+                end = offsets[i] + levels[i].len;
+        }
+
+        memcpy( header, _ktx2_identifier, sizeof( _ktx2_identifier ) );
+        _ktx2_put32( header + 12, f->vk_format );
+        _ktx2_put32( header + 16, 1 ); /* Type size */
+        _ktx2_put32( header + 20, width );
+        _ktx2_put32( header + 24, height );
+        _ktx2_put32( header + 36, 1 ); /* Faces */
+        _ktx2_put32( header + 40, count );
+        _ktx2_put32( header + 44, supercompression );
+        _ktx2_put32( header + 48, (uint32_t) dfd_offset );
+        _ktx2_put32( header + 52, (uint32_t) dfd_len );
+        _ktx2_put32( header + 56, (uint32_t) kvd_offset );
+        _ktx2_put32( header + 60, (uint32_t) kvd_len );
+
+        for ( uint32_t i = 0; i < count; ++i ) {
+                unsigned char *index = header + KTX2_HEADER_SIZE + KTX2_LEVEL_SIZE * i;
+                _ktx2_put64( index, offsets[i] );
+                _ktx2_put64( index + 8, levels[i].len );
+                _ktx2_put64( index + 16, levels[i].uncompressed_len );
+        }
+
+        return (size_t) offsets[count - 1];
+}
+
+KTX2_EXTERN bool ktx2_write_header ( FILE *file, uint32_t vk_format, uint32_t width, uint32_t height,
+                                     bool premultiplied, uint64_t len ) {
+        const _ktx2_format *f = _ktx2_find( vk_format );
+        if ( f == NULL ) {
+                return false;
+        }
+
+        unsigned char header[KTX2_MAX_HEADER];
+        memset( header, 0, sizeof( header ) );
+
+        ktx2_level level = { .len = len, .uncompressed_len = len };
+        uint64_t offset;
+        size_t header_len = _ktx2_header( header, f, width, height, premultiplied, KTX2_SUPERCOMPRESSION_NONE,
+                                          &level, 1, &offset );
+
+        return fwrite( header, header_len, 1, file ) == 1;
+}
+
+KTX2_EXTERN bool ktx2_write ( FILE *file, uint32_t vk_format, uint32_t width, uint32_t height, bool premultiplied,
+                              uint32_t supercompression, const ktx2_level *levels, uint32_t count ) {
+        const _ktx2_format *f = _ktx2_find( vk_format );
+        if ( f == NULL || count == 0 || count > KTX2_MAX_LEVELS ) {
+                return false;
+        }
+
+        unsigned char header[KTX2_MAX_HEADER];
+        memset( header, 0, sizeof( header ) );
+
+        uint64_t offsets[KTX2_MAX_LEVELS];
+        uint64_t end = _ktx2_header( header, f, width, height, premultiplied, supercompression, levels, count,
+                                     offsets );
+        if ( fwrite( header, (size_t) end, 1, file ) != 1 ) {
+                return false;
+        }
+
+        /* Padding in front of a level is shorter than a block */
+        static const unsigned char zeros[16] = { 0 };
+        for ( uint32_t i = count; i-- > 0; ) {
+                size_t pad = (size_t) ( offsets[i] - end );
+                if ( ( pad > 0 && fwrite( zeros, pad, 1, file ) != 1 ) ||
+                     ( levels[i].len > 0 && fwrite( levels[i].data, (size_t) levels[i].len, 1, file ) != 1 ) ) {
+                        return false;
+                }
+                end = offsets[i] + levels[i].len;
+        }
+
+        return true;
+}
+
+#endif
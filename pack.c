@@ -1,8 +1,38 @@
 // Utility for packing images into single texture atlas
 
+#define _DEFAULT_SOURCE
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARENA_IMPL
+#include "arena.h"
+
+// Allocations are grouped by the phase they belong to, so each phase can be
+// released in bulk once it's done
+enum phase {
+        PHASE_LOAD,
+        PHASE_BLIT,
+        PHASE_ENCODE,
+        PHASE_METADATA,
+
+        PHASE_NUM
+};
+
+static arena arenas[PHASE_NUM] = {
+    [PHASE_LOAD] = { .name = "load" },
+    [PHASE_BLIT] = { .name = "blit" },
+    [PHASE_ENCODE] = { .name = "encode" },
+    [PHASE_METADATA] = { .name = "metadata" },
+};
+
+#define META_MALLOC( size ) arena_alloc( &arenas[PHASE_METADATA], size )
+#define META_REALLOC( ptr, new_size ) arena_realloc( &arenas[PHASE_METADATA], ptr, new_size )
+#define META_FREE( ptr ) arena_free( ptr )
 
 #define META_IMPL
 #include "meta.h"
@@ -21,10 +51,48 @@
                 _a < _b ? _a : _b;          \
         } )
 
+#define STBI_MALLOC( size ) arena_alloc( &arenas[PHASE_LOAD], size )
+#define STBI_REALLOC( ptr, new_size ) arena_realloc( &arenas[PHASE_LOAD], ptr, new_size )
+#define STBI_FREE( ptr ) arena_free( ptr )
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+
+#define CACHE_IMPL
+#include "cache.h"
+
+#define DEFLATE_MALLOC( size ) arena_alloc( &arenas[PHASE_ENCODE], size )
+#define DEFLATE_FREE( ptr ) arena_free( ptr )
+#define PNGW_MALLOC( size ) arena_alloc( &arenas[PHASE_ENCODE], size )
+#define PNGW_FREE( ptr ) arena_free( ptr )
+
+#define DEFLATE_IMPL
+#include "deflate.h"
+#define CHECKSUM_IMPL
+#include "checksum.h"
+#define PNGW_IMPL
+#include "pngw.h"
+#define FORMAT_MALLOC( size ) arena_alloc( &arenas[PHASE_ENCODE], size )
+#define FORMAT_FREE( ptr ) arena_free( ptr )
+#define QUANT_MALLOC( size ) arena_alloc( &arenas[PHASE_ENCODE], size )
+#define QUANT_FREE( ptr ) arena_free( ptr )
+
+#define BLIT_IMPL
+#include "blit.h"
+#define FORMAT_IMPL
+#include "format.h"
+#define DDS_IMPL
+#include "dds.h"
+#define KTX2_IMPL
+#include "ktx2.h"
+#define BC_IMPL
+#include "bc.h"
+#define SWIZZLE_IMPL
+#include "swizzle.h"
+#define QUANT_IMPL
+#include "quant.h"
+#define POOL_IMPL
+#include "pool.h"
 
 #define ANSI_RED "\e[0;31m"
 #define ANSI_GREEN "\e[0;32m"
@@ -46,8 +114,38 @@
 const char *usage = "USAGE: pack [OPTIONS] -- [IMAGES]\n"
                     "OPTIONS:\n"
                     "\t-h --help\t displays this help message\n"
-                    "\t-i       \t Where to output image\n"
-                    "\t-o       \t Where to output metadata\n";
+                    "\t-i       \t Where to output image, - for stdout\n"
+                    "\t-o       \t Where to output metadata\n"
+                    "\t-c --cache\t Directory of decoded image cache\n"
+                    "\t-m --memory-budget\t Assemble atlas in bands within this many MB. Images are decoded once "
+                    "up front to find the channels they use, again for their band unless cached with -c\n"
+                    "\t-s --stats\t Report memory use of each phase\n"
+                    "\t-j --jobs\t Number of threads, one per CPU by default\n"
+                    "\t-p --premultiply\t Premultiply colour by alpha\n"
+                    "\t   --srgb\t Colour is sRGB, premultiply in linear light\n"
+                    "\t   --clean-alpha zero|dilate\t Colour of fully transparent pixels\n"
+                    "\t   --padding\t Empty pixels between sprites\n"
+                    "\t   --extrude\t Repeat sprite edges this many pixels outwards\n"
+                    "\t   --collapse-solid\t Shrink single colour sprites to a shared 4x4 cell\n"
+                    "\t-f --format rgba8|rgb565|rgba4444|rgba5551|bc1|bc3|bc4|bc5|bc7|etc2|astc4x4|astc5x4|astc5x5|"
+                    "astc6x5|astc6x6|astc8x5|astc8x6|astc8x8\t Pixel format, packed ones go to DDS, BC ones to DDS or "
+                    "KTX2, ETC2 and ASTC to KTX2\n"
+                    "\t   --dither none|ordered|diffusion\t Dithering for packed formats\n"
+                    "\t   --quality fast|normal|slow\t Effort of block compression, normal by default\n"
+                    "\t   --container dds|ktx2\t File block compressed pixels go in, DDS for BC and KTX2 for the rest by "
+                    "default. KTX2 takes RGBA8 too\n"
+                    "\t   --mips\t Write every mip level down to 1x1, goes to KTX2\n"
+                    "\t   --supercompression none|zlib\t Deflate every KTX2 level, none by default\n"
+                    "\t   --raw\t Write pixels without PNG, DDS or KTX2 header, RGBA8 included\n"
+                    "\t   --swizzle linear|morton|tiled\t Order of raw pixels, linear rows by default, tiles padded "
+                    "with zeros\n"
+                    "\t   --tile\t Side of swizzled tiles, power of two, 32 by default\n"
+                    "\t-q --quantise\t Write indexed PNG with palette of at most this many colours\n"
+                    "\t   --png-filter row|sampled|none|trial\t Pick PNG filter for every row, from a few rows of each "
+                    "group, leave rows unfiltered or keep whatever deflates smallest\n"
+                    "\t   --speed store|fast|balanced|max\t PNG preset, stored, RLE only, lazy matching or exhaustive "
+                    "search\n"
+                    "\t   --time-budget\t Seconds for writing PNG, after that it settles for quicker settings\n";
 
 typedef struct vec2 {
         int x, y;
@@ -74,16 +172,178 @@ struct outmost_rect {
 };
 
 struct image {
+        // Size in the atlas, original one unless the sprite is collapsed
         struct rect size;
+        struct rect original;
         const char *name;
         const stbi_uc *pixels;
+
+        // Channels of pixels, as stored in the source file
+        int channels;
+        bool has_alpha;
+        bool has_colour;
+
+        // Every pixel is the same, colour is that pixel as RGBA
+        bool solid;
+        uint32_t colour;
+
+        // Collapsed sprite drawn by another of the same colour, index of it
+        int shares;
+
+        // Mapping of the pixels when they come from the cache
+        cache_entry cache;
 };
 
 static char *image_output = NULL;
+
+// Stdout taken over for the image, -1 when it goes to a file
+static int image_fd = -1;
 static char *metadata_output = NULL;
+static char *cache_dir = NULL;
+
+// Zero keeps the whole atlas in memory, otherwise it's assembled in bands
+static size_t memory_budget = 0;
+
+static int compression_level = 8;
+static pngw_strategy png_strategy = PNGW_STRATEGY_ROW;
+
+// Zero lets the PNG writer take as long as it needs
+static double png_budget = 0;
+
+// Anything but RGBA8 is written packed instead of as PNG
+static format pixel_format = FORMAT_RGBA8;
+static format_dither dither = FORMAT_DITHER_NONE;
+static bool raw_output = false;
+
+// DXGI codes of packed formats in DDS, plain and sRGB. Only premultiplied
+// atlases are named by code, the rest by their masks.
+static const uint32_t dxgi_packed_formats[FORMAT_NUM][2] = {
+    [FORMAT_RGBA8] = { DDS_DXGI_R8G8B8A8_UNORM, DDS_DXGI_R8G8B8A8_UNORM_SRGB },
+    [FORMAT_RGB565] = { DDS_DXGI_B5G6R5_UNORM, DDS_DXGI_B5G6R5_UNORM },
+    [FORMAT_RGBA4444] = { DDS_DXGI_B4G4R4A4_UNORM, DDS_DXGI_B4G4R4A4_UNORM },
+    [FORMAT_RGBA5551] = { DDS_DXGI_B5G5R5A1_UNORM, DDS_DXGI_B5G5R5A1_UNORM },
+};
+
+// Block compressed format replaces the pixel format when picked
+static bool block_output = false;
+static bc_format block_format = BC_FORMAT_BC7;
+static bc_quality block_quality = BC_QUALITY_NORMAL;
+
+// Automatic picks DDS for BC formats and KTX2 for those DDS can't hold
+enum container {
+        CONTAINER_AUTO,
+        CONTAINER_DDS,
+        CONTAINER_KTX2,
+};
+
+static enum container container = CONTAINER_AUTO;
+
+// Every level of the mip chain down to 1x1 goes out, not only the atlas
+static bool mip_chain = false;
+
+// KTX2 levels may go out deflated as zlib streams
+static uint32_t supercompression = KTX2_SUPERCOMPRESSION_NONE;
+
+// Format codes of block compressed formats in DDS and KTX2, plain and sRGB,
+// zero where the container has none
+static const uint32_t dxgi_formats[BC_FORMAT_NUM][2] = {
+    [BC_FORMAT_BC1] = { DDS_DXGI_BC1_UNORM, DDS_DXGI_BC1_UNORM_SRGB },
+    [BC_FORMAT_BC3] = { DDS_DXGI_BC3_UNORM, DDS_DXGI_BC3_UNORM_SRGB },
+    [BC_FORMAT_BC4] = { DDS_DXGI_BC4_UNORM, DDS_DXGI_BC4_UNORM },
+    [BC_FORMAT_BC5] = { DDS_DXGI_BC5_UNORM, DDS_DXGI_BC5_UNORM },
+    [BC_FORMAT_BC7] = { DDS_DXGI_BC7_UNORM, DDS_DXGI_BC7_UNORM_SRGB },
+};
+
+// BC1 is always told to have alpha, blocks with transparent pixels keep it
+static const uint32_t vk_formats[BC_FORMAT_NUM][2] = {
+    [BC_FORMAT_BC1] = { KTX2_VK_FORMAT_BC1_RGBA_UNORM_BLOCK, KTX2_VK_FORMAT_BC1_RGBA_SRGB_BLOCK },
+    [BC_FORMAT_BC3] = { KTX2_VK_FORMAT_BC3_UNORM_BLOCK, KTX2_VK_FORMAT_BC3_SRGB_BLOCK },
+    [BC_FORMAT_BC4] = { KTX2_VK_FORMAT_BC4_UNORM_BLOCK, KTX2_VK_FORMAT_BC4_UNORM_BLOCK },
+    [BC_FORMAT_BC5] = { KTX2_VK_FORMAT_BC5_UNORM_BLOCK, KTX2_VK_FORMAT_BC5_UNORM_BLOCK },
+    [BC_FORMAT_BC7] = { KTX2_VK_FORMAT_BC7_UNORM_BLOCK, KTX2_VK_FORMAT_BC7_SRGB_BLOCK },
+    [BC_FORMAT_ETC2] = { KTX2_VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK, KTX2_VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK },
+    [BC_FORMAT_ASTC_4X4] = { KTX2_VK_FORMAT_ASTC_4x4_UNORM_BLOCK, KTX2_VK_FORMAT_ASTC_4x4_SRGB_BLOCK },
+    [BC_FORMAT_ASTC_5X4] = { KTX2_VK_FORMAT_ASTC_5x4_UNORM_BLOCK, KTX2_VK_FORMAT_ASTC_5x4_SRGB_BLOCK },
+    [BC_FORMAT_ASTC_5X5] = { KTX2_VK_FORMAT_ASTC_5x5_UNORM_BLOCK, KTX2_VK_FORMAT_ASTC_5x5_SRGB_BLOCK },
+    [BC_FORMAT_ASTC_6X5] = { KTX2_VK_FORMAT_ASTC_6x5_UNORM_BLOCK, KTX2_VK_FORMAT_ASTC_6x5_SRGB_BLOCK },
+    [BC_FORMAT_ASTC_6X6] = { KTX2_VK_FORMAT_ASTC_6x6_UNORM_BLOCK, KTX2_VK_FORMAT_ASTC_6x6_SRGB_BLOCK },
+    [BC_FORMAT_ASTC_8X5] = { KTX2_VK_FORMAT_ASTC_8x5_UNORM_BLOCK, KTX2_VK_FORMAT_ASTC_8x5_SRGB_BLOCK },
+    [BC_FORMAT_ASTC_8X6] = { KTX2_VK_FORMAT_ASTC_8x6_UNORM_BLOCK, KTX2_VK_FORMAT_ASTC_8x6_SRGB_BLOCK },
+    [BC_FORMAT_ASTC_8X8] = { KTX2_VK_FORMAT_ASTC_8x8_UNORM_BLOCK, KTX2_VK_FORMAT_ASTC_8x8_SRGB_BLOCK },
+};
+
+// Raw pixels go in tiles of this side instead of rows unless linear
+static swizzle swizzle_layout = SWIZZLE_LINEAR;
+static int swizzle_tile = 32;
+
+// Zero writes true colour, otherwise most colours in palette of indexed PNG
+static int palette_colours = 0;
+static quant palette;
+
+static bool print_stats = false;
+
+// Time spent writing PNG rows and bytes in and out of deflate, for stats
+static struct {
+        double seconds;
+        size_t filtered;
+        size_t compressed;
+} png_stats;
+
+// Time spent encoding blocks and pixels they cover
+static struct {
+        double seconds;
+        size_t pixels;
+} block_stats;
+
+// Time spent supercompressing KTX2 levels and bytes in and out
+static struct {
+        double seconds;
+        size_t uncompressed;
+        size_t compressed;
+} zlib_stats;
+
+static bool premultiply = false;
+static bool srgb = false;
+
+// What to do with leftover colour of fully transparent pixels
+enum clean_alpha {
+        CLEAN_ALPHA_KEEP,
+        CLEAN_ALPHA_ZERO,
+        CLEAN_ALPHA_DILATE,
+};
+
+static enum clean_alpha clean_alpha = CLEAN_ALPHA_KEEP;
+
+// Solid sprites bigger than SOLID_SIZE squared collapse to a cell of that
+// side, shared by all of the same colour. Bilinear samples anywhere in the
+// middle of the cell then never reach its neighbours.
+#define SOLID_SIZE 4
+
+static bool collapse_solid = false;
+
+// Images with a cell of their own come first, the rest share one of those
+static int own_cell_count = 0;
+
+// Space around every sprite, extrusion on all sides and padding after it
+static int padding = 0;
+static int extrude = 0;
+
+// Cells are rounded up to multiples of the block footprint, so no block
+// straddles two sprites
+static struct rect cell_align = { 1, 1 };
+
+static int thread_count = 0;
+static pool *workers = NULL;
+
+// Composition and halving work on tiles of rows this big, so they stay in
+// L2 cache
+#define COMPOSE_TILE_BYTES ( 256 * 1024 )
 
 #define MAX_IMAGES ( 128 )
 
+// PNG stores dimensions as 31 bit integers, layout uses plain ints too
+#define MAX_ATLAS_SIDE ( INT32_MAX )
+
 static struct image images[MAX_IMAGES];
 static int image_count = 0;
 
@@ -92,12 +352,286 @@ static int image_location_count = 0;
 
 static struct outmost_rect outmost = {};
 
+// Channels of the atlas, just enough to hold every image
+static int atlas_channels = 4;
+
 // static int image_widths[MAX_IMAGES];
 // static int image_heights[MAX_IMAGES];
 // static stbi_uc *image_pixels[MAX_IMAGES];
 
 void display_usage ( void );
 
+uint32_t pixel_rgba ( const stbi_uc *px, int channels ) {
+        unsigned char rgba[4];
+        blit_kernel( channels, 4 )( px, rgba, 1 );
+
+        uint32_t colour;
+        memcpy( &colour, rgba, sizeof( colour ) );
+        return colour;
+}
+
+// Find out whether image uses alpha and colour at all, or is just one colour
+void analyse_image ( struct image *img ) {
+        int n = img->channels;
+        size_t texels = (size_t) img->original.width * img->original.height;
+
+        img->has_alpha = false;
+        img->has_colour = false;
+
+        // First pixel speaks for all of a solid sprite
+        img->solid = blit_uniform( img->pixels, texels, n );
+        if ( img->solid ) {
+                texels = min( texels, (size_t) 1 );
+                img->colour = pixel_rgba( img->pixels, n );
+        }
+
+        bool check_alpha = n == 2 || n == 4;
+        bool check_colour = n >= 3;
+
+        for ( size_t i = 0; i < texels && ( check_alpha || check_colour ); ++i ) {
+                const stbi_uc *px = img->pixels + i * n;
+
+                if ( check_alpha && px[n - 1] != 255 ) {
+                        img->has_alpha = true;
+                        check_alpha = false;
+                }
+
+                if ( check_colour && ( px[0] != px[1] || px[1] != px[2] ) ) {
+                        img->has_colour = true;
+                        check_colour = false;
+                }
+        }
+}
+
+// Load image through the decode cache, returns whether it was a cache hit
+bool load_cached ( struct image *img ) {
+        size_t file_len;
+        const unsigned char *file = cache_map_file( img->name, &file_len );
+        if ( file == NULL ) {
+                return false;
+        }
+
+        uint64_t key = cache_hash( file, file_len, CACHE_VERSION );
+
+        cache_entry entry;
+        if ( cache_lookup( cache_dir, key, &entry ) ) {
+                cache_unmap_file( file, file_len );
+
+                img->original.width = entry.width;
+                img->original.height = entry.height;
+                img->channels = entry.channels;
+                img->pixels = entry.pixels;
+                img->has_alpha = entry.flags & CACHE_FLAG_ALPHA;
+                img->has_colour = entry.flags & CACHE_FLAG_COLOUR;
+                img->solid = entry.flags & CACHE_FLAG_SOLID;
+                img->colour = img->solid ? pixel_rgba( img->pixels, img->channels ) : 0;
+                img->cache = entry;
+
+                return true;
+        }
+
+        img->pixels = stbi_load_from_memory( file, file_len, &img->original.width,
+                                             &img->original.height, &img->channels, 0 );
+        cache_unmap_file( file, file_len );
+
+        if ( img->pixels == NULL ) {
+                return false;
+        }
+
+        analyse_image( img );
+
+        entry = (cache_entry) {
+            .width = img->original.width,
+            .height = img->original.height,
+            .channels = img->channels,
+            .flags = ( img->has_alpha ? CACHE_FLAG_ALPHA : 0 ) |
+                     ( img->has_colour ? CACHE_FLAG_COLOUR : 0 ) |
+                     ( img->solid ? CACHE_FLAG_SOLID : 0 ),
+            .pixels = img->pixels,
+        };
+
+        if ( !cache_store( cache_dir, key, &entry ) ) {
+                LOGW( "Failed to cache %s in %s\n", img->name, cache_dir );
+        }
+
+        return false;
+}
+
+// Decode pixels of image, returns whether they came from the cache
+bool load_pixels ( struct image *img ) {
+        if ( cache_dir != NULL ) {
+                return load_cached( img );
+        }
+
+        img->pixels = stbi_load( img->name, &img->original.width, &img->original.height, &img->channels, 0 );
+        if ( img->pixels != NULL ) {
+                analyse_image( img );
+        }
+
+        return false;
+}
+
+void release_pixels ( struct image *img ) {
+        if ( img->cache.map != NULL ) {
+                cache_release( &img->cache );
+        } else {
+                stbi_image_free( (void *) img->pixels );
+        }
+
+        img->pixels = NULL;
+}
+
+// Drop pixels of all images, decoded ones go with the load arena
+void release_images ( void ) {
+        for ( int i = 0; i < image_count; ++i ) {
+                if ( images[i].cache.map != NULL ) {
+                        cache_release( &images[i].cache );
+                }
+                images[i].pixels = NULL;
+        }
+
+        arena_reset( &arenas[PHASE_LOAD] );
+}
+
+double seconds ( void ) {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void report_stats ( void ) {
+        for ( int i = 0; i < PHASE_NUM; ++i ) {
+                LOGI( "Memory %-9s peak %8.2f MB\n", arenas[i].name, arenas[i].peak / ( 1024.0 * 1024.0 ) );
+        }
+
+        LOGI( "Memory %-9s peak %8.2f MB\n", "total", arena_total_peak() / ( 1024.0 * 1024.0 ) );
+
+        // Filtering included, speed is what the PNG writer managed on all threads
+        if ( png_stats.filtered > 0 ) {
+                double mb = png_stats.filtered / ( 1024.0 * 1024.0 );
+                LOGI( "PNG level %d %8.2f MB filtered to %.2f MB, ratio %.2f at %.1f MB/s\n", compression_level, mb,
+                      png_stats.compressed / ( 1024.0 * 1024.0 ), (double) png_stats.filtered / png_stats.compressed,
+                      mb / png_stats.seconds );
+        }
+        if ( block_stats.pixels > 0 ) {
+                double mpx = block_stats.pixels / 1e6;
+                LOGI( "Blocks %s %.2f Mpx encoded at %.2f Mpx/s\n", bc_name( block_format ), mpx,
+                      mpx / block_stats.seconds );
+        }
+        if ( zlib_stats.uncompressed > 0 ) {
+                double mb = zlib_stats.uncompressed / ( 1024.0 * 1024.0 );
+                LOGI( "KTX2 zlib level %d %8.2f MB of levels to %.2f MB, ratio %.2f at %.1f MB/s\n",
+                      compression_level, mb, zlib_stats.compressed / ( 1024.0 * 1024.0 ),
+                      (double) zlib_stats.uncompressed / zlib_stats.compressed, mb / zlib_stats.seconds );
+        }
+        LOGI( "Blit kernels %s on %d threads\n", blit_isa(), pool_threads( workers ) );
+        LOGI( "Checksum kernels %s\n", checksum_isa() );
+}
+
+// Find out size and channels of image without keeping its pixels around
+bool probe_image ( struct image *img ) {
+        // Decoded once up front so colour, alpha and solid sprites are told
+        // apart same as without bands. One image at a time is no more than
+        // bands hold anyway. A cache miss stores the entry, later loads just
+        // map it.
+        load_pixels( img );
+        if ( img->pixels == NULL ) {
+                return false;
+        }
+
+        release_pixels( img );
+        return true;
+}
+
+// Room sprite takes in the layout
+bool is_collapsible ( const struct image *img ) {
+        return img->solid && (int64_t) img->original.width * img->original.height > SOLID_SIZE * SOLID_SIZE;
+}
+
+bool is_collapsed ( const struct image *img ) {
+        return img->size.width != img->original.width || img->size.height != img->original.height;
+}
+
+// Move collapsed sprites of a colour that already has a cell behind all
+// others, pointing them at that cell. Returns how many have a cell of their own.
+int share_solid_cells ( void ) {
+        static struct image shared[MAX_IMAGES];
+        int shared_count = 0;
+        int own = 0;
+
+        for ( int i = 0; i < image_count; ++i ) {
+                struct image img = images[i];
+                img.shares = -1;
+
+                for ( int j = 0; j < own && is_collapsed( &img ); ++j ) {
+                        if ( is_collapsed( &images[j] ) && images[j].colour == img.colour ) {
+                                img.shares = j;
+                                break;
+                        }
+                }
+
+                if ( img.shares < 0 ) {
+                        images[own++] = img;
+                        continue;
+                }
+
+                // Never drawn, no need to keep the pixels
+                if ( img.pixels != NULL ) {
+                        release_pixels( &img );
+                }
+                shared[shared_count++] = img;
+        }
+
+        memcpy( images + own, shared, sizeof( struct image ) * shared_count );
+
+        return own;
+}
+
+struct rect cell_size ( struct rect size ) {
+        int width = size.width + 2 * extrude + padding;
+        int height = size.height + 2 * extrude + padding;
+
+        return (struct rect) {
+            .width = ( width + cell_align.width - 1 ) / cell_align.width * cell_align.width,
+            .height = ( height + cell_align.height - 1 ) / cell_align.height * cell_align.height,
+        };
+}
+
+// Copy rows [row_begin, row_end) of image placed at atlas position at into
+// band of the atlas which starts at row band_y. Rows reach up to extrude
+// past the image, those repeat its edge rows.
+void blit_image ( const struct image *img, vec2 at, unsigned char *band, int width,
+                  int band_y, int row_begin, int row_end ) {
+        // Collapsed sprite has more pixels than its size needs, all the same
+        size_t src_stride = (size_t) img->size.width * img->channels;
+        size_t dst_stride = (size_t) width * atlas_channels;
+
+        blit_row_fn kernel = blit_kernel( img->channels, atlas_channels );
+        unsigned char *dst = band + (size_t) ( at.y + row_begin - band_y ) * dst_stride +
+                             (size_t) at.x * atlas_channels;
+
+        for ( int h = row_begin; h < row_end; ++h ) {
+                int src_row = min( max( h, 0 ), img->size.height - 1 );
+
+                kernel( img->pixels + src_row * src_stride, dst, img->size.width );
+
+                // Done while row is still in cache, opaque sprites stay as they are.
+                // Premultiplying zeroes transparent colour on its own.
+                if ( img->has_alpha && premultiply ) {
+                        blit_premultiply( dst, img->size.width, atlas_channels, srgb );
+                } else if ( img->has_alpha && clean_alpha == CLEAN_ALPHA_ZERO ) {
+                        blit_clear_transparent( dst, img->size.width, atlas_channels );
+                } else if ( img->has_alpha && clean_alpha == CLEAN_ALPHA_DILATE ) {
+                        blit_dilate( img->pixels, src_stride, img->channels, img->size.width,
+                                     img->size.height, src_row, dst, atlas_channels );
+                }
+
+                blit_extrude( dst, img->size.width, atlas_channels, extrude );
+
+                dst += dst_stride;
+        }
+}
+
 vec2 edge_parallel ( struct edge edge ) {
         struct vec2 change = {
             edge.end.x - edge.start.x,
@@ -179,7 +713,7 @@ void pack ( struct image img, int max_width ) {
                 image_locations[image_location_count++] = (vec2) { 0, 0 };
 
                 outmost.topleft = (vec2) { 0, 0 };
-                outmost.bottomright = (vec2) { img.size.width, img.size.height };
+                outmost.bottomright = (vec2) { cell_size( img.size ).width, cell_size( img.size ).height };
 
                 return;
         }
@@ -189,13 +723,15 @@ void pack ( struct image img, int max_width ) {
 
         vec2 prev = image_locations[image_location_count - 1];
         vec2 new = (vec2) {
-            prev.x + images[image_location_count - 1].size.width,
+            prev.x + cell_size( images[image_location_count - 1].size ).width,
             prev.y,
         };
 
+        struct rect cell = cell_size( images[image_location_count].size );
+
         vec2 corner = (vec2) {
-            new.x + images[image_location_count].size.width,
-            new.y + images[image_location_count].size.height,
+            new.x + cell.width,
+            new.y + cell.height,
         };
 
         if ( corner.x > max_width ) {
@@ -205,154 +741,1304 @@ void pack ( struct image img, int max_width ) {
                 };
 
                 corner = (vec2) {
-                    new.x + images[image_location_count].size.width,
-                    new.y + images[image_location_count].size.height,
+                    new.x + cell.width,
+                    new.y + cell.height,
                 };
         }
 
         image_locations[image_location_count++] = new;
 
         outmost = new_outmost( new, corner );
-
-        printf( "Outmost %d %d %d %d\n", outmost.topleft.x, outmost.topleft.y,
-                outmost.bottomright.x, outmost.bottomright.y );
 }
 
-int main ( int argc, char **argv ) {
-        // Process arguments
-        {
-                bool arg_processing = true;
-                for ( int i = 1; i < argc; ++i ) {
-                        if ( arg_processing ) {
-                                if ( strcmp( "-o", argv[i] ) == 0 ) {
-                                        metadata_output = argv[++i];
-                                        continue;
-                                }
-                                if ( strcmp( "-i", argv[i] ) == 0 ) {
-                                        image_output = argv[++i];
-                                        continue;
-                                }
+struct compose_job {
+        unsigned char *band;
+        int width;
+        int band_y;
+        int rows;
+        int tile_rows;
+        vec2 offset;
+};
 
-                                if ( strcmp( "-h", argv[i] ) == 0 ) {
-                                        display_usage();
-                                        return 0;
-                                }
+// Clear one tile of band rows and blit every sprite crossing it. Sprites
+// never overlap, so tiles are independent of each other.
+void compose_tile ( void *arg, int index ) {
+        const struct compose_job *job = arg;
+        size_t row_bytes = (size_t) job->width * atlas_channels;
 
-                                if ( strcmp( "--", argv[i] ) == 0 ) {
-                                        arg_processing = false;
-                                        continue;
-                                }
-                        } else {
-                                // Add image to image list
-                                images[image_count++].name = argv[i];
-                        }
+        int tile_y = job->band_y + index * job->tile_rows;
+        int tile_end = min( tile_y + job->tile_rows, job->band_y + job->rows );
+
+        memset( job->band + (size_t) ( tile_y - job->band_y ) * row_bytes, 0,
+                (size_t) ( tile_end - tile_y ) * row_bytes );
+
+        for ( int i = 0; i < own_cell_count; ++i ) {
+                const struct image *img = &images[i];
+                vec2 at = (vec2) {
+                    image_locations[i].x + job->offset.x + extrude,
+                    image_locations[i].y + job->offset.y + extrude,
+                };
+
+                int row_begin = max( tile_y - at.y, -extrude );
+                int row_end = min( tile_end - at.y, img->size.height + extrude );
+                if ( row_begin >= row_end ) {
+                        continue;
                 }
-        }
 
-        // Error on no images, we don't pack voids here
-        if ( image_count == 0 ) {
-                LOGE( "Expected images to pack\n" );
-                display_usage();
-                return -1;
+                blit_image( img, at, job->band, job->width, job->band_y, row_begin, row_end );
         }
+}
 
-        // Warn on single image, it's just copying it
-        if ( image_count == 1 ) {
-                LOGW( "Packing single image is just copying it\n" );
-        }
+// Compose rows [band_y, band_y + rows) of the atlas into band on all threads,
+// every sprite crossing them must have its pixels loaded
+void compose ( unsigned char *band, int width, int band_y, int rows, vec2 offset ) {
+        size_t row_bytes = (size_t) width * atlas_channels;
+
+        struct compose_job job = {
+            .band = band,
+            .width = width,
+            .band_y = band_y,
+            .rows = rows,
+            .tile_rows = (int) max( COMPOSE_TILE_BYTES / row_bytes, (size_t) 1 ),
+            .offset = offset,
+        };
 
-        LOGI( "Packing textures\n" );
+        pool_run( workers, compose_tile, &job, ( rows + job.tile_rows - 1 ) / job.tile_rows );
+}
 
-        // Load images to memory
-        for ( int i = 0; i < image_count; ++i ) {
-                LOGT( "Loading %s\n", images[i].name );
-                images[i].pixels = stbi_load( images[i].name, &images[i].size.width,
-                                              &images[i].size.height, NULL, 4 );
-                CHANGE();
-                LOGT( "Loaded %s\n", images[i].name );
+// Destination of atlas rows, PNG, packed pixels or blocks with or without header
+struct atlas_writer {
+        pngw png;
+
+        FILE *file;
+        int width;
+        format_converter packed;
+        unsigned char *row;
+
+        // Swizzled output gathers a row of tiles before writing it out
+        unsigned char *tiles;
+        size_t padded_width;
+        int tile_rows;
+
+        // Held KTX2 levels, none when rows go straight out. The first fills
+        // up as rows come and the next gathers them halved.
+        ktx2_level levels[KTX2_MAX_LEVELS];
+        int level_count;
+        int height;
+        size_t filled;
+        unsigned char *half;
+        int half_rows;
+
+        // Last two rows of the band before, a lone last row of odd height
+        // folds into the half row they made
+        unsigned char *tail;
+};
+
+// Anything but plain RGBA8 in rows of PNG goes out as packed pixels, blocks
+// or KTX2 levels. Raw RGBA8 goes out packed too, only without the header.
+bool packed_output ( void ) {
+        return block_output || raw_output || container == CONTAINER_KTX2 || pixel_format != FORMAT_RGBA8 ||
+               swizzle_layout != SWIZZLE_LINEAR;
+}
+
+// Round up to whole swizzled tiles
+size_t swizzled_side ( size_t side ) {
+        if ( swizzle_layout == SWIZZLE_LINEAR ) {
+                return side;
         }
 
-        // Bubble Sort images based on their size
-        for ( int i = 0; i < image_count; ++i ) {
-                for ( int j = 0; j < image_count - 1; ++j ) {
-                        // // Don't check element against itself
-                        // if ( i == j ) {
-                        //         continue;
-                        // }
+        return ( side + swizzle_tile - 1 ) & ~(size_t) ( swizzle_tile - 1 );
+}
 
-                        int current_score =
-                            images[j]
-                                .size.height;                      // images[j].size.width * images[j].size.height;
-                        int next_score = images[j + 1].size.width; // images[j + 1].size.width *
-                                                                   // images[j + 1].size.height;
+void png_run ( void *ctx, pngw_job_fn fn, void *arg, int count ) {
+        pool_run( (pool *) ctx, fn, arg, count );
+}
 
-                        // If next image is bigger swap
-                        if ( next_score > current_score ) {
-                                struct image buf = images[j];
-                                images[j] = images[j + 1];
-                                images[j + 1] = buf;
-                        }
-                }
+void block_run ( void *ctx, bc_job_fn fn, void *arg, int count ) {
+        pool_run( (pool *) ctx, fn, arg, count );
+}
+
+// KTX2 levels are held until the last one is done when their lengths
+// aren't known up front or the smallest has to go out first
+bool held_levels ( void ) {
+        return container == CONTAINER_KTX2 && ( mip_chain || supercompression != KTX2_SUPERCOMPRESSION_NONE );
+}
+
+// Levels of the atlas, one unless the whole mip chain goes out
+int level_count ( int width, int height ) {
+        int count = 1;
+        while ( mip_chain && ( width > 1 || height > 1 ) ) {
+                width = max( width / 2, 1 );
+                height = max( height / 2, 1 );
+                count += 1;
         }
 
-        int max_width = images[0].size.width + images[1].size.width;
+        return count;
+}
 
-        for ( int i = 0; i < image_count; ++i ) {
-                pack( images[i], max_width );
+// KTX2 format of the atlas, RGBA8 unless it's block compressed
+uint32_t ktx2_format ( void ) {
+        if ( block_output ) {
+                return vk_formats[block_format][srgb];
         }
 
-        // Print locations
-        for ( int i = 0; i < image_location_count; ++i ) {
-                printf( "%s X: %d Y: %d W: %d H %d\n", images[i].name, image_locations[i].x,
-                        image_locations[i].y, images[i].size.width, images[i].size.height );
+        return srgb ? KTX2_VK_FORMAT_R8G8B8A8_SRGB : KTX2_VK_FORMAT_R8G8B8A8_UNORM;
+}
+
+// Bytes of level of width by height pixels, blocks sticking out of it count
+// as whole ones
+size_t level_len ( int width, int height ) {
+        if ( !block_output ) {
+                return (size_t) width * height * 4;
         }
 
-        int width = outmost.bottomright.x - outmost.topleft.x;
-        int height = outmost.bottomright.y - outmost.topleft.y;
+        size_t across = ( width + cell_align.width - 1 ) / cell_align.width;
+        size_t down = ( height + cell_align.height - 1 ) / cell_align.height;
+        return across * down * bc_block_bytes( block_format );
+}
 
-        unsigned char *data = malloc( sizeof( unsigned char ) * width * height * 4 );
+// DDS or KTX2 header of block compressed or KTX2 RGBA8 atlas, sRGB colour
+// picks sRGB formats where there are some
+bool write_block_header ( FILE *file, int width, int height ) {
+        if ( container == CONTAINER_KTX2 ) {
+                return ktx2_write_header( file, ktx2_format(), width, height, premultiply, level_len( width, height ) );
+        }
 
-        int x_offset = -outmost.topleft.x;
-        int y_offset = -outmost.topleft.y;
+        return dds_write_block_header( file, width, height, dxgi_formats[block_format][srgb],
+                                       bc_block_bytes( block_format ), premultiply );
+}
 
-        for ( int i = 0; i < image_count; ++i ) {
-                struct image img = images[i];
-                vec2 topleft = image_locations[i];
+struct halve_job {
+        const unsigned char *src;
+        size_t stride;
+        int width;
+        int height;
+        unsigned char *dst;
+        int rows;
+        int tile_rows;
+};
 
-                printf( "Writing %s at %d %d\n", images[i].name, topleft.x, topleft.y );
+void halve_tile ( void *arg, int index ) {
+        const struct halve_job *job = arg;
+        size_t half_row = (size_t) max( job->width / 2, 1 ) * 4;
 
-                for ( int h = 0; h < img.size.height; ++h ) {
-                        for ( int w = 0; w < img.size.width; ++w ) {
-                                int pixel_idx = ( h * img.size.width + w ) * 4;
-                                int global_pixel_idx =
-                                    ( ( topleft.y + h + y_offset ) * width + w + topleft.x + x_offset ) * 4;
+        int begin = index * job->tile_rows;
+        int end = min( begin + job->tile_rows, job->rows );
+        for ( int y = begin; y < end; ++y ) {
+                blit_halve( job->src, job->stride, job->width, job->height, y, job->dst + y * half_row, 4, srgb,
+                            premultiply );
+        }
+}
 
-                                // printf( "Pixel idx %d\n", pixel_idx );
-                                // printf( "GPixel idx %d\n", global_pixel_idx );
+// First rows of width by height RGBA8 pixels halved into dst on all threads
+void halve ( const unsigned char *src, size_t stride, int width, int height, unsigned char *dst, int rows ) {
+        struct halve_job job = {
+            .src = src,
+            .stride = stride,
+            .width = width,
+            .height = height,
+            .dst = dst,
+            .rows = rows,
+            .tile_rows = (int) max( COMPOSE_TILE_BYTES / ( 2 * stride ), (size_t) 1 ),
+        };
 
-                                data[global_pixel_idx] = img.pixels[pixel_idx];
-                                data[global_pixel_idx + 1] = img.pixels[pixel_idx + 1];
-                                data[global_pixel_idx + 2] = img.pixels[pixel_idx + 2];
-                                data[global_pixel_idx + 3] = img.pixels[pixel_idx + 3];
-                        }
+        pool_run( workers, halve_tile, &job, ( rows + job.tile_rows - 1 ) / job.tile_rows );
+}
+
+// Level of width by count pixels into out, blocks or RGBA8 as it is. Blocks
+// sticking out of smaller levels repeat their last column and row.
+bool encode_level ( const unsigned char *rows, size_t stride, int width, int count, unsigned char *out ) {
+        if ( !block_output ) {
+                for ( int y = 0; y < count; ++y ) {
+                        memcpy( out + (size_t) y * width * 4, rows + y * stride, (size_t) width * 4 );
                 }
+                return true;
         }
 
-        LOGI( "Atlas generated\n" );
+        int padded_width = ( width + cell_align.width - 1 ) / cell_align.width * cell_align.width;
+        int padded_count = ( count + cell_align.height - 1 ) / cell_align.height * cell_align.height;
+        unsigned char *padded = NULL;
 
-        stbi_write_png( image_output, width, height, 4, data,
-                        sizeof( unsigned char ) * width * 4 );
+        if ( padded_width != width || padded_count != count ) {
+                size_t padded_row = (size_t) padded_width * 4;
+                padded = arena_alloc( &arenas[PHASE_ENCODE], padded_row * padded_count );
+                if ( padded == NULL ) {
+                        return false;
+                }
 
-        // Output the correct metadata
+                for ( int y = 0; y < padded_count; ++y ) {
+                        unsigned char *row = padded + y * padded_row;
+                        memcpy( row, rows + min( y, count - 1 ) * stride, (size_t) width * 4 );
+                        for ( int x = width; x < padded_width; ++x ) {
+                                memcpy( row + x * 4, row + ( width - 1 ) * 4, 4 );
+                        }
+                }
 
-        LOGI( "Generate metadata\n" );
+                rows = padded;
+                stride = padded_row;
+        }
 
-        const int base_len = 1024 * 4;
+        double start = seconds();
+        bc_encode_rows( block_format, block_quality, rows, stride, padded_width, padded_count, out, block_run,
+                        workers );
+        block_stats.seconds += seconds() - start;
+        block_stats.pixels += (size_t) padded_width * padded_count;
 
-        meta_value image_data = meta_new_array();
+        arena_free( padded );
+        return true;
+}
 
-        for ( int i = 0; i < image_count; ++i ) {
-                float uv_left = (float) image_locations[i].x / (float) width;
+// Room for the whole first level and the next one gathering it halved
+bool levels_begin ( struct atlas_writer *w, int height ) {
+        w->height = height;
+        w->level_count = level_count( w->width, height );
+
+        size_t len = level_len( w->width, height );
+        unsigned char *data = arena_alloc( &arenas[PHASE_ENCODE], len );
+        w->levels[0] = (ktx2_level) { .data = data, .len = len, .uncompressed_len = len };
+
+        if ( w->level_count > 1 ) {
+                w->half = arena_alloc( &arenas[PHASE_ENCODE],
+                                       (size_t) max( w->width / 2, 1 ) * max( height / 2, 1 ) * 4 );
+                w->tail = arena_alloc( &arenas[PHASE_ENCODE], (size_t) w->width * 4 * 3 );
+                if ( w->half == NULL || w->tail == NULL ) {
+                        return false;
+                }
+        }
+
+        return data != NULL;
+}
+
+// Levels are deflated in pieces of this many bytes on all workers, every
+// piece matches against the window in front of it
+#define ZLIB_PIECE ( (size_t) 1 << 20 )
+
+struct zlib_piece {
+        const unsigned char *data;
+        size_t dict_len;
+        size_t len;
+        bool final;
+
+        unsigned char *compressed;
+        size_t compressed_len;
+};
+
+void zlib_piece_job ( void *arg, int index ) {
+        struct zlib_piece *piece = (struct zlib_piece *) arg + index;
+        piece->compressed = deflate_compress( piece->data - piece->dict_len, piece->dict_len, piece->len,
+                                              compression_level, piece->final, &piece->compressed_len );
+}
+
+// Replace every level by a zlib stream of it, uncompressed lengths stay
+bool zlib_levels ( ktx2_level *levels, int count ) {
+        int piece_count = 0;
+        for ( int l = 0; l < count; ++l ) {
+                piece_count += (int) ( ( levels[l].len + ZLIB_PIECE - 1 ) / ZLIB_PIECE );
+        }
+
+        struct zlib_piece *pieces = arena_calloc( &arenas[PHASE_ENCODE], piece_count, sizeof( *pieces ) );
+        if ( pieces == NULL ) {
+                return false;
+        }
+
+        struct zlib_piece *piece = pieces;
+        for ( int l = 0; l < count; ++l ) {
+                for ( size_t offset = 0; offset < levels[l].len; offset += ZLIB_PIECE, ++piece ) {
+                        piece->data = (const unsigned char *) levels[l].data + offset;
+                        piece->dict_len = min( offset, (size_t) DEFLATE_WINDOW );
+                        piece->len = min( (size_t) levels[l].len - offset, ZLIB_PIECE );
+                        piece->final = offset + piece->len == levels[l].len;
+                }
+        }
+
+        double start = seconds();
+        pool_run( workers, zlib_piece_job, pieces, piece_count );
+
+        // Header, pieces one after another, then Adler-32 of the whole level
+        bool ok = true;
+        piece = pieces;
+        for ( int l = 0; l < count; ++l ) {
+                int level_pieces = (int) ( ( levels[l].len + ZLIB_PIECE - 1 ) / ZLIB_PIECE );
+                size_t len = 2 + 4;
+                for ( int i = 0; i < level_pieces; ++i ) {
+                        ok = ok && piece[i].compressed != NULL;
+                        len += piece[i].compressed_len;
+                }
+
+                unsigned char *stream = ok ? arena_alloc( &arenas[PHASE_ENCODE], len ) : NULL;
+                ok = stream != NULL;
+                if ( ok ) {
+                        deflate_zlib_header( compression_level, stream );
+                        size_t pos = 2;
+                        for ( int i = 0; i < level_pieces; ++i ) {
+                                memcpy( stream + pos, piece[i].compressed, piece[i].compressed_len );
+                                pos += piece[i].compressed_len;
+                        }
+
+                        uint32_t adler = checksum_adler32( CHECKSUM_ADLER32_INIT, levels[l].data, levels[l].len );
+                        for ( int b = 0; b < 4; ++b ) {
+                                stream[pos + b] = (unsigned char) ( adler >> ( 24 - 8 * b ) );
+                        }
+
+                        zlib_stats.uncompressed += levels[l].len;
+                        zlib_stats.compressed += len;
+                        arena_free( (void *) levels[l].data );
+                        levels[l].data = stream;
+                        levels[l].len = len;
+                }
+
+                piece += level_pieces;
+        }
+
+        for ( int i = 0; i < piece_count; ++i ) {
+                arena_free( pieces[i].compressed );
+        }
+        arena_free( pieces );
+        zlib_stats.seconds += seconds() - start;
+
+        return ok;
+}
+
+// Halve the rest of the mip chain out of the second level, supercompress
+// every level and write them all, smallest first
+bool levels_end ( struct atlas_writer *w ) {
+        int width = w->width;
+        int height = w->height;
+        unsigned char *pixels = w->half;
+        bool ok = w->half_rows == max( height / 2, 1 ) || w->level_count == 1;
+        int done = 1;
+
+        for ( ; ok && done < w->level_count; ++done ) {
+                width = max( width / 2, 1 );
+                height = max( height / 2, 1 );
+
+                size_t len = level_len( width, height );
+                unsigned char *data = arena_alloc( &arenas[PHASE_ENCODE], len );
+                w->levels[done] = (ktx2_level) { .data = data, .len = len, .uncompressed_len = len };
+                ok = data != NULL && encode_level( pixels, (size_t) width * 4, width, height, data );
+
+                // Next level is made from this one before it's let go
+                unsigned char *next = NULL;
+                if ( ok && done + 1 < w->level_count ) {
+                        size_t next_len = (size_t) max( width / 2, 1 ) * max( height / 2, 1 ) * 4;
+                        next = arena_alloc( &arenas[PHASE_ENCODE], next_len );
+                        ok = next != NULL;
+                        if ( ok ) {
+                                halve( pixels, (size_t) width * 4, width, height, next, max( height / 2, 1 ) );
+                        }
+                }
+
+                arena_free( pixels );
+                pixels = next;
+        }
+        arena_free( pixels );
+        arena_free( w->tail );
+
+        if ( ok && supercompression == KTX2_SUPERCOMPRESSION_ZLIB ) {
+                ok = zlib_levels( w->levels, w->level_count );
+        }
+
+        ok = ok && ktx2_write( w->file, ktx2_format(), w->width, w->height, premultiply, supercompression, w->levels,
+                               w->level_count );
+
+        for ( int l = 0; l < done; ++l ) {
+                arena_free( (void *) w->levels[l].data );
+        }
+
+        return ok;
+}
+
+bool atlas_begin ( struct atlas_writer *w, FILE *file, int width, int height ) {
+        *w = (struct atlas_writer) { .file = file, .width = width };
+
+        if ( palette_colours > 0 || !packed_output() ) {
+                bool ok = palette_colours > 0
+                              ? pngw_begin_indexed( &w->png, pngw_write_file, file, width, height, palette.palette,
+                                                    palette.colours, compression_level )
+                              : pngw_begin( &w->png, pngw_write_file, file, width, height, atlas_channels,
+                                            compression_level );
+
+                // Bands are filtered and deflated on all workers
+                pngw_set_runner( &w->png, png_run, workers );
+                pngw_set_strategy( &w->png, png_strategy );
+                pngw_set_budget( &w->png, png_budget );
+                return ok;
+        }
+
+        if ( held_levels() ) {
+                return levels_begin( w, height );
+        }
+
+        if ( block_output || container == CONTAINER_KTX2 ) {
+                return raw_output || write_block_header( file, width, height );
+        }
+
+        const format_desc *desc = format_describe( pixel_format );
+        uint32_t masks[4];
+        for ( int c = 0; c < 4; ++c ) {
+                masks[c] = format_mask( desc, c );
+        }
+
+        if ( swizzle_layout != SWIZZLE_LINEAR ) {
+                // Converted rows land in the tile row buffer, padding stays zero
+                w->padded_width = swizzled_side( width );
+                size_t len = w->padded_width * swizzle_tile * desc->bytes;
+                w->tiles = arena_alloc( &arenas[PHASE_ENCODE], len );
+                w->row = arena_alloc( &arenas[PHASE_ENCODE], len );
+                if ( w->tiles == NULL || w->row == NULL ) {
+                        return false;
+                }
+                memset( w->tiles, 0, len );
+        } else {
+                w->row = arena_alloc( &arenas[PHASE_ENCODE], (size_t) width * desc->bytes );
+        }
+
+        return w->row != NULL && format_begin( &w->packed, pixel_format, dither, width ) &&
+               ( raw_output || dds_write_header( file, width, height, desc->bytes * 8, masks,
+                                                 dxgi_packed_formats[pixel_format][srgb], premultiply ) );
+}
+
+// Swizzle gathered row of tiles and write it out
+bool atlas_flush_tiles ( struct atlas_writer *w ) {
+        int bytes = w->packed.desc->bytes;
+        size_t row_len = w->padded_width * bytes;
+
+        // Last row of tiles sticks out of the atlas, the rest is padding
+        memset( w->tiles + w->tile_rows * row_len, 0, ( swizzle_tile - w->tile_rows ) * row_len );
+
+        swizzle_tiles( swizzle_layout, swizzle_tile, bytes, w->tiles, row_len, w->padded_width, w->row );
+        w->tile_rows = 0;
+
+        return fwrite( w->row, row_len * swizzle_tile, 1, w->file ) == 1;
+}
+
+bool png_write_rows ( struct atlas_writer *w, const unsigned char *rows, size_t stride, int count ) {
+        double start = seconds();
+        bool ok = pngw_write_rows( &w->png, rows, stride, count );
+        png_stats.seconds += seconds() - start;
+        return ok;
+}
+
+// Whole rows of blocks on all workers or RGBA8 rows of KTX2, bands are cut
+// so count is a multiple of the block height. Held levels keep them and
+// gather them halved into the next level, otherwise they go straight out.
+bool level_write_rows ( struct atlas_writer *w, const unsigned char *rows, size_t stride, int count ) {
+        size_t len = level_len( w->width, count );
+        bool held = w->level_count > 0;
+
+        unsigned char *out = held ? (unsigned char *) w->levels[0].data + w->filled
+                                  : arena_alloc( &arenas[PHASE_ENCODE], len );
+        if ( out == NULL || !encode_level( rows, stride, w->width, count, out ) ) {
+                if ( !held ) {
+                        arena_free( out );
+                }
+                return false;
+        }
+
+        if ( held ) {
+                w->filled += len;
+
+                if ( w->half == NULL ) {
+                        return true;
+                }
+
+                // Bands of mip chains come in even counts. A lone last row of
+                // odd height goes under the two rows before it and their half
+                // row is made again from all three, same as in a whole atlas.
+                size_t row_len = (size_t) w->width * 4;
+                size_t half_len = (size_t) max( w->width / 2, 1 ) * 4;
+                if ( count == 1 && w->half_rows > 0 ) {
+                        memcpy( w->tail + 2 * row_len, rows, row_len );
+                        halve( w->tail, row_len, w->width, 3, w->half + ( w->half_rows - 1 ) * half_len, 1 );
+                        return true;
+                }
+
+                int half_rows = max( count / 2, 1 );
+                halve( rows, stride, w->width, count, w->half + w->half_rows * half_len, half_rows );
+                w->half_rows += half_rows;
+
+                for ( int y = 0; y < 2 && count >= 2; ++y ) {
+                        memcpy( w->tail + y * row_len, rows + ( count - 2 + y ) * stride, row_len );
+                }
+                return true;
+        }
+
+        bool ok = fwrite( out, len, 1, w->file ) == 1;
+        arena_free( out );
+        return ok;
+}
+
+bool atlas_write_rows ( struct atlas_writer *w, const unsigned char *rows, size_t stride, int count ) {
+        if ( palette_colours > 0 ) {
+                // Whole band is mapped first, PNG compresses every call on its own
+                size_t width = (size_t) w->png.width;
+                unsigned char *indices = arena_alloc( &arenas[PHASE_ENCODE], width * count );
+                if ( indices == NULL ) {
+                        return false;
+                }
+
+                for ( int y = 0; y < count; ++y ) {
+                        quant_map_row( &palette, rows + y * stride, width, indices + y * width );
+                }
+
+                bool ok = png_write_rows( w, indices, width, count );
+                arena_free( indices );
+                return ok;
+        }
+
+        if ( !packed_output() ) {
+                return png_write_rows( w, rows, stride, count );
+        }
+
+        if ( block_output || container == CONTAINER_KTX2 ) {
+                return level_write_rows( w, rows, stride, count );
+        }
+
+        size_t row_len = w->packed.width * w->packed.desc->bytes;
+
+        if ( swizzle_layout != SWIZZLE_LINEAR ) {
+                size_t tile_row_len = w->padded_width * w->packed.desc->bytes;
+
+                for ( int y = 0; y < count; ++y ) {
+                        format_convert_row( &w->packed, rows + y * stride, w->tiles + w->tile_rows * tile_row_len );
+                        if ( ++w->tile_rows == swizzle_tile && !atlas_flush_tiles( w ) ) {
+                                return false;
+                        }
+                }
+
+                return true;
+        }
+
+        for ( int y = 0; y < count; ++y ) {
+                format_convert_row( &w->packed, rows + y * stride, w->row );
+                if ( fwrite( w->row, row_len, 1, w->file ) != 1 ) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+bool atlas_end ( struct atlas_writer *w ) {
+        if ( palette_colours > 0 || !packed_output() ) {
+                png_stats.filtered = w->png.filtered_len;
+                png_stats.compressed = w->png.compressed_len;
+                return pngw_end( &w->png );
+        }
+
+        if ( w->level_count > 0 ) {
+                return levels_end( w );
+        }
+
+        bool ok = w->tiles == NULL || w->tile_rows == 0 || atlas_flush_tiles( w );
+
+        format_end( &w->packed );
+        if ( w->tiles != NULL ) {
+                arena_free( w->tiles );
+        }
+        if ( w->row != NULL ) {
+                arena_free( w->row );
+        }
+
+        return ok;
+}
+
+void quant_run ( void *ctx, quant_job_fn fn, void *arg, int count ) {
+        pool_run( (pool *) ctx, fn, arg, count );
+}
+
+bool build_palette ( void ) {
+        if ( !quant_build( &palette, palette_colours, quant_run, workers ) ) {
+                LOGE( "Failed to build palette\n" );
+                return false;
+        }
+
+        LOGI( "Palette of %d colours from %zu%s\n", palette.colours, palette.len,
+              palette.shift > 0 ? " colour buckets" : " colours" );
+
+        return true;
+}
+
+// Image given as - goes to stdout, see claim_stdout
+FILE *open_image ( void ) {
+        if ( image_fd >= 0 ) {
+                return fdopen( image_fd, "wb" );
+        }
+
+        return fopen( image_output, "wb" );
+}
+
+// Write rows of the atlas in one go
+int write_atlas ( const unsigned char *data, int width, int height ) {
+        FILE *f = open_image();
+        if ( f == NULL ) {
+                LOGE( "Failed to open %s\n", image_output );
+                return -1;
+        }
+
+        size_t row_bytes = (size_t) width * atlas_channels;
+
+        if ( palette_colours > 0 ) {
+                quant_add_rows( &palette, data, row_bytes, width, height );
+                if ( !build_palette() ) {
+                        fclose( f );
+                        return -1;
+                }
+        }
+
+        struct atlas_writer writer;
+        bool ok = atlas_begin( &writer, f, width, height ) &&
+                  atlas_write_rows( &writer, data, row_bytes, height );
+        ok = atlas_end( &writer ) && ok;
+        ok = fclose( f ) == 0 && ok;
+
+        if ( !ok ) {
+                LOGE( "Failed to write %s\n", image_output );
+                return -1;
+        }
+
+        return 0;
+}
+
+// Compose band of the atlas, decoding sprites crossing it and releasing
+// those that end in it. Adds up bytes of sprites left alive to live.
+bool compose_band ( unsigned char *band, int width, int band_y, int rows, vec2 offset, size_t *live ) {
+        for ( int i = 0; i < own_cell_count; ++i ) {
+                struct image *img = &images[i];
+                int top = image_locations[i].y + offset.y;
+                int bottom = top + img->size.height + 2 * extrude;
+
+                if ( bottom <= band_y || top >= band_y + rows ) {
+                        continue;
+                }
+
+                if ( img->pixels == NULL ) {
+                        load_pixels( img );
+                        if ( img->pixels == NULL ) {
+                                LOGE( "Failed to load %s\n", img->name );
+                                return false;
+                        }
+                }
+        }
+
+        compose( band, width, band_y, rows, offset );
+
+        // Sprites are done once the band reaches their bottom
+        for ( int i = 0; i < own_cell_count; ++i ) {
+                struct image *img = &images[i];
+                int bottom = image_locations[i].y + offset.y + img->size.height + 2 * extrude;
+
+                if ( img->pixels == NULL ) {
+                        continue;
+                }
+
+                if ( bottom <= band_y + rows ) {
+                        release_pixels( img );
+                } else if ( img->cache.map == NULL ) {
+                        *live += (size_t) img->original.width * img->original.height * img->channels;
+                }
+        }
+
+        return true;
+}
+
+// Assemble and write the atlas in horizontal bands. Only sprites crossing
+// the current band are decoded, so memory stays around the budget.
+int write_banded ( int width, int height, vec2 offset ) {
+        size_t row_bytes = (size_t) width * atlas_channels;
+
+        // Band itself, its filtered copy and compressed data are alive at once
+        size_t band_rows = memory_budget / ( 3 * row_bytes );
+        if ( band_rows < 1 ) {
+                band_rows = 1;
+        }
+        if ( band_rows > (size_t) height ) {
+                band_rows = height;
+        }
+
+        // Blocks are encoded from whole rows of them, height is a multiple too.
+        // Bands of mip chains halve on their own, so they come in even counts.
+        size_t band_align = mip_chain && cell_align.height % 2 != 0 ? 2 * cell_align.height : cell_align.height;
+        band_rows = max( band_rows / band_align * band_align, band_align );
+
+        LOGI( "Assembling in bands of %zu rows\n", band_rows );
+
+        unsigned char *band = arena_alloc( &arenas[PHASE_BLIT], band_rows * row_bytes );
+        if ( band == NULL ) {
+                LOGE( "Failed to allocate atlas band\n" );
+                return -1;
+        }
+
+        // Palette needs every colour before the first row is written, that
+        // takes an extra pass over the bands
+        if ( palette_colours > 0 ) {
+                for ( int band_y = 0; band_y < height; band_y += band_rows ) {
+                        int rows = min( (int) band_rows, height - band_y );
+                        size_t live = 0;
+
+                        if ( !compose_band( band, width, band_y, rows, offset, &live ) ) {
+                                arena_free( band );
+                                return -1;
+                        }
+
+                        quant_add_rows( &palette, band, row_bytes, width, rows );
+                }
+
+                if ( !build_palette() ) {
+                        arena_free( band );
+                        return -1;
+                }
+        }
+
+        FILE *f = open_image();
+        if ( f == NULL ) {
+                LOGE( "Failed to open %s\n", image_output );
+                arena_free( band );
+                return -1;
+        }
+
+        struct atlas_writer writer;
+        bool ok = atlas_begin( &writer, f, width, height );
+        bool warned = false;
+
+        for ( int band_y = 0; ok && band_y < height; band_y += band_rows ) {
+                int rows = min( (int) band_rows, height - band_y );
+                size_t live = 0;
+
+                ok = compose_band( band, width, band_y, rows, offset, &live );
+
+                if ( !warned && 3 * band_rows * row_bytes + live > memory_budget ) {
+                        LOGW( "Sprites crossing band at row %d take %zu MB, over memory budget\n",
+                              band_y, live >> 20 );
+                        warned = true;
+                }
+
+                ok = ok && atlas_write_rows( &writer, band, row_bytes, rows );
+        }
+
+        ok = atlas_end( &writer ) && ok;
+        ok = fclose( f ) == 0 && ok;
+        arena_free( band );
+
+        if ( !ok ) {
+                LOGE( "Failed to write %s\n", image_output );
+                return -1;
+        }
+
+        return 0;
+}
+
+int main ( int argc, char **argv ) {
+        blit_init();
+        checksum_init();
+        format_init();
+
+        // Process arguments
+        {
+                bool arg_processing = true;
+                for ( int i = 1; i < argc; ++i ) {
+                        if ( arg_processing ) {
+                                if ( strcmp( "-o", argv[i] ) == 0 ) {
+                                        metadata_output = argv[++i];
+                                        continue;
+                                }
+                                if ( strcmp( "-i", argv[i] ) == 0 ) {
+                                        image_output = argv[++i];
+                                        continue;
+                                }
+
+                                if ( strcmp( "-c", argv[i] ) == 0 || strcmp( "--cache", argv[i] ) == 0 ) {
+                                        cache_dir = argv[++i];
+                                        continue;
+                                }
+
+                                if ( strcmp( "-m", argv[i] ) == 0 || strcmp( "--memory-budget", argv[i] ) == 0 ) {
+                                        memory_budget = (size_t) atol( argv[++i] ) << 20;
+                                        continue;
+                                }
+
+                                if ( strcmp( "-s", argv[i] ) == 0 || strcmp( "--stats", argv[i] ) == 0 ) {
+                                        print_stats = true;
+                                        continue;
+                                }
+
+                                if ( strcmp( "-j", argv[i] ) == 0 || strcmp( "--jobs", argv[i] ) == 0 ) {
+                                        thread_count = atoi( argv[++i] );
+                                        continue;
+                                }
+
+                                if ( strcmp( "-p", argv[i] ) == 0 || strcmp( "--premultiply", argv[i] ) == 0 ) {
+                                        premultiply = true;
+                                        continue;
+                                }
+
+                                if ( strcmp( "--srgb", argv[i] ) == 0 ) {
+                                        srgb = true;
+                                        continue;
+                                }
+
+                                if ( strcmp( "--clean-alpha", argv[i] ) == 0 ) {
+                                        const char *mode = argv[++i];
+                                        if ( mode != NULL && strcmp( mode, "zero" ) == 0 ) {
+                                                clean_alpha = CLEAN_ALPHA_ZERO;
+                                        } else if ( mode != NULL && strcmp( mode, "dilate" ) == 0 ) {
+                                                clean_alpha = CLEAN_ALPHA_DILATE;
+                                        } else {
+                                                LOGE( "Expected zero or dilate after --clean-alpha\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "--padding", argv[i] ) == 0 ) {
+                                        padding = max( atoi( argv[++i] ), 0 );
+                                        continue;
+                                }
+
+                                if ( strcmp( "--extrude", argv[i] ) == 0 ) {
+                                        extrude = max( atoi( argv[++i] ), 0 );
+                                        continue;
+                                }
+
+                                if ( strcmp( "--collapse-solid", argv[i] ) == 0 ) {
+                                        collapse_solid = true;
+                                        continue;
+                                }
+
+                                if ( strcmp( "-f", argv[i] ) == 0 || strcmp( "--format", argv[i] ) == 0 ) {
+                                        if ( format_parse( argv[++i], &pixel_format ) ) {
+                                                block_output = false;
+                                        } else if ( bc_parse( argv[i], &block_format ) ) {
+                                                block_output = true;
+                                                pixel_format = FORMAT_RGBA8;
+                                        } else {
+                                                LOGE( "Unknown pixel format %s\n", argv[i] ? argv[i] : "" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "--quality", argv[i] ) == 0 ) {
+                                        const char *mode = argv[++i];
+                                        if ( mode != NULL && strcmp( mode, "fast" ) == 0 ) {
+                                                block_quality = BC_QUALITY_FAST;
+                                        } else if ( mode != NULL && strcmp( mode, "normal" ) == 0 ) {
+                                                block_quality = BC_QUALITY_NORMAL;
+                                        } else if ( mode != NULL && strcmp( mode, "slow" ) == 0 ) {
+                                                block_quality = BC_QUALITY_SLOW;
+                                        } else {
+                                                LOGE( "Expected fast, normal or slow after --quality\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "--container", argv[i] ) == 0 ) {
+                                        const char *mode = argv[++i];
+                                        if ( mode != NULL && strcmp( mode, "dds" ) == 0 ) {
+                                                container = CONTAINER_DDS;
+                                        } else if ( mode != NULL && strcmp( mode, "ktx2" ) == 0 ) {
+                                                container = CONTAINER_KTX2;
+                                        } else {
+                                                LOGE( "Expected dds or ktx2 after --container\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "--mips", argv[i] ) == 0 ) {
+                                        mip_chain = true;
+                                        continue;
+                                }
+
+                                if ( strcmp( "--supercompression", argv[i] ) == 0 ) {
+                                        const char *mode = argv[++i];
+                                        if ( mode != NULL && strcmp( mode, "none" ) == 0 ) {
+                                                supercompression = KTX2_SUPERCOMPRESSION_NONE;
+                                        } else if ( mode != NULL && strcmp( mode, "zlib" ) == 0 ) {
+                                                supercompression = KTX2_SUPERCOMPRESSION_ZLIB;
+                                        } else {
+                                                LOGE( "Expected none or zlib after --supercompression\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "--dither", argv[i] ) == 0 ) {
+                                        const char *mode = argv[++i];
+                                        if ( mode != NULL && strcmp( mode, "none" ) == 0 ) {
+                                                dither = FORMAT_DITHER_NONE;
+                                        } else if ( mode != NULL && strcmp( mode, "ordered" ) == 0 ) {
+                                                dither = FORMAT_DITHER_ORDERED;
+                                        } else if ( mode != NULL && strcmp( mode, "diffusion" ) == 0 ) {
+                                                dither = FORMAT_DITHER_DIFFUSION;
+                                        } else {
+                                                LOGE( "Expected none, ordered or diffusion after --dither\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "-q", argv[i] ) == 0 || strcmp( "--quantise", argv[i] ) == 0 ) {
+                                        palette_colours = min( max( atoi( argv[++i] ), 2 ), QUANT_MAX_COLOURS );
+                                        continue;
+                                }
+
+                                if ( strcmp( "--png-filter", argv[i] ) == 0 ) {
+                                        const char *mode = argv[++i];
+                                        if ( mode != NULL && strcmp( mode, "row" ) == 0 ) {
+                                                png_strategy = PNGW_STRATEGY_ROW;
+                                        } else if ( mode != NULL && strcmp( mode, "sampled" ) == 0 ) {
+                                                png_strategy = PNGW_STRATEGY_SAMPLED;
+                                        } else if ( mode != NULL && strcmp( mode, "none" ) == 0 ) {
+                                                png_strategy = PNGW_STRATEGY_NONE;
+                                        } else if ( mode != NULL && strcmp( mode, "trial" ) == 0 ) {
+                                                png_strategy = PNGW_STRATEGY_TRIAL;
+                                        } else {
+                                                LOGE( "Expected row, sampled, none or trial after --png-filter\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                // Sets both deflate level and filters, --png-filter after it still wins
+                                if ( strcmp( "--speed", argv[i] ) == 0 ) {
+                                        const char *mode = argv[++i];
+                                        if ( mode != NULL && strcmp( mode, "store" ) == 0 ) {
+                                                compression_level = DEFLATE_STORED_LEVEL;
+                                                png_strategy = PNGW_STRATEGY_NONE;
+                                        } else if ( mode != NULL && strcmp( mode, "fast" ) == 0 ) {
+                                                compression_level = DEFLATE_MIN_LEVEL;
+                                                png_strategy = PNGW_STRATEGY_SAMPLED;
+                                        } else if ( mode != NULL && strcmp( mode, "balanced" ) == 0 ) {
+                                                compression_level = 6;
+                                                png_strategy = PNGW_STRATEGY_SAMPLED;
+                                        } else if ( mode != NULL && strcmp( mode, "max" ) == 0 ) {
+                                                compression_level = DEFLATE_MAX_LEVEL;
+                                                png_strategy = PNGW_STRATEGY_TRIAL;
+                                        } else {
+                                                LOGE( "Expected store, fast, balanced or max after --speed\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "--raw", argv[i] ) == 0 ) {
+                                        raw_output = true;
+                                        continue;
+                                }
+
+                                if ( strcmp( "--swizzle", argv[i] ) == 0 ) {
+                                        if ( !swizzle_parse( argv[++i], &swizzle_layout ) ) {
+                                                LOGE( "Expected linear, morton or tiled after --swizzle\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "--time-budget", argv[i] ) == 0 ) {
+                                        png_budget = argv[i + 1] != NULL ? atof( argv[++i] ) : 0;
+                                        if ( png_budget <= 0 ) {
+                                                LOGE( "Expected seconds after --time-budget\n" );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "--tile", argv[i] ) == 0 ) {
+                                        swizzle_tile = argv[i + 1] != NULL ? atoi( argv[++i] ) : 0;
+                                        if ( !swizzle_tile_valid( swizzle_tile ) ) {
+                                                LOGE( "Expected power of two from 2 to %d after --tile\n",
+                                                      SWIZZLE_MAX_TILE );
+                                                display_usage();
+                                                return -1;
+                                        }
+                                        continue;
+                                }
+
+                                if ( strcmp( "-h", argv[i] ) == 0 ) {
+                                        display_usage();
+                                        return 0;
+                                }
+
+                                if ( strcmp( "--", argv[i] ) == 0 ) {
+                                        arg_processing = false;
+                                        continue;
+                                }
+                        } else {
+                                // Add image to image list
+                                images[image_count++].name = argv[i];
+                        }
+                }
+        }
+
+        // Error on no images, we don't pack voids here
+        if ( image_count == 0 ) {
+                LOGE( "Expected images to pack\n" );
+                display_usage();
+                return -1;
+        }
+
+        // Warn on single image, it's just copying it
+        if ( image_count == 1 ) {
+                LOGW( "Packing single image is just copying it\n" );
+        }
+
+        // Only KTX2 holds mip chains and supercompressed levels
+        bool levels_asked = mip_chain || supercompression != KTX2_SUPERCOMPRESSION_NONE;
+        if ( levels_asked && container == CONTAINER_AUTO ) {
+                container = CONTAINER_KTX2;
+        }
+
+        if ( levels_asked && container == CONTAINER_DDS ) {
+                LOGE( "DDS can't hold mip chain or supercompression, use KTX2\n" );
+                return -1;
+        }
+
+        if ( levels_asked && raw_output ) {
+                LOGE( "Raw output holds a single level as it is, without mip chain or supercompression\n" );
+                return -1;
+        }
+
+        if ( container == CONTAINER_KTX2 && !block_output &&
+             ( pixel_format != FORMAT_RGBA8 || swizzle_layout != SWIZZLE_LINEAR || palette_colours > 0 ) ) {
+                LOGE( "KTX2 holds RGBA8 and block compressed formats only\n" );
+                return -1;
+        }
+
+        if ( palette_colours > 0 && packed_output() ) {
+                LOGE( "Palette and packed pixel format can't be used together\n" );
+                return -1;
+        }
+
+        if ( block_output && swizzle_layout != SWIZZLE_LINEAR ) {
+                LOGE( "Swizzle and block compressed format can't be used together\n" );
+                return -1;
+        }
+
+        if ( block_output && container == CONTAINER_AUTO ) {
+                container = dxgi_formats[block_format][0] != 0 ? CONTAINER_DDS : CONTAINER_KTX2;
+        }
+
+        if ( block_output && container == CONTAINER_DDS && dxgi_formats[block_format][0] == 0 ) {
+                LOGE( "DDS can't hold %s, use KTX2\n", bc_name( block_format ) );
+                return -1;
+        }
+
+        // DDS has no way to tell pixels are swizzled
+        if ( swizzle_layout != SWIZZLE_LINEAR ) {
+                raw_output = true;
+        }
+
+        if ( block_output ) {
+                cell_align = (struct rect) { bc_block_width( block_format ), bc_block_height( block_format ) };
+        }
+
+        // Image piped out keeps stdout to itself, everything printed goes to stderr
+        if ( image_output != NULL && strcmp( image_output, "-" ) == 0 ) {
+                fflush( stdout );
+                image_fd = dup( STDOUT_FILENO );
+                if ( image_fd < 0 || dup2( STDERR_FILENO, STDOUT_FILENO ) < 0 ) {
+                        LOGE( "Failed to take over stdout\n" );
+                        return -1;
+                }
+        }
+
+        workers = pool_create( thread_count );
+        if ( workers == NULL ) {
+                LOGE( "Failed to start threads\n" );
+                return -1;
+        }
+
+        LOGI( "Packing textures\n" );
+
+        // Load images to memory
+        for ( int i = 0; i < image_count; ++i ) {
+                LOGT( "Loading %s\n", images[i].name );
+                bool cached = false;
+                bool loaded;
+                if ( memory_budget > 0 ) {
+                        // Pixels wait for the band they appear in
+                        loaded = probe_image( &images[i] );
+                } else {
+                        cached = load_pixels( &images[i] );
+                        loaded = images[i].pixels != NULL;
+                }
+                CHANGE();
+
+                if ( !loaded ) {
+                        const char *reason = stbi_failure_reason();
+                        LOGE( "Failed to load %s: %s\n", images[i].name,
+                              reason != NULL ? reason : "can't open file" );
+                        return -1;
+                }
+
+                LOGT( "Loaded %s%s\n", images[i].name, cached ? " (cached)" : "" );
+
+                images[i].size = images[i].original;
+                images[i].shares = -1;
+
+                if ( collapse_solid && is_collapsible( &images[i] ) ) {
+                        images[i].size = (struct rect) { SOLID_SIZE, SOLID_SIZE };
+                }
+        }
+
+        // Drop channels nobody uses
+        {
+                bool any_alpha = false;
+                bool any_colour = false;
+                for ( int i = 0; i < image_count; ++i ) {
+                        any_alpha |= images[i].has_alpha;
+                        any_colour |= images[i].has_colour;
+                }
+
+                atlas_channels = ( any_colour ? 3 : 1 ) + ( any_alpha ? 1 : 0 );
+
+                // Packed formats and palettes are made from full RGBA rows
+                if ( packed_output() || palette_colours > 0 ) {
+                        atlas_channels = 4;
+                }
+
+                if ( atlas_channels != 4 ) {
+                        LOGI( "Atlas reduced to %d channels\n", atlas_channels );
+                }
+        }
+
+        // Bubble Sort images based on their size
+        for ( int i = 0; i < image_count; ++i ) {
+                for ( int j = 0; j < image_count - 1; ++j ) {
+                        // // Don't check element against itself
+                        // if ( i == j ) {
+                        //         continue;
+                        // }
+
+                        int current_score =
+                            images[j]
+                                .size.height;                      // images[j].size.width * images[j].size.height;
+                        int next_score = images[j + 1].size.width; // images[j + 1].size.width *
+                                                                   // images[j + 1].size.height;
+
+                        // If next image is bigger swap
+                        if ( next_score > current_score ) {
+                                struct image buf = images[j];
+                                images[j] = images[j + 1];
+                                images[j + 1] = buf;
+                        }
+                }
+        }
+
+        // Layout can't grow past sum of the sides, make sure coordinates fit
+        {
+                int64_t total_width = 0;
+                int64_t total_height = 0;
+                for ( int i = 0; i < image_count; ++i ) {
+                        total_width += (int64_t) images[i].size.width + 2 * extrude + padding + cell_align.width - 1;
+                        total_height += (int64_t) images[i].size.height + 2 * extrude + padding + cell_align.height - 1;
+                }
+
+                if ( total_width > MAX_ATLAS_SIDE || total_height > MAX_ATLAS_SIDE ) {
+                        LOGE( "Images are too large to lay out in single atlas\n" );
+                        return -1;
+                }
+        }
+
+        own_cell_count = share_solid_cells();
+        if ( own_cell_count < image_count ) {
+                LOGI( "%d solid sprites share cells of others\n", image_count - own_cell_count );
+        }
+
+        int max_width = cell_size( images[0].size ).width + cell_size( images[1].size ).width;
+
+        for ( int i = 0; i < own_cell_count; ++i ) {
+                pack( images[i], max_width );
+        }
+
+        for ( int i = own_cell_count; i < image_count; ++i ) {
+                image_locations[image_location_count++] = image_locations[images[i].shares];
+        }
+
+        // Print locations
+        for ( int i = 0; i < image_location_count; ++i ) {
+                printf( "%s X: %d Y: %d W: %d H %d\n", images[i].name, image_locations[i].x,
+                        image_locations[i].y, images[i].size.width, images[i].size.height );
+        }
+
+        int width = outmost.bottomright.x - outmost.topleft.x;
+        int height = outmost.bottomright.y - outmost.topleft.y;
+
+        int x_offset = -outmost.topleft.x;
+        int y_offset = -outmost.topleft.y;
+
+        // DDS keeps pitch or size of the level in 32 bits, bigger atlases can't be told
+        if ( packed_output() && !raw_output && container != CONTAINER_KTX2 ) {
+                uint64_t dds_len = block_output ? level_len( width, height )
+                                                : (uint64_t) width * format_describe( pixel_format )->bytes;
+                if ( dds_len > UINT32_MAX ) {
+                        LOGE( "%dx%d atlas is too large for DDS, try --raw\n", width, height );
+                        return -1;
+                }
+        }
+
+        if ( palette_colours > 0 ) {
+                quant_begin( &palette );
+        }
+
+        if ( memory_budget > 0 ) {
+                if ( write_banded( width, height, (vec2) { x_offset, y_offset } ) != 0 ) {
+                        return -1;
+                }
+
+                LOGI( "Atlas generated\n" );
+        } else {
+                uint64_t atlas_bytes = (uint64_t) width * height * atlas_channels;
+
+                unsigned char *data = NULL;
+                if ( atlas_bytes <= SIZE_MAX ) {
+                        // Left uninitialised, composition clears what sprites don't cover
+                        data = arena_alloc( &arenas[PHASE_BLIT], (size_t) atlas_bytes );
+                }
+
+                if ( data == NULL ) {
+                        LOGE( "Failed to allocate %llu MB for %dx%d atlas, try --memory-budget\n",
+                              (unsigned long long) ( atlas_bytes >> 20 ), width, height );
+                        return -1;
+                }
+
+                compose( data, width, 0, height, (vec2) { x_offset, y_offset } );
+
+                LOGI( "Atlas generated\n" );
+
+                if ( write_atlas( data, width, height ) != 0 ) {
+                        return -1;
+                }
+        }
+
+        // Pixels are all written out, only metadata is left
+        release_images();
+        quant_end( &palette );
+        arena_reset( &arenas[PHASE_BLIT] );
+        arena_reset( &arenas[PHASE_ENCODE] );
+
+        // Output the correct metadata
+
+        LOGI( "Generate metadata\n" );
+
+        const int base_len = 1024 * 4 + image_count * 256;
+
+        meta_value image_data = meta_new_array();
+
+        for ( int i = 0; i < image_count; ++i ) {
+                float uv_left = (float) image_locations[i].x / (float) width;
                 float uv_top = (float) image_locations[i].y / (float) height;
 
                 float uv_right =
@@ -365,10 +2051,10 @@ int main ( int argc, char **argv ) {
 
                 meta_set_field( &image_desc, "x",
                                 &(meta_value) { .type = META_VALUETYPE_INT,
-                                                .data = { .integer = image_locations[i].x } } );
+                                                .data = { .integer = image_locations[i].x + extrude } } );
                 meta_set_field( &image_desc, "y",
                                 &(meta_value) { .type = META_VALUETYPE_INT,
-                                                .data = { .integer = image_locations[i].y } } );
+                                                .data = { .integer = image_locations[i].y + extrude } } );
 
                 meta_set_field( &image_desc, "width",
                                 &(meta_value) { .type = META_VALUETYPE_INT,
@@ -377,6 +2063,16 @@ int main ( int argc, char **argv ) {
                                 &(meta_value) { .type = META_VALUETYPE_INT,
                                                 .data = { .integer = images[i].size.height } } );
 
+                // Collapsed sprite is stretched from its cell back to original size
+                if ( is_collapsed( &images[i] ) ) {
+                        meta_set_field( &image_desc, "original_width",
+                                        &(meta_value) { .type = META_VALUETYPE_INT,
+                                                        .data = { .integer = images[i].original.width } } );
+                        meta_set_field( &image_desc, "original_height",
+                                        &(meta_value) { .type = META_VALUETYPE_INT,
+                                                        .data = { .integer = images[i].original.height } } );
+                }
+
                 meta_value str = meta_new_string( images[i].name );
                 meta_set_field( &image_desc, "name", &str );
 
@@ -396,15 +2092,58 @@ int main ( int argc, char **argv ) {
         meta_set_field( &atlas_desc, "atlas_texture", &atlas_texture );
         meta_set_field( &atlas_desc, "subtextures", &image_data );
 
+        if ( palette_colours > 0 ) {
+                meta_value format_name = meta_new_string( "indexed" );
+                meta_set_field( &atlas_desc, "pixel_format", &format_name );
+        } else if ( packed_output() ) {
+                meta_value format_name = meta_new_string( block_output ? bc_name( block_format )
+                                                                       : format_describe( pixel_format )->name );
+                meta_set_field( &atlas_desc, "pixel_format", &format_name );
+        }
+
+        // Sprites start on whole blocks, UVs of their cells never share one
+        if ( block_output ) {
+                meta_set_field( &atlas_desc, "block_width",
+                                &(meta_value) { .type = META_VALUETYPE_INT, .data = { .integer = cell_align.width } } );
+                meta_set_field( &atlas_desc, "block_height",
+                                &(meta_value) { .type = META_VALUETYPE_INT, .data = { .integer = cell_align.height } } );
+        }
+
+        if ( mip_chain ) {
+                meta_set_field( &atlas_desc, "mip_levels",
+                                &(meta_value) { .type = META_VALUETYPE_INT,
+                                                .data = { .integer = level_count( width, height ) } } );
+        }
+
+        // Raw pixels have nothing else telling how they are laid out
+        if ( raw_output ) {
+                meta_value layout = meta_new_string( swizzle_name( swizzle_layout ) );
+                meta_set_field( &atlas_desc, "layout", &layout );
+        }
+
+        if ( swizzle_layout != SWIZZLE_LINEAR ) {
+                meta_set_field( &atlas_desc, "tile_size",
+                                &(meta_value) { .type = META_VALUETYPE_INT, .data = { .integer = swizzle_tile } } );
+                meta_set_field( &atlas_desc, "padded_width",
+                                &(meta_value) { .type = META_VALUETYPE_INT,
+                                                .data = { .integer = (int) swizzled_side( width ) } } );
+                meta_set_field( &atlas_desc, "padded_height",
+                                &(meta_value) { .type = META_VALUETYPE_INT,
+                                                .data = { .integer = (int) swizzled_side( height ) } } );
+        }
+
+        if ( premultiply ) {
+                meta_value alpha = meta_new_string( srgb ? "premultiplied_linear" : "premultiplied" );
+                meta_set_field( &atlas_desc, "alpha", &alpha );
+        }
+
         // Allocate some space for metadata
-        char *metadata = malloc( sizeof( char ) * base_len );
+        char *metadata = arena_alloc( &arenas[PHASE_METADATA], sizeof( char ) * base_len );
         for ( int i = 0; i < base_len; ++i ) {
                 metadata[i] = 0;
         }
 
-        printf( "Compose\n" );
         meta_compose( &atlas_desc, metadata, sizeof( char ) * base_len );
-        printf( "Compose2\n" );
 
         // strlcat( metadata, "# Computer generated do not edit\n\n", base_len );
         //
@@ -436,6 +2175,14 @@ int main ( int argc, char **argv ) {
 
         fclose( f );
 
+        arena_reset( &arenas[PHASE_METADATA] );
+
+        if ( print_stats ) {
+                report_stats();
+        }
+
+        pool_destroy( workers );
+
         return 0;
 }
 
@@ -0,0 +1,960 @@
+/* Streaming PNG writer.
+ *
+ * Before #including,
+ *      #define PNGW_IMPL
+ *
+ * in the file you want the implementation to reside. Implementation needs
+ * deflate.h and checksum.h implementations to be included as well, the
+ * latter initialised with checksum_init.
+ *
+ * Rows are handed over in bands. Every band is filtered, deflated and
+ * handed to the write callback as IDAT chunks right away, so only a single
+ * band worth of filtered and compressed data is alive at a time. Bands
+ * keep compressing against the tail of the previous one, splitting costs
+ * next to nothing. Output never needs seeking, pipes do fine.
+ *
+ * Given a runner, bands are filtered in groups of rows and deflated in
+ * pieces of PNGW_PIECE bytes in parallel, pigz style. Every piece uses the
+ * 32 KB in front of it as dictionary and ends with a sync flush, so pieces
+ * are simply written one after another. Adler-32 of pieces is combined
+ * afterwards. Output does not depend on the number of threads.
+ *
+ * Rows get the filter whose output has the smallest sum of absolute
+ * values, tried with SSE2 or AVX2 kernels when the CPU has them. Sampled
+ * strategy tries filters on a few rows of every group and uses the winner
+ * for all of them, a fraction of the work for a slightly bigger file.
+ * Trial strategy deflates every group with each of the others and keeps
+ * the smallest, for shipping builds along with the top deflate level.
+ * Rows can also go out unfiltered, together with stored deflate blocks
+ * that writes a PNG about as fast as memory gets copied.
+ *
+ * With a time budget, once it runs out remaining groups are filtered per
+ * row and pieces deflated at PNGW_BUDGET_LEVEL at most.
+ *
+ * Indexed images take one byte per pixel and are written unfiltered, as
+ * the PNG spec recommends for palettes. */
+
+#ifndef _PNGW_H
+#define _PNGW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef PNGW_EXTERN
+#define PNGW_EXTERN extern
+#endif
+
+#ifndef PNGW_STATIC
+#define PNGW_STATIC static
+#endif
+
+/* How row filters are chosen */
+typedef enum pngw_strategy {
+        PNGW_STRATEGY_ROW,     /* Best of all five for every row */
+        PNGW_STRATEGY_SAMPLED, /* Best over sampled rows for a whole group */
+        PNGW_STRATEGY_NONE,    /* No filtering at all */
+        PNGW_STRATEGY_TRIAL,   /* Smallest deflated group of all the above */
+} pngw_strategy;
+
+/* Takes next len bytes of the file, false stops the writer */
+typedef bool ( *pngw_write_fn )( void *ctx, const void *data, size_t len );
+
+typedef void ( *pngw_job_fn )( void *arg, int index );
+typedef void ( *pngw_run_fn )( void *ctx, pngw_job_fn fn, void *arg, int count );
+
+typedef struct pngw {
+        pngw_write_fn write;
+        void *write_ctx;
+
+        /* Runs filter and deflate jobs, NULL does them one by one */
+        pngw_run_fn run;
+        void *run_ctx;
+
+        int width;
+        int height;
+        int channels;
+        int level;
+        bool indexed;
+        pngw_strategy strategy;
+
+        /* Monotonic time in seconds when the budget runs out, 0 for none */
+        double deadline;
+
+        size_t row_bytes;
+        int rows_written;
+
+        /* Last unfiltered row of previous band, Up, Average and Paeth need it */
+        unsigned char *prev_row;
+
+        /* Tail of the previous band filtered data, dictionary for the next one */
+        unsigned char *window;
+        size_t window_len;
+
+        uint32_t adler;
+        bool failed;
+
+        /* Filtered bytes handed to deflate and what came out so far */
+        size_t filtered_len;
+        size_t compressed_len;
+} pngw;
+
+/* Write signature and header. Level is deflate level, DEFLATE_MIN_LEVEL
+ * (RLE) to DEFLATE_MAX_LEVEL */
+PNGW_EXTERN bool pngw_begin ( pngw *png, pngw_write_fn write, void *ctx, int width, int height, int channels,
+                              int level );
+
+/* Same for 8 bit indexed image with palette of RGBA colours, those with
+ * alpha below 255 have to come first */
+PNGW_EXTERN bool pngw_begin_indexed ( pngw *png, pngw_write_fn write, void *ctx, int width, int height,
+                                      const unsigned char *palette, int colours, int level );
+
+/* Write callback for a FILE * passed as ctx */
+PNGW_EXTERN bool pngw_write_file ( void *ctx, const void *data, size_t len );
+
+/* Spread work of following writes over run, call fn( arg, index ) for
+ * every index below count and return once all are done */
+PNGW_EXTERN void pngw_set_runner ( pngw *png, pngw_run_fn run, void *ctx );
+
+PNGW_EXTERN void pngw_set_strategy ( pngw *png, pngw_strategy strategy );
+
+/* Give the rest of the image seconds from now, 0 takes the limit away */
+PNGW_EXTERN void pngw_set_budget ( pngw *png, double seconds );
+
+/* Write next count rows, rows are stride bytes apart */
+PNGW_EXTERN bool pngw_write_rows ( pngw *png, const unsigned char *rows, size_t stride, int count );
+
+/* Finish the image, all rows have to be written by now */
+PNGW_EXTERN bool pngw_end ( pngw *png );
+
+#endif /* _PNGW_H */
+
+/* Implementation */
+#ifdef PNGW_IMPL
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define PNGW_X86
+#include <immintrin.h>
+#endif
+
+/* Allow for opting out malloc */
+#ifndef PNGW_MALLOC
+#define PNGW_MALLOC( size ) malloc( size )
+#endif
+#ifndef PNGW_FREE
+#define PNGW_FREE( ptr ) free( ptr )
+#endif
+
+/* Bytes of filtered data per job, deflated as one chunk */
+#ifndef PNGW_PIECE
+#define PNGW_PIECE ( (size_t) 1 << 20 )
+#endif
+
+/* Rows of a group tried by the sampled strategy */
+#define PNGW_SAMPLES 8
+
+/* Deflate level groups are tried with by the trial strategy */
+#ifndef PNGW_TRIAL_LEVEL
+#define PNGW_TRIAL_LEVEL 5
+#endif
+
+/* Highest deflate level once time budget runs out */
+#ifndef PNGW_BUDGET_LEVEL
+#define PNGW_BUDGET_LEVEL 6
+#endif
+
+enum {
+        PNGW_FILTER_NONE,
+        PNGW_FILTER_SUB,
+        PNGW_FILTER_UP,
+        PNGW_FILTER_AVERAGE,
+        PNGW_FILTER_PAETH,
+
+        PNGW_FILTER_NUM
+};
+
+PNGW_EXTERN bool pngw_write_file ( void *ctx, const void *data, size_t len ) {
+        return fwrite( data, 1, len, (FILE *) ctx ) == len;
+}
+
+PNGW_STATIC void _pngw_write ( pngw *png, const void *data, size_t len ) {
+        if ( !png->failed && len > 0 && !png->write( png->write_ctx, data, len ) ) {
+                png->failed = true;
+        }
+}
+
+PNGW_STATIC void _pngw_be32 ( unsigned char *dest, uint32_t v ) {
+        dest[0] = (unsigned char) ( v >> 24 );
+        dest[1] = (unsigned char) ( v >> 16 );
+        dest[2] = (unsigned char) ( v >> 8 );
+        dest[3] = (unsigned char) v;
+}
+
+/* Chunk written from up to three pieces, saves gluing them together */
+PNGW_STATIC void _pngw_chunk ( pngw *png, const char *type,
+                               const unsigned char *a, size_t a_len,
+                               const unsigned char *b, size_t b_len,
+                               const unsigned char *c, size_t c_len ) {
+        unsigned char header[8];
+        _pngw_be32( header, (uint32_t) ( a_len + b_len + c_len ) );
+        memcpy( header + 4, type, 4 );
+
+        uint32_t crc = checksum_crc32( CHECKSUM_CRC32_INIT, header + 4, 4 );
+        crc = checksum_crc32( crc, a, a_len );
+        crc = checksum_crc32( crc, b, b_len );
+        crc = checksum_crc32( crc, c, c_len );
+
+        unsigned char footer[4];
+        _pngw_be32( footer, crc );
+
+        _pngw_write( png, header, 8 );
+        _pngw_write( png, a, a_len );
+        _pngw_write( png, b, b_len );
+        _pngw_write( png, c, c_len );
+        _pngw_write( png, footer, 4 );
+}
+
+PNGW_STATIC unsigned char _pngw_paeth ( int a, int b, int c ) {
+        int p = a + b - c;
+        int pa = abs( p - a );
+        int pb = abs( p - b );
+        int pc = abs( p - c );
+
+        if ( pa <= pb && pa <= pc ) {
+                return (unsigned char) a;
+        }
+        if ( pb <= pc ) {
+                return (unsigned char) b;
+        }
+        return (unsigned char) c;
+}
+
+/* Filter kernels, out gets len filtered bytes of row. Vector ones share
+ * the scalar code for the first pixel and the tail. */
+typedef void ( *_pngw_filter_fn )( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                   unsigned char *out );
+
+/* Sum of filtered bytes taken as signed, smaller tends to compress better */
+typedef uint64_t ( *_pngw_cost_fn )( const unsigned char *data, size_t len );
+
+static _pngw_filter_fn _pngw_filters[PNGW_FILTER_NUM];
+static _pngw_cost_fn _pngw_cost;
+
+PNGW_STATIC void _pngw_none ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                              unsigned char *out ) {
+        (void) prev;
+        (void) bpp;
+        memcpy( out, row, len );
+}
+
+PNGW_STATIC void _pngw_sub_tail ( const unsigned char *row, size_t i, size_t len, int bpp, unsigned char *out ) {
+        for ( ; i < len; ++i ) {
+                out[i] = row[i] - ( i >= (size_t) bpp ? row[i - bpp] : 0 );
+        }
+}
+
+PNGW_STATIC void _pngw_up_tail ( const unsigned char *row, const unsigned char *prev, size_t i, size_t len,
+                                 unsigned char *out ) {
+        for ( ; i < len; ++i ) {
+                out[i] = row[i] - prev[i];
+        }
+}
+
+PNGW_STATIC void _pngw_average_tail ( const unsigned char *row, const unsigned char *prev, size_t i, size_t len,
+                                      int bpp, unsigned char *out ) {
+        for ( ; i < len; ++i ) {
+                out[i] = row[i] - ( ( ( i >= (size_t) bpp ? row[i - bpp] : 0 ) + prev[i] ) >> 1 );
+        }
+}
+
+PNGW_STATIC void _pngw_paeth_tail ( const unsigned char *row, const unsigned char *prev, size_t i, size_t len,
+                                    int bpp, unsigned char *out ) {
+        for ( ; i < len; ++i ) {
+                if ( i < (size_t) bpp ) {
+                        out[i] = row[i] - prev[i];
+                } else {
+                        out[i] = row[i] - _pngw_paeth( row[i - bpp], prev[i], prev[i - bpp] );
+                }
+        }
+}
+
+PNGW_STATIC void _pngw_sub ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                             unsigned char *out ) {
+        (void) prev;
+        _pngw_sub_tail( row, 0, len, bpp, out );
+}
+
+PNGW_STATIC void _pngw_up ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                            unsigned char *out ) {
+        (void) bpp;
+        _pngw_up_tail( row, prev, 0, len, out );
+}
+
+PNGW_STATIC void _pngw_average ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                 unsigned char *out ) {
+        _pngw_average_tail( row, prev, 0, len, bpp, out );
+}
+
+PNGW_STATIC void _pngw_paeth_row ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                   unsigned char *out ) {
+        _pngw_paeth_tail( row, prev, 0, len, bpp, out );
+}
+
+PNGW_STATIC uint64_t _pngw_cost_scalar ( const unsigned char *data, size_t len ) {
+        uint64_t cost = 0;
+        for ( size_t i = 0; i < len; ++i ) {
+                cost += abs( (signed char) data[i] );
+        }
+        return cost;
+}
+
+#ifdef PNGW_X86
+
+/* Neighbours left of the first pixel are zero, vectors start past it */
+__attribute__( ( target( "sse2" ) ) )
+PNGW_STATIC void _pngw_sub_sse2 ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                  unsigned char *out ) {
+        (void) prev;
+        size_t i = (size_t) bpp < len ? (size_t) bpp : len;
+        memcpy( out, row, i );
+
+        for ( ; i + 16 <= len; i += 16 ) {
+                __m128i x = _mm_loadu_si128( (const __m128i *) ( row + i ) );
+                __m128i a = _mm_loadu_si128( (const __m128i *) ( row + i - bpp ) );
+                _mm_storeu_si128( (__m128i *) ( out + i ), _mm_sub_epi8( x, a ) );
+        }
+
+        _pngw_sub_tail( row, i, len, bpp, out );
+}
+
+__attribute__( ( target( "sse2" ) ) )
+PNGW_STATIC void _pngw_up_sse2 ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                 unsigned char *out ) {
+        (void) bpp;
+        size_t i = 0;
+
+        for ( ; i + 16 <= len; i += 16 ) {
+                __m128i x = _mm_loadu_si128( (const __m128i *) ( row + i ) );
+                __m128i b = _mm_loadu_si128( (const __m128i *) ( prev + i ) );
+                _mm_storeu_si128( (__m128i *) ( out + i ), _mm_sub_epi8( x, b ) );
+        }
+
+        _pngw_up_tail( row, prev, i, len, out );
+}
+
+/* Average rounding down, avg_epu8 rounds up when the sum is odd */
+__attribute__( ( target( "sse2" ) ) )
+PNGW_STATIC void _pngw_average_sse2 ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                      unsigned char *out ) {
+        const __m128i one = _mm_set1_epi8( 1 );
+        size_t i = (size_t) bpp < len ? (size_t) bpp : len;
+        _pngw_average_tail( row, prev, 0, i, bpp, out );
+
+        for ( ; i + 16 <= len; i += 16 ) {
+                __m128i x = _mm_loadu_si128( (const __m128i *) ( row + i ) );
+                __m128i a = _mm_loadu_si128( (const __m128i *) ( row + i - bpp ) );
+                __m128i b = _mm_loadu_si128( (const __m128i *) ( prev + i ) );
+                __m128i avg = _mm_sub_epi8( _mm_avg_epu8( a, b ), _mm_and_si128( _mm_xor_si128( a, b ), one ) );
+                _mm_storeu_si128( (__m128i *) ( out + i ), _mm_sub_epi8( x, avg ) );
+        }
+
+        _pngw_average_tail( row, prev, i, len, bpp, out );
+}
+
+/* Paeth predictor of 8 bytes widened to 16 bits, ties go a, b, c */
+__attribute__( ( target( "sse2" ) ) )
+PNGW_STATIC __m128i _pngw_paeth_sse2_16 ( __m128i a, __m128i b, __m128i c ) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i pa = _mm_sub_epi16( b, c );
+        __m128i pb = _mm_sub_epi16( a, c );
+        __m128i pc = _mm_add_epi16( pa, pb );
+
+        pa = _mm_max_epi16( pa, _mm_sub_epi16( zero, pa ) );
+        pb = _mm_max_epi16( pb, _mm_sub_epi16( zero, pb ) );
+        pc = _mm_max_epi16( pc, _mm_sub_epi16( zero, pc ) );
+
+        __m128i not_a = _mm_or_si128( _mm_cmpgt_epi16( pa, pb ), _mm_cmpgt_epi16( pa, pc ) );
+        __m128i not_b = _mm_cmpgt_epi16( pb, pc );
+        __m128i bc = _mm_or_si128( _mm_and_si128( not_b, c ), _mm_andnot_si128( not_b, b ) );
+
+        return _mm_or_si128( _mm_and_si128( not_a, bc ), _mm_andnot_si128( not_a, a ) );
+}
+
+__attribute__( ( target( "sse2" ) ) )
+PNGW_STATIC void _pngw_paeth_sse2 ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                    unsigned char *out ) {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = (size_t) bpp < len ? (size_t) bpp : len;
+        _pngw_paeth_tail( row, prev, 0, i, bpp, out );
+
+        for ( ; i + 16 <= len; i += 16 ) {
+                __m128i x = _mm_loadu_si128( (const __m128i *) ( row + i ) );
+                __m128i a = _mm_loadu_si128( (const __m128i *) ( row + i - bpp ) );
+                __m128i b = _mm_loadu_si128( (const __m128i *) ( prev + i ) );
+                __m128i c = _mm_loadu_si128( (const __m128i *) ( prev + i - bpp ) );
+
+                __m128i lo = _pngw_paeth_sse2_16( _mm_unpacklo_epi8( a, zero ), _mm_unpacklo_epi8( b, zero ),
+                                                  _mm_unpacklo_epi8( c, zero ) );
+                __m128i hi = _pngw_paeth_sse2_16( _mm_unpackhi_epi8( a, zero ), _mm_unpackhi_epi8( b, zero ),
+                                                  _mm_unpackhi_epi8( c, zero ) );
+
+                _mm_storeu_si128( (__m128i *) ( out + i ), _mm_sub_epi8( x, _mm_packus_epi16( lo, hi ) ) );
+        }
+
+        _pngw_paeth_tail( row, prev, i, len, bpp, out );
+}
+
+/* Absolute value of a signed byte is the smaller of it and its negation
+ * taken unsigned, sad against zero sums them */
+__attribute__( ( target( "sse2" ) ) )
+PNGW_STATIC uint64_t _pngw_cost_sse2 ( const unsigned char *data, size_t len ) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sum = zero;
+        size_t i = 0;
+
+        for ( ; i + 16 <= len; i += 16 ) {
+                __m128i x = _mm_loadu_si128( (const __m128i *) ( data + i ) );
+                __m128i abs = _mm_min_epu8( x, _mm_sub_epi8( zero, x ) );
+                sum = _mm_add_epi64( sum, _mm_sad_epu8( abs, zero ) );
+        }
+
+        uint64_t halves[2];
+        _mm_storeu_si128( (__m128i *) halves, sum );
+        return halves[0] + halves[1] + _pngw_cost_scalar( data + i, len - i );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+PNGW_STATIC void _pngw_sub_avx2 ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                  unsigned char *out ) {
+        (void) prev;
+        size_t i = (size_t) bpp < len ? (size_t) bpp : len;
+        memcpy( out, row, i );
+
+        for ( ; i + 32 <= len; i += 32 ) {
+                __m256i x = _mm256_loadu_si256( (const __m256i *) ( row + i ) );
+                __m256i a = _mm256_loadu_si256( (const __m256i *) ( row + i - bpp ) );
+                _mm256_storeu_si256( (__m256i *) ( out + i ), _mm256_sub_epi8( x, a ) );
+        }
+
+        _pngw_sub_tail( row, i, len, bpp, out );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+PNGW_STATIC void _pngw_up_avx2 ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                 unsigned char *out ) {
+        (void) bpp;
+        size_t i = 0;
+
+        for ( ; i + 32 <= len; i += 32 ) {
+                __m256i x = _mm256_loadu_si256( (const __m256i *) ( row + i ) );
+                __m256i b = _mm256_loadu_si256( (const __m256i *) ( prev + i ) );
+                _mm256_storeu_si256( (__m256i *) ( out + i ), _mm256_sub_epi8( x, b ) );
+        }
+
+        _pngw_up_tail( row, prev, i, len, out );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+PNGW_STATIC void _pngw_average_avx2 ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                      unsigned char *out ) {
+        const __m256i one = _mm256_set1_epi8( 1 );
+        size_t i = (size_t) bpp < len ? (size_t) bpp : len;
+        _pngw_average_tail( row, prev, 0, i, bpp, out );
+
+        for ( ; i + 32 <= len; i += 32 ) {
+                __m256i x = _mm256_loadu_si256( (const __m256i *) ( row + i ) );
+                __m256i a = _mm256_loadu_si256( (const __m256i *) ( row + i - bpp ) );
+                __m256i b = _mm256_loadu_si256( (const __m256i *) ( prev + i ) );
+                __m256i avg = _mm256_sub_epi8( _mm256_avg_epu8( a, b ),
+                                               _mm256_and_si256( _mm256_xor_si256( a, b ), one ) );
+                _mm256_storeu_si256( (__m256i *) ( out + i ), _mm256_sub_epi8( x, avg ) );
+        }
+
+        _pngw_average_tail( row, prev, i, len, bpp, out );
+}
+
+/* 16 bytes widened to a whole register, no lane shuffling to undo */
+__attribute__( ( target( "avx2" ) ) )
+PNGW_STATIC void _pngw_paeth_avx2 ( const unsigned char *row, const unsigned char *prev, size_t len, int bpp,
+                                    unsigned char *out ) {
+        const __m256i zero = _mm256_setzero_si256();
+        size_t i = (size_t) bpp < len ? (size_t) bpp : len;
+        _pngw_paeth_tail( row, prev, 0, i, bpp, out );
+
+        for ( ; i + 16 <= len; i += 16 ) {
+                __m256i a = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i *) ( row + i - bpp ) ) );
+                __m256i b = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i *) ( prev + i ) ) );
+                __m256i c = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i *) ( prev + i - bpp ) ) );
+
+                __m256i pa = _mm256_sub_epi16( b, c );
+                __m256i pb = _mm256_sub_epi16( a, c );
+                __m256i pc = _mm256_abs_epi16( _mm256_add_epi16( pa, pb ) );
+                pa = _mm256_abs_epi16( pa );
+                pb = _mm256_abs_epi16( pb );
+
+                __m256i not_a = _mm256_or_si256( _mm256_cmpgt_epi16( pa, pb ), _mm256_cmpgt_epi16( pa, pc ) );
+                __m256i not_b = _mm256_cmpgt_epi16( pb, pc );
+                __m256i pred = _mm256_blendv_epi8( a, _mm256_blendv_epi8( b, c, not_b ), not_a );
+                pred = _mm256_packus_epi16( pred, zero );
+                pred = _mm256_permute4x64_epi64( pred, 0x08 );
+
+                __m128i x = _mm_loadu_si128( (const __m128i *) ( row + i ) );
+                _mm_storeu_si128( (__m128i *) ( out + i ), _mm_sub_epi8( x, _mm256_castsi256_si128( pred ) ) );
+        }
+
+        _pngw_paeth_tail( row, prev, i, len, bpp, out );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+PNGW_STATIC uint64_t _pngw_cost_avx2 ( const unsigned char *data, size_t len ) {
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i sum = zero;
+        size_t i = 0;
+
+        for ( ; i + 32 <= len; i += 32 ) {
+                __m256i x = _mm256_loadu_si256( (const __m256i *) ( data + i ) );
+                sum = _mm256_add_epi64( sum, _mm256_sad_epu8( _mm256_abs_epi8( x ), zero ) );
+        }
+
+        uint64_t quarters[4];
+        _mm256_storeu_si256( (__m256i *) quarters, sum );
+        return quarters[0] + quarters[1] + quarters[2] + quarters[3] + _pngw_cost_scalar( data + i, len - i );
+}
+
+#endif
+
+/* Pick kernels for this CPU, same every time so calling it again is fine */
+PNGW_STATIC void _pngw_init ( void ) {
+        _pngw_filters[PNGW_FILTER_NONE] = _pngw_none;
+        _pngw_filters[PNGW_FILTER_SUB] = _pngw_sub;
+        _pngw_filters[PNGW_FILTER_UP] = _pngw_up;
+        _pngw_filters[PNGW_FILTER_AVERAGE] = _pngw_average;
+        _pngw_filters[PNGW_FILTER_PAETH] = _pngw_paeth_row;
+        _pngw_cost = _pngw_cost_scalar;
+
+#ifdef PNGW_X86
+        __builtin_cpu_init();
+
+        if ( __builtin_cpu_supports( "sse2" ) ) {
+                _pngw_filters[PNGW_FILTER_SUB] = _pngw_sub_sse2;
+                _pngw_filters[PNGW_FILTER_UP] = _pngw_up_sse2;
+                _pngw_filters[PNGW_FILTER_AVERAGE] = _pngw_average_sse2;
+                _pngw_filters[PNGW_FILTER_PAETH] = _pngw_paeth_sse2;
+                _pngw_cost = _pngw_cost_sse2;
+        }
+
+        if ( __builtin_cpu_supports( "avx2" ) ) {
+                _pngw_filters[PNGW_FILTER_SUB] = _pngw_sub_avx2;
+                _pngw_filters[PNGW_FILTER_UP] = _pngw_up_avx2;
+                _pngw_filters[PNGW_FILTER_AVERAGE] = _pngw_average_avx2;
+                _pngw_filters[PNGW_FILTER_PAETH] = _pngw_paeth_avx2;
+                _pngw_cost = _pngw_cost_avx2;
+        }
+#endif
+}
+
+/* Pick the filter with smallest sum of absolute values, same as stb. Only
+ * costs are kept, the winner is filtered again straight into out. */
+PNGW_STATIC void _pngw_filter_best ( const unsigned char *row, const unsigned char *prev,
+                                     size_t len, int bpp, unsigned char *out, unsigned char *scratch ) {
+        uint64_t best_cost = UINT64_MAX;
+        int best = PNGW_FILTER_NONE;
+
+        for ( int type = PNGW_FILTER_NONE; type < PNGW_FILTER_NUM; ++type ) {
+                _pngw_filters[type]( row, prev, len, bpp, scratch );
+
+                uint64_t cost = _pngw_cost( scratch, len );
+                if ( cost < best_cost ) {
+                        best_cost = cost;
+                        best = type;
+                }
+        }
+
+        out[0] = (unsigned char) best;
+        _pngw_filters[best]( row, prev, len, bpp, out + 1 );
+}
+
+PNGW_STATIC bool _pngw_begin ( pngw *png, pngw_write_fn write, void *ctx, int width, int height, int channels,
+                               int colour_type, int level ) {
+        static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+        _pngw_init();
+
+        *png = (pngw) {
+            .write = write,
+            .write_ctx = ctx,
+            .width = width,
+            .height = height,
+            .channels = channels,
+            .level = level,
+            .row_bytes = (size_t) width * channels,
+            .adler = CHECKSUM_ADLER32_INIT,
+        };
+
+        png->prev_row = (unsigned char *) PNGW_MALLOC( png->row_bytes );
+        png->window = (unsigned char *) PNGW_MALLOC( DEFLATE_WINDOW );
+        if ( png->prev_row == NULL || png->window == NULL ) {
+                PNGW_FREE( png->prev_row );
+                PNGW_FREE( png->window );
+                return false;
+        }
+
+        /* Row above the first one counts as zeros */
+        memset( png->prev_row, 0, png->row_bytes );
+
+        unsigned char ihdr[13];
+        _pngw_be32( ihdr, width );
+        _pngw_be32( ihdr + 4, height );
+        ihdr[8] = 8; /* Bit depth */
+        ihdr[9] = (unsigned char) colour_type;
+        ihdr[10] = 0; /* Deflate */
+        ihdr[11] = 0; /* Adaptive filtering */
+        ihdr[12] = 0; /* No interlace */
+
+        _pngw_write( png, signature, sizeof( signature ) );
+        _pngw_chunk( png, "IHDR", ihdr, sizeof( ihdr ), NULL, 0, NULL, 0 );
+
+        return !png->failed;
+}
+
+PNGW_EXTERN bool pngw_begin ( pngw *png, pngw_write_fn write, void *ctx, int width, int height, int channels,
+                              int level ) {
+        static const unsigned char colour_type[5] = { 0, 0, 4, 2, 6 };
+
+        if ( width <= 0 || height <= 0 || channels < 1 || channels > 4 ) {
+                return false;
+        }
+
+        return _pngw_begin( png, write, ctx, width, height, channels, colour_type[channels], level );
+}
+
+PNGW_EXTERN bool pngw_begin_indexed ( pngw *png, pngw_write_fn write, void *ctx, int width, int height,
+                                      const unsigned char *palette, int colours, int level ) {
+        if ( width <= 0 || height <= 0 || colours < 1 || colours > 256 ) {
+                return false;
+        }
+
+        if ( !_pngw_begin( png, write, ctx, width, height, 1, 3, level ) ) {
+                return false;
+        }
+
+        png->indexed = true;
+
+        unsigned char plte[256 * 3];
+        unsigned char trns[256];
+        int translucent = 0;
+
+        for ( int i = 0; i < colours; ++i ) {
+                memcpy( plte + i * 3, palette + i * 4, 3 );
+                trns[i] = palette[i * 4 + 3];
+                if ( trns[i] < 255 ) {
+                        translucent = i + 1;
+                }
+        }
+
+        _pngw_chunk( png, "PLTE", plte, colours * 3, NULL, 0, NULL, 0 );
+        if ( translucent > 0 ) {
+                _pngw_chunk( png, "tRNS", trns, translucent, NULL, 0, NULL, 0 );
+        }
+
+        return !png->failed;
+}
+
+PNGW_EXTERN void pngw_set_runner ( pngw *png, pngw_run_fn run, void *ctx ) {
+        png->run = run;
+        png->run_ctx = ctx;
+}
+
+PNGW_EXTERN void pngw_set_strategy ( pngw *png, pngw_strategy strategy ) {
+        png->strategy = strategy;
+}
+
+PNGW_STATIC double _pngw_now ( void ) {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+PNGW_EXTERN void pngw_set_budget ( pngw *png, double seconds ) {
+        png->deadline = seconds > 0 ? _pngw_now() + seconds : 0;
+}
+
+PNGW_STATIC bool _pngw_over_budget ( const pngw *png ) {
+        return png->deadline > 0 && _pngw_now() > png->deadline;
+}
+
+PNGW_STATIC void _pngw_run ( pngw *png, pngw_job_fn fn, void *arg, int count ) {
+        if ( png->run != NULL && count > 1 ) {
+                png->run( png->run_ctx, fn, arg, count );
+                return;
+        }
+
+        for ( int i = 0; i < count; ++i ) {
+                fn( arg, i );
+        }
+}
+
+typedef struct _pngw_piece {
+        unsigned char *compressed;
+        size_t compressed_len;
+        uint32_t adler;
+} _pngw_piece;
+
+typedef struct _pngw_band {
+        pngw *png;
+
+        const unsigned char *rows;
+        size_t stride;
+        int count;
+        int group;
+
+        /* Filtered rows with window_len bytes of dictionary in front */
+        unsigned char *filtered;
+        size_t filtered_len;
+
+        /* Scratch of every group, scratch_len bytes each */
+        unsigned char *scratch;
+        size_t scratch_len;
+
+        _pngw_piece *pieces;
+        int piece_count;
+        bool last;
+        bool failed;
+} _pngw_band;
+
+/* Row above y, from the input or previous band */
+PNGW_STATIC const unsigned char *_pngw_prev ( const _pngw_band *band, int y ) {
+        return y == 0 ? band->png->prev_row : band->rows + ( y - 1 ) * band->stride;
+}
+
+/* Filter with the smallest cost summed over rows spread evenly in the group */
+PNGW_STATIC int _pngw_filter_sampled ( const _pngw_band *band, int begin, int end, unsigned char *scratch ) {
+        const pngw *png = band->png;
+        int samples = end - begin < PNGW_SAMPLES ? end - begin : PNGW_SAMPLES;
+        uint64_t costs[PNGW_FILTER_NUM] = { 0 };
+
+        for ( int s = 0; s < samples; ++s ) {
+                int y = begin + (int) ( (int64_t) s * ( end - begin ) / samples );
+                const unsigned char *row = band->rows + y * band->stride;
+                for ( int type = PNGW_FILTER_NONE; type < PNGW_FILTER_NUM; ++type ) {
+                        _pngw_filters[type]( row, _pngw_prev( band, y ), png->row_bytes, png->channels, scratch );
+                        costs[type] += _pngw_cost( scratch, png->row_bytes );
+                }
+        }
+
+        int best = PNGW_FILTER_NONE;
+        for ( int type = PNGW_FILTER_NONE + 1; type < PNGW_FILTER_NUM; ++type ) {
+                if ( costs[type] < costs[best] ) {
+                        best = type;
+                }
+        }
+
+        return best;
+}
+
+/* Filter rows from begin up to end into out, type -1 picks per row */
+PNGW_STATIC void _pngw_filter_rows ( const _pngw_band *band, int begin, int end, int type, unsigned char *out,
+                                     unsigned char *scratch ) {
+        const pngw *png = band->png;
+        size_t filtered_row = png->row_bytes + 1;
+
+        for ( int y = begin; y < end; ++y, out += filtered_row ) {
+                const unsigned char *row = band->rows + y * band->stride;
+                if ( type < 0 ) {
+                        _pngw_filter_best( row, _pngw_prev( band, y ), png->row_bytes, png->channels, out, scratch );
+                } else {
+                        out[0] = (unsigned char) type;
+                        _pngw_filters[type]( row, _pngw_prev( band, y ), png->row_bytes, png->channels, out + 1 );
+                }
+        }
+}
+
+/* Filter, -1 for per row, whose output deflates smallest at trial level */
+PNGW_STATIC int _pngw_filter_trial ( const _pngw_band *band, int begin, int end, unsigned char *scratch ) {
+        const pngw *png = band->png;
+        unsigned char *trial = scratch + png->row_bytes;
+        size_t trial_len = ( png->row_bytes + 1 ) * ( end - begin );
+
+        int best = -1;
+        size_t best_len = SIZE_MAX;
+        for ( int type = -1; type < PNGW_FILTER_NUM; ++type ) {
+                _pngw_filter_rows( band, begin, end, type, trial, scratch );
+
+                size_t len;
+                unsigned char *compressed = deflate_compress( trial, 0, trial_len, PNGW_TRIAL_LEVEL, true, &len );
+                if ( compressed == NULL ) {
+                        return -1;
+                }
+                PNGW_FREE( compressed );
+
+                if ( len < best_len ) {
+                        best_len = len;
+                        best = type;
+                }
+        }
+
+        return best;
+}
+
+/* Filter a group of rows */
+PNGW_STATIC void _pngw_filter_job ( void *arg, int index ) {
+        _pngw_band *band = (_pngw_band *) arg;
+        pngw *png = band->png;
+        size_t filtered_row = png->row_bytes + 1;
+
+        int begin = index * band->group;
+        int end = begin + band->group < band->count ? begin + band->group : band->count;
+
+        unsigned char *scratch = band->scratch + (size_t) index * band->scratch_len;
+
+        /* Indexed rows always stay unfiltered, otherwise -1 picks per row */
+        int type = -1;
+        if ( png->indexed || png->strategy == PNGW_STRATEGY_NONE ) {
+                type = PNGW_FILTER_NONE;
+        } else if ( png->strategy == PNGW_STRATEGY_SAMPLED ) {
+                type = _pngw_filter_sampled( band, begin, end, scratch );
+        } else if ( png->strategy == PNGW_STRATEGY_TRIAL && !_pngw_over_budget( png ) ) {
+                type = _pngw_filter_trial( band, begin, end, scratch );
+        }
+
+        _pngw_filter_rows( band, begin, end, type, band->filtered + begin * filtered_row, scratch );
+}
+
+PNGW_STATIC void _pngw_deflate_job ( void *arg, int index ) {
+        _pngw_band *band = (_pngw_band *) arg;
+        pngw *png = band->png;
+        _pngw_piece *piece = band->pieces + index;
+
+        size_t offset = (size_t) index * PNGW_PIECE;
+        size_t len = band->filtered_len - offset < PNGW_PIECE ? band->filtered_len - offset : PNGW_PIECE;
+
+        size_t dict_len = png->window_len + offset;
+        if ( dict_len > DEFLATE_WINDOW ) {
+                dict_len = DEFLATE_WINDOW;
+        }
+
+        const unsigned char *data = band->filtered + offset;
+        bool final = band->last && index == band->piece_count - 1;
+
+        piece->adler = checksum_adler32( CHECKSUM_ADLER32_INIT, data, len );
+        int level = png->level;
+        if ( level > PNGW_BUDGET_LEVEL && _pngw_over_budget( png ) ) {
+                level = PNGW_BUDGET_LEVEL;
+        }
+
+        piece->compressed = deflate_compress( data - dict_len, dict_len, len, level, final, &piece->compressed_len );
+        if ( piece->compressed == NULL ) {
+                __atomic_store_n( &band->failed, true, __ATOMIC_RELAXED );
+        }
+}
+
+PNGW_EXTERN bool pngw_write_rows ( pngw *png, const unsigned char *rows, size_t stride, int count ) {
+        if ( png->failed || count <= 0 || png->rows_written + count > png->height ) {
+                return false;
+        }
+
+        size_t filtered_row = png->row_bytes + 1;
+        size_t filtered_len = filtered_row * count;
+
+        int group = PNGW_PIECE / filtered_row > 0 ? (int) ( PNGW_PIECE / filtered_row ) : 1;
+        int groups = ( count + group - 1 ) / group;
+        int piece_count = (int) ( ( filtered_len + PNGW_PIECE - 1 ) / PNGW_PIECE );
+
+        /* Dictionary goes in front of the band, deflate needs them contiguous.
+         * Every group gets a row of scratch, trials a whole group more. */
+        size_t scratch_len = png->row_bytes;
+        if ( png->strategy == PNGW_STRATEGY_TRIAL && !png->indexed ) {
+                scratch_len += filtered_row * ( group < count ? group : count );
+        }
+        unsigned char *buffer =
+            (unsigned char *) PNGW_MALLOC( png->window_len + filtered_len + (size_t) groups * scratch_len );
+        _pngw_piece *pieces = (_pngw_piece *) PNGW_MALLOC( piece_count * sizeof( _pngw_piece ) );
+        if ( buffer == NULL || pieces == NULL ) {
+                PNGW_FREE( buffer );
+                PNGW_FREE( pieces );
+                png->failed = true;
+                return false;
+        }
+
+        memcpy( buffer, png->window, png->window_len );
+        memset( pieces, 0, piece_count * sizeof( _pngw_piece ) );
+
+        bool first = png->rows_written == 0;
+        png->rows_written += count;
+
+        _pngw_band band = {
+            .png = png,
+            .rows = rows,
+            .stride = stride,
+            .count = count,
+            .group = group,
+            .filtered = buffer + png->window_len,
+            .filtered_len = filtered_len,
+            .scratch = buffer + png->window_len + filtered_len,
+            .scratch_len = scratch_len,
+            .pieces = pieces,
+            .piece_count = piece_count,
+            .last = png->rows_written == png->height,
+        };
+
+        _pngw_run( png, _pngw_filter_job, &band, groups );
+        _pngw_run( png, _pngw_deflate_job, &band, piece_count );
+
+        memcpy( png->prev_row, rows + ( count - 1 ) * stride, png->row_bytes );
+        png->failed = band.failed;
+
+        unsigned char header[2];
+        deflate_zlib_header( png->level, header );
+
+        for ( int i = 0; i < piece_count && !png->failed; ++i ) {
+                size_t len = i < piece_count - 1 ? PNGW_PIECE : filtered_len - (size_t) i * PNGW_PIECE;
+                png->adler = checksum_adler32_combine( png->adler, pieces[i].adler, len );
+                png->filtered_len += len;
+                png->compressed_len += pieces[i].compressed_len;
+
+                bool final = band.last && i == piece_count - 1;
+                unsigned char adler[4];
+                _pngw_be32( adler, png->adler );
+
+                _pngw_chunk( png, "IDAT",
+                             header, first && i == 0 ? 2 : 0,
+                             pieces[i].compressed, pieces[i].compressed_len,
+                             adler, final ? 4 : 0 );
+        }
+
+        for ( int i = 0; i < piece_count; ++i ) {
+                PNGW_FREE( pieces[i].compressed );
+        }
+
+        /* Keep the tail around for next band to match against */
+        size_t total = png->window_len + filtered_len;
+        png->window_len = total < DEFLATE_WINDOW ? total : DEFLATE_WINDOW;
+        memcpy( png->window, buffer + total - png->window_len, png->window_len );
+
+        PNGW_FREE( pieces );
+        PNGW_FREE( buffer );
+
+        return !png->failed;
+}
+
+PNGW_EXTERN bool pngw_end ( pngw *png ) {
+        bool complete = png->rows_written == png->height;
+
+        if ( complete ) {
+                _pngw_chunk( png, "IEND", NULL, 0, NULL, 0, NULL, 0 );
+        }
+
+        PNGW_FREE( png->prev_row );
+        PNGW_FREE( png->window );
+        png->prev_row = NULL;
+        png->window = NULL;
+
+        return complete && !png->failed;
+}
+
+#endif
@@ -0,0 +1,208 @@
+/* Thread pool running indexed jobs.
+ *
+ * Before #including,
+ *      #define POOL_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * pool_run calls fn( arg, index ) for every index below count, spread
+ * over the workers and the calling thread, and returns once all of them
+ * are done. Jobs are handed out one index at a time, so uneven jobs
+ * balance out as long as there's more of them than threads. */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#ifndef POOL_EXTERN
+#define POOL_EXTERN extern
+#endif
+
+#ifndef POOL_STATIC
+#define POOL_STATIC static
+#endif
+
+#ifndef POOL_MALLOC
+#define POOL_MALLOC( size ) malloc( size )
+#endif
+
+#ifndef POOL_FREE
+#define POOL_FREE( ptr ) free( ptr )
+#endif
+
+typedef void ( *pool_fn )( void *arg, int index );
+
+typedef struct pool pool;
+
+/* Threads include the caller, one runs everything on the caller,
+ * zero or less means one per CPU */
+POOL_EXTERN pool *pool_create ( int threads );
+POOL_EXTERN void pool_destroy ( pool *p );
+
+POOL_EXTERN int pool_threads ( const pool *p );
+POOL_EXTERN void pool_run ( pool *p, pool_fn fn, void *arg, int count );
+
+POOL_EXTERN int pool_cpu_count ( void );
+
+#endif /* _POOL_H */
+
+/* Implementation */
+#ifdef POOL_IMPL
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct pool {
+        pthread_t *workers;
+        int worker_count;
+
+        pthread_mutex_t lock;
+        pthread_cond_t start;
+        pthread_cond_t done;
+
+        /* Bumped for every run so workers notice new jobs */
+        unsigned generation;
+        bool quit;
+
+        pool_fn fn;
+        void *arg;
+        int count;
+
+        int next;
+        int busy; /* Workers not done with current run */
+};
+
+POOL_STATIC void _pool_drain ( pool *p ) {
+        for ( ;; ) {
+                int index = __atomic_fetch_add( &p->next, 1, __ATOMIC_RELAXED );
+                if ( index >= p->count ) {
+                        break;
+                }
+
+                p->fn( p->arg, index );
+        }
+}
+
+POOL_STATIC void *_pool_worker ( void *arg ) {
+        pool *p = (pool *) arg;
+        unsigned seen = 0;
+
+        pthread_mutex_lock( &p->lock );
+
+        for ( ;; ) {
+                while ( !p->quit && p->generation == seen ) {
+                        pthread_cond_wait( &p->start, &p->lock );
+                }
+
+                if ( p->quit ) {
+                        break;
+                }
+
+                seen = p->generation;
+                pthread_mutex_unlock( &p->lock );
+
+                _pool_drain( p );
+
+                pthread_mutex_lock( &p->lock );
+                if ( --p->busy == 0 ) {
+                        pthread_cond_signal( &p->done );
+                }
+        }
+
+        pthread_mutex_unlock( &p->lock );
+
+        return NULL;
+}
+
+POOL_EXTERN int pool_cpu_count ( void ) {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        return cpus < 1 ? 1 : (int) cpus;
+}
+
+POOL_EXTERN pool *pool_create ( int threads ) {
+        if ( threads <= 0 ) {
+                threads = pool_cpu_count();
+        }
+
+        pool *p = (pool *) POOL_MALLOC( sizeof( pool ) );
+        if ( p == NULL ) {
+                return NULL;
+        }
+
+        *p = (pool) { 0 };
+        pthread_mutex_init( &p->lock, NULL );
+        pthread_cond_init( &p->start, NULL );
+        pthread_cond_init( &p->done, NULL );
+
+        if ( threads > 1 ) {
+                p->workers = (pthread_t *) POOL_MALLOC( sizeof( pthread_t ) * ( threads - 1 ) );
+        }
+
+        /* Fewer workers than asked for still works, just slower */
+        for ( int i = 0; p->workers != NULL && i < threads - 1; ++i ) {
+                if ( pthread_create( &p->workers[i], NULL, _pool_worker, p ) != 0 ) {
+                        break;
+                }
+                p->worker_count += 1;
+        }
+
+        return p;
+}
+
+POOL_EXTERN void pool_destroy ( pool *p ) {
+        if ( p == NULL ) {
+                return;
+        }
+
+        pthread_mutex_lock( &p->lock );
+        p->quit = true;
+        pthread_cond_broadcast( &p->start );
+        pthread_mutex_unlock( &p->lock );
+
+        for ( int i = 0; i < p->worker_count; ++i ) {
+                pthread_join( p->workers[i], NULL );
+        }
+
+        pthread_cond_destroy( &p->done );
+        pthread_cond_destroy( &p->start );
+        pthread_mutex_destroy( &p->lock );
+
+        if ( p->workers != NULL ) {
+                POOL_FREE( p->workers );
+        }
+        POOL_FREE( p );
+}
+
+POOL_EXTERN int pool_threads ( const pool *p ) {
+        return p->worker_count + 1;
+}
+
+POOL_EXTERN void pool_run ( pool *p, pool_fn fn, void *arg, int count ) {
+        if ( p->worker_count == 0 || count <= 1 ) {
+                for ( int i = 0; i < count; ++i ) {
+                        fn( arg, i );
+                }
+                return;
+        }
+
+        pthread_mutex_lock( &p->lock );
+        p->fn = fn;
+        p->arg = arg;
+        p->count = count;
+        p->next = 0;
+        p->busy = p->worker_count;
+        p->generation += 1;
+        pthread_cond_broadcast( &p->start );
+        pthread_mutex_unlock( &p->lock );
+
+        _pool_drain( p );
+
+        pthread_mutex_lock( &p->lock );
+        while ( p->busy > 0 ) {
+                pthread_cond_wait( &p->done, &p->lock );
+        }
+        pthread_mutex_unlock( &p->lock );
+}
+
+#endif
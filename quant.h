@@ -0,0 +1,491 @@
+/* Palette quantisation of RGBA pixels.
+ *
+ * Before #including,
+ *      #define QUANT_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Pixels are first gathered into a histogram of colours. When there are
+ * no more colours than the palette takes they are used as they are,
+ * otherwise median cut splits them into boxes and a few rounds of k-means
+ * refine the box averages. Alpha is treated as a fourth channel. Histograms
+ * growing too big drop low bits of every channel to stay bounded.
+ *
+ * Palette is ordered with translucent colours first, so PNG tRNS can stop
+ * after the last of them. */
+
+#ifndef _QUANT_H
+#define _QUANT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef QUANT_EXTERN
+#define QUANT_EXTERN extern
+#endif
+
+#ifndef QUANT_STATIC
+#define QUANT_STATIC static
+#endif
+
+#ifndef QUANT_MALLOC
+#define QUANT_MALLOC( size ) malloc( size )
+#endif
+
+#ifndef QUANT_FREE
+#define QUANT_FREE( ptr ) free( ptr )
+#endif
+
+#define QUANT_MAX_COLOURS 256
+
+/* Distinct colours kept before low bits start getting dropped */
+#define QUANT_MAX_ENTRIES ( 1 << 18 )
+
+#define QUANT_KMEANS_ROUNDS 4
+
+/* Runs fn( arg, index ) for index below count, maybe in parallel */
+typedef void ( *quant_job_fn )( void *arg, int index );
+typedef void ( *quant_run_fn )( void *ctx, quant_job_fn fn, void *arg, int count );
+
+typedef struct quant_entry {
+        uint32_t colour; /* RGBA bytes in memory order */
+        uint32_t count;  /* Zero marks empty slot */
+        int index;
+} quant_entry;
+
+typedef struct quant {
+        quant_entry *table;
+        size_t capacity;
+        size_t len;
+
+        /* Low bits dropped from every channel */
+        int shift;
+
+        unsigned char palette[QUANT_MAX_COLOURS * 4];
+        int colours;
+        int translucent; /* Leading palette entries with alpha below 255 */
+
+        bool failed;
+} quant;
+
+QUANT_EXTERN void quant_begin ( quant *q );
+QUANT_EXTERN void quant_end ( quant *q );
+
+QUANT_EXTERN void quant_add_rows ( quant *q, const unsigned char *rgba, size_t stride, size_t width, size_t rows );
+
+/* Pick at most max_colours, run can be NULL to do everything here */
+QUANT_EXTERN bool quant_build ( quant *q, int max_colours, quant_run_fn run, void *ctx );
+
+/* Palette index of every pixel in row */
+QUANT_EXTERN void quant_map_row ( const quant *q, const unsigned char *rgba, size_t width, unsigned char *indices );
+
+#endif /* _QUANT_H */
+
+/* Implementation */
+#ifdef QUANT_IMPL
+
+#include <stdlib.h>
+#include <string.h>
+
+#define QUANT_CHUNK 4096
+
+typedef struct quant_box {
+        size_t begin;
+        size_t end;
+        uint64_t error; /* Squared error along channel */
+        int channel;
+} quant_box;
+
+QUANT_STATIC size_t _quant_slot ( const quant *q, uint32_t colour ) {
+        size_t slot = (size_t) ( colour * 0x9e3779b1u ) & ( q->capacity - 1 );
+        while ( q->table[slot].count != 0 && q->table[slot].colour != colour ) {
+                slot = ( slot + 1 ) & ( q->capacity - 1 );
+        }
+        return slot;
+}
+
+QUANT_STATIC uint32_t _quant_key ( const quant *q, uint32_t colour ) {
+        uint32_t keep = ( 0xffu >> q->shift << q->shift ) * 0x01010101u;
+        return colour & keep;
+}
+
+QUANT_STATIC void _quant_insert ( quant *q, uint32_t key, uint32_t count ) {
+        size_t slot = _quant_slot( q, key );
+        if ( q->table[slot].count == 0 ) {
+                q->table[slot].colour = key;
+                q->len += 1;
+        }
+        q->table[slot].count += count;
+}
+
+/* Rehash into table of capacity, dropping another bit when coarser */
+QUANT_STATIC bool _quant_rehash ( quant *q, size_t capacity, int shift ) {
+        quant_entry *old = q->table;
+        size_t old_capacity = q->capacity;
+
+        q->table = (quant_entry *) QUANT_MALLOC( sizeof( quant_entry ) * capacity );
+        if ( q->table == NULL ) {
+                q->table = old;
+                q->failed = true;
+                return false;
+        }
+
+        memset( q->table, 0, sizeof( quant_entry ) * capacity );
+        q->capacity = capacity;
+        q->shift = shift;
+        q->len = 0;
+
+        for ( size_t i = 0; i < old_capacity; ++i ) {
+                if ( old[i].count != 0 ) {
+                        _quant_insert( q, _quant_key( q, old[i].colour ), old[i].count );
+                }
+        }
+
+        if ( old != NULL ) {
+                QUANT_FREE( old );
+        }
+
+        return true;
+}
+
+QUANT_EXTERN void quant_begin ( quant *q ) {
+        *q = (quant) { 0 };
+        _quant_rehash( q, 1024, 0 );
+}
+
+QUANT_EXTERN void quant_end ( quant *q ) {
+        if ( q->table != NULL ) {
+                QUANT_FREE( q->table );
+        }
+        q->table = NULL;
+}
+
+QUANT_EXTERN void quant_add_rows ( quant *q, const unsigned char *rgba, size_t stride, size_t width, size_t rows ) {
+        for ( size_t y = 0; y < rows && !q->failed; ++y ) {
+                const unsigned char *row = rgba + y * stride;
+                uint32_t last = 0;
+                uint32_t run = 0;
+
+                /* Runs of one colour are common, count them up before hashing */
+                for ( size_t x = 0; x <= width; ++x ) {
+                        uint32_t colour = 0;
+                        if ( x < width ) {
+                                memcpy( &colour, row + x * 4, 4 );
+                                colour = _quant_key( q, colour );
+                                if ( run > 0 && colour == last ) {
+                                        run += 1;
+                                        continue;
+                                }
+                        }
+
+                        if ( run > 0 ) {
+                                _quant_insert( q, last, run );
+                        }
+
+                        last = colour;
+                        run = 1;
+
+                        if ( q->len * 2 >= q->capacity ) {
+                                bool full = q->len >= QUANT_MAX_ENTRIES && q->shift < 7;
+                                size_t capacity = full ? q->capacity : q->capacity * 2;
+                                if ( !_quant_rehash( q, capacity, q->shift + ( full ? 1 : 0 ) ) ) {
+                                        return;
+                                }
+                                last = _quant_key( q, last );
+                        }
+                }
+        }
+}
+
+/* Colour a histogram key stands for, middle of the dropped bits except at
+ * the ends so black, white and full transparency stay exact */
+QUANT_STATIC void _quant_centre ( const quant *q, uint32_t key, unsigned char out[4] ) {
+        memcpy( out, &key, 4 );
+        if ( q->shift == 0 ) {
+                return;
+        }
+
+        int top = 0xff >> q->shift << q->shift;
+        for ( int c = 0; c < 4; ++c ) {
+                if ( out[c] == top ) {
+                        out[c] = 255;
+                } else if ( out[c] != 0 ) {
+                        out[c] += 1 << ( q->shift - 1 );
+                }
+        }
+}
+
+QUANT_STATIC uint32_t _quant_distance ( const unsigned char *a, const unsigned char *b ) {
+        uint32_t d = 0;
+        for ( int c = 0; c < 4; ++c ) {
+                int diff = a[c] - b[c];
+                d += diff * diff;
+        }
+        return d;
+}
+
+QUANT_STATIC int _quant_nearest ( const quant *q, const unsigned char *colour ) {
+        uint32_t best_distance = UINT32_MAX;
+        int best = 0;
+
+        for ( int i = 0; i < q->colours; ++i ) {
+                uint32_t d = _quant_distance( colour, q->palette + i * 4 );
+                if ( d < best_distance ) {
+                        best_distance = d;
+                        best = i;
+                }
+        }
+
+        return best;
+}
+
+/* Squared error of box along its worst channel */
+QUANT_STATIC void _quant_measure ( const quant_entry *entries, quant_box *box ) {
+        box->error = 0;
+        box->channel = 0;
+
+        for ( int c = 0; c < 4; ++c ) {
+                uint64_t n = 0, sum = 0, sum_sq = 0;
+                for ( size_t i = box->begin; i < box->end; ++i ) {
+                        uint64_t v = ( (const unsigned char *) &entries[i].colour )[c];
+                        n += entries[i].count;
+                        sum += v * entries[i].count;
+                        sum_sq += v * v * entries[i].count;
+                }
+
+                /* Square of the sum can overflow on big atlases */
+                uint64_t error = sum_sq - (uint64_t) ( (double) sum * sum / n );
+                if ( error > box->error ) {
+                        box->error = error;
+                        box->channel = c;
+                }
+        }
+}
+
+/* Sort entries of box by channel, counting sort on the byte */
+QUANT_STATIC void _quant_sort ( quant_entry *entries, quant_entry *scratch, const quant_box *box ) {
+        size_t offsets[257] = { 0 };
+
+        for ( size_t i = box->begin; i < box->end; ++i ) {
+                offsets[( (const unsigned char *) &entries[i].colour )[box->channel] + 1] += 1;
+        }
+        for ( int v = 0; v < 256; ++v ) {
+                offsets[v + 1] += offsets[v];
+        }
+        for ( size_t i = box->begin; i < box->end; ++i ) {
+                scratch[offsets[( (const unsigned char *) &entries[i].colour )[box->channel]]++] = entries[i];
+        }
+
+        memcpy( entries + box->begin, scratch, sizeof( quant_entry ) * ( box->end - box->begin ) );
+}
+
+QUANT_STATIC void _quant_median_cut ( quant *q, quant_entry *entries, size_t len, int max_colours,
+                                      quant_entry *scratch ) {
+        quant_box boxes[QUANT_MAX_COLOURS];
+        int box_count = 1;
+
+        boxes[0] = (quant_box) { .begin = 0, .end = len };
+        _quant_measure( entries, &boxes[0] );
+
+        while ( box_count < max_colours ) {
+                int worst = -1;
+                for ( int i = 0; i < box_count; ++i ) {
+                        if ( boxes[i].end - boxes[i].begin > 1 && boxes[i].error > 0 &&
+                             ( worst < 0 || boxes[i].error > boxes[worst].error ) ) {
+                                worst = i;
+                        }
+                }
+                if ( worst < 0 ) {
+                        break;
+                }
+
+                quant_box *box = &boxes[worst];
+                _quant_sort( entries, scratch, box );
+
+                /* Split at weighted median, both halves keep at least one colour */
+                uint64_t total = 0, half = 0;
+                for ( size_t i = box->begin; i < box->end; ++i ) {
+                        total += entries[i].count;
+                }
+                size_t split = box->begin;
+                while ( split < box->end - 1 && half + entries[split].count <= total / 2 ) {
+                        half += entries[split++].count;
+                }
+                if ( split == box->begin ) {
+                        split += 1;
+                }
+
+                boxes[box_count] = (quant_box) { .begin = split, .end = box->end };
+                box->end = split;
+                _quant_measure( entries, box );
+                _quant_measure( entries, &boxes[box_count] );
+                box_count += 1;
+        }
+
+        for ( int b = 0; b < box_count; ++b ) {
+                uint64_t sum[4] = { 0 }, n = 0;
+                for ( size_t i = boxes[b].begin; i < boxes[b].end; ++i ) {
+                        unsigned char c[4];
+                        _quant_centre( q, entries[i].colour, c );
+                        for ( int ch = 0; ch < 4; ++ch ) {
+                                sum[ch] += (uint64_t) c[ch] * entries[i].count;
+                        }
+                        n += entries[i].count;
+                }
+                for ( int ch = 0; ch < 4; ++ch ) {
+                        q->palette[b * 4 + ch] = (unsigned char) ( ( sum[ch] + n / 2 ) / n );
+                }
+        }
+
+        q->colours = box_count;
+}
+
+typedef struct quant_assign_job {
+        const quant *q;
+        quant_entry *entries;
+        size_t len;
+} quant_assign_job;
+
+QUANT_STATIC void _quant_assign ( void *arg, int index ) {
+        quant_assign_job *job = (quant_assign_job *) arg;
+        size_t begin = (size_t) index * QUANT_CHUNK;
+        size_t end = begin + QUANT_CHUNK < job->len ? begin + QUANT_CHUNK : job->len;
+
+        for ( size_t i = begin; i < end; ++i ) {
+                unsigned char c[4];
+                _quant_centre( job->q, job->entries[i].colour, c );
+                job->entries[i].index = _quant_nearest( job->q, c );
+        }
+}
+
+QUANT_STATIC void _quant_kmeans ( quant *q, quant_entry *entries, size_t len, quant_run_fn run, void *ctx ) {
+        quant_assign_job job = { .q = q, .entries = entries, .len = len };
+        int chunks = (int) ( ( len + QUANT_CHUNK - 1 ) / QUANT_CHUNK );
+
+        for ( int round = 0; round <= QUANT_KMEANS_ROUNDS; ++round ) {
+                if ( run != NULL ) {
+                        run( ctx, _quant_assign, &job, chunks );
+                } else {
+                        for ( int i = 0; i < chunks; ++i ) {
+                                _quant_assign( &job, i );
+                        }
+                }
+
+                /* Last round only assigns */
+                if ( round == QUANT_KMEANS_ROUNDS ) {
+                        break;
+                }
+
+                uint64_t sum[QUANT_MAX_COLOURS][4] = { { 0 } };
+                uint64_t n[QUANT_MAX_COLOURS] = { 0 };
+                for ( size_t i = 0; i < len; ++i ) {
+                        unsigned char c[4];
+                        _quant_centre( q, entries[i].colour, c );
+                        for ( int ch = 0; ch < 4; ++ch ) {
+                                sum[entries[i].index][ch] += (uint64_t) c[ch] * entries[i].count;
+                        }
+                        n[entries[i].index] += entries[i].count;
+                }
+
+                /* Colours nobody picked stay where they are */
+                for ( int p = 0; p < q->colours; ++p ) {
+                        for ( int ch = 0; n[p] > 0 && ch < 4; ++ch ) {
+                                q->palette[p * 4 + ch] = (unsigned char) ( ( sum[p][ch] + n[p] / 2 ) / n[p] );
+                        }
+                }
+        }
+}
+
+QUANT_EXTERN bool quant_build ( quant *q, int max_colours, quant_run_fn run, void *ctx ) {
+        if ( q->failed || q->len == 0 ) {
+                return false;
+        }
+
+        if ( max_colours > QUANT_MAX_COLOURS ) {
+                max_colours = QUANT_MAX_COLOURS;
+        }
+
+        quant_entry *entries = (quant_entry *) QUANT_MALLOC( sizeof( quant_entry ) * q->len * 2 );
+        if ( entries == NULL ) {
+                return false;
+        }
+
+        size_t len = 0;
+        for ( size_t i = 0; i < q->capacity; ++i ) {
+                if ( q->table[i].count != 0 ) {
+                        entries[len++] = q->table[i];
+                }
+        }
+
+        if ( len <= (size_t) max_colours ) {
+                /* Few enough to keep every colour */
+                for ( size_t i = 0; i < len; ++i ) {
+                        _quant_centre( q, entries[i].colour, q->palette + i * 4 );
+                        entries[i].index = (int) i;
+                }
+                q->colours = (int) len;
+        } else {
+                _quant_median_cut( q, entries, len, max_colours, entries + len );
+                _quant_kmeans( q, entries, len, run, ctx );
+        }
+
+        /* Translucent colours go first for tRNS */
+        int order[QUANT_MAX_COLOURS];
+        int remap[QUANT_MAX_COLOURS];
+        int placed = 0;
+        for ( int pass = 0; pass < 2; ++pass ) {
+                for ( int p = 0; p < q->colours; ++p ) {
+                        if ( ( q->palette[p * 4 + 3] < 255 ) == ( pass == 0 ) ) {
+                                remap[p] = placed;
+                                order[placed++] = p;
+                        }
+                }
+                if ( pass == 0 ) {
+                        q->translucent = placed;
+                }
+        }
+
+        unsigned char palette[QUANT_MAX_COLOURS * 4];
+        for ( int p = 0; p < q->colours; ++p ) {
+                memcpy( palette + p * 4, q->palette + order[p] * 4, 4 );
+        }
+        memcpy( q->palette, palette, (size_t) q->colours * 4 );
+
+        /* Histogram slots remember their index for mapping */
+        for ( size_t i = 0; i < len; ++i ) {
+                q->table[_quant_slot( q, entries[i].colour )].index = remap[entries[i].index];
+        }
+
+        QUANT_FREE( entries );
+
+        return true;
+}
+
+QUANT_EXTERN void quant_map_row ( const quant *q, const unsigned char *rgba, size_t width, unsigned char *indices ) {
+        uint32_t last = 0;
+        int last_index = -1;
+
+        for ( size_t x = 0; x < width; ++x ) {
+                uint32_t colour;
+                memcpy( &colour, rgba + x * 4, 4 );
+                colour = _quant_key( q, colour );
+
+                if ( last_index < 0 || colour != last ) {
+                        const quant_entry *entry = &q->table[_quant_slot( q, colour )];
+                        if ( entry->count != 0 ) {
+                                last_index = entry->index;
+                        } else {
+                                /* Not seen while building, only happens if rows differ */
+                                unsigned char c[4];
+                                _quant_centre( q, colour, c );
+                                last_index = _quant_nearest( q, c );
+                        }
+                        last = colour;
+                }
+
+                indices[x] = (unsigned char) last_index;
+        }
+}
+
+#endif
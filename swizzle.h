@@ -0,0 +1,162 @@
+/* Swizzled pixel layouts.
+ *
+ * Before #including,
+ *      #define SWIZZLE_IMPL
+ *
+ * in the file you want the implementation to reside.
+ *
+ * Reorders rows of pixels into square tiles of power of two side, stored
+ * one after another left to right and top to bottom. Inside a tile pixels
+ * go in Morton (Z) order, bits of x and y interleaved with x in the lowest
+ * one, or row by row. Image is expected to be padded to whole tiles, a
+ * tile as big as the image gives plain Morton order of all of it.
+ *
+ * Tiles are reordered a row of tiles at a time. Every tile is written
+ * as 2x2 pixel blocks, which are contiguous in Morton order, so reads go
+ * along two rows and writes stay within the tile. */
+
+#ifndef _SWIZZLE_H
+#define _SWIZZLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef SWIZZLE_EXTERN
+#define SWIZZLE_EXTERN extern
+#endif
+
+#ifndef SWIZZLE_STATIC
+#define SWIZZLE_STATIC static
+#endif
+
+#define SWIZZLE_MAX_TILE 4096
+
+typedef enum swizzle {
+        SWIZZLE_LINEAR, /* Rows top to bottom, no tiles */
+        SWIZZLE_MORTON,
+        SWIZZLE_TILED,
+        SWIZZLE_NUM,
+} swizzle;
+
+SWIZZLE_EXTERN const char *swizzle_name ( swizzle s );
+SWIZZLE_EXTERN bool swizzle_parse ( const char *name, swizzle *s );
+
+/* Power of two from 2 up to SWIZZLE_MAX_TILE */
+SWIZZLE_EXTERN bool swizzle_tile_valid ( int tile );
+
+/* Position of pixel in Morton order */
+SWIZZLE_EXTERN uint32_t swizzle_morton ( uint32_t x, uint32_t y );
+
+/* Reorder tile rows of width pixels, bytes each and stride apart, into
+ * width / tile tiles written one after another to dst */
+SWIZZLE_EXTERN void swizzle_tiles ( swizzle s, int tile, int bytes, const unsigned char *src, size_t stride,
+                                    size_t width, unsigned char *dst );
+
+#endif /* _SWIZZLE_H */
+
+/* Implementation */
+#ifdef SWIZZLE_IMPL
+
+#include <string.h>
+
+static const char *_swizzle_names[SWIZZLE_NUM] = {
+    [SWIZZLE_LINEAR] = "linear",
+    [SWIZZLE_MORTON] = "morton",
+    [SWIZZLE_TILED] = "tiled",
+};
+
+SWIZZLE_EXTERN const char *swizzle_name ( swizzle s ) { return _swizzle_names[s]; }
+
+SWIZZLE_EXTERN bool swizzle_parse ( const char *name, swizzle *s ) {
+        for ( int i = 0; name != NULL && i < SWIZZLE_NUM; ++i ) {
+                if ( strcmp( name, _swizzle_names[i] ) == 0 ) {
+                        *s = (swizzle) i;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+SWIZZLE_EXTERN bool swizzle_tile_valid ( int tile ) {
+        return tile >= 2 && tile <= SWIZZLE_MAX_TILE && ( tile & ( tile - 1 ) ) == 0;
+}
+
+/* Spread low 16 bits apart, one zero bit between each */
+SWIZZLE_STATIC uint32_t _swizzle_spread ( uint32_t v ) {
+        v &= 0xffff;
+        v = ( v | ( v << 8 ) ) & 0x00ff00ff;
+        v = ( v | ( v << 4 ) ) & 0x0f0f0f0f;
+        v = ( v | ( v << 2 ) ) & 0x33333333;
+        v = ( v | ( v << 1 ) ) & 0x55555555;
+        return v;
+}
+
+SWIZZLE_EXTERN uint32_t swizzle_morton ( uint32_t x, uint32_t y ) {
+        return _swizzle_spread( x ) | ( _swizzle_spread( y ) << 1 );
+}
+
+/* Bytes is a constant at every call, so the copies turn into plain moves */
+static inline void _swizzle_morton_tiles ( int tile, int bytes, const unsigned char *src, size_t stride,
+                                           size_t width, unsigned char *dst, const uint32_t *spread ) {
+        size_t tile_bytes = (size_t) tile * tile * bytes;
+
+        for ( size_t t = 0; t < width / tile; ++t ) {
+                const unsigned char *in = src + t * tile * bytes;
+                unsigned char *out = dst + t * tile_bytes;
+
+                for ( int y = 0; y < tile; y += 2 ) {
+                        const unsigned char *row0 = in + y * stride;
+                        const unsigned char *row1 = row0 + stride;
+                        uint32_t high = spread[y / 2] << 1;
+
+                        for ( int x = 0; x < tile; x += 2 ) {
+                                unsigned char *block = out + (size_t) ( spread[x / 2] | high ) * bytes;
+                                memcpy( block, row0 + x * bytes, 2 * bytes );
+                                memcpy( block + 2 * bytes, row1 + x * bytes, 2 * bytes );
+                        }
+                }
+        }
+}
+
+SWIZZLE_EXTERN void swizzle_tiles ( swizzle s, int tile, int bytes, const unsigned char *src, size_t stride,
+                                    size_t width, unsigned char *dst ) {
+        if ( s == SWIZZLE_LINEAR ) {
+                for ( int y = 0; y < tile; ++y ) {
+                        memcpy( dst + y * width * bytes, src + y * stride, width * bytes );
+                }
+                return;
+        }
+
+        if ( s == SWIZZLE_TILED ) {
+                size_t row_len = (size_t) tile * bytes;
+                for ( size_t t = 0; t < width / tile; ++t ) {
+                        for ( int y = 0; y < tile; ++y ) {
+                                memcpy( dst, src + y * stride + t * row_len, row_len );
+                                dst += row_len;
+                        }
+                }
+                return;
+        }
+
+        /* Morton position of every other coordinate, 2x2 blocks take the rest */
+        uint32_t spread[SWIZZLE_MAX_TILE / 2];
+        for ( int i = 0; i < tile / 2; ++i ) {
+                spread[i] = _swizzle_spread( i * 2 );
+        }
+
+        switch ( bytes ) {
+        case 2:
+                _swizzle_morton_tiles( tile, 2, src, stride, width, dst, spread );
+                break;
+        case 4:
+                _swizzle_morton_tiles( tile, 4, src, stride, width, dst, spread );
+                break;
+        default:
+                _swizzle_morton_tiles( tile, bytes, src, stride, width, dst, spread );
+                break;
+        }
+}
+
+#endif